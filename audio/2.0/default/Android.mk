@@ -90,3 +90,30 @@ LOCAL_CFLAGS += -DTARGET_USES_BCRADIO_FUTURE_FEATURES
 endif
 
 #include $(BUILD_EXECUTABLE)
+
+#
+# Benchmark
+#
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := android.hardware.audio@2.0-params-benchmark
+LOCAL_PROPRIETARY_MODULE := true
+LOCAL_SRC_FILES := \
+    ParametersUtil.cpp \
+    ParametersUtil_benchmark.cpp \
+
+LOCAL_SHARED_LIBRARIES := \
+    libbase \
+    libcutils \
+    libhidlbase \
+    liblog \
+    libutils \
+    android.hardware.audio@2.0 \
+
+LOCAL_HEADER_LIBRARIES := \
+    libaudio_system_headers \
+    libmedia_headers \
+
+LOCAL_WHOLE_STATIC_LIBRARIES := libmedia_helper
+
+include $(BUILD_NATIVE_BENCHMARK)
@@ -244,6 +244,7 @@ Return<void> Device::createAudioPatch(const hidl_vec<AudioPortConfig>& sources,
         if (retval == Result::OK) {
             patch = static_cast<AudioPatchHandle>(halPatch);
         }
+        invalidateParamsCache();
     }
     _hidl_cb(retval, patch);
     return Void();
@@ -251,10 +252,12 @@ Return<void> Device::createAudioPatch(const hidl_vec<AudioPortConfig>& sources,
 
 Return<Result> Device::releaseAudioPatch(int32_t patch) {
     if (version() >= AUDIO_DEVICE_API_VERSION_3_0) {
-        return analyzeStatus(
+        Result retval = analyzeStatus(
             "release_audio_patch",
             mDevice->release_audio_patch(
                 mDevice, static_cast<audio_patch_handle_t>(patch)));
+        invalidateParamsCache();
+        return retval;
     }
     return Result::NOT_SUPPORTED;
 }
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <stdio.h>
+
 #include "ParametersUtil.h"
 
 namespace android {
@@ -22,6 +24,18 @@ namespace audio {
 namespace V2_0 {
 namespace implementation {
 
+// Keys whose values can only change as a result of a call done through this
+// HAL, they are cached until the next one. Routing is not cached as audio
+// patches on the device change it for the streams.
+static const char* const kCacheableKeys[] = {
+    AudioParameter::keyFrameCount,
+    AudioParameter::keyStreamSupportedChannels,
+    AudioParameter::keyStreamSupportedFormats,
+    AudioParameter::keyStreamSupportedSamplingRates,
+};
+
+std::atomic<uint32_t> ParametersUtil::sCacheGeneration{0};
+
 // Static method and not private method to avoid leaking status_t dependency
 static Result getHalStatusToResult(status_t status) {
     switch (status) {
@@ -53,19 +67,33 @@ Result ParametersUtil::getParam(const char* name, bool* value) {
 }
 
 Result ParametersUtil::getParam(const char* name, int* value) {
-    const String8 halName(name);
-    AudioParameter keys;
-    keys.addKey(halName);
-    std::unique_ptr<AudioParameter> params = getParams(keys);
-    return getHalStatusToResult(params->getInt(halName, *value));
+    String8 halValue;
+    status_t status = getParamValue(String8(name), &halValue);
+    // Same conversion as AudioParameter::getInt.
+    if (status == OK && sscanf(halValue.string(), "%d", value) != 1) {
+        status = INVALID_OPERATION;
+    }
+    return getHalStatusToResult(status);
 }
 
 Result ParametersUtil::getParam(const char* name, String8* value) {
-    const String8 halName(name);
+    return getHalStatusToResult(getParamValue(String8(name), value));
+}
+
+status_t ParametersUtil::getParamValue(const String8& name, String8* value) {
+    if (isCacheable(name)) {
+        std::lock_guard<std::mutex> lock(mCacheLock);
+        syncCacheGenerationLocked();
+        auto it = mCache.find(name.string());
+        if (it != mCache.end()) {
+            *value = it->second.value;
+            return it->second.status;
+        }
+    }
     AudioParameter keys;
-    keys.addKey(halName);
+    keys.addKey(name);
     std::unique_ptr<AudioParameter> params = getParams(keys);
-    return getHalStatusToResult(params->get(halName, *value));
+    return params->get(name, *value);
 }
 
 void ParametersUtil::getParametersImpl(
@@ -99,15 +127,77 @@ void ParametersUtil::getParametersImpl(
 
 std::unique_ptr<AudioParameter> ParametersUtil::getParams(
     const AudioParameter& keys) {
+    std::unique_ptr<AudioParameter> result(new AudioParameter());
+    AudioParameter halKeys;
+    uint32_t generation;
+    String8 key;
+    {
+        std::lock_guard<std::mutex> lock(mCacheLock);
+        generation = syncCacheGenerationLocked();
+        for (size_t i = 0; i < keys.size(); ++i) {
+            keys.getAt(i, key);
+            auto it = isCacheable(key) ? mCache.find(key.string()) : mCache.end();
+            if (it == mCache.end()) {
+                halKeys.addKey(key);
+            } else if (it->second.status == OK) {
+                result->add(key, it->second.value);
+            }
+        }
+    }
+    if (keys.size() != 0 && halKeys.size() == 0) {
+        return result;
+    }
+
     String8 paramsAndValues;
-    char* halValues = halGetParameters(keys.keysToString().string());
+    char* halValues = halGetParameters(halKeys.keysToString().string());
     if (halValues != NULL) {
         paramsAndValues.setTo(halValues);
         free(halValues);
     } else {
         paramsAndValues.clear();
     }
-    return std::unique_ptr<AudioParameter>(new AudioParameter(paramsAndValues));
+    const AudioParameter halParams(paramsAndValues);
+    String8 value;
+    for (size_t i = 0; i < halParams.size(); ++i) {
+        halParams.getAt(i, key, value);
+        result->add(key, value);
+    }
+
+    // Keep what was fetched unless something was set in the meantime, the
+    // values might be stale then.
+    std::lock_guard<std::mutex> lock(mCacheLock);
+    if (syncCacheGenerationLocked() == generation) {
+        for (size_t i = 0; i < halKeys.size(); ++i) {
+            halKeys.getAt(i, key);
+            if (isCacheable(key)) {
+                CachedParam& cached = mCache[key.string()];
+                cached.status = halParams.get(key, cached.value);
+            }
+        }
+    }
+    return result;
+}
+
+// static
+bool ParametersUtil::isCacheable(const String8& key) {
+    for (const char* cacheableKey : kCacheableKeys) {
+        if (key == cacheableKey) return true;
+    }
+    return false;
+}
+
+uint32_t ParametersUtil::syncCacheGenerationLocked() {
+    uint32_t generation = sCacheGeneration.load(std::memory_order_acquire);
+    if (generation != mCacheGeneration) {
+        mCache.clear();
+        mCacheGeneration = generation;
+    }
+    return generation;
+}
+
+// static
+void ParametersUtil::invalidateParamsCache() {
+    sCacheGeneration.fetch_add(1, std::memory_order_acq_rel);
 }
 
 Result ParametersUtil::setParam(const char* name, bool value) {
@@ -141,6 +231,9 @@ Result ParametersUtil::setParametersImpl(
 
 Result ParametersUtil::setParams(const AudioParameter& param) {
     int halStatus = halSetParameters(param.toString().string());
+    // Invalidate once the HAL has applied the change, so that a concurrent get
+    // can not cache a value from before it.
+    invalidateParamsCache();
     if (halStatus == OK)
         return Result::OK;
     else if (halStatus == -ENOSYS)
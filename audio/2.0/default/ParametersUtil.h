@@ -17,8 +17,12 @@
 #ifndef android_hardware_audio_V2_0_ParametersUtil_H_
 #define android_hardware_audio_V2_0_ParametersUtil_H_
 
+#include <atomic>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 
 #include <android/hardware/audio/2.0/types.h>
 #include <hidl/HidlSupport.h>
@@ -43,6 +47,8 @@ class ParametersUtil {
     void getParametersImpl(
             const hidl_vec<hidl_string>& keys,
             std::function<void(Result retval, const hidl_vec<ParameterValue>& parameters)> cb);
+    // Cached keys are answered locally, all the others are fetched with a single
+    // legacy get_parameters call.
     std::unique_ptr<AudioParameter> getParams(const AudioParameter& keys);
     Result setParam(const char* name, bool value);
     Result setParam(const char* name, int value);
@@ -50,11 +56,30 @@ class ParametersUtil {
     Result setParametersImpl(const hidl_vec<ParameterValue>& parameters);
     Result setParams(const AudioParameter& param);
 
+    // Drops the cached values of every device and stream. Called for each
+    // change done through the legacy HAL that may affect parameter values.
+    static void invalidateParamsCache();
+
   protected:
     virtual ~ParametersUtil() {}
 
     virtual char* halGetParameters(const char* keys) = 0;
     virtual int halSetParameters(const char* keysAndValues) = 0;
+
+  private:
+    struct CachedParam {
+        status_t status;  // BAD_VALUE if the HAL does not return the key
+        String8 value;
+    };
+
+    static bool isCacheable(const String8& key);
+    status_t getParamValue(const String8& name, String8* value);
+    uint32_t syncCacheGenerationLocked();
+
+    static std::atomic<uint32_t> sCacheGeneration;
+    std::mutex mCacheLock;
+    uint32_t mCacheGeneration = 0;
+    std::unordered_map<std::string, CachedParam> mCache;
 };
 
 }  // namespace implementation
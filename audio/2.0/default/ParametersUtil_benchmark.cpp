@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+
+#include <benchmark/benchmark.h>
+
+#include "ParametersUtil.h"
+
+using ::android::AudioParameter;
+using ::android::String8;
+using ::android::hardware::hidl_string;
+using ::android::hardware::hidl_vec;
+using ::android::hardware::audio::V2_0::ParameterValue;
+using ::android::hardware::audio::V2_0::Result;
+using ::android::hardware::audio::V2_0::implementation::ParametersUtil;
+
+namespace {
+
+// Legacy HAL answering from a table, parsing the keys and formatting the reply
+// with str_parms like the legacy HALs do.
+class FakeLegacyHal : public ParametersUtil {
+  public:
+    ~FakeLegacyHal() override {}
+
+    char* halGetParameters(const char* keys) override {
+        AudioParameter halKeys((String8(keys)));
+        AudioParameter reply;
+        String8 key;
+        for (size_t i = 0; i < halKeys.size(); ++i) {
+            halKeys.getAt(i, key);
+            auto it = mValues.find(key.string());
+            if (it != mValues.end()) {
+                reply.add(key, String8(it->second.c_str()));
+            }
+        }
+        return strdup(reply.toString().string());
+    }
+
+    int halSetParameters(const char*) override { return 0; }
+
+  private:
+    const std::map<std::string, std::string> mValues = {
+        {AudioParameter::keyRouting, "2"},
+        {AudioParameter::keyFormat, "1"},
+        {AudioParameter::keyChannels, "3"},
+        {AudioParameter::keySamplingRate, "48000"},
+        {AudioParameter::keyFrameCount, "960"},
+        {AudioParameter::keyStreamSupportedChannels,
+         "AUDIO_CHANNEL_OUT_STEREO|AUDIO_CHANNEL_OUT_5POINT1|AUDIO_CHANNEL_OUT_7POINT1"},
+        {AudioParameter::keyStreamSupportedFormats,
+         "AUDIO_FORMAT_PCM_16_BIT|AUDIO_FORMAT_PCM_24_BIT_PACKED|AUDIO_FORMAT_AC3"},
+        {AudioParameter::keyStreamSupportedSamplingRates,
+         "32000|44100|48000|88200|96000|176400|192000"},
+    };
+};
+
+// Routing is never cached, every lookup is a string round-trip through the legacy HAL.
+void BM_GetParamRoundTrip(benchmark::State& state) {
+    FakeLegacyHal hal;
+    int value;
+    while (state.KeepRunning()) {
+        hal.getParam(AudioParameter::keyRouting, &value);
+        benchmark::DoNotOptimize(value);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_GetParamRoundTrip);
+
+// The frame count is answered from the cache after the first lookup.
+void BM_GetParamCached(benchmark::State& state) {
+    FakeLegacyHal hal;
+    int value;
+    while (state.KeepRunning()) {
+        hal.getParam(AudioParameter::keyFrameCount, &value);
+        benchmark::DoNotOptimize(value);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_GetParamCached);
+
+// Same, with a set invalidating the cache every state.range(0) lookups.
+void BM_GetParamCachedWithSets(benchmark::State& state) {
+    FakeLegacyHal hal;
+    int value;
+    int64_t lookups = 0;
+    while (state.KeepRunning()) {
+        if (++lookups % state.range(0) == 0) {
+            hal.setParam("screen_state", true);
+        }
+        hal.getParam(AudioParameter::keyFrameCount, &value);
+        benchmark::DoNotOptimize(value);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_GetParamCachedWithSets)->Arg(10)->Arg(100)->Arg(1000);
+
+// Four keys in a single getParameters call: the current configuration of the
+// stream, which is fetched with one legacy call, or its capabilities, which are
+// cached.
+void BM_GetParameters(benchmark::State& state) {
+    FakeLegacyHal hal;
+    hidl_vec<hidl_string> keys;
+    if (state.range(0)) {
+        keys = {AudioParameter::keyFrameCount, AudioParameter::keyStreamSupportedChannels,
+                AudioParameter::keyStreamSupportedFormats,
+                AudioParameter::keyStreamSupportedSamplingRates};
+    } else {
+        keys = {AudioParameter::keyRouting, AudioParameter::keyFormat,
+                AudioParameter::keyChannels, AudioParameter::keySamplingRate};
+    }
+    size_t values = 0;
+    while (state.KeepRunning()) {
+        hal.getParametersImpl(keys, [&values](Result, const hidl_vec<ParameterValue>& params) {
+            values += params.size();
+        });
+    }
+    benchmark::DoNotOptimize(values);
+    state.SetItemsProcessed(state.iterations() * keys.size());
+}
+BENCHMARK(BM_GetParameters)->ArgName("cached")->Arg(0)->Arg(1);
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -18,10 +18,13 @@
 //#define LOG_NDEBUG 0
 #define ATRACE_TAG ATRACE_TAG_AUDIO
 
+#include <inttypes.h>
+#include <stdio.h>
 #include <memory>
 
 #include <android/log.h>
 #include <hardware/audio.h>
+#include <utils/Timers.h>
 #include <utils/Trace.h>
 
 #include "StreamOut.h"
@@ -42,7 +45,8 @@ class WriteThread : public Thread {
     // WriteThread's lifespan never exceeds StreamOut's lifespan.
     WriteThread(std::atomic<bool>* stop, audio_stream_out_t* stream,
                 StreamOut::CommandMQ* commandMQ, StreamOut::DataMQ* dataMQ,
-                StreamOut::StatusMQ* statusMQ, EventFlag* efGroup)
+                StreamOut::StatusMQ* statusMQ, EventFlag* efGroup,
+                StreamOut::WriteStats* stats)
         : Thread(false /*canCallJava*/),
           mStop(stop),
           mStream(stream),
@@ -50,9 +54,18 @@ class WriteThread : public Thread {
           mDataMQ(dataMQ),
           mStatusMQ(statusMQ),
           mEfGroup(efGroup),
-          mBuffer(nullptr) {}
+          mStats(stats),
+          mBuffer(nullptr),
+          mBytesPerSecond(0),
+          mPlayedOutNs(0) {}
     bool init() {
         mBuffer.reset(new (std::nothrow) uint8_t[mDataMQ->getQuantumCount()]);
+        // Late writes can only be detected when the duration of the data is known.
+        audio_stream_t* common = &mStream->common;
+        if (audio_is_linear_pcm(common->get_format(common))) {
+            mBytesPerSecond = audio_stream_out_frame_size(mStream) *
+                              common->get_sample_rate(common);
+        }
         return mBuffer != nullptr;
     }
     virtual ~WriteThread() {}
@@ -64,27 +77,57 @@ class WriteThread : public Thread {
     StreamOut::DataMQ* mDataMQ;
     StreamOut::StatusMQ* mStatusMQ;
     EventFlag* mEfGroup;
+    StreamOut::WriteStats* mStats;
     std::unique_ptr<uint8_t[]> mBuffer;
+    size_t mBytesPerSecond;
+    nsecs_t mPlayedOutNs;  // when the data passed to the last write runs out
     IStreamOut::WriteStatus mStatus;
 
     bool threadLoop() override;
 
+    void doCommand();
     void doGetLatency();
     void doGetPresentationPosition();
     void doWrite();
+    void updateWakeupStats(nsecs_t elapsedNs);
 };
 
 void WriteThread::doWrite() {
     const size_t availToRead = mDataMQ->availableToRead();
     mStatus.retval = Result::OK;
     mStatus.reply.written = 0;
-    if (mDataMQ->read(&mBuffer[0], availToRead)) {
-        ssize_t writeResult = mStream->write(mStream, &mBuffer[0], availToRead);
-        if (writeResult >= 0) {
-            mStatus.reply.written = writeResult;
-        } else {
-            mStatus.retval = Stream::analyzeStatus("write", writeResult);
+    StreamOut::DataMQ::MemTransaction tx;
+    if (!mDataMQ->beginRead(availToRead, &tx)) {
+        return;
+    }
+
+    // Pass the data to the HAL right from the FMQ shared memory, unless it
+    // wraps around the end of the ring buffer.
+    const uint8_t* data = tx.getFirstRegion().getAddress();
+    if (tx.getFirstRegion().getLength() < availToRead) {
+        if (!tx.copyFrom(&mBuffer[0], 0, availToRead)) {
+            mDataMQ->commitRead(availToRead);
+            return;
+        }
+        data = &mBuffer[0];
+        mStats->wrappedWrites.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    const nsecs_t startNs = systemTime();
+    if (mPlayedOutNs != 0 && startNs > mPlayedOutNs) {
+        mStats->lateWrites.fetch_add(1, std::memory_order_relaxed);
+    }
+    ssize_t writeResult = mStream->write(mStream, data, availToRead);
+    mDataMQ->commitRead(availToRead);
+    mStats->writes.fetch_add(1, std::memory_order_relaxed);
+    if (writeResult >= 0) {
+        mStatus.reply.written = writeResult;
+        if (mBytesPerSecond != 0) {
+            mPlayedOutNs = systemTime() + writeResult * 1000000000LL / mBytesPerSecond;
         }
+    } else {
+        mStatus.retval = Stream::analyzeStatus("write", writeResult);
+        mPlayedOutNs = 0;
     }
 }
 
@@ -99,6 +142,37 @@ void WriteThread::doGetLatency() {
     mStatus.reply.latencyMs = mStream->get_latency(mStream);
 }
 
+void WriteThread::doCommand() {
+    switch (mStatus.replyTo) {
+        case IStreamOut::WriteCommand::WRITE:
+            doWrite();
+            break;
+        case IStreamOut::WriteCommand::GET_PRESENTATION_POSITION:
+            doGetPresentationPosition();
+            break;
+        case IStreamOut::WriteCommand::GET_LATENCY:
+            doGetLatency();
+            break;
+        default:
+            ALOGE("Unknown write thread command code %d", mStatus.replyTo);
+            mStatus.retval = Result::NOT_SUPPORTED;
+            break;
+    }
+    if (!mStatusMQ->write(&mStatus)) {
+        ALOGE("status message queue write failed");
+    }
+}
+
+void WriteThread::updateWakeupStats(nsecs_t elapsedNs) {
+    // Only this thread writes the counters, so plain load / store is enough
+    // for the maximum.
+    mStats->wakeups.fetch_add(1, std::memory_order_relaxed);
+    mStats->totalWakeupNs.fetch_add(elapsedNs, std::memory_order_relaxed);
+    if (elapsedNs > mStats->maxWakeupNs.load(std::memory_order_relaxed)) {
+        mStats->maxWakeupNs.store(elapsedNs, std::memory_order_relaxed);
+    }
+}
+
 bool WriteThread::threadLoop() {
     // This implementation doesn't return control back to the Thread until it
     // decides to stop,
@@ -114,25 +188,12 @@ bool WriteThread::threadLoop() {
         if (!mCommandMQ->read(&mStatus.replyTo)) {
             continue;  // Nothing to do.
         }
-        switch (mStatus.replyTo) {
-            case IStreamOut::WriteCommand::WRITE:
-                doWrite();
-                break;
-            case IStreamOut::WriteCommand::GET_PRESENTATION_POSITION:
-                doGetPresentationPosition();
-                break;
-            case IStreamOut::WriteCommand::GET_LATENCY:
-                doGetLatency();
-                break;
-            default:
-                ALOGE("Unknown write thread command code %d", mStatus.replyTo);
-                mStatus.retval = Result::NOT_SUPPORTED;
-                break;
-        }
-        if (!mStatusMQ->write(&mStatus)) {
-            ALOGE("status message queue write failed");
-        }
+        const nsecs_t wakeupNs = systemTime();
+        // WRITE carries no size, it consumes all the data in the FMQ. So one
+        // command is served per wakeup, as the client expects.
+        doCommand();
         mEfGroup->wake(static_cast<uint32_t>(MessageQueueFlagBits::NOT_FULL));
+        updateWakeupStats(systemTime() - wakeupNs);
     }
 
     return false;
@@ -262,7 +323,26 @@ Return<Result> StreamOut::setParameters(
 }
 
 Return<void> StreamOut::debugDump(const hidl_handle& fd) {
-    return mStreamCommon->debugDump(fd);
+    mStreamCommon->debugDump(fd);
+    if (fd.getNativeHandle() != nullptr && fd->numFds == 1 && mWriteThread.get()) {
+        dumpWriteStats(fd->data[0]);
+    }
+    return Void();
+}
+
+void StreamOut::dumpWriteStats(int fd) {
+    const uint64_t wakeups = mWriteStats.wakeups.load(std::memory_order_relaxed);
+    const int64_t totalWakeupNs = mWriteStats.totalWakeupNs.load(std::memory_order_relaxed);
+    dprintf(fd, "Write thread: %" PRIu64 " commands\n", wakeups);
+    dprintf(fd,
+            "  %" PRIu64 " writes, %" PRIu64 " copied on FMQ wrap, %" PRIu64
+            " late (possible underruns)\n",
+            mWriteStats.writes.load(std::memory_order_relaxed),
+            mWriteStats.wrappedWrites.load(std::memory_order_relaxed),
+            mWriteStats.lateWrites.load(std::memory_order_relaxed));
+    dprintf(fd, "  wakeup latency: mean %" PRId64 " us, max %" PRId64 " us\n",
+            wakeups != 0 ? totalWakeupNs / static_cast<int64_t>(wakeups) / 1000 : 0,
+            mWriteStats.maxWakeupNs.load(std::memory_order_relaxed) / 1000);
 }
 
 Return<Result> StreamOut::close() {
@@ -360,7 +440,7 @@ Return<void> StreamOut::prepareForWriting(uint32_t frameSize,
     // Create and launch the thread.
     auto tempWriteThread = std::make_unique<WriteThread>(
         &mStopWriteThread, mStream, tempCommandMQ.get(), tempDataMQ.get(),
-        tempStatusMQ.get(), tempElfGroup.get());
+        tempStatusMQ.get(), tempElfGroup.get(), &mWriteStats);
     if (!tempWriteThread->init()) {
         ALOGW("failed to start writer thread: %s", strerror(-status));
         sendError(Result::INVALID_ARGUMENTS);
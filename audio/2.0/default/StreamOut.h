@@ -58,6 +58,16 @@ struct StreamOut : public IStreamOut {
     typedef MessageQueue<uint8_t, kSynchronizedReadWrite> DataMQ;
     typedef MessageQueue<WriteStatus, kSynchronizedReadWrite> StatusMQ;
 
+    // Counters of the write thread. Only the write thread updates them, debugDump reads them.
+    struct WriteStats {
+        std::atomic<uint64_t> wakeups{0};  // one command per wakeup
+        std::atomic<uint64_t> writes{0};
+        std::atomic<uint64_t> wrappedWrites{0};  // data wrapped in the FMQ, had to be copied
+        std::atomic<uint64_t> lateWrites{0};     // previous buffer had already played out
+        std::atomic<int64_t> totalWakeupNs{0};
+        std::atomic<int64_t> maxWakeupNs{0};
+    };
+
     StreamOut(const sp<Device>& device, audio_stream_out_t* stream);
 
     // Methods from ::android::hardware::audio::V2_0::IStream follow.
@@ -124,9 +134,12 @@ struct StreamOut : public IStreamOut {
     EventFlag* mEfGroup;
     std::atomic<bool> mStopWriteThread;
     sp<Thread> mWriteThread;
+    WriteStats mWriteStats;
 
     virtual ~StreamOut();
 
+    void dumpWriteStats(int fd);
+
     static int asyncCallback(stream_callback_event_t event, void *param, void *cookie);
 };
 
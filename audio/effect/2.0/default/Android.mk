@@ -12,6 +12,7 @@ LOCAL_SRC_FILES := \
     Conversions.cpp \
     DownmixEffect.cpp \
     Effect.cpp \
+    EffectChain.cpp \
     EffectsFactory.cpp \
     EnvironmentalReverbEffect.cpp \
     EqualizerEffect.cpp \
@@ -44,3 +45,38 @@ LOCAL_HEADER_LIBRARIES := \
     libmedia_headers \
 
 include $(BUILD_SHARED_LIBRARY)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := android.hardware.audio.effect@2.0-chain-benchmark
+LOCAL_PROPRIETARY_MODULE := true
+LOCAL_SRC_FILES := \
+    AudioBufferManager.cpp \
+    Conversions.cpp \
+    Effect.cpp \
+    EffectChain.cpp \
+    EffectChain_benchmark.cpp \
+
+LOCAL_SHARED_LIBRARIES := \
+    libbase \
+    libcutils \
+    libeffects \
+    libfmq \
+    libhidlbase \
+    libhidlmemory \
+    libhidltransport \
+    liblog \
+    libutils \
+    android.hardware.audio.common@2.0 \
+    android.hardware.audio.common@2.0-util \
+    android.hardware.audio.effect@2.0 \
+    android.hidl.allocator@1.0 \
+    android.hidl.memory@1.0 \
+
+LOCAL_HEADER_LIBRARIES := \
+    libaudio_system_headers \
+    libaudioclient_headers \
+    libeffects_headers \
+    libhardware_headers \
+    libmedia_headers \
+
+include $(BUILD_NATIVE_BENCHMARK)
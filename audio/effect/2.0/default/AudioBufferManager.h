@@ -42,6 +42,7 @@ class AudioBufferWrapper : public RefBase {
     virtual ~AudioBufferWrapper();
     bool init();
     audio_buffer_t* getHalBuffer() { return &mHalBuffer; }
+    size_t getSize() const { return mHidlBuffer.data.size(); }
   private:
     AudioBufferWrapper(const AudioBufferWrapper&) = delete;
     void operator=(AudioBufferWrapper) = delete;
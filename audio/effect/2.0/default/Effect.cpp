@@ -25,6 +25,7 @@
 
 #include "Conversions.h"
 #include "Effect.h"
+#include "EffectChain.h"
 #include "EffectMap.h"
 
 namespace android {
@@ -38,100 +39,14 @@ using ::android::hardware::audio::common::V2_0::AudioChannelMask;
 using ::android::hardware::audio::common::V2_0::AudioFormat;
 using ::android::hardware::audio::effect::V2_0::MessageQueueFlagBits;
 
-namespace {
-
-class ProcessThread : public Thread {
-  public:
-    // ProcessThread's lifespan never exceeds Effect's lifespan.
-    ProcessThread(std::atomic<bool>* stop,
-            effect_handle_t effect,
-            std::atomic<audio_buffer_t*>* inBuffer,
-            std::atomic<audio_buffer_t*>* outBuffer,
-            Effect::StatusMQ* statusMQ,
-            EventFlag* efGroup)
-            : Thread(false /*canCallJava*/),
-              mStop(stop),
-              mEffect(effect),
-              mHasProcessReverse((*mEffect)->process_reverse != NULL),
-              mInBuffer(inBuffer),
-              mOutBuffer(outBuffer),
-              mStatusMQ(statusMQ),
-              mEfGroup(efGroup) {
-    }
-    virtual ~ProcessThread() {}
-
-  private:
-    std::atomic<bool>* mStop;
-    effect_handle_t mEffect;
-    bool mHasProcessReverse;
-    std::atomic<audio_buffer_t*>* mInBuffer;
-    std::atomic<audio_buffer_t*>* mOutBuffer;
-    Effect::StatusMQ* mStatusMQ;
-    EventFlag* mEfGroup;
-
-    bool threadLoop() override;
-};
-
-bool ProcessThread::threadLoop() {
-    // This implementation doesn't return control back to the Thread until it decides to stop,
-    // as the Thread uses mutexes, and this can lead to priority inversion.
-    while(!std::atomic_load_explicit(mStop, std::memory_order_acquire)) {
-        uint32_t efState = 0;
-        mEfGroup->wait(static_cast<uint32_t>(MessageQueueFlagBits::REQUEST_PROCESS_ALL), &efState);
-        if (!(efState & static_cast<uint32_t>(MessageQueueFlagBits::REQUEST_PROCESS_ALL))
-                || (efState & static_cast<uint32_t>(MessageQueueFlagBits::REQUEST_QUIT))) {
-            continue;  // Nothing to do or time to quit.
-        }
-        Result retval = Result::OK;
-        if (efState & static_cast<uint32_t>(MessageQueueFlagBits::REQUEST_PROCESS_REVERSE)
-                && !mHasProcessReverse) {
-            retval = Result::NOT_SUPPORTED;
-        }
-
-        if (retval == Result::OK) {
-            // affects both buffer pointers and their contents.
-            std::atomic_thread_fence(std::memory_order_acquire);
-            int32_t processResult;
-            audio_buffer_t* inBuffer =
-                    std::atomic_load_explicit(mInBuffer, std::memory_order_relaxed);
-            audio_buffer_t* outBuffer =
-                    std::atomic_load_explicit(mOutBuffer, std::memory_order_relaxed);
-            if (inBuffer != nullptr && outBuffer != nullptr) {
-                if (efState & static_cast<uint32_t>(MessageQueueFlagBits::REQUEST_PROCESS)) {
-                    processResult = (*mEffect)->process(mEffect, inBuffer, outBuffer);
-                } else {
-                    processResult = (*mEffect)->process_reverse(mEffect, inBuffer, outBuffer);
-                }
-                std::atomic_thread_fence(std::memory_order_release);
-            } else {
-                ALOGE("processing buffers were not set before calling 'process'");
-                processResult = -ENODEV;
-            }
-            switch(processResult) {
-                case 0: retval = Result::OK; break;
-                case -ENODATA: retval = Result::INVALID_STATE; break;
-                case -EINVAL: retval = Result::INVALID_ARGUMENTS; break;
-                default: retval = Result::NOT_INITIALIZED;
-            }
-        }
-        if (!mStatusMQ->write(&retval)) {
-            ALOGW("status message queue write failed");
-        }
-        mEfGroup->wake(static_cast<uint32_t>(MessageQueueFlagBits::DONE_PROCESSING));
-    }
-
-    return false;
-}
-
-}  // namespace
-
 // static
 const char *Effect::sContextResultOfCommand = "returned status";
 const char *Effect::sContextCallToCommand = "error";
 const char *Effect::sContextCallFunction = sContextCallToCommand;
 
 Effect::Effect(effect_handle_t handle)
-        : mIsClosed(false), mHandle(handle), mEfGroup(nullptr), mStopProcessThread(false) {
+        : mIsClosed(false), mHandle(handle), mEfGroup(nullptr), mStopProcessThread(false),
+          mProcessingClaimed(false) {
 }
 
 Effect::~Effect() {
@@ -258,6 +173,14 @@ std::vector<uint8_t> Effect::parameterToHal(
     return halParamBuffer;
 }
 
+bool Effect::claimProcessing() {
+    return !mProcessingClaimed.exchange(true);
+}
+
+void Effect::releaseProcessing() {
+    mProcessingClaimed.store(false);
+}
+
 Result Effect::analyzeCommandStatus(const char* commandName, const char* context, status_t status) {
     return analyzeStatus("command", commandName, context, status);
 }
@@ -359,35 +282,44 @@ Result Effect::getSupportedConfigsImpl(
 Return<void> Effect::prepareForProcessing(prepareForProcessing_cb _hidl_cb) {
     status_t status;
     // Create message queue.
-    if (mStatusMQ) {
-        ALOGE("the client attempts to call prepareForProcessing_cb twice");
+    if (mStatusMQ || !claimProcessing()) {
+        ALOGE("the client attempts to call prepareForProcessing_cb twice"
+                " or the effect is processed by a chain");
         _hidl_cb(Result::INVALID_STATE, StatusMQ::Descriptor());
         return Void();
     }
     std::unique_ptr<StatusMQ> tempStatusMQ(new StatusMQ(1, true /*EventFlag*/));
     if (!tempStatusMQ->isValid()) {
         ALOGE_IF(!tempStatusMQ->isValid(), "status MQ is invalid");
+        releaseProcessing();
         _hidl_cb(Result::INVALID_ARGUMENTS, StatusMQ::Descriptor());
         return Void();
     }
     status = EventFlag::createEventFlag(tempStatusMQ->getEventFlagWord(), &mEfGroup);
     if (status != OK || !mEfGroup) {
         ALOGE("failed creating event flag for status MQ: %s", strerror(-status));
+        mEfGroup = nullptr;
+        releaseProcessing();
         _hidl_cb(Result::INVALID_ARGUMENTS, StatusMQ::Descriptor());
         return Void();
     }
 
     // Create and launch the thread.
-    mProcessThread = new ProcessThread(
+    mProcessThread = new EffectChainThread(
             &mStopProcessThread,
-            mHandle,
+            std::vector<effect_handle_t>{mHandle},
             &mHalInBufferPtr,
             &mHalOutBufferPtr,
+            nullptr /*passThroughSize*/,
             tempStatusMQ.get(),
             mEfGroup);
     status = mProcessThread->run("effect", PRIORITY_URGENT_AUDIO);
     if (status != OK) {
         ALOGW("failed to start effect processing thread: %s", strerror(-status));
+        mProcessThread.clear();
+        EventFlag::deleteEventFlag(&mEfGroup);
+        mEfGroup = nullptr;
+        releaseProcessing();
         _hidl_cb(Result::INVALID_ARGUMENTS, MQDescriptorSync<Result>());
         return Void();
     }
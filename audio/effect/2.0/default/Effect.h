@@ -182,6 +182,7 @@ struct Effect : public IEffect {
             uint32_t paramSize, const void* paramData, uint32_t valueSize, const void* valueData);
 
   private:
+    friend struct EffectChain;        // to run the effect on the chain thread
     friend struct VirtualizerEffect;  // for getParameterImpl
     friend struct VisualizerEffect;   // to allow executing commands
 
@@ -205,6 +206,8 @@ struct Effect : public IEffect {
     EventFlag* mEfGroup;
     std::atomic<bool> mStopProcessThread;
     sp<Thread> mProcessThread;
+    // Set once processing is set up, either on the effect's own thread or by an EffectChain.
+    std::atomic<bool> mProcessingClaimed;
 
     virtual ~Effect();
 
@@ -226,6 +229,8 @@ struct Effect : public IEffect {
     static std::vector<uint8_t> parameterToHal(
             uint32_t paramSize, const void* paramData, uint32_t valueSize, const void** valueData);
 
+    bool claimProcessing();
+    void releaseProcessing();
     Result analyzeCommandStatus(
             const char* commandName, const char* context, status_t status);
     Result analyzeStatus(
@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <memory.h>
+
+#define LOG_TAG "EffectChainHAL"
+#define ATRACE_TAG ATRACE_TAG_AUDIO
+
+#include <android/log.h>
+#include <utils/Trace.h>
+
+#include "EffectChain.h"
+
+namespace android {
+namespace hardware {
+namespace audio {
+namespace effect {
+namespace V2_0 {
+namespace implementation {
+
+using ::android::hardware::audio::effect::V2_0::MessageQueueFlagBits;
+
+EffectChainThread::EffectChainThread(std::atomic<bool>* stop,
+        std::vector<effect_handle_t> effects,
+        std::atomic<audio_buffer_t*>* inBuffer,
+        std::atomic<audio_buffer_t*>* outBuffer,
+        std::atomic<size_t>* passThroughSize,
+        Effect::StatusMQ* statusMQ,
+        EventFlag* efGroup)
+        : Thread(false /*canCallJava*/),
+          mStop(stop),
+          mEffects(std::move(effects)),
+          mHasProcessReverse(true),
+          mInBuffer(inBuffer),
+          mOutBuffer(outBuffer),
+          mPassThroughSize(passThroughSize),
+          mStatusMQ(statusMQ),
+          mEfGroup(efGroup) {
+    for (effect_handle_t effect : mEffects) {
+        mHasProcessReverse = mHasProcessReverse && (*effect)->process_reverse != NULL;
+    }
+}
+
+int32_t EffectChainThread::processChain(
+        bool reverse, audio_buffer_t* inBuffer, audio_buffer_t* outBuffer) {
+    size_t idleEffects = 0;
+    for (size_t i = 0; i < mEffects.size(); ++i) {
+        effect_handle_t effect = mEffects[i];
+        audio_buffer_t* effectInBuffer = i == 0 ? inBuffer : outBuffer;
+        int32_t processResult = reverse ?
+                (*effect)->process_reverse(effect, effectInBuffer, outBuffer) :
+                (*effect)->process(effect, effectInBuffer, outBuffer);
+        if (processResult == -ENODATA) {
+            // The effect did not write anything, the next one must still see the input.
+            if (i + 1 < mEffects.size() && effectInBuffer->raw != outBuffer->raw) {
+                memcpy(outBuffer->raw, effectInBuffer->raw,
+                        std::atomic_load_explicit(mPassThroughSize, std::memory_order_relaxed));
+            }
+            ++idleEffects;
+        } else if (processResult != 0) {
+            ALOGW("effect %zu of the chain failed to process: %s", i, strerror(-processResult));
+            return processResult;
+        }
+    }
+    return idleEffects == mEffects.size() ? -ENODATA : 0;
+}
+
+bool EffectChainThread::threadLoop() {
+    // This implementation doesn't return control back to the Thread until it decides to stop,
+    // as the Thread uses mutexes, and this can lead to priority inversion.
+    while(!std::atomic_load_explicit(mStop, std::memory_order_acquire)) {
+        uint32_t efState = 0;
+        mEfGroup->wait(static_cast<uint32_t>(MessageQueueFlagBits::REQUEST_PROCESS_ALL), &efState);
+        if (!(efState & static_cast<uint32_t>(MessageQueueFlagBits::REQUEST_PROCESS_ALL))
+                || (efState & static_cast<uint32_t>(MessageQueueFlagBits::REQUEST_QUIT))) {
+            continue;  // Nothing to do or time to quit.
+        }
+        Result retval = Result::OK;
+        if (efState & static_cast<uint32_t>(MessageQueueFlagBits::REQUEST_PROCESS_REVERSE)
+                && !mHasProcessReverse) {
+            retval = Result::NOT_SUPPORTED;
+        }
+        const bool reverse =
+                !(efState & static_cast<uint32_t>(MessageQueueFlagBits::REQUEST_PROCESS));
+
+        if (retval == Result::OK) {
+            // affects both buffer pointers and their contents.
+            std::atomic_thread_fence(std::memory_order_acquire);
+            int32_t processResult;
+            audio_buffer_t* inBuffer =
+                    std::atomic_load_explicit(mInBuffer, std::memory_order_relaxed);
+            audio_buffer_t* outBuffer =
+                    std::atomic_load_explicit(mOutBuffer, std::memory_order_relaxed);
+            if (inBuffer != nullptr && outBuffer != nullptr) {
+                processResult = processChain(reverse, inBuffer, outBuffer);
+                std::atomic_thread_fence(std::memory_order_release);
+            } else {
+                ALOGE("processing buffers were not set before calling 'process'");
+                processResult = -ENODEV;
+            }
+            switch(processResult) {
+                case 0: retval = Result::OK; break;
+                case -ENODATA: retval = Result::INVALID_STATE; break;
+                case -EINVAL: retval = Result::INVALID_ARGUMENTS; break;
+                default: retval = Result::NOT_INITIALIZED;
+            }
+        }
+        if (!mStatusMQ->write(&retval)) {
+            ALOGW("status message queue write failed");
+        }
+        mEfGroup->wake(static_cast<uint32_t>(MessageQueueFlagBits::DONE_PROCESSING));
+    }
+
+    return false;
+}
+
+EffectChain::EffectChain(const std::vector<sp<Effect>>& effects)
+        : mIsClosed(false), mEffects(effects), mHalInBufferPtr(nullptr),
+          mHalOutBufferPtr(nullptr), mPassThroughSize(0), mEfGroup(nullptr),
+          mStopProcessThread(false) {
+}
+
+EffectChain::~EffectChain() {
+    ATRACE_CALL();
+    close();
+    if (mProcessThread.get()) {
+        ATRACE_NAME("mProcessThread->join");
+        status_t status = mProcessThread->join();
+        ALOGE_IF(status, "processing thread exit error: %s", strerror(-status));
+    }
+    if (mEfGroup) {
+        status_t status = EventFlag::deleteEventFlag(&mEfGroup);
+        ALOGE_IF(status, "processing MQ event flag deletion error: %s", strerror(-status));
+    }
+    if (mStatusMQ) {
+        // The thread has exited, the effects can be processed elsewhere again.
+        releaseEffects(mEffects.size());
+    }
+    mInBuffer.clear();
+    mOutBuffer.clear();
+}
+
+void EffectChain::releaseEffects(size_t count) {
+    while (count > 0) {
+        mEffects[--count]->releaseProcessing();
+    }
+}
+
+void EffectChain::prepareForProcessing(PrepareForProcessingCallback cb) {
+    status_t status;
+    // Create message queue.
+    if (mStatusMQ || mEffects.empty()) {
+        ALOGE("the client attempts to call prepareForProcessing twice or the chain is empty");
+        cb(Result::INVALID_STATE, StatusMQ::Descriptor());
+        return;
+    }
+    std::vector<effect_handle_t> handles;
+    for (const auto& effect : mEffects) {
+        if (!effect->claimProcessing()) {
+            ALOGE("effect %p is already processed on its own or by another chain",
+                    effect->mHandle);
+            releaseEffects(handles.size());
+            cb(Result::INVALID_STATE, StatusMQ::Descriptor());
+            return;
+        }
+        handles.push_back(effect->mHandle);
+    }
+    std::unique_ptr<StatusMQ> tempStatusMQ(new StatusMQ(1, true /*EventFlag*/));
+    if (!tempStatusMQ->isValid()) {
+        ALOGE_IF(!tempStatusMQ->isValid(), "status MQ is invalid");
+        releaseEffects(handles.size());
+        cb(Result::INVALID_ARGUMENTS, StatusMQ::Descriptor());
+        return;
+    }
+    status = EventFlag::createEventFlag(tempStatusMQ->getEventFlagWord(), &mEfGroup);
+    if (status != OK || !mEfGroup) {
+        ALOGE("failed creating event flag for status MQ: %s", strerror(-status));
+        mEfGroup = nullptr;
+        releaseEffects(handles.size());
+        cb(Result::INVALID_ARGUMENTS, StatusMQ::Descriptor());
+        return;
+    }
+
+    // Create and launch the thread.
+    const size_t numClaimed = handles.size();
+    mProcessThread = new EffectChainThread(
+            &mStopProcessThread,
+            std::move(handles),
+            &mHalInBufferPtr,
+            &mHalOutBufferPtr,
+            &mPassThroughSize,
+            tempStatusMQ.get(),
+            mEfGroup);
+    status = mProcessThread->run("effect chain", PRIORITY_URGENT_AUDIO);
+    if (status != OK) {
+        ALOGW("failed to start effect chain processing thread: %s", strerror(-status));
+        mProcessThread.clear();
+        EventFlag::deleteEventFlag(&mEfGroup);
+        mEfGroup = nullptr;
+        releaseEffects(numClaimed);
+        cb(Result::INVALID_ARGUMENTS, StatusMQ::Descriptor());
+        return;
+    }
+
+    mStatusMQ = std::move(tempStatusMQ);
+    cb(Result::OK, *mStatusMQ->getDesc());
+}
+
+Result EffectChain::setProcessBuffers(const AudioBuffer& inBuffer, const AudioBuffer& outBuffer) {
+    AudioBufferManager& manager = AudioBufferManager::getInstance();
+    sp<AudioBufferWrapper> tempInBuffer, tempOutBuffer;
+    if (!manager.wrap(inBuffer, &tempInBuffer)) {
+        ALOGE("Could not map memory of the input buffer");
+        return Result::INVALID_ARGUMENTS;
+    }
+    if (!manager.wrap(outBuffer, &tempOutBuffer)) {
+        ALOGE("Could not map memory of the output buffer");
+        return Result::INVALID_ARGUMENTS;
+    }
+    mInBuffer = tempInBuffer;
+    mOutBuffer = tempOutBuffer;
+    // The processing thread only reads these after waking up by an event flag,
+    // so it's OK to update them non-atomically.
+    mPassThroughSize.store(std::min(mInBuffer->getSize(), mOutBuffer->getSize()),
+            std::memory_order_release);
+    mHalInBufferPtr.store(mInBuffer->getHalBuffer(), std::memory_order_release);
+    mHalOutBufferPtr.store(mOutBuffer->getHalBuffer(), std::memory_order_release);
+    return Result::OK;
+}
+
+Result EffectChain::close() {
+    if (mIsClosed) return Result::INVALID_STATE;
+    mIsClosed = true;
+    if (mProcessThread.get()) {
+        mStopProcessThread.store(true, std::memory_order_release);
+    }
+    if (mEfGroup) {
+        mEfGroup->wake(static_cast<uint32_t>(MessageQueueFlagBits::REQUEST_QUIT));
+    }
+    return Result::OK;
+}
+
+}  // namespace implementation
+}  // namespace V2_0
+}  // namespace effect
+}  // namespace audio
+}  // namespace hardware
+}  // namespace android
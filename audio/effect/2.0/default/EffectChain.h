@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_AUDIO_EFFECT_V2_0_EFFECTCHAIN_H
+#define ANDROID_HARDWARE_AUDIO_EFFECT_V2_0_EFFECTCHAIN_H
+
+#include <atomic>
+#include <functional>
+#include <vector>
+
+#include <utils/RefBase.h>
+
+#include "AudioBufferManager.h"
+#include "Effect.h"
+
+namespace android {
+namespace hardware {
+namespace audio {
+namespace effect {
+namespace V2_0 {
+namespace implementation {
+
+/*
+ * Processing thread of an effect chain. Each REQUEST_PROCESS or
+ * REQUEST_PROCESS_REVERSE wake of the event flag runs all the effects on the
+ * current buffers, writes one result to the status queue and wakes
+ * DONE_PROCESSING. Effect runs its processing on a chain of one.
+ */
+class EffectChainThread : public Thread {
+  public:
+    // The thread's lifespan must not exceed the lifespan of the pointed to
+    // objects. passThroughSize may be null for a single effect.
+    EffectChainThread(std::atomic<bool>* stop,
+            std::vector<effect_handle_t> effects,
+            std::atomic<audio_buffer_t*>* inBuffer,
+            std::atomic<audio_buffer_t*>* outBuffer,
+            std::atomic<size_t>* passThroughSize,
+            Effect::StatusMQ* statusMQ,
+            EventFlag* efGroup);
+    virtual ~EffectChainThread() {}
+
+  private:
+    std::atomic<bool>* mStop;
+    const std::vector<effect_handle_t> mEffects;
+    bool mHasProcessReverse;
+    std::atomic<audio_buffer_t*>* mInBuffer;
+    std::atomic<audio_buffer_t*>* mOutBuffer;
+    std::atomic<size_t>* mPassThroughSize;
+    Effect::StatusMQ* mStatusMQ;
+    EventFlag* mEfGroup;
+
+    bool threadLoop() override;
+    int32_t processChain(bool reverse, audio_buffer_t* inBuffer, audio_buffer_t* outBuffer);
+};
+
+/*
+ * Runs several effects one after another on a single processing thread, so
+ * that a buffer costs one request and one acknowledgement for the whole chain
+ * instead of one thread hop per effect. The client side protocol is the same
+ * as for a single effect: write the buffers with setProcessBuffers, wake
+ * REQUEST_PROCESS on the event flag of the status queue, wait for
+ * DONE_PROCESSING and read the result.
+ *
+ * The first effect reads the input buffer and writes the output buffer, the
+ * following ones process the output buffer in place, thus the chain is meant
+ * for insert effects. An effect that has nothing to do (-ENODATA) passes the
+ * audio through, the chain reports INVALID_STATE only if all effects did so.
+ */
+struct EffectChain : public RefBase {
+    typedef Effect::StatusMQ StatusMQ;
+    using PrepareForProcessingCallback =
+            std::function<void(Result retval, const StatusMQ::Descriptor& statusMQ)>;
+
+    explicit EffectChain(const std::vector<sp<Effect>>& effects);
+
+    // Starts the processing thread, the effects must not have been prepared
+    // for processing on their own, nor be part of another chain. They are
+    // released for other use once the chain is destroyed.
+    void prepareForProcessing(PrepareForProcessingCallback cb);
+    Result setProcessBuffers(const AudioBuffer& inBuffer, const AudioBuffer& outBuffer);
+    Result close();
+
+  private:
+    bool mIsClosed;
+    const std::vector<sp<Effect>> mEffects;
+    sp<AudioBufferWrapper> mInBuffer;
+    sp<AudioBufferWrapper> mOutBuffer;
+    std::atomic<audio_buffer_t*> mHalInBufferPtr;
+    std::atomic<audio_buffer_t*> mHalOutBufferPtr;
+    std::atomic<size_t> mPassThroughSize;
+    std::unique_ptr<StatusMQ> mStatusMQ;
+    EventFlag* mEfGroup;
+    std::atomic<bool> mStopProcessThread;
+    sp<Thread> mProcessThread;
+
+    virtual ~EffectChain();
+
+    // Releases the processing claims on the first count effects.
+    void releaseEffects(size_t count);
+};
+
+}  // namespace implementation
+}  // namespace V2_0
+}  // namespace effect
+}  // namespace audio
+}  // namespace hardware
+}  // namespace android
+
+#endif  // ANDROID_HARDWARE_AUDIO_EFFECT_V2_0_EFFECTCHAIN_H
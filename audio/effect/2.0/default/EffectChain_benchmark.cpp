@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "EffectChainBenchmark"
+
+#include <memory>
+#include <vector>
+
+#include <android/hidl/allocator/1.0/IAllocator.h>
+#include <android/log.h>
+#include <benchmark/benchmark.h>
+
+#include "Effect.h"
+#include "EffectChain.h"
+
+using ::android::sp;
+using ::android::hardware::EventFlag;
+using ::android::hardware::hidl_memory;
+using ::android::hardware::audio::effect::V2_0::AudioBuffer;
+using ::android::hardware::audio::effect::V2_0::MessageQueueFlagBits;
+using ::android::hardware::audio::effect::V2_0::Result;
+using ::android::hardware::audio::effect::V2_0::implementation::Effect;
+using ::android::hardware::audio::effect::V2_0::implementation::EffectChain;
+using ::android::hidl::allocator::V1_0::IAllocator;
+
+namespace {
+
+// A 20 ms buffer at 48 kHz, stereo float.
+constexpr uint32_t kFrameCount = 960;
+constexpr size_t kChannels = 2;
+constexpr size_t kBufferSize = kFrameCount * kChannels * sizeof(float);
+
+// An insert effect applying a gain, standing in for EQ, bass boost and the like.
+struct StubEffect {
+    const struct effect_interface_s* itfe;
+};
+
+int32_t stubProcess(effect_handle_t, audio_buffer_t* inBuffer, audio_buffer_t* outBuffer) {
+    for (size_t i = 0; i < inBuffer->frameCount * kChannels; ++i) {
+        outBuffer->f32[i] = inBuffer->f32[i] * 0.9f;
+    }
+    return 0;
+}
+
+int32_t stubCommand(effect_handle_t, uint32_t, uint32_t, void*, uint32_t*, void*) {
+    return 0;
+}
+
+int32_t stubGetDescriptor(effect_handle_t, effect_descriptor_t*) {
+    return -EINVAL;
+}
+
+const struct effect_interface_s kStubInterface = {
+    stubProcess, stubCommand, stubGetDescriptor, nullptr /*process_reverse*/
+};
+
+bool allocateBuffer(uint64_t id, AudioBuffer* buffer) {
+    static sp<IAllocator> ashmem = IAllocator::getService("ashmem");
+    if (ashmem == nullptr) return false;
+    bool success = false;
+    ashmem->allocate(kBufferSize, [&](bool s, const hidl_memory& memory) {
+        success = s;
+        if (s) buffer->data = memory;
+    });
+    buffer->id = id;
+    buffer->frameCount = kFrameCount;
+    return success;
+}
+
+// Client side of the processing protocol, as used by the framework for an effect or a chain.
+class Processor {
+  public:
+    ~Processor() {
+        if (mEfGroup) EventFlag::deleteEventFlag(&mEfGroup);
+    }
+
+    bool init(Result retval, const Effect::StatusMQ::Descriptor& desc) {
+        if (retval != Result::OK) return false;
+        mStatusMQ.reset(new Effect::StatusMQ(desc));
+        return mStatusMQ->isValid() &&
+                EventFlag::createEventFlag(mStatusMQ->getEventFlagWord(), &mEfGroup) == android::OK;
+    }
+
+    bool process() {
+        mEfGroup->wake(static_cast<uint32_t>(MessageQueueFlagBits::REQUEST_PROCESS));
+        uint32_t efState = 0;
+        mEfGroup->wait(static_cast<uint32_t>(MessageQueueFlagBits::DONE_PROCESSING), &efState);
+        Result retval;
+        return mStatusMQ->read(&retval) && retval == Result::OK;
+    }
+
+  private:
+    std::unique_ptr<Effect::StatusMQ> mStatusMQ;
+    EventFlag* mEfGroup = nullptr;
+};
+
+std::vector<sp<Effect>> makeEffects(size_t count, std::vector<StubEffect>* stubs) {
+    stubs->assign(count, StubEffect{&kStubInterface});
+    std::vector<sp<Effect>> effects;
+    for (auto& stub : *stubs) {
+        effects.push_back(new Effect(reinterpret_cast<effect_handle_t>(&stub)));
+    }
+    return effects;
+}
+
+// Each effect on its own processing thread: one request and acknowledgement per effect.
+void BM_EffectThreads(benchmark::State& state) {
+    AudioBuffer inBuffer, outBuffer;
+    if (!allocateBuffer(1, &inBuffer) || !allocateBuffer(2, &outBuffer)) {
+        state.SkipWithError("could not allocate buffers");
+        return;
+    }
+    std::vector<StubEffect> stubs;
+    std::vector<sp<Effect>> effects = makeEffects(state.range(0), &stubs);
+    std::vector<Processor> processors(effects.size());
+    for (size_t i = 0; i < effects.size(); ++i) {
+        bool ready = false;
+        effects[i]->prepareForProcessing([&](Result r, const Effect::StatusMQ::Descriptor& d) {
+            ready = processors[i].init(r, d);
+        });
+        if (!ready || effects[i]->setProcessBuffers(i == 0 ? inBuffer : outBuffer, outBuffer)
+                != Result::OK) {
+            state.SkipWithError("could not prepare effect");
+            return;
+        }
+    }
+
+    while (state.KeepRunning()) {
+        for (auto& processor : processors) {
+            if (!processor.process()) {
+                state.SkipWithError("processing failed");
+                break;
+            }
+        }
+    }
+    for (auto& effect : effects) {
+        effect->close();
+    }
+}
+BENCHMARK(BM_EffectThreads)->DenseRange(1, 6)->UseRealTime();
+
+// All effects on one chain thread: one request and acknowledgement per buffer.
+void BM_EffectChain(benchmark::State& state) {
+    AudioBuffer inBuffer, outBuffer;
+    if (!allocateBuffer(3, &inBuffer) || !allocateBuffer(4, &outBuffer)) {
+        state.SkipWithError("could not allocate buffers");
+        return;
+    }
+    std::vector<StubEffect> stubs;
+    sp<EffectChain> chain = new EffectChain(makeEffects(state.range(0), &stubs));
+    Processor processor;
+    bool ready = false;
+    chain->prepareForProcessing([&](Result r, const EffectChain::StatusMQ::Descriptor& d) {
+        ready = processor.init(r, d);
+    });
+    if (!ready || chain->setProcessBuffers(inBuffer, outBuffer) != Result::OK) {
+        state.SkipWithError("could not prepare chain");
+        return;
+    }
+
+    while (state.KeepRunning()) {
+        if (!processor.process()) {
+            state.SkipWithError("processing failed");
+            break;
+        }
+    }
+    chain->close();
+}
+BENCHMARK(BM_EffectChain)->DenseRange(1, 6)->UseRealTime();
+
+}  // namespace
+
+BENCHMARK_MAIN();
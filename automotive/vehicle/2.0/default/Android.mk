@@ -90,6 +90,23 @@ LOCAL_EXPORT_C_INCLUDE_DIRS := \
 include $(BUILD_STATIC_LIBRARY)
 
 
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := $(call all-proto-files-under, impl/vhal_v2_0/proto)
+
+LOCAL_PROTOC_OPTIMIZE_TYPE := lite
+
+LOCAL_MODULE := $(vhal_v2_0)-libproto-native-host
+LOCAL_MODULE_CLASS := STATIC_LIBRARIES
+
+LOCAL_MODULE_TAGS := optional
+
+generated_sources_dir := $(call local-generated-sources-dir)
+LOCAL_EXPORT_C_INCLUDE_DIRS := \
+    $(generated_sources_dir)/proto/$(LOCAL_PATH)/impl/vhal_v2_0/proto
+
+include $(BUILD_HOST_STATIC_LIBRARY)
+
+
 ###############################################################################
 # Vehicle default VehicleHAL implementation
 ###############################################################################
@@ -128,6 +145,27 @@ LOCAL_CFLAGS += -Wall -Wextra -Werror
 include $(BUILD_STATIC_LIBRARY)
 
 
+###############################################################################
+# Host tool replaying a recorded property log into the emulated VehicleHAL
+###############################################################################
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := $(vhal_v2_0)-replay
+LOCAL_SRC_FILES := \
+    impl/vhal_v2_0/tools/VehicleReplay.cpp \
+
+LOCAL_STATIC_LIBRARIES := \
+    $(vhal_v2_0)-libproto-native-host \
+
+LOCAL_SHARED_LIBRARIES := \
+    libprotobuf-cpp-lite \
+
+LOCAL_CFLAGS += -Wall -Wextra -Werror
+LOCAL_MODULE_HOST_OS := linux
+
+include $(BUILD_HOST_EXECUTABLE)
+
+
 ###############################################################################
 # Vehicle reference implementation unit tests
 ###############################################################################
@@ -139,11 +177,13 @@ LOCAL_WHOLE_STATIC_LIBRARIES := \
     $(vhal_v2_0)-manager-lib \
 
 LOCAL_SRC_FILES:= \
+    tests/ConcurrentQueue_test.cpp \
     tests/RecurrentTimer_test.cpp \
     tests/SubscriptionManager_test.cpp \
     tests/VehicleHalManager_test.cpp \
     tests/VehicleObjectPool_test.cpp \
     tests/VehiclePropConfigIndex_test.cpp \
+    tests/VehiclePropertyStore_test.cpp \
 
 LOCAL_SHARED_LIBRARIES := \
     libhidlbase \
@@ -21,7 +21,9 @@
 #include <atomic>
 #include <thread>
 #include <condition_variable>
+#include <cstdint>
 #include <iostream>
+#include <vector>
 
 namespace android {
 
@@ -30,11 +32,23 @@ class ConcurrentQueue {
 public:
     void waitForItems() {
         std::unique_lock<std::mutex> g(mLock);
+        mWakeupSize = 1;
         while (mQueue.empty() && mIsActive) {
             mCond.wait(g);
         }
     }
 
+    /* Waits until the queue holds at least minSize items, the timeout expires
+     * or the queue is deactivated.
+     */
+    void waitForSize(size_t minSize, std::chrono::nanoseconds timeout) {
+        std::unique_lock<std::mutex> g(mLock);
+        mWakeupSize = minSize;
+        mCond.wait_for(g, timeout, [this, minSize] {
+            return mQueue.size() >= minSize || !mIsActive;
+        });
+    }
+
     std::vector<T> flush() {
         std::vector<T> items;
 
@@ -56,6 +70,10 @@ public:
                 return;
             }
             mQueue.push(std::move(item));
+            // Don't wake up a consumer waiting for a larger batch on every item.
+            if (mQueue.size() < mWakeupSize) {
+                return;
+            }
         }
         mCond.notify_one();
     }
@@ -79,12 +97,166 @@ private:
     using MuxGuard = std::lock_guard<std::mutex>;
 
     bool mIsActive = true;
+    size_t mWakeupSize = 1;
     mutable std::mutex mLock;
     std::condition_variable mCond;
     std::queue<T> mQueue;
 };
 
+/* Bounded variant of ConcurrentQueue with the same interface, for high event
+ * rates. Producers push into a lock-free ring buffer, any number of threads
+ * may push but only one thread may consume (waitFor... and flush). The mutex
+ * is only taken to put the consumer to sleep and to wake it up.
+ *
+ * When the ring is full producers yield until the consumer makes room, so
+ * events are never dropped while the queue is active.
+ */
 template<typename T>
+class BoundedConcurrentQueue {
+public:
+    static constexpr size_t kDefaultCapacity = 4096;
+
+    explicit BoundedConcurrentQueue(size_t capacity = kDefaultCapacity)
+            : mSlots(roundUpToPowerOfTwo(capacity)),
+              mMask(mSlots.size() - 1) {
+        for (size_t i = 0; i < mSlots.size(); i++) {
+            mSlots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    void waitForItems() {
+        waitFor(1, nullptr);
+    }
+
+    /* Waits until the queue holds at least minSize items, the timeout expires
+     * or the queue is deactivated.
+     */
+    void waitForSize(size_t minSize, std::chrono::nanoseconds timeout) {
+        waitFor(minSize, &timeout);
+    }
+
+    std::vector<T> flush() {
+        std::vector<T> items;
+        if (!mIsActive) {
+            return items;
+        }
+        items.reserve(mSize.load());
+        T item;
+        while (pop(&item)) {
+            items.push_back(std::move(item));
+        }
+        return items;
+    }
+
+    void push(T&& item) {
+        size_t pos = mTail.load(std::memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            if (!mIsActive) {
+                return;
+            }
+            slot = &mSlots[pos & mMask];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence)
+                    - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (mTail.compare_exchange_weak(pos, pos + 1,
+                                                std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // Full, wait for the consumer to catch up.
+                std::this_thread::yield();
+                pos = mTail.load(std::memory_order_relaxed);
+            } else {
+                pos = mTail.load(std::memory_order_relaxed);
+            }
+        }
+        slot->item = std::move(item);
+        slot->sequence.store(pos + 1, std::memory_order_release);
+
+        // Sequentially consistent with the consumer announcing it is about
+        // to sleep in waitFor(), so that either the consumer sees this item or
+        // we see the consumer sleeping.
+        size_t size = mSize.fetch_add(1) + 1;
+        if (mSleeping.load() && size >= mWakeupSize.load()) {
+            MuxGuard g(mLock);
+            mCond.notify_one();
+        }
+    }
+
+    /* Deactivates the queue, thus no one can push items to it, also
+     * notifies all waiting thread.
+     */
+    void deactivate() {
+        mIsActive = false;
+        MuxGuard g(mLock);
+        mCond.notify_all();  // To unblock all waiting consumers.
+    }
+
+    BoundedConcurrentQueue(const BoundedConcurrentQueue &) = delete;
+    BoundedConcurrentQueue &operator=(const BoundedConcurrentQueue &) = delete;
+private:
+    using MuxGuard = std::lock_guard<std::mutex>;
+
+    struct Slot {
+        // Equals the position of the slot when it is free for a producer to
+        // fill it, and position + 1 once the item has been published.
+        std::atomic<size_t> sequence;
+        T item;
+    };
+
+    static size_t roundUpToPowerOfTwo(size_t n) {
+        size_t result = 2;
+        while (result < n) {
+            result <<= 1;
+        }
+        return result;
+    }
+
+    bool pop(T* item) {
+        Slot& slot = mSlots[mHead & mMask];
+        size_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence != mHead + 1) {
+            return false;  // Empty or not published yet.
+        }
+        *item = std::move(slot.item);
+        slot.sequence.store(mHead + mSlots.size(), std::memory_order_release);
+        mHead++;
+        mSize.fetch_sub(1);
+        return true;
+    }
+
+    void waitFor(size_t minSize, const std::chrono::nanoseconds* timeout) {
+        std::unique_lock<std::mutex> g(mLock);
+        mWakeupSize.store(minSize);
+        mSleeping.store(true);
+        auto ready = [this, minSize] {
+            return mSize.load() >= minSize || !mIsActive;
+        };
+        if (timeout != nullptr) {
+            mCond.wait_for(g, *timeout, ready);
+        } else {
+            mCond.wait(g, ready);
+        }
+        mSleeping.store(false);
+    }
+
+    std::vector<Slot> mSlots;
+    const size_t mMask;
+    std::atomic<size_t> mTail { 0 };
+    // Only accessed by the consumer.
+    size_t mHead = 0;
+    std::atomic<size_t> mSize { 0 };
+
+    std::atomic<bool> mIsActive { true };
+    std::atomic<bool> mSleeping { false };
+    std::atomic<size_t> mWakeupSize { 1 };
+    mutable std::mutex mLock;
+    std::condition_variable mCond;
+};
+
+template<typename T, typename Queue = ConcurrentQueue<T>>
 class BatchingConsumer {
 private:
     enum class State {
@@ -102,14 +274,21 @@ public:
 
     using OnBatchReceivedFunc = std::function<void(const std::vector<T>& vec)>;
 
-    void run(ConcurrentQueue<T>* queue,
+    /* Delivers items from the queue in batches: once an item arrives, waits
+     * for batchInterval to collect more. If maxBatchSize is not 0 the batch is
+     * delivered as soon as that many items are queued, without waiting for
+     * the rest of the interval.
+     */
+    void run(Queue* queue,
              std::chrono::nanoseconds batchInterval,
-             const OnBatchReceivedFunc& func) {
+             const OnBatchReceivedFunc& func,
+             size_t maxBatchSize = 0) {
         mQueue = queue;
         mBatchInterval = batchInterval;
+        mMaxBatchSize = maxBatchSize;
 
         mWorkerThread = std::thread(
-            &BatchingConsumer<T>::runInternal, this, func);
+            &BatchingConsumer<T, Queue>::runInternal, this, func);
     }
 
     void requestStop() {
@@ -129,7 +308,11 @@ private:
                 mQueue->waitForItems();
                 if (State::STOP_REQUESTED == mState) break;
 
-                std::this_thread::sleep_for(mBatchInterval);
+                if (mMaxBatchSize > 0) {
+                    mQueue->waitForSize(mMaxBatchSize, mBatchInterval);
+                } else {
+                    std::this_thread::sleep_for(mBatchInterval);
+                }
                 if (State::STOP_REQUESTED == mState) break;
 
                 std::vector<T> items = mQueue->flush();
@@ -148,7 +331,8 @@ private:
 
     std::atomic<State> mState;
     std::chrono::nanoseconds mBatchInterval;
-    ConcurrentQueue<T>* mQueue;
+    size_t mMaxBatchSize = 0;
+    Queue* mQueue;
 };
 
 }  // namespace android
@@ -17,19 +17,30 @@
 #ifndef android_hardware_automotive_vehicle_V2_0_RecurrentTimer_H_
 #define android_hardware_automotive_vehicle_V2_0_RecurrentTimer_H_
 
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <functional>
 #include <list>
 #include <mutex>
+#include <queue>
 #include <set>
+#include <string>
 #include <thread>
 #include <unordered_map>
+#include <vector>
 
 /**
  * This class allows to specify multiple time intervals to receive
  * notifications. A single thread is used internally.
+ *
+ * Events sharing an interval are grouped and fire together, and groups are kept in a min-heap
+ * ordered by their next event time, so a wake-up only touches the groups that are due no matter
+ * how many events are registered.
  */
 class RecurrentTimer {
 private:
@@ -39,6 +50,18 @@ private:
 public:
     using Action = std::function<void(const std::vector<int32_t>& cookies)>;
 
+    /**
+     * Timing statistics of all events registered with one interval. Jitter is the delay between
+     * the time a group was due and the time it actually fired.
+     */
+    struct IntervalStats {
+        Nanos interval;
+        size_t numCookies;
+        uint64_t numFired;
+        Nanos meanJitter;
+        Nanos maxJitter;
+    };
+
     RecurrentTimer(const Action& action) : mAction(action) {
         mTimerThread = std::thread(&RecurrentTimer::loop, this, action);
     }
@@ -53,14 +76,32 @@ public:
      * interval provided before.
      */
     void registerRecurrentEvent(std::chrono::nanoseconds interval, int32_t cookie) {
-        TimePoint now = Clock::now();
-        // Align event time point among all intervals. Thus if we have two intervals 1ms and 2ms,
-        // during every second wake-up both intervals will be triggered.
-        TimePoint absoluteTime = now - Nanos(now.time_since_epoch().count() % interval.count());
-
         {
             std::lock_guard<std::mutex> g(mLock);
-            mCookieToEventsMap[cookie] = { interval, cookie, absoluteTime };
+            auto it = mCookieToInterval.find(cookie);
+            if (it != mCookieToInterval.end()) {
+                if (it->second == interval) {
+                    return;
+                }
+                removeCookieLocked(cookie, it->second);
+            }
+            mCookieToInterval[cookie] = interval;
+
+            auto groupIt = mIntervalToGroup.find(interval.count());
+            if (groupIt == mIntervalToGroup.end()) {
+                TimePoint now = Clock::now();
+                // Align event time point among all intervals. Thus if we have two intervals 1ms
+                // and 2ms, during every second wake-up both intervals will be triggered.
+                TimePoint absoluteTime =
+                        now - Nanos(now.time_since_epoch().count() % interval.count());
+                IntervalGroup& group = mIntervalToGroup[interval.count()];
+                group.interval = interval;
+                group.absoluteTime = absoluteTime;
+                group.cookies.push_back(cookie);
+                mQueue.push({ absoluteTime, interval.count() });
+            } else {
+                groupIt->second.cookies.push_back(cookie);
+            }
         }
         mCond.notify_one();
     }
@@ -68,28 +109,88 @@ public:
     void unregisterRecurrentEvent(int32_t cookie) {
         {
             std::lock_guard<std::mutex> g(mLock);
-            mCookieToEventsMap.erase(cookie);
+            auto it = mCookieToInterval.find(cookie);
+            if (it == mCookieToInterval.end()) {
+                return;
+            }
+            removeCookieLocked(cookie, it->second);
+            mCookieToInterval.erase(it);
         }
         mCond.notify_one();
     }
 
+    std::vector<IntervalStats> getIntervalStats() const {
+        std::vector<IntervalStats> stats;
+        std::lock_guard<std::mutex> g(mLock);
+        for (auto&& it : mIntervalToGroup) {
+            const IntervalGroup& group = it.second;
+            stats.push_back({
+                group.interval,
+                group.cookies.size(),
+                group.numFired,
+                group.numFired > 1 ? group.totalJitter / static_cast<int64_t>(group.numFired - 1) : Nanos(0),
+                group.maxJitter,
+            });
+        }
+        return stats;
+    }
+
+    /**
+     * Appends one line per interval with its timing statistics to outDump, for debug dumps.
+     */
+    void dumpIntervalStats(std::string* outDump) const {
+        std::vector<IntervalStats> stats = getIntervalStats();
+        std::sort(stats.begin(), stats.end(), [](const IntervalStats& a, const IntervalStats& b) {
+            return a.interval < b.interval;
+        });
+        char buf[160];
+        for (const IntervalStats& s : stats) {
+            snprintf(buf, sizeof(buf),
+                     "  interval %" PRId64 " us: %zu events, fired %" PRIu64
+                     ", jitter mean %" PRId64 " us, max %" PRId64 " us\n",
+                     static_cast<int64_t>(s.interval.count() / 1000), s.numCookies, s.numFired,
+                     static_cast<int64_t>(s.meanJitter.count() / 1000),
+                     static_cast<int64_t>(s.maxJitter.count() / 1000));
+            outDump->append(buf);
+        }
+    }
 
 private:
 
-    struct RecurrentEvent {
+    struct IntervalGroup {
         Nanos interval;
-        int32_t cookie;
         TimePoint absoluteTime;  // Absolute time of the next event.
+        std::vector<int32_t> cookies;
+
+        uint64_t numFired = 0;
+        Nanos totalJitter { 0 };
+        Nanos maxJitter { 0 };
 
         void updateNextEventTime(TimePoint now) {
             // We want to move time to next event by adding some number of intervals (usually 1)
-            // to previous absoluteTime.
-            int intervalMultiplier = (now - absoluteTime) / interval;
-            if (intervalMultiplier <= 0) intervalMultiplier = 1;
+            // to previous absoluteTime. Missed events are skipped so the group is never due twice
+            // in one wake-up.
+            int intervalMultiplier = (now - absoluteTime) / interval + 1;
             absoluteTime += intervalMultiplier * interval;
         }
     };
 
+    // (next event time, interval) of a group. Entries are not removed when a group changes;
+    // an entry whose group is gone or has moved on to another time is skipped when popped.
+    using QueueEntry = std::pair<TimePoint, int64_t>;
+
+    void removeCookieLocked(int32_t cookie, Nanos interval) {
+        auto groupIt = mIntervalToGroup.find(interval.count());
+        if (groupIt == mIntervalToGroup.end()) {
+            return;
+        }
+        std::vector<int32_t>& cookies = groupIt->second.cookies;
+        cookies.erase(std::remove(cookies.begin(), cookies.end(), cookie), cookies.end());
+        if (cookies.empty()) {
+            mIntervalToGroup.erase(groupIt);
+        }
+    }
+
     void loop(const Action& action) {
         static constexpr auto kInvalidTime = TimePoint(Nanos::max());
 
@@ -97,22 +198,34 @@ private:
 
         while (!mStopRequested) {
             auto now = Clock::now();
-            auto nextEventTime = kInvalidTime;
             cookies.clear();
 
             {
                 std::unique_lock<std::mutex> g(mLock);
 
-                for (auto&& it : mCookieToEventsMap) {
-                    RecurrentEvent& event = it.second;
-                    if (event.absoluteTime <= now) {
-                        event.updateNextEventTime(now);
-                        cookies.push_back(event.cookie);
-                    }
+                while (!mQueue.empty() && mQueue.top().first <= now) {
+                    QueueEntry entry = mQueue.top();
+                    mQueue.pop();
 
-                    if (nextEventTime > event.absoluteTime) {
-                        nextEventTime = event.absoluteTime;
+                    auto it = mIntervalToGroup.find(entry.second);
+                    if (it == mIntervalToGroup.end() || it->second.absoluteTime != entry.first) {
+                        continue;  // Stale entry
                     }
+                    IntervalGroup& group = it->second;
+                    // The first event of a group is aligned back in time and fires right away,
+                    // its delay is not jitter.
+                    if (group.numFired > 0) {
+                        Nanos jitter = now - group.absoluteTime;
+                        group.totalJitter += jitter;
+                        if (jitter > group.maxJitter) {
+                            group.maxJitter = jitter;
+                        }
+                    }
+                    group.numFired++;
+
+                    cookies.insert(cookies.end(), group.cookies.begin(), group.cookies.end());
+                    group.updateNextEventTime(now);
+                    mQueue.push({ group.absoluteTime, entry.second });
                 }
             }
 
@@ -121,15 +234,20 @@ private:
             }
 
             std::unique_lock<std::mutex> g(mLock);
-            mCond.wait_until(g, nextEventTime);  // nextEventTime can be nanoseconds::max()
+            // Stale entries at the top may cause an early wake-up, which is harmless.
+            auto nextEventTime = mQueue.empty() ? kInvalidTime : mQueue.top().first;
+            if (!mStopRequested) {
+                mCond.wait_until(g, nextEventTime);  // nextEventTime can be nanoseconds::max()
+            }
         }
     }
 
     void stop() {
-        mStopRequested = true;
         {
             std::lock_guard<std::mutex> g(mLock);
-            mCookieToEventsMap.clear();
+            mStopRequested = true;
+            mCookieToInterval.clear();
+            mIntervalToGroup.clear();
         }
         mCond.notify_one();
         if (mTimerThread.joinable()) {
@@ -142,7 +260,10 @@ private:
     std::condition_variable mCond;
     std::atomic_bool mStopRequested { false };
     Action mAction;
-    std::unordered_map<int32_t, RecurrentEvent> mCookieToEventsMap;
+    std::unordered_map<int32_t, Nanos> mCookieToInterval;
+    // Interval in nanoseconds -> events registered with that interval
+    std::unordered_map<int64_t, IntervalGroup> mIntervalToGroup;
+    std::priority_queue<QueueEntry, std::vector<QueueEntry>, std::greater<QueueEntry>> mQueue;
 };
 
 
@@ -19,6 +19,7 @@
 
 #include <memory>
 #include <map>
+#include <mutex>
 #include <set>
 #include <list>
 
@@ -51,6 +52,7 @@ public:
     void addOrUpdateSubscription(const SubscribeOptions &opts);
     bool isSubscribed(int32_t propId, int32_t areaId, SubscribeFlags flags);
     std::vector<int32_t> getSubscribedProperties() const;
+    const SubscribeOptions* getSubscription(int32_t propId) const;
 
 private:
     const sp<IVehicleCallback> mCallback;
@@ -75,11 +77,25 @@ public:
 
 struct HalClientValues {
     sp<HalClient> client;
-    std::list<VehiclePropValue *> values;
+    std::vector<VehiclePropValue *> values;
 };
 
 using ClientId = uint64_t;
 
+/**
+ * Counters of HAL events handled by SubscriptionManager::distributeValuesToClients.
+ * Every counter is per client, an event delivered to two clients is counted twice.
+ */
+struct DeliveryStats {
+    uint64_t delivered = 0;
+    // Held back within a sample period, then replaced by a newer value.
+    uint64_t decimated = 0;
+    // Replaced by a newer value of the same property in the same batch.
+    uint64_t coalesced = 0;
+    // ON_CHANGE values identical to the last value delivered to the client.
+    uint64_t deduplicated = 0;
+};
+
 class SubscriptionManager {
 public:
     using OnPropertyUnsubscribed = std::function<void(int32_t)>;
@@ -108,12 +124,38 @@ public:
                                        std::list<SubscribeOptions>* outUpdatedOptions);
 
     /**
-     * Returns a list of IVehicleCallback -> list of VehiclePropValue ready for
-     * dispatching to its clients.
+     * Groups values by the clients subscribed to them. outClientValues has one
+     * entry per client and entries without values are to be skipped. It is
+     * meant to be kept by the caller across calls so that its buffers are
+     * reused, the caller should clear the client references once it is done
+     * with them. Values in it stay valid until the next call to this method or
+     * to flushPendingValues.
+     *
+     * A client subscribed with a non-zero sample rate gets at most one value
+     * per sample period for every property and area, the latest one if several
+     * came in the same batch. Values that come in later in the period are held
+     * back, the latest of them is delivered by flushPendingValues once the
+     * period is over unless a newer value comes in first. A client subscribed
+     * with zero sample rate (ON_CHANGE properties) doesn't get values equal to
+     * the last one it got.
      */
-    std::list<HalClientValues> distributeValuesToClients(
+    void distributeValuesToClients(
             const std::vector<recyclable_ptr<VehiclePropValue>>& propValues,
-            SubscribeFlags flags) const;
+            SubscribeFlags flags,
+            std::vector<HalClientValues>* outClientValues);
+
+    /**
+     * Groups the values held back by distributeValuesToClients whose sample
+     * period is over at the given time (elapsedRealtimeNano) by client, same
+     * as distributeValuesToClients. Returns true if values are still held
+     * back, in which case this is to be called again later.
+     */
+    bool flushPendingValues(int64_t now, std::vector<HalClientValues>* outClientValues);
+
+    /** Returns true if values are held back to be delivered by flushPendingValues. */
+    bool hasPendingValues() const;
+
+    DeliveryStats getDeliveryStats() const;
 
     std::list<sp<HalClient>> getSubscribedClients(int32_t propId,
                                                   int32_t area,
@@ -137,6 +179,8 @@ private:
     sp<HalClient> getOrCreateHalClientLocked(ClientId callingPid,
                                              const sp<IVehicleCallback>& callback);
 
+    void rebuildDeliveryIndexLocked();
+
     void onCallbackDead(uint64_t cookie);
 
 private:
@@ -162,12 +206,59 @@ private:
 private:
     using MuxGuard = std::lock_guard<std::mutex>;
 
+    // Last value delivered to a subscriber for one area.
+    struct AreaState {
+        int32_t areaId;
+        int64_t periodStart = 0;  // Timestamp of the value that opened the sample period
+        uint64_t batch = 0;       // Batch in which the last value was queued
+        size_t valueIndex = 0;    // Index of that value in HalClientValues::values
+        recyclable_ptr<VehiclePropValue> lastValue;     // Only for zero sample rate
+        recyclable_ptr<VehiclePropValue> pendingValue;  // Held back until periodStart + period
+    };
+
+    // Subscription of one client to one property in the delivery index.
+    struct Subscriber {
+        size_t clientIndex;  // Index in mIndexClients
+        int32_t vehicleAreas;
+        SubscribeFlags flags;
+        float sampleRate;
+        std::vector<AreaState> areaStates;
+    };
+
+    void prepareClientValuesLocked(std::vector<HalClientValues>* outClientValues);
+
+    bool shouldDeliverLocked(Subscriber* subscriber,
+                             VehiclePropValue* value,
+                             std::vector<VehiclePropValue*>* clientValues);
+
+    void storeValueLocked(const VehiclePropValue& value,
+                          recyclable_ptr<VehiclePropValue>* outStored);
+
+    static int64_t minSamplePeriod(float sampleRate);
+
     mutable std::mutex mLock;
 
+    // Copies of values kept in AreaState, declared first to outlive them.
+    VehiclePropValuePool mValuePool;
+
     std::map<ClientId, sp<HalClient>> mClients;
     std::map<int32_t, sp<HalClientVector>> mPropToClients;
     std::map<int32_t, SubscribeOptions> mHalEventSubscribeOptions;
 
+    // Flattened copy of mPropToClients used to distribute values, rebuilt on
+    // every subscription change. mIndexPropIds is sorted and
+    // mIndexSubscribers[i] holds the subscribers of mIndexPropIds[i].
+    std::vector<sp<HalClient>> mIndexClients;
+    std::vector<int32_t> mIndexPropIds;
+    std::vector<std::vector<Subscriber>> mIndexSubscribers;
+
+    uint64_t mBatch = 0;
+    DeliveryStats mDeliveryStats;
+    // Number of AreaStates with a pendingValue.
+    size_t mPendingCount = 0;
+    // Pending values handed out by the last flushPendingValues call.
+    std::vector<recyclable_ptr<VehiclePropValue>> mFlushedValues;
+
     OnPropertyUnsubscribed mOnPropertyUnsubscribed;
     sp<DeathRecipient> mCallbackDeathRecipient;
 };
@@ -73,6 +73,12 @@ public:
      */
     virtual void onCreate() {}
 
+    /**
+     * Override this method to append implementation specific state to the
+     * output of IVehicle::debugDump.
+     */
+    virtual void dump(std::string* /* outDump */) {}
+
     void init(
         VehiclePropValuePool* valueObjectPool,
         const HalEventFunction& onHalEvent,
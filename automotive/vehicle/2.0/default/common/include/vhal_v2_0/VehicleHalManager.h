@@ -29,6 +29,7 @@
 #include <android/hardware/automotive/vehicle/2.0/IVehicle.h>
 
 #include "ConcurrentQueue.h"
+#include "RecurrentTimer.h"
 #include "SubscriptionManager.h"
 #include "VehicleHal.h"
 #include "VehicleObjectPool.h"
@@ -51,7 +52,9 @@ public:
     VehicleHalManager(VehicleHal* vehicleHal)
         : mHal(vehicleHal),
           mSubscriptionManager(std::bind(&VehicleHalManager::onAllClientsUnsubscribed,
-                                         this, std::placeholders::_1)) {
+                                         this, std::placeholders::_1)),
+          mFlushTimer(std::bind(&VehicleHalManager::onFlushTimer,
+                                this, std::placeholders::_1)) {
         init();
     }
 
@@ -88,6 +91,13 @@ private:
     // This method will be called from BatchingConsumer thread
     void onBatchHalEvent(const std::vector<VehiclePropValuePtr >& values);
 
+    // Delivers the values held back by the subscription manager, called from
+    // mFlushTimer while there are any.
+    void onFlushTimer(const std::vector<int32_t>& cookies);
+
+    void deliverClientValuesLocked();
+    void updateFlushTimerLocked(bool hasPendingValues);
+
     void handlePropertySetEvent(const VehiclePropValue& value);
 
     const VehiclePropConfig* getPropConfigOrNull(int32_t prop) const;
@@ -107,11 +117,20 @@ private:
     std::unique_ptr<VehiclePropConfigIndex> mConfigIndex;
     SubscriptionManager mSubscriptionManager;
 
+    // Serializes deliveries from the batching thread and from mFlushTimer, and
+    // guards the members below.
+    std::mutex mDeliveryLock;
     hidl_vec<VehiclePropValue> mHidlVecOfVehiclePropValuePool;
+    std::vector<HalClientValues> mClientValues;
+    bool mFlushTimerArmed = false;
 
-    ConcurrentQueue<VehiclePropValuePtr> mEventQueue;
-    BatchingConsumer<VehiclePropValuePtr> mBatchingConsumer;
+    BoundedConcurrentQueue<VehiclePropValuePtr> mEventQueue;
+    BatchingConsumer<VehiclePropValuePtr,
+                     BoundedConcurrentQueue<VehiclePropValuePtr>>
+        mBatchingConsumer;
     VehiclePropValuePool mValueObjectPool;
+    // Last so that its thread is stopped before anything it uses is destroyed.
+    RecurrentTimer mFlushTimer;
 };
 
 }  // namespace V2_0
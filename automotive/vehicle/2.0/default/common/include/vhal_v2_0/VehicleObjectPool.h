@@ -18,9 +18,12 @@
 #ifndef android_hardware_automotive_vehicle_V2_0_VehicleObjectPool_H_
 #define android_hardware_automotive_vehicle_V2_0_VehicleObjectPool_H_
 
-#include <deque>
-#include <map>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <mutex>
+#include <vector>
 
 #include <android/hardware/automotive/vehicle/2.0/types.h>
 
@@ -31,15 +34,56 @@ namespace vehicle {
 namespace V2_0 {
 
 // Handy metric mostly for unit tests and debug.
-#define INC_METRIC_IF_DEBUG(val) PoolStats::instance()->val++;
-struct PoolStats {
-    std::atomic<uint32_t> Obtained {0};
-    std::atomic<uint32_t> Created {0};
-    std::atomic<uint32_t> Recycled {0};
-
-    static PoolStats* instance() {
-        static PoolStats inst;
-        return &inst;
+#define INC_METRIC_IF_DEBUG(val) PoolStats::threadCounters()->val++;
+
+/**
+ * Object pool counters, summed up over all threads. Every thread counts in
+ * counters of its own, so counting doesn't make threads using the pools
+ * synchronize with each other.
+ */
+template<typename Counter>
+struct PoolCounters {
+    Counter Obtained {};
+    Counter Created {};
+    Counter Recycled {};
+    // Obtained = MagazineHits + SharedHits + Created, where MagazineHits are
+    // objects taken from the calling thread's magazine and SharedHits are
+    // objects taken after refilling an empty magazine from the shared list.
+    Counter MagazineHits {};
+    Counter SharedHits {};
+    // Failed compare-and-swap attempts on the shared free list.
+    Counter Contended {};
+    // Recycled objects deleted because the shared free list was full.
+    Counter Discarded {};
+};
+
+/* Counter only ever incremented by the thread owning it, but read by others. */
+class ThreadCounter {
+public:
+    void operator++(int) {
+        mValue.store(mValue.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    uint32_t load() const { return mValue.load(std::memory_order_relaxed); }
+    void reset() { mValue.store(0, std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint32_t> mValue {0};
+};
+
+struct PoolStats : public PoolCounters<uint32_t> {
+    struct ThreadCounters : public PoolCounters<ThreadCounter> {
+        ThreadCounters();
+        ~ThreadCounters();
+    };
+
+    /* Returns the counters of all threads, including the exited ones. */
+    static PoolStats get();
+    /* Zeroes the counters of all threads, pools must not be in use. */
+    static void reset();
+
+    static ThreadCounters* threadCounters() {
+        static thread_local ThreadCounters counters;
+        return &counters;
     }
 };
 
@@ -66,10 +110,115 @@ private:
 template <typename T>
 using recyclable_ptr = typename std::unique_ptr<T, Deleter<T>>;
 
+/**
+ * Bounded lock-free list of free objects. It's made of two stacks over the
+ * same array of nodes: one holding objects and one holding empty nodes. Stack
+ * heads are tagged with a counter incremented on every change to avoid ABA.
+ */
+template<typename T>
+class FreeList {
+public:
+    FreeList(size_t capacity) : mCapacity(capacity) {}
+
+    ~FreeList() {
+        T* o;
+        while (pop(&o)) {
+            delete o;
+        }
+    }
+
+    /* Returns false if the list is full. */
+    bool push(T* o) {
+        std::call_once(mNodesAllocated, [this] { allocateNodes(); });
+        uint32_t index;
+        if (!popNode(&mEmptyHead, &index)) {
+            return false;
+        }
+        mNodes[index].object = o;
+        pushNode(&mObjectHead, index);
+        return true;
+    }
+
+    /* Returns false if the list is empty. */
+    bool pop(T** outObject) {
+        uint32_t index;
+        if (!popNode(&mObjectHead, &index)) {
+            return false;
+        }
+        *outObject = mNodes[index].object;
+        pushNode(&mEmptyHead, index);
+        return true;
+    }
+
+    FreeList& operator =(const FreeList &) = delete;
+    FreeList(const FreeList &) = delete;
+
+private:
+    static constexpr uint32_t kNoNode = UINT32_MAX;
+
+    struct Node {
+        std::atomic<uint32_t> next { kNoNode };
+        T* object = nullptr;
+    };
+
+    // Head is (tag << 32) | index of the top node.
+    static uint64_t makeHead(uint64_t oldHead, uint32_t index) {
+        return (((oldHead >> 32) + 1) << 32) | index;
+    }
+
+    void allocateNodes() {
+        mNodes.reset(new Node[mCapacity]);
+        for (size_t i = 0; i < mCapacity; i++) {
+            pushNode(&mEmptyHead, i);
+        }
+    }
+
+    // Doesn't touch the nodes if the stack is empty, so pop() is safe to call
+    // before they are allocated.
+    bool popNode(std::atomic<uint64_t>* head, uint32_t* outIndex) {
+        uint64_t h = head->load(std::memory_order_acquire);
+        for (;;) {
+            uint32_t index = static_cast<uint32_t>(h);
+            if (index == kNoNode) {
+                return false;
+            }
+            uint32_t next = mNodes[index].next.load(std::memory_order_relaxed);
+            if (head->compare_exchange_weak(h, makeHead(h, next), std::memory_order_acquire)) {
+                *outIndex = index;
+                return true;
+            }
+            INC_METRIC_IF_DEBUG(Contended)
+        }
+    }
+
+    void pushNode(std::atomic<uint64_t>* head, uint32_t index) {
+        uint64_t h = head->load(std::memory_order_relaxed);
+        for (;;) {
+            mNodes[index].next.store(static_cast<uint32_t>(h), std::memory_order_relaxed);
+            if (head->compare_exchange_weak(h, makeHead(h, index), std::memory_order_release,
+                                            std::memory_order_relaxed)) {
+                return;
+            }
+            INC_METRIC_IF_DEBUG(Contended)
+        }
+    }
+
+    const size_t mCapacity;
+    std::once_flag mNodesAllocated;
+    std::unique_ptr<Node[]> mNodes;
+    std::atomic<uint64_t> mObjectHead { kNoNode };
+    std::atomic<uint64_t> mEmptyHead { kNoNode };
+};
+
 /**
  * Generic abstract object pool class. Users of this class must implement
  * #createObject method.
  *
+ * Every thread keeps a small magazine of free objects for each pool it uses
+ * recently, so most obtain and recycle calls don't synchronize with other
+ * threads at all. Magazines are refilled from and overflow into a lock-free
+ * free list shared by all threads.
+ *
  * This class is thread-safe. Concurrent calls to #obtain(...) method from
  * multiple threads is OK, also client can obtain an object in one thread and
  * then move ownership to another thread.
@@ -78,21 +227,31 @@ using recyclable_ptr = typename std::unique_ptr<T, Deleter<T>>;
 template<typename T>
 class ObjectPool {
 public:
-    ObjectPool() = default;
+    ObjectPool(size_t sharedCapacity = kDefaultSharedCapacity)
+        : mId(sNextId++),
+          mFreeList(sharedCapacity),
+          // Small enough for std::function to store inline, copying it to
+          // every recyclable_ptr doesn't allocate.
+          mDeleter([this](T* o) { recycle(o); }) {}
     virtual ~ObjectPool() = default;
 
     virtual recyclable_ptr<T> obtain() {
-        std::lock_guard<std::mutex> g(mLock);
         INC_METRIC_IF_DEBUG(Obtained)
-        if (mObjects.empty()) {
-            INC_METRIC_IF_DEBUG(Created)
-            return wrap(createObject());
+        Magazine* m = getMagazine();
+        if (m->count == 0) {
+            T* o;
+            while (m->count < kMagazineSize / 2 && mFreeList.pop(&o)) {
+                m->objects[m->count++] = o;
+            }
+            if (m->count == 0) {
+                INC_METRIC_IF_DEBUG(Created)
+                return wrap(createObject());
+            }
+            INC_METRIC_IF_DEBUG(SharedHits)
+        } else {
+            INC_METRIC_IF_DEBUG(MagazineHits)
         }
-
-        auto o = wrap(mObjects.front().release());
-        mObjects.pop_front();
-
-        return o;
+        return wrap(m->objects[--m->count]);
     }
 
     ObjectPool& operator =(const ObjectPool &) = delete;
@@ -103,30 +262,80 @@ protected:
 
     virtual void recycle(T* o) {
         INC_METRIC_IF_DEBUG(Recycled)
-        std::lock_guard<std::mutex> g(mLock);
-        mObjects.push_back(std::unique_ptr<T> { o } );
+        Magazine* m = getMagazine();
+        if (m->count == kMagazineSize) {
+            // Keep half of the magazine for this thread, share the rest.
+            for (size_t i = kMagazineSize / 2; i < kMagazineSize; i++) {
+                if (!mFreeList.push(m->objects[i])) {
+                    INC_METRIC_IF_DEBUG(Discarded)
+                    delete m->objects[i];
+                }
+            }
+            m->count = kMagazineSize / 2;
+        }
+        m->objects[m->count++] = o;
     }
 
 private:
-    const Deleter<T>& getDeleter() {
-        if (!mDeleter.get()) {
-            Deleter<T> *d = new Deleter<T>(std::bind(
-                &ObjectPool::recycle, this, std::placeholders::_1));
-            mDeleter.reset(d);
+    static constexpr size_t kDefaultSharedCapacity = 1024;
+    static constexpr size_t kMagazineSize = 32;
+    static constexpr size_t kMagazinesPerThread = 8;
+
+    struct Magazine {
+        uint64_t poolId = 0;  // Pool ids start at 1
+        size_t count = 0;
+        T* objects[kMagazineSize];
+
+        void clear() {
+            for (size_t i = 0; i < count; i++) {
+                delete objects[i];
+            }
+            count = 0;
+        }
+    };
+
+    struct ThreadCache {
+        Magazine magazines[kMagazinesPerThread];
+        size_t nextToEvict = 0;
+
+        ~ThreadCache() {
+            for (Magazine& m : magazines) {
+                m.clear();
+            }
         }
-        return *mDeleter.get();
+    };
+
+    // Magazines are matched to pools by id, never by address, and evicted
+    // objects are deleted rather than returned, so that a destroyed pool is
+    // never accessed through a magazine that outlived it.
+    Magazine* getMagazine() {
+        static thread_local ThreadCache cache;
+        for (Magazine& m : cache.magazines) {
+            if (m.poolId == mId) {
+                return &m;
+            }
+        }
+        Magazine* m = &cache.magazines[cache.nextToEvict++ % kMagazinesPerThread];
+        m->clear();
+        m->poolId = mId;
+        return m;
     }
 
     recyclable_ptr<T> wrap(T* raw) {
-        return recyclable_ptr<T> { raw, getDeleter() };
+        return recyclable_ptr<T> { raw, mDeleter };
     }
 
 private:
-    mutable std::mutex mLock;
-    std::deque<std::unique_ptr<T>> mObjects;
-    std::unique_ptr<Deleter<T>> mDeleter;
+    static std::atomic<uint64_t> sNextId;
+
+    const uint64_t mId;
+    FreeList<T> mFreeList;
+    const Deleter<T> mDeleter;
 };
 
+template<typename T>
+std::atomic<uint64_t> ObjectPool<T>::sNextId {1};
+
 /**
  * This class provides a pool of recycable VehiclePropertyValue objects.
  *
@@ -138,11 +347,10 @@ private:
  * safely pass it around. Once this object goes out of scope, it will be
  * returned the the object pool.
  *
- * Some objects are not recycable: strings and vector data types with
- * vector length > maxRecyclableVectorSize (provided in the constructor). These
- * objects will be deleted immediately once the go out of scope. There's no
- * synchornization penalty for these objects since we do not store them in the
- * pool.
+ * Vector data types with vector length > maxRecyclableVectorSize (provided in
+ * the constructor) are not recycable. These objects will be deleted
+ * immediately once the go out of scope. String and COMPLEX values are recycled
+ * with their payload cleared.
  *
  * This class is thread-safe. Users can obtain an object in one thread and pass
  * it to another.
@@ -173,8 +381,7 @@ public:
      * returning back to the object pool.
      *
      */
-    VehiclePropValuePool(size_t maxRecyclableVectorSize = 4) :
-        mMaxRecyclableVectorSize(maxRecyclableVectorSize) {};
+    VehiclePropValuePool(size_t maxRecyclableVectorSize = 4);
 
     RecyclableType obtain(VehiclePropertyType type);
 
@@ -190,16 +397,28 @@ public:
     VehiclePropValuePool(VehiclePropValuePool& ) = delete;
     VehiclePropValuePool& operator=(VehiclePropValuePool&) = delete;
 private:
-    bool isDisposable(VehiclePropertyType type, size_t vecSize) const {
-        return vecSize > mMaxRecyclableVectorSize ||
-               VehiclePropertyType::STRING == type ||
-               VehiclePropertyType::COMPLEX == type;
+    static constexpr VehiclePropertyType kPooledTypes[] = {
+        VehiclePropertyType::STRING,
+        VehiclePropertyType::BOOLEAN,
+        VehiclePropertyType::INT32,
+        VehiclePropertyType::INT32_VEC,
+        VehiclePropertyType::INT64,
+        VehiclePropertyType::FLOAT,
+        VehiclePropertyType::FLOAT_VEC,
+        VehiclePropertyType::BYTES,
+        VehiclePropertyType::COMPLEX,
+    };
+
+    static bool hasVector(VehiclePropertyType type) {
+        return type != VehiclePropertyType::STRING && type != VehiclePropertyType::COMPLEX;
     }
 
+    /* Returns index of the pool for given type and vector size in mValueTypePools, or -1 if
+     * such values are not pooled. */
+    int getPoolIndex(VehiclePropertyType type, size_t vecSize) const;
+
     RecyclableType obtainDisposable(VehiclePropertyType valueType,
                                     size_t vectorSize) const;
-    RecyclableType obtainRecylable(VehiclePropertyType type,
-                                   size_t vecSize);
 
     class InternalPool: public ObjectPool<VehiclePropValue> {
     public:
@@ -214,6 +433,7 @@ private:
         void recycle(VehiclePropValue* o) override;
     private:
         bool check(VehiclePropValue::RawValue* v);
+        void reset(VehiclePropValue::RawValue* v);
 
         template <typename VecType>
         bool check(hidl_vec<VecType>* vec, bool expected) {
@@ -232,9 +452,10 @@ private:
     };
 
 private:
-    mutable std::mutex mLock;
     const size_t mMaxRecyclableVectorSize;
-    std::map<int32_t, std::unique_ptr<InternalPool>> mValueTypePools;
+    // Indexed by getPoolIndex(), all pools are created upfront so that
+    // looking them up doesn't need a lock.
+    std::vector<std::unique_ptr<InternalPool>> mValueTypePools;
 };
 
 }  // namespace V2_0
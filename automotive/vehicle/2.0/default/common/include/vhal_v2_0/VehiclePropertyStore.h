@@ -18,9 +18,12 @@
 #define android_hardware_automotive_vehicle_V2_0_impl_PropertyDb_H_
 
 #include <cstdint>
+#include <functional>
+#include <map>
 #include <unordered_map>
 #include <memory>
 #include <mutex>
+#include <vector>
 
 #include <android/hardware/automotive/vehicle/2.0/IVehicle.h>
 
@@ -34,22 +37,24 @@ namespace V2_0 {
  * Encapsulates work related to storing and accessing configuration, storing and modifying
  * vehicle property values.
  *
- * VehiclePropertyValues stored in a sorted map thus it makes easier to get range of values, e.g.
- * to get value for all areas for particular property.
+ * Values are kept per property, each property has its own lock, so accessing one property doesn't
+ * block accessing others. Within a property values are stored in a sorted map thus it makes
+ * easier to get range of values, e.g. to get value for all areas for particular property.
  *
- * This class is thread-safe, however it uses blocking synchronization across all methods.
+ * Stored values are immutable and shared with snapshots, writing a value replaces it. This lets
+ * readers copy values without holding any lock.
+ *
+ * This class is thread-safe, except that all properties have to be registered before it is
+ * accessed from multiple threads.
  */
 class VehiclePropertyStore {
 public:
     /* Function that used to calculate unique token for given VehiclePropValue */
     using TokenFunction = std::function<int64_t(const VehiclePropValue& value)>;
 
-private:
-    struct RecordConfig {
-        VehiclePropConfig propConfig;
-        TokenFunction tokenFunction;
-    };
+    using ValuePtr = std::shared_ptr<const VehiclePropValue>;
 
+private:
     struct RecordId {
         int32_t prop;
         int32_t area;
@@ -59,8 +64,15 @@ private:
         bool operator<(const RecordId& other) const;
     };
 
-    using PropertyMap = std::map<RecordId, VehiclePropValue>;
-    using PropertyMapRange = std::pair<PropertyMap::const_iterator, PropertyMap::const_iterator>;
+    using PropertyMap = std::map<RecordId, ValuePtr>;
+
+    struct PropertyRecord {
+        VehiclePropConfig propConfig;
+        TokenFunction tokenFunction;
+
+        mutable std::mutex lock;
+        PropertyMap values;  // Values for all areas and tokens of the property. Guarded by lock.
+    };
 
 public:
     void registerProperty(const VehiclePropConfig& config, TokenFunction tokenFunc = nullptr);
@@ -74,6 +86,9 @@ public:
 
     std::vector<VehiclePropValue> readAllValues() const;
     std::vector<VehiclePropValue> readValuesForProperty(int32_t propId) const;
+    /* Same as readAllValues() but doesn't copy the values, they stay valid after the store is
+     * modified. */
+    std::vector<ValuePtr> snapshotAllValues() const;
     std::unique_ptr<VehiclePropValue> readValueOrNull(const VehiclePropValue& request) const;
     std::unique_ptr<VehiclePropValue> readValueOrNull(int32_t prop, int32_t area = 0,
                                                       int64_t token = 0) const;
@@ -83,16 +98,15 @@ public:
     const VehiclePropConfig* getConfigOrDie(int32_t propId) const;
 
 private:
-    RecordId getRecordIdLocked(const VehiclePropValue& valuePrototype) const;
-    const VehiclePropValue* getValueOrNullLocked(const RecordId& recId) const;
-    PropertyMapRange findRangeLocked(int32_t propId) const;
+    PropertyRecord* getRecordOrNull(int32_t propId) const;
+    static RecordId getRecordId(const PropertyRecord& record,
+                                const VehiclePropValue& valuePrototype);
+    ValuePtr readValuePtrOrNull(const PropertyRecord& record, const RecordId& recId) const;
 
 private:
     using MuxGuard = std::lock_guard<std::mutex>;
-    mutable std::mutex mLock;
-    std::unordered_map<int32_t /* VehicleProperty */, RecordConfig> mConfigs;
 
-    PropertyMap mPropertyValues;  // Sorted map of RecordId : VehiclePropValue.
+    std::unordered_map<int32_t /* VehicleProperty */, std::unique_ptr<PropertyRecord>> mRecords;
 };
 
 }  // namespace V2_0
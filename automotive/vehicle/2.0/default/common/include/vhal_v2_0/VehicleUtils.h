@@ -67,6 +67,10 @@ std::unique_ptr<VehiclePropValue> createVehiclePropValue(
 size_t getVehicleRawValueVectorSize(
     const VehiclePropValue::RawValue& value, VehiclePropertyType type);
 
+/**
+ * Deep copy. Buffers of dest that have the size of the ones in src are reused,
+ * so they must be owned by dest.
+ */
 void copyVehicleRawValue(VehiclePropValue::RawValue* dest,
                                 const VehiclePropValue::RawValue& src);
 
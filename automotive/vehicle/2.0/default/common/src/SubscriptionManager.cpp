@@ -18,7 +18,9 @@
 
 #include "SubscriptionManager.h"
 
+#include <algorithm>
 #include <cmath>
+#include <cstring>
 #include <inttypes.h>
 
 #include <android/log.h>
@@ -74,6 +76,29 @@ void HalClient::addOrUpdateSubscription(const SubscribeOptions &opts)  {
     }
 }
 
+static inline bool matchesSubscription(int32_t subscribedAreas,
+                                       SubscribeFlags subscribedFlags,
+                                       int32_t areaId,
+                                       SubscribeFlags flags) {
+    return (subscribedFlags & flags)
+           && (subscribedAreas == 0 || areaId == 0 || subscribedAreas & areaId);
+}
+
+template <typename T>
+static bool isEqualHidlVec(const hidl_vec<T>& a, const hidl_vec<T>& b) {
+    return a.size() == b.size() && std::equal(a.data(), a.data() + a.size(), b.data());
+}
+
+static bool isEqualRawValue(const VehiclePropValue::RawValue& a,
+                            const VehiclePropValue::RawValue& b) {
+    return isEqualHidlVec(a.int32Values, b.int32Values)
+           && isEqualHidlVec(a.floatValues, b.floatValues)
+           && isEqualHidlVec(a.int64Values, b.int64Values)
+           && isEqualHidlVec(a.bytes, b.bytes)
+           && a.stringValue.size() == b.stringValue.size()
+           && std::strcmp(a.stringValue.c_str(), b.stringValue.c_str()) == 0;
+}
+
 bool HalClient::isSubscribed(int32_t propId,
                              int32_t areaId,
                              SubscribeFlags flags) {
@@ -82,9 +107,7 @@ bool HalClient::isSubscribed(int32_t propId,
         return false;
     }
     const SubscribeOptions& opts = it->second;
-    bool res = (opts.flags & flags)
-           && (opts.vehicleAreas == 0 || areaId == 0 || opts.vehicleAreas & areaId);
-    return res;
+    return matchesSubscription(opts.vehicleAreas, opts.flags, areaId, flags);
 }
 
 std::vector<int32_t> HalClient::getSubscribedProperties() const {
@@ -96,6 +119,11 @@ std::vector<int32_t> HalClient::getSubscribedProperties() const {
     return props;
 }
 
+const SubscribeOptions* HalClient::getSubscription(int32_t propId) const {
+    auto it = mSubscriptions.find(propId);
+    return it == mSubscriptions.end() ? nullptr : &it->second;
+}
+
 StatusCode SubscriptionManager::addOrUpdateSubscription(
         ClientId clientId,
         const sp<IVehicleCallback> &callback,
@@ -127,35 +155,165 @@ StatusCode SubscriptionManager::addOrUpdateSubscription(
         }
     }
 
+    rebuildDeliveryIndexLocked();
+
     return StatusCode::OK;
 }
 
-std::list<HalClientValues> SubscriptionManager::distributeValuesToClients(
+void SubscriptionManager::distributeValuesToClients(
         const std::vector<recyclable_ptr<VehiclePropValue>>& propValues,
-        SubscribeFlags flags) const {
-    std::map<sp<HalClient>, std::list<VehiclePropValue*>> clientValuesMap;
+        SubscribeFlags flags,
+        std::vector<HalClientValues>* outClientValues) {
+    MuxGuard g(mLock);
+    prepareClientValuesLocked(outClientValues);
 
-    {
-        MuxGuard g(mLock);
-        for (const auto& propValue: propValues) {
-            VehiclePropValue* v = propValue.get();
-            auto clients = getSubscribedClientsLocked(
-                v->prop, v->areaId, flags);
-            for (const auto& client : clients) {
-                clientValuesMap[client].push_back(v);
+    for (const auto& propValue: propValues) {
+        VehiclePropValue* v = propValue.get();
+        auto it = std::lower_bound(mIndexPropIds.begin(), mIndexPropIds.end(), v->prop);
+        if (it == mIndexPropIds.end() || *it != v->prop) {
+            continue;
+        }
+        for (Subscriber& s : mIndexSubscribers[it - mIndexPropIds.begin()]) {
+            if (!matchesSubscription(s.vehicleAreas, s.flags, v->areaId, flags)) {
+                continue;
+            }
+            auto& clientValues = (*outClientValues)[s.clientIndex].values;
+            if (shouldDeliverLocked(&s, v, &clientValues)) {
+                clientValues.push_back(v);
+                mDeliveryStats.delivered++;
             }
         }
     }
+}
 
-    std::list<HalClientValues> clientValues;
-    for (const auto& entry : clientValuesMap) {
-        clientValues.push_back(HalClientValues {
-            .client = entry.first,
-            .values = entry.second
-        });
+bool SubscriptionManager::flushPendingValues(int64_t now,
+                                             std::vector<HalClientValues>* outClientValues) {
+    MuxGuard g(mLock);
+    prepareClientValuesLocked(outClientValues);
+
+    for (size_t i = 0; i < mIndexSubscribers.size() && mPendingCount > 0; i++) {
+        for (Subscriber& s : mIndexSubscribers[i]) {
+            for (AreaState& state : s.areaStates) {
+                if (state.pendingValue == nullptr
+                        || now - state.periodStart < minSamplePeriod(s.sampleRate)) {
+                    continue;
+                }
+                auto& clientValues = (*outClientValues)[s.clientIndex].values;
+                state.periodStart = state.pendingValue->timestamp;
+                state.batch = mBatch;
+                state.valueIndex = clientValues.size();
+                clientValues.push_back(state.pendingValue.get());
+                mFlushedValues.push_back(std::move(state.pendingValue));
+                mPendingCount--;
+                mDeliveryStats.delivered++;
+            }
+        }
     }
+    return mPendingCount > 0;
+}
 
-    return clientValues;
+bool SubscriptionManager::hasPendingValues() const {
+    MuxGuard g(mLock);
+    return mPendingCount > 0;
+}
+
+void SubscriptionManager::prepareClientValuesLocked(
+        std::vector<HalClientValues>* outClientValues) {
+    mBatch++;
+    // Values flushed by the previous call have been delivered by now.
+    mFlushedValues.clear();
+
+    outClientValues->resize(mIndexClients.size());
+    for (size_t i = 0; i < mIndexClients.size(); i++) {
+        HalClientValues& cv = (*outClientValues)[i];
+        cv.client = mIndexClients[i];
+        cv.values.clear();
+    }
+}
+
+int64_t SubscriptionManager::minSamplePeriod(float sampleRate) {
+    // Allow some jitter so that a source running at exactly the sample rate
+    // isn't decimated by half.
+    return static_cast<int64_t>(0.9e9f / sampleRate);
+}
+
+bool SubscriptionManager::shouldDeliverLocked(Subscriber* subscriber,
+                                              VehiclePropValue* value,
+                                              std::vector<VehiclePropValue*>* clientValues) {
+    AreaState* state = nullptr;
+    for (AreaState& areaState : subscriber->areaStates) {
+        if (areaState.areaId == value->areaId) {
+            state = &areaState;
+            break;
+        }
+    }
+    if (state == nullptr) {
+        subscriber->areaStates.emplace_back();
+        state = &subscriber->areaStates.back();
+        state->areaId = value->areaId;
+    } else if (subscriber->sampleRate > 0 && value->timestamp > 0) {
+        auto elapsed = value->timestamp - state->periodStart;
+        if (elapsed >= 0 && elapsed < minSamplePeriod(subscriber->sampleRate)) {
+            if (state->batch == mBatch) {
+                // Latest value wins.
+                (*clientValues)[state->valueIndex] = value;
+                mDeliveryStats.coalesced++;
+            } else {
+                // Hold the value back until the period is over, the latest one wins.
+                if (state->pendingValue != nullptr) {
+                    mDeliveryStats.decimated++;
+                } else {
+                    mPendingCount++;
+                }
+                storeValueLocked(*value, &state->pendingValue);
+            }
+            return false;
+        }
+    } else if (subscriber->sampleRate == 0 && state->lastValue != nullptr
+               && isEqualRawValue(state->lastValue->value, value->value)) {
+        mDeliveryStats.deduplicated++;
+        return false;
+    }
+
+    if (state->pendingValue != nullptr) {
+        // Superseded by this value.
+        state->pendingValue.reset();
+        mPendingCount--;
+        mDeliveryStats.decimated++;
+    }
+    state->periodStart = value->timestamp;
+    state->batch = mBatch;
+    state->valueIndex = clientValues->size();
+    if (subscriber->sampleRate == 0) {
+        storeValueLocked(*value, &state->lastValue);
+    }
+    return true;
+}
+
+void SubscriptionManager::storeValueLocked(const VehiclePropValue& value,
+                                           recyclable_ptr<VehiclePropValue>* outStored) {
+    VehiclePropValue* stored = outStored->get();
+    if (stored == nullptr) {
+        *outStored = mValuePool.obtain(value);
+        if (*outStored == nullptr) {
+            // Values of unknown type aren't pooled.
+            *outStored = recyclable_ptr<VehiclePropValue>(
+                    new VehiclePropValue(value),
+                    Deleter<VehiclePropValue>([](VehiclePropValue* v) { delete v; }));
+        }
+        return;
+    }
+    // Values of one property usually have the same layout, so the buffers of
+    // the stored value are reused.
+    stored->prop = value.prop;
+    stored->areaId = value.areaId;
+    stored->timestamp = value.timestamp;
+    copyVehicleRawValue(&stored->value, value.value);
+}
+
+DeliveryStats SubscriptionManager::getDeliveryStats() const {
+    MuxGuard g(mLock);
+    return mDeliveryStats;
 }
 
 std::list<sp<HalClient>> SubscriptionManager::getSubscribedClients(
@@ -215,6 +373,69 @@ void SubscriptionManager::addClientToPropMapLocked(
     propClients->addOrUpdate(client);
 }
 
+void SubscriptionManager::rebuildDeliveryIndexLocked() {
+    // Keep the delivery state of subscriptions that didn't change.
+    std::vector<sp<HalClient>> oldClients;
+    std::vector<int32_t> oldPropIds;
+    std::vector<std::vector<Subscriber>> oldSubscribers;
+    oldClients.swap(mIndexClients);
+    oldPropIds.swap(mIndexPropIds);
+    oldSubscribers.swap(mIndexSubscribers);
+
+    std::map<HalClient*, size_t> clientIndices;
+    for (const auto& entry : mClients) {
+        clientIndices.emplace(entry.second.get(), mIndexClients.size());
+        mIndexClients.push_back(entry.second);
+    }
+
+    // mPropToClients is ordered by property id, so is the index.
+    for (const auto& entry : mPropToClients) {
+        const sp<HalClientVector>& propClients = entry.second;
+        std::vector<Subscriber> subscribers;
+        for (size_t i = 0; i < propClients->size(); i++) {
+            const sp<HalClient>& client = propClients->itemAt(i);
+            auto indexIt = clientIndices.find(client.get());
+            const SubscribeOptions* opts = client->getSubscription(entry.first);
+            if (indexIt == clientIndices.end() || opts == nullptr) {
+                continue;
+            }
+            Subscriber subscriber;
+            subscriber.clientIndex = indexIt->second;
+            subscriber.vehicleAreas = opts->vehicleAreas;
+            subscriber.flags = opts->flags;
+            subscriber.sampleRate = opts->sampleRate;
+
+            auto oldIt = std::lower_bound(oldPropIds.begin(), oldPropIds.end(), entry.first);
+            if (oldIt != oldPropIds.end() && *oldIt == entry.first) {
+                for (Subscriber& old : oldSubscribers[oldIt - oldPropIds.begin()]) {
+                    if (oldClients[old.clientIndex] == client
+                            && old.sampleRate == subscriber.sampleRate) {
+                        subscriber.areaStates = std::move(old.areaStates);
+                        break;
+                    }
+                }
+            }
+            subscribers.push_back(std::move(subscriber));
+        }
+        if (!subscribers.empty()) {
+            mIndexPropIds.push_back(entry.first);
+            mIndexSubscribers.push_back(std::move(subscribers));
+        }
+    }
+
+    // Values held back for subscriptions that are gone are dropped with them.
+    mPendingCount = 0;
+    for (const auto& subscribers : mIndexSubscribers) {
+        for (const Subscriber& s : subscribers) {
+            for (const AreaState& state : s.areaStates) {
+                if (state.pendingValue != nullptr) {
+                    mPendingCount++;
+                }
+            }
+        }
+    }
+}
+
 sp<HalClientVector> SubscriptionManager::getClientsForPropertyLocked(
         int32_t propId) const {
     auto it = mPropToClients.find(propId);
@@ -277,6 +498,8 @@ void SubscriptionManager::unsubscribe(ClientId clientId,
             }
             mClients.erase(clientIter);
         }
+
+        rebuildDeliveryIndexLocked();
     }
 
     if (propertyClients == nullptr || propertyClients->isEmpty()) {
@@ -19,10 +19,12 @@
 #include "VehicleHalManager.h"
 
 #include <cmath>
+#include <cstdio>
 #include <fstream>
 
 #include <android/log.h>
 #include <android/hardware/automotive/vehicle/2.0/BpHwVehicleCallback.h>
+#include <utils/SystemClock.h>
 
 #include "VehicleUtils.h"
 
@@ -35,6 +37,11 @@ namespace V2_0 {
 using namespace std::placeholders;
 
 constexpr std::chrono::milliseconds kHalEventBatchingTimeWindow(10);
+// Deliver a batch right away once this many events are queued, instead of
+// waiting for the rest of kHalEventBatchingTimeWindow.
+constexpr size_t kHalEventBatchMaxSize = 128;
+// The only event registered with mFlushTimer.
+constexpr int32_t kFlushTimerCookie = 0;
 
 const VehiclePropValue kEmptyValue{};
 
@@ -42,7 +49,7 @@ const VehiclePropValue kEmptyValue{};
  * Indicates what's the maximum size of hidl_vec<VehiclePropValue> we want
  * to store in reusable object pool.
  */
-constexpr auto kMaxHidlVecOfVehiclPropValuePoolSize = 20;
+constexpr size_t kMaxHidlVecOfVehiclPropValuePoolSize = kHalEventBatchMaxSize;
 
 Return<void> VehicleHalManager::getAllPropConfigs(getAllPropConfigs_cb _hidl_cb) {
     ALOGI("getAllPropConfigs called");
@@ -177,7 +184,17 @@ Return<StatusCode> VehicleHalManager::unsubscribe(const sp<IVehicleCallback>& ca
 }
 
 Return<void> VehicleHalManager::debugDump(IVehicle::debugDump_cb _hidl_cb) {
-    _hidl_cb("");
+    DeliveryStats stats = mSubscriptionManager.getDeliveryStats();
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "HAL events to clients: delivered %" PRIu64 ", decimated %" PRIu64
+             ", coalesced %" PRIu64 ", deduplicated %" PRIu64 "\n",
+             stats.delivered, stats.decimated, stats.coalesced, stats.deduplicated);
+    std::string dump(buf);
+    dump.append("Flush timer:\n");
+    mFlushTimer.dumpIntervalStats(&dump);
+    mHal->dump(&dump);
+    _hidl_cb(dump);
     return Void();
 }
 
@@ -190,7 +207,8 @@ void VehicleHalManager::init() {
     mBatchingConsumer.run(&mEventQueue,
                           kHalEventBatchingTimeWindow,
                           std::bind(&VehicleHalManager::onBatchHalEvent,
-                                    this, _1));
+                                    this, _1),
+                          kHalEventBatchMaxSize);
 
     mHal->init(&mValueObjectPool,
                std::bind(&VehicleHalManager::onHalEvent, this, _1),
@@ -233,13 +251,41 @@ void VehicleHalManager::onHalPropertySetError(StatusCode errorCode,
 }
 
 void VehicleHalManager::onBatchHalEvent(const std::vector<VehiclePropValuePtr>& values) {
-    const auto& clientValues = mSubscriptionManager.distributeValuesToClients(
-            values, SubscribeFlags::HAL_EVENT);
+    std::lock_guard<std::mutex> g(mDeliveryLock);
+    mSubscriptionManager.distributeValuesToClients(
+            values, SubscribeFlags::HAL_EVENT, &mClientValues);
+    deliverClientValuesLocked();
+    updateFlushTimerLocked(mSubscriptionManager.hasPendingValues());
+}
+
+void VehicleHalManager::onFlushTimer(const std::vector<int32_t>& /* cookies */) {
+    std::lock_guard<std::mutex> g(mDeliveryLock);
+    bool hasPendingValues = mSubscriptionManager.flushPendingValues(
+            elapsedRealtimeNano(), &mClientValues);
+    deliverClientValuesLocked();
+    updateFlushTimerLocked(hasPendingValues);
+}
 
-    for (const HalClientValues& cv : clientValues) {
+void VehicleHalManager::updateFlushTimerLocked(bool hasPendingValues) {
+    if (hasPendingValues && !mFlushTimerArmed) {
+        mFlushTimer.registerRecurrentEvent(kHalEventBatchingTimeWindow, kFlushTimerCookie);
+    } else if (!hasPendingValues && mFlushTimerArmed) {
+        mFlushTimer.unregisterRecurrentEvent(kFlushTimerCookie);
+    }
+    mFlushTimerArmed = hasPendingValues;
+}
+
+void VehicleHalManager::deliverClientValuesLocked() {
+    for (HalClientValues& cv : mClientValues) {
         auto vecSize = cv.values.size();
+        if (vecSize == 0) {
+            // Don't keep clients that unsubscribed or died alive until the
+            // next delivery, buffers are kept.
+            cv.client.clear();
+            continue;
+        }
         hidl_vec<VehiclePropValue> vec;
-        if (vecSize < kMaxHidlVecOfVehiclPropValuePoolSize) {
+        if (vecSize <= kMaxHidlVecOfVehiclPropValuePoolSize) {
             vec.setToExternal(&mHidlVecOfVehiclePropValuePool[0], vecSize);
         } else {
             vec.resize(vecSize);
@@ -255,6 +301,7 @@ void VehicleHalManager::onBatchHalEvent(const std::vector<VehiclePropValuePtr>&
                   toString(cv.client->getCallback()).c_str(),
                   status.description().c_str());
         }
+        cv.client.clear();
     }
 }
 
@@ -18,6 +18,10 @@
 
 #include "VehicleObjectPool.h"
 
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
 #include <log/log.h>
 
 #include "VehicleUtils.h"
@@ -28,11 +32,109 @@ namespace automotive {
 namespace vehicle {
 namespace V2_0 {
 
+namespace {
+
+// Counters of the running threads, and the sum of those of exited threads.
+struct StatsRegistry {
+    std::mutex lock;
+    std::vector<PoolStats::ThreadCounters*> threads;
+    PoolStats exited;
+};
+
+StatsRegistry* getStatsRegistry() {
+    static StatsRegistry registry;
+    return &registry;
+}
+
+void addCounters(const PoolCounters<ThreadCounter>& counters, PoolStats* stats) {
+    stats->Obtained += counters.Obtained.load();
+    stats->Created += counters.Created.load();
+    stats->Recycled += counters.Recycled.load();
+    stats->MagazineHits += counters.MagazineHits.load();
+    stats->SharedHits += counters.SharedHits.load();
+    stats->Contended += counters.Contended.load();
+    stats->Discarded += counters.Discarded.load();
+}
+
+void resetCounters(PoolCounters<ThreadCounter>* counters) {
+    counters->Obtained.reset();
+    counters->Created.reset();
+    counters->Recycled.reset();
+    counters->MagazineHits.reset();
+    counters->SharedHits.reset();
+    counters->Contended.reset();
+    counters->Discarded.reset();
+}
+
+}  // namespace
+
+PoolStats::ThreadCounters::ThreadCounters() {
+    StatsRegistry* registry = getStatsRegistry();
+    std::lock_guard<std::mutex> g(registry->lock);
+    registry->threads.push_back(this);
+}
+
+PoolStats::ThreadCounters::~ThreadCounters() {
+    StatsRegistry* registry = getStatsRegistry();
+    std::lock_guard<std::mutex> g(registry->lock);
+    addCounters(*this, &registry->exited);
+    registry->threads.erase(
+            std::find(registry->threads.begin(), registry->threads.end(), this));
+}
+
+PoolStats PoolStats::get() {
+    StatsRegistry* registry = getStatsRegistry();
+    std::lock_guard<std::mutex> g(registry->lock);
+    PoolStats stats = registry->exited;
+    for (const ThreadCounters* counters : registry->threads) {
+        addCounters(*counters, &stats);
+    }
+    return stats;
+}
+
+void PoolStats::reset() {
+    StatsRegistry* registry = getStatsRegistry();
+    std::lock_guard<std::mutex> g(registry->lock);
+    registry->exited = PoolStats();
+    for (ThreadCounters* counters : registry->threads) {
+        resetCounters(counters);
+    }
+}
+
+constexpr VehiclePropertyType VehiclePropValuePool::kPooledTypes[];
+
+VehiclePropValuePool::VehiclePropValuePool(size_t maxRecyclableVectorSize)
+        : mMaxRecyclableVectorSize(maxRecyclableVectorSize) {
+    for (VehiclePropertyType type : kPooledTypes) {
+        for (size_t vecSize = 0; vecSize <= mMaxRecyclableVectorSize; vecSize++) {
+            // Values without vector are only pooled once, as vector size 0.
+            mValueTypePools.emplace_back(
+                    (hasVector(type) || vecSize == 0)
+                    ? std::make_unique<InternalPool>(type, vecSize) : nullptr);
+        }
+    }
+}
+
+int VehiclePropValuePool::getPoolIndex(VehiclePropertyType type, size_t vecSize) const {
+    if (!hasVector(type)) {
+        vecSize = 0;
+    } else if (vecSize > mMaxRecyclableVectorSize) {
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof(kPooledTypes) / sizeof(kPooledTypes[0]); i++) {
+        if (kPooledTypes[i] == type) {
+            return i * (mMaxRecyclableVectorSize + 1) + vecSize;
+        }
+    }
+    return -1;
+}
+
 VehiclePropValuePool::RecyclableType VehiclePropValuePool::obtain(
         VehiclePropertyType type, size_t vecSize) {
-    return isDisposable(type, vecSize)
+    int index = getPoolIndex(type, vecSize);
+    return index < 0
            ? obtainDisposable(type, vecSize)
-           : obtainRecylable(type, vecSize);
+           : mValueTypePools[index]->obtain();
 }
 
 VehiclePropValuePool::RecyclableType VehiclePropValuePool::obtain(
@@ -44,6 +146,9 @@ VehiclePropValuePool::RecyclableType VehiclePropValuePool::obtain(
     VehiclePropertyType type = getPropType(src.prop);
     size_t vecSize = getVehicleRawValueVectorSize(src.value, type);;
     auto dest = obtain(type, vecSize);
+    if (dest == nullptr) {
+        return dest;  // Unknown type
+    }
 
     dest->prop = src.prop;
     dest->areaId = src.areaId;
@@ -85,22 +190,6 @@ VehiclePropValuePool::RecyclableType VehiclePropValuePool::obtainComplex() {
     return obtain(VehiclePropertyType::COMPLEX);
 }
 
-VehiclePropValuePool::RecyclableType VehiclePropValuePool::obtainRecylable(
-        VehiclePropertyType type, size_t vecSize) {
-    // VehiclePropertyType is not overlapping with vectorSize.
-    int32_t key = static_cast<int32_t>(type)
-                  | static_cast<int32_t>(vecSize);
-
-    std::lock_guard<std::mutex> g(mLock);
-    auto it = mValueTypePools.find(key);
-
-    if (it == mValueTypePools.end()) {
-        auto newPool(std::make_unique<InternalPool>(type, vecSize));
-        it = mValueTypePools.emplace(key, std::move(newPool)).first;
-    }
-    return it->second->obtain();
-}
-
 VehiclePropValuePool::RecyclableType VehiclePropValuePool::obtainBoolean(
         bool value)  {
     return obtainInt32(value);
@@ -126,7 +215,10 @@ void VehiclePropValuePool::InternalPool::recycle(VehiclePropValue* o) {
         return;
     }
 
-    if (!check(&o->value)) {
+    if (!hasVector(mPropType)) {
+        reset(&o->value);
+        ObjectPool<VehiclePropValue>::recycle(o);
+    } else if (!check(&o->value)) {
         ALOGE("Discarding value for prop 0x%x because it contains "
                   "data that is not consistent with this pool. "
                   "Expected type: %d, vector size: %zu",
@@ -152,6 +244,15 @@ bool VehiclePropValuePool::InternalPool::check(VehiclePropValue::RawValue* v) {
            && v->stringValue.size() == 0;
 }
 
+void VehiclePropValuePool::InternalPool::reset(VehiclePropValue::RawValue* v) {
+    // Unlike resize(0), these don't allocate.
+    v->int32Values.setToExternal(nullptr, 0);
+    v->floatValues.setToExternal(nullptr, 0);
+    v->int64Values.setToExternal(nullptr, 0);
+    v->bytes.setToExternal(nullptr, 0);
+    v->stringValue.clear();
+}
+
 VehiclePropValue* VehiclePropValuePool::InternalPool::createObject() {
     return createVehiclePropValue(mPropType, mVectorSize).release();
 }
@@ -16,6 +16,8 @@
 #define LOG_TAG "VehiclePropertyStore"
 #include <log/log.h>
 
+#include <algorithm>
+
 #include <common/include/vhal_v2_0/VehicleUtils.h>
 #include "VehiclePropertyStore.h"
 
@@ -37,92 +39,129 @@ bool VehiclePropertyStore::RecordId::operator<(const VehiclePropertyStore::Recor
 
 void VehiclePropertyStore::registerProperty(const VehiclePropConfig& config,
                                             VehiclePropertyStore::TokenFunction tokenFunc) {
-    MuxGuard g(mLock);
-    mConfigs.insert({ config.prop, RecordConfig { config, tokenFunc } });
+    std::unique_ptr<PropertyRecord> record(new PropertyRecord);
+    record->propConfig = config;
+    record->tokenFunction = tokenFunc;
+
+    mRecords.insert({ config.prop, std::move(record) });
 }
 
 bool VehiclePropertyStore::writeValue(const VehiclePropValue& propValue) {
-    MuxGuard g(mLock);
-    if (!mConfigs.count(propValue.prop)) return false;
-
-    RecordId recId = getRecordIdLocked(propValue);
-    VehiclePropValue* valueToUpdate = const_cast<VehiclePropValue*>(getValueOrNullLocked(recId));
-    if (valueToUpdate == nullptr) {
-        mPropertyValues.insert({ recId, propValue });
-    } else {
-        valueToUpdate->timestamp = propValue.timestamp;
-        valueToUpdate->value = propValue.value;
+    PropertyRecord* record = getRecordOrNull(propValue.prop);
+    if (record == nullptr) return false;
+
+    RecordId recId = getRecordId(*record, propValue);
+    // Copy before taking the lock, the value it replaces is released after the lock.
+    ValuePtr value = std::make_shared<const VehiclePropValue>(propValue);
+    {
+        MuxGuard g(record->lock);
+        record->values[recId].swap(value);
     }
     return true;
 }
 
 void VehiclePropertyStore::removeValue(const VehiclePropValue& propValue) {
-    MuxGuard g(mLock);
-    RecordId recId = getRecordIdLocked(propValue);
-    auto it = mPropertyValues.find(recId);
-    if (it != mPropertyValues.end()) {
-        mPropertyValues.erase(it);
-    }
+    PropertyRecord* record = getRecordOrNull(propValue.prop);
+    if (record == nullptr) return;
+
+    RecordId recId = getRecordId(*record, propValue);
+    MuxGuard g(record->lock);
+    record->values.erase(recId);
 }
 
 void VehiclePropertyStore::removeValuesForProperty(int32_t propId) {
-    MuxGuard g(mLock);
-    auto range = findRangeLocked(propId);
-    mPropertyValues.erase(range.first, range.second);
+    PropertyRecord* record = getRecordOrNull(propId);
+    if (record == nullptr) return;
+
+    MuxGuard g(record->lock);
+    record->values.clear();
 }
 
 std::vector<VehiclePropValue> VehiclePropertyStore::readAllValues() const {
-    MuxGuard g(mLock);
+    std::vector<ValuePtr> snapshot = snapshotAllValues();
     std::vector<VehiclePropValue> allValues;
-    allValues.reserve(mPropertyValues.size());
-    for (auto&& it : mPropertyValues) {
-        allValues.push_back(it.second);
+    allValues.reserve(snapshot.size());
+    for (auto&& value : snapshot) {
+        allValues.push_back(*value);
     }
     return allValues;
 }
 
 std::vector<VehiclePropValue> VehiclePropertyStore::readValuesForProperty(int32_t propId) const {
     std::vector<VehiclePropValue> values;
-    MuxGuard g(mLock);
-    auto range = findRangeLocked(propId);
-    for (auto it = range.first; it != range.second; ++it) {
-        values.push_back(it->second);
+    PropertyRecord* record = getRecordOrNull(propId);
+    if (record == nullptr) return values;
+
+    std::vector<ValuePtr> snapshot;
+    {
+        MuxGuard g(record->lock);
+        snapshot.reserve(record->values.size());
+        for (auto&& it : record->values) {
+            snapshot.push_back(it.second);
+        }
     }
 
+    values.reserve(snapshot.size());
+    for (auto&& value : snapshot) {
+        values.push_back(*value);
+    }
     return values;
 }
 
+std::vector<VehiclePropertyStore::ValuePtr> VehiclePropertyStore::snapshotAllValues() const {
+    std::vector<const PropertyRecord*> records;
+    records.reserve(mRecords.size());
+    for (auto&& it : mRecords) {
+        records.push_back(it.second.get());
+    }
+    // Sorted by property, like values within a record.
+    std::sort(records.begin(), records.end(),
+              [](const PropertyRecord* a, const PropertyRecord* b) {
+                  return a->propConfig.prop < b->propConfig.prop;
+              });
+
+    std::vector<ValuePtr> snapshot;
+    for (const PropertyRecord* record : records) {
+        MuxGuard g(record->lock);
+        for (auto&& it : record->values) {
+            snapshot.push_back(it.second);
+        }
+    }
+    return snapshot;
+}
+
 std::unique_ptr<VehiclePropValue> VehiclePropertyStore::readValueOrNull(
         const VehiclePropValue& request) const {
-    MuxGuard g(mLock);
-    RecordId recId = getRecordIdLocked(request);
-    const VehiclePropValue* internalValue = getValueOrNullLocked(recId);
-    return internalValue ? std::make_unique<VehiclePropValue>(*internalValue) : nullptr;
+    PropertyRecord* record = getRecordOrNull(request.prop);
+    if (record == nullptr) return nullptr;
+
+    ValuePtr value = readValuePtrOrNull(*record, getRecordId(*record, request));
+    return value ? std::make_unique<VehiclePropValue>(*value) : nullptr;
 }
 
 std::unique_ptr<VehiclePropValue> VehiclePropertyStore::readValueOrNull(
         int32_t prop, int32_t area, int64_t token) const {
+    PropertyRecord* record = getRecordOrNull(prop);
+    if (record == nullptr) return nullptr;
+
     RecordId recId = {prop, isGlobalProp(prop) ? 0 : area, token };
-    MuxGuard g(mLock);
-    const VehiclePropValue* internalValue = getValueOrNullLocked(recId);
-    return internalValue ? std::make_unique<VehiclePropValue>(*internalValue) : nullptr;
+    ValuePtr value = readValuePtrOrNull(*record, recId);
+    return value ? std::make_unique<VehiclePropValue>(*value) : nullptr;
 }
 
 
 std::vector<VehiclePropConfig> VehiclePropertyStore::getAllConfigs() const {
-    MuxGuard g(mLock);
     std::vector<VehiclePropConfig> configs;
-    configs.reserve(mConfigs.size());
-    for (auto&& recordConfigIt: mConfigs) {
-        configs.push_back(recordConfigIt.second.propConfig);
+    configs.reserve(mRecords.size());
+    for (auto&& recordIt: mRecords) {
+        configs.push_back(recordIt.second->propConfig);
     }
     return configs;
 }
 
 const VehiclePropConfig* VehiclePropertyStore::getConfigOrNull(int32_t propId) const {
-    MuxGuard g(mLock);
-    auto recordConfigIt = mConfigs.find(propId);
-    return recordConfigIt != mConfigs.end() ? &recordConfigIt->second.propConfig : nullptr;
+    PropertyRecord* record = getRecordOrNull(propId);
+    return record != nullptr ? &record->propConfig : nullptr;
 }
 
 const VehiclePropConfig* VehiclePropertyStore::getConfigOrDie(int32_t propId) const {
@@ -134,35 +173,31 @@ const VehiclePropConfig* VehiclePropertyStore::getConfigOrDie(int32_t propId) co
     return cfg;
 }
 
-VehiclePropertyStore::RecordId VehiclePropertyStore::getRecordIdLocked(
-        const VehiclePropValue& valuePrototype) const {
+VehiclePropertyStore::PropertyRecord* VehiclePropertyStore::getRecordOrNull(
+        int32_t propId) const {
+    auto it = mRecords.find(propId);
+    return it != mRecords.end() ? it->second.get() : nullptr;
+}
+
+VehiclePropertyStore::RecordId VehiclePropertyStore::getRecordId(
+        const PropertyRecord& record, const VehiclePropValue& valuePrototype) {
     RecordId recId = {
         .prop = valuePrototype.prop,
         .area = isGlobalProp(valuePrototype.prop) ? 0 : valuePrototype.areaId,
         .token = 0
     };
 
-    auto it = mConfigs.find(recId.prop);
-    if (it == mConfigs.end()) return {};
-
-    if (it->second.tokenFunction != nullptr) {
-        recId.token = it->second.tokenFunction(valuePrototype);
+    if (record.tokenFunction != nullptr) {
+        recId.token = record.tokenFunction(valuePrototype);
     }
     return recId;
 }
 
-const VehiclePropValue* VehiclePropertyStore::getValueOrNullLocked(
-        const VehiclePropertyStore::RecordId& recId) const  {
-    auto it = mPropertyValues.find(recId);
-    return it == mPropertyValues.end() ? nullptr : &it->second;
-}
-
-VehiclePropertyStore::PropertyMapRange VehiclePropertyStore::findRangeLocked(int32_t propId) const {
-    // Based on the fact that mPropertyValues is a sorted map by RecordId.
-    auto beginIt = mPropertyValues.lower_bound( RecordId { propId, INT32_MIN, 0 });
-    auto endIt = mPropertyValues.lower_bound( RecordId { propId + 1, INT32_MIN, 0 });
-
-    return  PropertyMapRange { beginIt, endIt };
+VehiclePropertyStore::ValuePtr VehiclePropertyStore::readValuePtrOrNull(
+        const PropertyRecord& record, const VehiclePropertyStore::RecordId& recId) const  {
+    MuxGuard g(record.lock);
+    auto it = record.values.find(recId);
+    return it == record.values.end() ? nullptr : it->second;
 }
 
 }  // namespace V2_0
@@ -18,6 +18,8 @@
 
 #include "VehicleUtils.h"
 
+#include <cstring>
+
 #include <log/log.h>
 
 namespace android {
@@ -78,18 +80,25 @@ size_t getVehicleRawValueVectorSize(
 
 template<typename T>
 inline void copyHidlVec(hidl_vec <T>* dest, const hidl_vec <T>& src) {
-    for (size_t i = 0; i < std::min(dest->size(), src.size()); i++) {
+    if (dest->size() != src.size()) {
+        *dest = src;
+        return;
+    }
+    for (size_t i = 0; i < src.size(); i++) {
         (*dest)[i] = src[i];
     }
 }
 
 void copyVehicleRawValue(VehiclePropValue::RawValue* dest,
                          const VehiclePropValue::RawValue& src) {
-    dest->int32Values = src.int32Values;
-    dest->floatValues = src.floatValues;
-    dest->int64Values = src.int64Values;
-    dest->bytes = src.bytes;
-    dest->stringValue = src.stringValue;
+    copyHidlVec(&dest->int32Values, src.int32Values);
+    copyHidlVec(&dest->floatValues, src.floatValues);
+    copyHidlVec(&dest->int64Values, src.int64Values);
+    copyHidlVec(&dest->bytes, src.bytes);
+    if (dest->stringValue.size() != src.stringValue.size()
+            || strcmp(dest->stringValue.c_str(), src.stringValue.c_str()) != 0) {
+        dest->stringValue = src.stringValue;
+    }
 }
 
 template<typename T>
@@ -97,7 +106,7 @@ void shallowCopyHidlVec(hidl_vec <T>* dest, const hidl_vec <T>& src) {
     if (src.size() > 0) {
         dest->setToExternal(const_cast<T*>(&src[0]), src.size());
     } else if (dest->size() > 0) {
-        dest->resize(0);
+        dest->setToExternal(nullptr, 0);  // Unlike resize(0), doesn't allocate.
     }
 }
 
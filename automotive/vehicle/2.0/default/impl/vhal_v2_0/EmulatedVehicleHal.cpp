@@ -165,6 +165,11 @@ StatusCode EmulatedVehicleHal::unsubscribe(int32_t property) {
     return StatusCode::OK;
 }
 
+void EmulatedVehicleHal::dump(std::string* outDump) {
+    outDump->append("Continuous property timer:\n");
+    mRecurrentTimer.dumpIntervalStats(outDump);
+}
+
 bool EmulatedVehicleHal::isContinuousProperty(int32_t propId) const {
     const VehiclePropConfig* config = mPropStore->getConfigOrNull(propId);
     if (config == nullptr) {
@@ -183,8 +188,8 @@ bool EmulatedVehicleHal::setPropertyFromVehicle(const VehiclePropValue& propValu
     }
 }
 
-std::vector<VehiclePropValue> EmulatedVehicleHal::getAllProperties() const  {
-    return mPropStore->readAllValues();
+std::vector<VehiclePropertyStore::ValuePtr> EmulatedVehicleHal::getAllProperties() const  {
+    return mPropStore->snapshotAllValues();
 }
 
 StatusCode EmulatedVehicleHal::handleGenerateFakeDataRequest(const VehiclePropValue& request) {
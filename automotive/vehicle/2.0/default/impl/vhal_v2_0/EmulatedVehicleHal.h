@@ -58,10 +58,11 @@ public:
     StatusCode set(const VehiclePropValue& propValue) override;
     StatusCode subscribe(int32_t property, int32_t areas, float sampleRate) override;
     StatusCode unsubscribe(int32_t property) override;
+    void dump(std::string* outDump) override;
 
     //  Methods from EmulatedVehicleHalIface
     bool setPropertyFromVehicle(const VehiclePropValue& propValue) override;
-    std::vector<VehiclePropValue> getAllProperties() const override;
+    std::vector<VehiclePropertyStore::ValuePtr> getAllProperties() const override;
 
 private:
     constexpr std::chrono::nanoseconds hertzToNanoseconds(float hz) const {
@@ -54,17 +54,20 @@ int PipeComm::open() {
 }
 
 std::vector<uint8_t> PipeComm::read() {
-    static constexpr int MAX_RX_MSG_SZ = 2048;
-    std::vector<uint8_t> msg = std::vector<uint8_t>(MAX_RX_MSG_SZ);
+    // The pipe frame header is four hex digits, so a batch of updates can use up to 64k.
+    static constexpr int MAX_RX_MSG_SZ = 0xffff;
     int numBytes;
 
-    numBytes = qemu_pipe_frame_recv(mPipeFd, msg.data(), msg.size());
+    if (mRxBuffer.empty()) {
+        mRxBuffer.resize(MAX_RX_MSG_SZ + 1);
+    }
+
+    numBytes = qemu_pipe_frame_recv(mPipeFd, mRxBuffer.data(), mRxBuffer.size());
 
-    if (numBytes == MAX_RX_MSG_SZ) {
+    if (numBytes > MAX_RX_MSG_SZ) {
         ALOGE("%s:  Received max size = %d", __FUNCTION__, MAX_RX_MSG_SZ);
     } else if (numBytes > 0) {
-        msg.resize(numBytes);
-        return msg;
+        return std::vector<uint8_t>(mRxBuffer.begin(), mRxBuffer.begin() + numBytes);
     } else {
         ALOGD("%s: Connection terminated on pipe %d, numBytes=%d", __FUNCTION__, mPipeFd, numBytes);
         {
@@ -63,6 +63,8 @@ public:
 private:
     std::mutex mMutex;
     int mPipeFd;
+    // Receive buffer, only accessed by the thread calling read().
+    std::vector<uint8_t> mRxBuffer;
 };
 
 }  // impl
@@ -21,11 +21,18 @@
 #include <log/log.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "SocketComm.h"
 
 // Socket to use when communicating with Host PC
 static constexpr int DEBUG_SOCKET = 33452;
+// Every message is preceded by its length as a 32-bit big endian value
+static constexpr size_t MSG_HEADER_LEN = 4;
+// Largest message accepted from the host, protects against a corrupted length header
+static constexpr size_t MAX_RX_MSG_SIZE = 16 * 1024 * 1024;
+// Initial size of the read ahead buffer
+static constexpr size_t RX_BUFFER_SIZE = 64 * 1024;
 
 namespace android {
 namespace hardware {
@@ -40,6 +47,9 @@ SocketComm::SocketComm() {
     mCurSockFd = -1;
     mExit      =  0;
     mSockFd    = -1;
+    mRxBuffer.resize(RX_BUFFER_SIZE);
+    mRxBegin   =  0;
+    mRxEnd     =  0;
 }
 
 
@@ -57,6 +67,8 @@ int SocketComm::connect() {
             std::lock_guard<std::mutex> lock(mMutex);
             mCurSockFd = cSockFd;
         }
+        mRxBegin = 0;
+        mRxEnd = 0;
         ALOGD("%s: Incoming connection received on socket %d", __FUNCTION__, cSockFd);
     } else {
         cSockFd = -1;
@@ -98,44 +110,77 @@ int SocketComm::open() {
 }
 
 std::vector<uint8_t> SocketComm::read() {
-    int32_t msgSize;
-    int numBytes = 0;
-
     // This is a variable length message.
     // Read the number of bytes to rx over the socket
-    numBytes = ::read(mCurSockFd, &msgSize, sizeof(msgSize));
+    if (!fillRxBuffer(MSG_HEADER_LEN)) {
+        return std::vector<uint8_t>();
+    }
+
+    uint32_t msgSize;
+    memcpy(&msgSize, mRxBuffer.data() + mRxBegin, MSG_HEADER_LEN);
     msgSize = ntohl(msgSize);
 
-    if (numBytes != sizeof(msgSize)) {
-        // This happens when connection is closed
-        ALOGD("%s: numBytes=%d, expected=4", __FUNCTION__, numBytes);
-        ALOGD("%s: Connection terminated on socket %d", __FUNCTION__, mCurSockFd);
-        {
-            std::lock_guard<std::mutex> lock(mMutex);
-            mCurSockFd = -1;
-        }
+    if (msgSize == 0 || msgSize > MAX_RX_MSG_SIZE) {
+        ALOGE("%s: Invalid msgSize=%u, dropping connection on socket %d", __FUNCTION__, msgSize,
+              mCurSockFd);
+        closeCurSocket();
+        return std::vector<uint8_t>();
+    }
 
+    if (!fillRxBuffer(MSG_HEADER_LEN + msgSize)) {
         return std::vector<uint8_t>();
     }
 
-    std::vector<uint8_t> msg = std::vector<uint8_t>(msgSize);
+    // Received a message.
+    auto msgBegin = mRxBuffer.begin() + mRxBegin + MSG_HEADER_LEN;
+    std::vector<uint8_t> msg(msgBegin, msgBegin + msgSize);
+    mRxBegin += MSG_HEADER_LEN + msgSize;
+    return msg;
+}
 
-    numBytes = ::read(mCurSockFd, msg.data(), msgSize);
+bool SocketComm::fillRxBuffer(size_t minSize) {
+    if (mRxEnd - mRxBegin >= minSize) {
+        return true;
+    }
 
-    if ((numBytes == msgSize) && (msgSize > 0)) {
-        // Received a message.
-        return msg;
-    } else {
-        // This happens when connection is closed
-        ALOGD("%s: numBytes=%d, msgSize=%d", __FUNCTION__, numBytes, msgSize);
-        ALOGD("%s: Connection terminated on socket %d", __FUNCTION__, mCurSockFd);
-        {
-            std::lock_guard<std::mutex> lock(mMutex);
-            mCurSockFd = -1;
+    // Move the partial message to the front of the buffer, then grow it if the message does not
+    // fit.  Afterwards read whatever the socket has, the next messages are usually already there.
+    memmove(mRxBuffer.data(), mRxBuffer.data() + mRxBegin, mRxEnd - mRxBegin);
+    mRxEnd -= mRxBegin;
+    mRxBegin = 0;
+    if (mRxBuffer.size() < minSize) {
+        mRxBuffer.resize(minSize);
+    }
+
+    while (mRxEnd < minSize) {
+        ssize_t numBytes = ::read(mCurSockFd, mRxBuffer.data() + mRxEnd, mRxBuffer.size() - mRxEnd);
+
+        if (numBytes < 0 && errno == EINTR) {
+            continue;
         }
 
-        return std::vector<uint8_t>();
+        if (numBytes <= 0) {
+            // This happens when connection is closed
+            ALOGD("%s: numBytes=%zd, expected=%zu", __FUNCTION__, numBytes, minSize - mRxEnd);
+            ALOGD("%s: Connection terminated on socket %d", __FUNCTION__, mCurSockFd);
+            closeCurSocket();
+            return false;
+        }
+
+        mRxEnd += static_cast<size_t>(numBytes);
     }
+
+    return true;
+}
+
+void SocketComm::closeCurSocket() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mCurSockFd != -1) {
+        close(mCurSockFd);
+        mCurSockFd = -1;
+    }
+    mRxBegin = 0;
+    mRxEnd = 0;
 }
 
 void SocketComm::stop() {
@@ -157,24 +202,42 @@ void SocketComm::stop() {
 }
 
 int SocketComm::write(const std::vector<uint8_t>& data) {
-    static constexpr int MSG_HEADER_LEN = 4;
     int retVal = 0;
-    union {
-        uint32_t msgLen;
-        uint8_t msgLenBytes[MSG_HEADER_LEN];
-    };
 
     // Prepare header for the message
-    msgLen = static_cast<uint32_t>(data.size());
-    msgLen = htonl(msgLen);
+    uint32_t msgLen = htonl(static_cast<uint32_t>(data.size()));
+    iovec iov[] = {
+        { &msgLen, MSG_HEADER_LEN },
+        { const_cast<uint8_t*>(data.data()), data.size() },
+    };
+    iovec* curIov = iov;
+    int numIov = 2;
 
     std::lock_guard<std::mutex> lock(mMutex);
     if (mCurSockFd != -1) {
-        retVal = ::write(mCurSockFd, msgLenBytes, MSG_HEADER_LEN);
-
-        if (retVal == MSG_HEADER_LEN) {
-            retVal = ::write(mCurSockFd, data.data(), data.size());
+        while (numIov > 0) {
+            ssize_t numBytes = ::writev(mCurSockFd, curIov, numIov);
+
+            if (numBytes < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+
+            // Large messages may go out in several pieces, skip over what has been sent.
+            size_t sent = static_cast<size_t>(numBytes);
+            while (numIov > 0 && sent >= curIov->iov_len) {
+                sent -= curIov->iov_len;
+                curIov++;
+                numIov--;
+            }
+            if (numIov > 0) {
+                curIov->iov_base = static_cast<uint8_t*>(curIov->iov_base) + sent;
+                curIov->iov_len -= sent;
+            }
         }
+        retVal = static_cast<int>(data.size());
     }
 
     return retVal;
@@ -54,7 +54,8 @@ public:
     int open() override;
 
     /**
-     * Blocking call to read data from the connection.
+     * Blocking call to read data from the connection.  Reads ahead as much as the socket has
+     * buffered, so a burst of small messages from the host costs a single read() syscall.
      *
      * @return std::vector<uint8_t> Serialized protobuf data received from emulator.  This will be
      *              an empty vector if the connection was closed or some other error occurred.
@@ -67,7 +68,8 @@ public:
     void stop() override;
 
     /**
-     * Transmits a string of data to the emulator.
+     * Transmits a string of data to the emulator.  The length header and the data go out in a
+     * single writev() call.
      *
      * @param data Serialized protobuf data to transmit.
      *
@@ -76,10 +78,23 @@ public:
     int write(const std::vector<uint8_t>& data) override;
 
 private:
+    /**
+     * Reads at least minSize bytes into mRxBuffer, more if the socket has them available.
+     *
+     * @return bool Returns false if the connection was closed or failed.
+     */
+    bool fillRxBuffer(size_t minSize);
+    void closeCurSocket();
+
     int mCurSockFd;
     std::atomic<int> mExit;
     std::mutex mMutex;
     int mSockFd;
+    // Bytes received but not yet returned by read(), from mRxBegin to mRxEnd.  Only accessed by
+    // the thread calling read().
+    std::vector<uint8_t> mRxBuffer;
+    size_t mRxBegin;
+    size_t mRxEnd;
 };
 
 }  // impl
@@ -127,22 +127,43 @@ void VehicleEmulator::doGetPropertyAll(VehicleEmulator::EmulatorMessage& /* rxMs
     {
         for (const auto& prop : mHal->getAllProperties()) {
             emulator::VehiclePropValue* protoVal = respMsg.add_value();
-            populateProtoVehiclePropValue(protoVal, &prop);
+            populateProtoVehiclePropValue(protoVal, prop.get());
         }
     }
 }
 
 void VehicleEmulator::doSetProperty(VehicleEmulator::EmulatorMessage& rxMsg,
                                     VehicleEmulator::EmulatorMessage& respMsg) {
-    emulator::VehiclePropValue protoVal = rxMsg.value(0);
+    respMsg.set_msg_type(emulator::SET_PROPERTY_RESP);
+
+    bool halRes = setPropertyFromProto(rxMsg.value(0));
+    respMsg.set_status(halRes ? emulator::RESULT_OK : emulator::ERROR_INVALID_PROPERTY);
+}
+
+void VehicleEmulator::doSetPropertyBatch(VehicleEmulator::EmulatorMessage& rxMsg,
+                                         VehicleEmulator::EmulatorMessage& respMsg) {
+    int32_t numFailed = 0;
+
+    respMsg.set_msg_type(emulator::SET_PROPERTY_BATCH_RESP);
+
+    // Values are applied in the order they were recorded, a bad one does not stop the rest.
+    for (const auto& protoVal : rxMsg.value()) {
+        if (!setPropertyFromProto(protoVal)) {
+            numFailed++;
+        }
+    }
+
+    respMsg.set_num_failed(numFailed);
+    respMsg.set_status(numFailed == 0 ? emulator::RESULT_OK : emulator::ERROR_INVALID_PROPERTY);
+}
+
+bool VehicleEmulator::setPropertyFromProto(const emulator::VehiclePropValue& protoVal) {
     VehiclePropValue val = {
         .prop = protoVal.prop(),
         .areaId = protoVal.area_id(),
         .timestamp = elapsedRealtimeNano(),
     };
 
-    respMsg.set_msg_type(emulator::SET_PROPERTY_RESP);
-
     // Copy value data if it is set.  This automatically handles complex data types if needed.
     if (protoVal.has_string_value()) {
         val.value.stringValue = protoVal.string_value().c_str();
@@ -168,8 +189,7 @@ void VehicleEmulator::doSetProperty(VehicleEmulator::EmulatorMessage& rxMsg,
                                                      protoVal.float_values().end() };
     }
 
-    bool halRes = mHal->setPropertyFromVehicle(val);
-    respMsg.set_status(halRes ? emulator::RESULT_OK : emulator::ERROR_INVALID_PROPERTY);
+    return mHal->setPropertyFromVehicle(val);
 }
 
 void VehicleEmulator::txMsg(emulator::EmulatorMessage& txMsg) {
@@ -214,6 +234,9 @@ void VehicleEmulator::parseRxProtoBuf(std::vector<uint8_t>& msg) {
             case emulator::SET_PROPERTY_CMD:
                 doSetProperty(rxMsg, respMsg);
                 break;
+            case emulator::SET_PROPERTY_BATCH_CMD:
+                doSetPropertyBatch(rxMsg, respMsg);
+                break;
             default:
                 ALOGW("%s: Unknown message received, type = %d", __func__, rxMsg.msg_type());
                 respMsg.set_status(emulator::ERROR_UNIMPLEMENTED_CMD);
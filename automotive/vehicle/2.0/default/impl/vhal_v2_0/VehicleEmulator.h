@@ -23,6 +23,7 @@
 #include <vector>
 
 #include "vhal_v2_0/VehicleHal.h"
+#include "vhal_v2_0/VehiclePropertyStore.h"
 
 #include "CommBase.h"
 #include "VehicleHalProto.pb.h"
@@ -41,7 +42,7 @@ class VehicleEmulator;  // Forward declaration.
 class EmulatedVehicleHalIface : public VehicleHal {
 public:
     virtual bool setPropertyFromVehicle(const VehiclePropValue& propValue) = 0;
-    virtual std::vector<VehiclePropValue> getAllProperties() const = 0;
+    virtual std::vector<VehiclePropertyStore::ValuePtr> getAllProperties() const = 0;
 
     void registerEmulator(VehicleEmulator* emulator) {
         ALOGI("%s, emulator: %p", __func__, emulator);
@@ -89,6 +90,8 @@ private:
     void doGetProperty(EmulatorMessage& rxMsg, EmulatorMessage& respMsg);
     void doGetPropertyAll(EmulatorMessage& rxMsg, EmulatorMessage& respMsg);
     void doSetProperty(EmulatorMessage& rxMsg, EmulatorMessage& respMsg);
+    void doSetPropertyBatch(EmulatorMessage& rxMsg, EmulatorMessage& respMsg);
+    bool setPropertyFromProto(const emulator::VehiclePropValue& protoVal);
     void txMsg(emulator::EmulatorMessage& txMsg);
     void parseRxProtoBuf(std::vector<uint8_t>& msg);
     void populateProtoVehicleConfig(emulator::VehiclePropConfig* protoCfg,
@@ -0,0 +1,386 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host side tool that streams a recorded property log into the emulated Vehicle HAL through the
+ * SocketComm port (forward it first with "adb forward tcp:33452 tcp:33452") and reports the
+ * sustained update rate.
+ *
+ * The log has one update per line, lines starting with '#' are ignored:
+ *
+ *     <timestamp ns> <prop> <area id> int32|int64|float|string|bytes <values...>
+ *
+ * Property and area ids may be given in hex.  A string value is the rest of the line, bytes are
+ * given as a single hex string.
+ */
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "VehicleHalProto.pb.h"
+
+namespace {
+
+using std::chrono::steady_clock;
+
+constexpr size_t kMsgHeaderLen = 4;
+constexpr const char* kDefaultAddress = "127.0.0.1";
+constexpr const char* kDefaultPort = "33452";
+
+struct LogEntry {
+    int64_t timestamp;
+    emulator::VehiclePropValue value;
+};
+
+void usage(const char* name) {
+    fprintf(stderr,
+            "Usage: %s [-a address] [-p port] [-r rate] [-b batch] <property log>\n"
+            "  -a address  host the emulator port is forwarded to (default %s)\n"
+            "  -p port     forwarded port (default %s)\n"
+            "  -r rate     replay speed as a multiple of real time, 0 replays as fast as\n"
+            "              possible (default 1)\n"
+            "  -b batch    maximum updates per message, 1 sends one SET_PROPERTY_CMD per\n"
+            "              update (default 64)\n",
+            name, kDefaultAddress, kDefaultPort);
+}
+
+bool parseHexBytes(const std::string& hex, std::string* out) {
+    if (hex.size() % 2 != 0) return false;
+    out->clear();
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        char* end;
+        std::string byte = hex.substr(i, 2);
+        long value = strtol(byte.c_str(), &end, 16);
+        if (*end != '\0') return false;
+        out->push_back(static_cast<char>(value));
+    }
+    return true;
+}
+
+bool parseLine(const std::string& line, LogEntry* entry) {
+    std::istringstream in(line);
+    std::string prop, areaId, type;
+    if (!(in >> entry->timestamp >> prop >> areaId >> type)) return false;
+
+    emulator::VehiclePropValue& value = entry->value;
+    value.Clear();
+    value.set_prop(static_cast<int32_t>(strtoul(prop.c_str(), nullptr, 0)));
+    value.set_area_id(static_cast<int32_t>(strtoul(areaId.c_str(), nullptr, 0)));
+
+    if (type == "int32") {
+        int32_t v;
+        while (in >> v) value.add_int32_values(v);
+    } else if (type == "int64") {
+        int64_t v;
+        while (in >> v) value.add_int64_values(v);
+    } else if (type == "float") {
+        float v;
+        while (in >> v) value.add_float_values(v);
+    } else if (type == "string") {
+        std::string s;
+        std::getline(in >> std::ws, s);
+        value.set_string_value(s);
+    } else if (type == "bytes") {
+        std::string hex, bytes;
+        if (!(in >> hex) || !parseHexBytes(hex, &bytes)) return false;
+        value.set_bytes_value(bytes);
+    } else {
+        return false;
+    }
+
+    return in.eof();
+}
+
+bool readLog(const char* path, std::vector<LogEntry>* entries) {
+    std::ifstream in(path);
+    if (!in) {
+        fprintf(stderr, "failed to open %s\n", path);
+        return false;
+    }
+
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(in, line)) {
+        lineNumber++;
+        if (line.empty() || line[0] == '#') continue;
+
+        LogEntry entry;
+        if (!parseLine(line, &entry)) {
+            fprintf(stderr, "%s:%d: malformed update: %s\n", path, lineNumber, line.c_str());
+            return false;
+        }
+        entries->push_back(std::move(entry));
+    }
+
+    // Replay in recorded order even if the log was merged from several sources.
+    std::stable_sort(entries->begin(), entries->end(),
+                     [](const LogEntry& a, const LogEntry& b) {
+                         return a.timestamp < b.timestamp;
+                     });
+    return true;
+}
+
+int connectTo(const char* address, const char* port) {
+    addrinfo hints {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res;
+    int err = getaddrinfo(address, port, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "getaddrinfo(%s:%s): %s\n", address, port, gai_strerror(err));
+        return -1;
+    }
+
+    int fd = -1;
+    for (addrinfo* ai = res; ai != nullptr; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0) {
+        fprintf(stderr, "failed to connect to %s:%s: %s\n", address, port, strerror(errno));
+        return -1;
+    }
+
+    // Each message is already a full batch, don't let Nagle hold it back.
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+bool writeFully(int fd, const uint8_t* data, size_t size) {
+    while (size > 0) {
+        ssize_t numBytes = write(fd, data, size);
+        if (numBytes < 0 && errno == EINTR) continue;
+        if (numBytes <= 0) return false;
+        data += numBytes;
+        size -= static_cast<size_t>(numBytes);
+    }
+    return true;
+}
+
+bool readFully(int fd, uint8_t* data, size_t size) {
+    while (size > 0) {
+        ssize_t numBytes = read(fd, data, size);
+        if (numBytes < 0 && errno == EINTR) continue;
+        if (numBytes <= 0) return false;
+        data += numBytes;
+        size -= static_cast<size_t>(numBytes);
+    }
+    return true;
+}
+
+/*
+ * Counts the replies to the replayed messages.  Replies are read on their own thread so
+ * that the next batch goes out without waiting for a round trip.
+ */
+class ReplyCounter {
+public:
+    explicit ReplyCounter(int fd) : mFd(fd), mThread(&ReplyCounter::rxThread, this) {}
+
+    ~ReplyCounter() {
+        shutdown(mFd, SHUT_RDWR);
+        mThread.join();
+    }
+
+    bool waitForReplies(size_t count, std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> g(mLock);
+        return mCond.wait_for(g, timeout,
+                              [this, count] { return mClosed || mReplies >= count; }) &&
+               mReplies >= count;
+    }
+
+    int64_t getFailed() const { return mFailed; }
+
+private:
+    void rxThread() {
+        std::vector<uint8_t> msg;
+        emulator::EmulatorMessage reply;
+        for (;;) {
+            uint32_t msgLen;
+            if (!readFully(mFd, reinterpret_cast<uint8_t*>(&msgLen), kMsgHeaderLen)) break;
+            msg.resize(ntohl(msgLen));
+            if (!readFully(mFd, msg.data(), msg.size())) break;
+
+            if (!reply.ParseFromArray(msg.data(), static_cast<int>(msg.size()))) {
+                fprintf(stderr, "failed to parse a reply of %zu bytes\n", msg.size());
+                mFailed++;
+            } else if (reply.msg_type() == emulator::SET_PROPERTY_BATCH_RESP) {
+                mFailed += reply.num_failed();
+            } else if (reply.status() != emulator::RESULT_OK) {
+                mFailed++;
+            }
+
+            std::lock_guard<std::mutex> g(mLock);
+            mReplies++;
+            mCond.notify_one();
+        }
+
+        std::lock_guard<std::mutex> g(mLock);
+        mClosed = true;
+        mCond.notify_one();
+    }
+
+    const int mFd;
+    std::mutex mLock;
+    std::condition_variable mCond;
+    size_t mReplies = 0;
+    bool mClosed = false;
+    std::atomic<int64_t> mFailed { 0 };
+    std::thread mThread;
+};
+
+bool sendMessage(int fd, const emulator::EmulatorMessage& msg, std::vector<uint8_t>* buffer) {
+    size_t msgLen = static_cast<size_t>(msg.ByteSize());
+    buffer->resize(kMsgHeaderLen + msgLen);
+
+    uint32_t header = htonl(static_cast<uint32_t>(msgLen));
+    memcpy(buffer->data(), &header, kMsgHeaderLen);
+    if (!msg.SerializeToArray(buffer->data() + kMsgHeaderLen, static_cast<int>(msgLen))) {
+        fprintf(stderr, "failed to serialize a message\n");
+        return false;
+    }
+    return writeFully(fd, buffer->data(), buffer->size());
+}
+
+}  // namespace anonymous
+
+int main(int argc, char** argv) {
+    const char* address = kDefaultAddress;
+    const char* port = kDefaultPort;
+    double rate = 1.0;
+    size_t batchSize = 64;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:p:r:b:h")) != -1) {
+        switch (opt) {
+            case 'a':
+                address = optarg;
+                break;
+            case 'p':
+                port = optarg;
+                break;
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 'b':
+                batchSize = static_cast<size_t>(std::max(1, atoi(optarg)));
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind + 1 != argc || rate < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<LogEntry> entries;
+    if (!readLog(argv[optind], &entries)) return 1;
+    if (entries.empty()) {
+        fprintf(stderr, "%s has no updates\n", argv[optind]);
+        return 1;
+    }
+
+    int fd = connectTo(address, port);
+    if (fd < 0) return 1;
+
+    size_t numMessages = 0;
+    int64_t maxLagUs = 0;
+    bool ok = true;
+    {
+        ReplyCounter replies(fd);
+        emulator::EmulatorMessage msg;
+        std::vector<uint8_t> buffer;
+
+        const int64_t firstTimestamp = entries.front().timestamp;
+        const auto start = steady_clock::now();
+        auto dueTime = [&](const LogEntry& entry) {
+            return start + std::chrono::duration_cast<steady_clock::duration>(
+                    std::chrono::nanoseconds(entry.timestamp - firstTimestamp) / rate);
+        };
+
+        for (size_t i = 0; i < entries.size();) {
+            auto now = steady_clock::now();
+            if (rate > 0) {
+                auto due = dueTime(entries[i]);
+                if (due > now) {
+                    std::this_thread::sleep_until(due);
+                    now = steady_clock::now();
+                }
+                maxLagUs = std::max<int64_t>(maxLagUs,
+                        std::chrono::duration_cast<std::chrono::microseconds>(now - due).count());
+            }
+
+            // Send everything that is due in as few messages as possible.
+            msg.Clear();
+            msg.set_msg_type(batchSize == 1 ? emulator::SET_PROPERTY_CMD
+                                            : emulator::SET_PROPERTY_BATCH_CMD);
+            size_t end = i;
+            do {
+                *msg.add_value() = entries[end].value;
+                end++;
+            } while (end < entries.size() && end - i < batchSize &&
+                     (rate == 0 || dueTime(entries[end]) <= now));
+
+            if (!sendMessage(fd, msg, &buffer)) {
+                fprintf(stderr, "connection lost after %zu updates\n", i);
+                ok = false;
+                break;
+            }
+            numMessages++;
+            i = end;
+        }
+
+        if (ok && !replies.waitForReplies(numMessages, std::chrono::seconds(10))) {
+            fprintf(stderr, "emulator did not acknowledge all messages\n");
+            ok = false;
+        }
+        std::chrono::duration<double> elapsed = steady_clock::now() - start;
+
+        printf("Replayed %zu updates in %zu messages over %.3f s: %.0f updates/sec, "
+               "%lld failed, max lag %lld us\n",
+               entries.size(), numMessages, elapsed.count(), entries.size() / elapsed.count(),
+               static_cast<long long>(replies.getFailed()), static_cast<long long>(maxLagUs));
+    }
+
+    close(fd);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "vhal_v2_0/ConcurrentQueue.h"
+
+namespace android {
+
+namespace {
+
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+
+template<typename Queue>
+class ConcurrentQueueTest : public ::testing::Test {};
+
+using QueueTypes = ::testing::Types<ConcurrentQueue<int>,
+                                    BoundedConcurrentQueue<int>>;
+TYPED_TEST_CASE(ConcurrentQueueTest, QueueTypes);
+
+TYPED_TEST(ConcurrentQueueTest, pushAndFlush) {
+    TypeParam queue;
+    for (int i = 0; i < 10; i++) {
+        queue.push(std::move(i));
+    }
+    queue.waitForItems();
+
+    std::vector<int> items = queue.flush();
+    ASSERT_EQ(10u, items.size());
+    for (int i = 0; i < 10; i++) {
+        ASSERT_EQ(i, items[i]);
+    }
+    ASSERT_TRUE(queue.flush().empty());
+}
+
+TYPED_TEST(ConcurrentQueueTest, deactivate) {
+    TypeParam queue;
+    std::thread consumer([&queue] { queue.waitForItems(); });
+    queue.deactivate();
+    consumer.join();
+
+    int item = 1;
+    queue.push(std::move(item));
+    ASSERT_TRUE(queue.flush().empty());
+}
+
+TYPED_TEST(ConcurrentQueueTest, waitForSizeTimesOut) {
+    TypeParam queue;
+    int item = 1;
+    queue.push(std::move(item));
+
+    auto start = steady_clock::now();
+    queue.waitForSize(2, milliseconds(10));
+    ASSERT_GE(steady_clock::now() - start, milliseconds(10));
+    ASSERT_EQ(1u, queue.flush().size());
+}
+
+TYPED_TEST(ConcurrentQueueTest, multipleProducers) {
+    constexpr int kProducers = 4;
+    constexpr int kItemsPerProducer = 10000;
+
+    TypeParam queue;
+    std::vector<std::thread> producers;
+    for (int p = 0; p < kProducers; p++) {
+        producers.emplace_back([&queue, p] {
+            for (int i = 0; i < kItemsPerProducer; i++) {
+                int item = p * kItemsPerProducer + i;
+                queue.push(std::move(item));
+            }
+        });
+    }
+
+    // Items of each producer must come out in the order they were pushed.
+    std::vector<int> next(kProducers, 0);
+    int received = 0;
+    while (received < kProducers * kItemsPerProducer) {
+        queue.waitForItems();
+        for (int item : queue.flush()) {
+            int p = item / kItemsPerProducer;
+            ASSERT_EQ(next[p]++, item % kItemsPerProducer);
+            received++;
+        }
+    }
+    for (auto& producer : producers) {
+        producer.join();
+    }
+}
+
+TEST(BoundedConcurrentQueueTest, pushBlocksWhileFull) {
+    BoundedConcurrentQueue<int> queue(4);
+    for (int i = 0; i < 4; i++) {
+        queue.push(std::move(i));
+    }
+
+    std::atomic<bool> pushed { false };
+    std::thread producer([&queue, &pushed] {
+        int item = 4;
+        queue.push(std::move(item));
+        pushed = true;
+    });
+    std::this_thread::sleep_for(milliseconds(10));
+    ASSERT_FALSE(pushed);
+
+    // The flush frees a slot, so the producer may already have pushed its
+    // item into it before the flush returns.
+    std::vector<int> items = queue.flush();
+    producer.join();
+    ASSERT_TRUE(pushed);
+    for (int item : queue.flush()) {
+        items.push_back(item);
+    }
+    ASSERT_EQ((std::vector<int> { 0, 1, 2, 3, 4 }), items);
+}
+
+TEST(BatchingConsumerTest, flushesEarlyAtMaxBatchSize) {
+    BoundedConcurrentQueue<int> queue;
+    BatchingConsumer<int, BoundedConcurrentQueue<int>> consumer;
+
+    std::mutex lock;
+    std::condition_variable cond;
+    std::vector<size_t> batchSizes;
+    consumer.run(&queue, milliseconds(1000),
+                 [&](const std::vector<int>& items) {
+                     std::lock_guard<std::mutex> g(lock);
+                     batchSizes.push_back(items.size());
+                     cond.notify_one();
+                 },
+                 10 /* maxBatchSize */);
+
+    auto start = steady_clock::now();
+    for (int i = 0; i < 10; i++) {
+        queue.push(std::move(i));
+    }
+    {
+        std::unique_lock<std::mutex> g(lock);
+        cond.wait_for(g, milliseconds(500),
+                      [&batchSizes] { return !batchSizes.empty(); });
+        ASSERT_EQ(1u, batchSizes.size());
+        ASSERT_EQ(10u, batchSizes[0]);
+    }
+    ASSERT_LT(steady_clock::now() - start, milliseconds(500));
+
+    consumer.requestStop();
+    queue.deactivate();
+    consumer.waitStopped();
+}
+
+/*
+ * Throughput and latency of the batching pipeline as used by
+ * VehicleHalManager: a few HAL threads push timestamped events as fast as
+ * they can, and the consumer records how long each event took to be
+ * delivered.
+ */
+template<typename Queue>
+void runBatchingBenchmark(const char* name, size_t maxBatchSize) {
+    constexpr int kProducers = 2;
+    constexpr int kEventsPerProducer = 200000;
+    constexpr int kEvents = kProducers * kEventsPerProducer;
+
+    Queue queue;
+    BatchingConsumer<int64_t, Queue> consumer;
+    std::vector<int64_t> latencies;
+    latencies.reserve(kEvents);
+    std::mutex lock;
+    std::condition_variable cond;
+
+    consumer.run(&queue, milliseconds(10),
+                 [&](const std::vector<int64_t>& items) {
+                     int64_t now = steady_clock::now().time_since_epoch().count();
+                     std::lock_guard<std::mutex> g(lock);
+                     for (int64_t pushed : items) {
+                         latencies.push_back(now - pushed);
+                     }
+                     cond.notify_one();
+                 },
+                 maxBatchSize);
+
+    auto start = steady_clock::now();
+    std::vector<std::thread> producers;
+    for (int p = 0; p < kProducers; p++) {
+        producers.emplace_back([&queue] {
+            for (int i = 0; i < kEventsPerProducer; i++) {
+                int64_t now = steady_clock::now().time_since_epoch().count();
+                queue.push(std::move(now));
+            }
+        });
+    }
+    for (auto& producer : producers) {
+        producer.join();
+    }
+    {
+        std::unique_lock<std::mutex> g(lock);
+        cond.wait_for(g, std::chrono::seconds(10),
+                      [&latencies] { return latencies.size() == kEvents; });
+        ASSERT_EQ(static_cast<size_t>(kEvents), latencies.size());
+    }
+    auto elapsed = steady_clock::now() - start;
+
+    consumer.requestStop();
+    queue.deactivate();
+    consumer.waitStopped();
+
+    std::sort(latencies.begin(), latencies.end());
+    auto usec = [](int64_t ns) {
+        return std::chrono::duration_cast<microseconds>(nanoseconds(ns)).count();
+    };
+    printf("%s: %lld events/sec, latency p50 %lld us, p99 %lld us\n", name,
+           static_cast<long long>(kEvents * 1000LL /
+               std::max<int64_t>(1, std::chrono::duration_cast<milliseconds>(
+                   elapsed).count())),
+           static_cast<long long>(usec(latencies[kEvents / 2])),
+           static_cast<long long>(usec(latencies[kEvents * 99 / 100])));
+}
+
+TEST(BatchingConsumerTest, benchmark) {
+    runBatchingBenchmark<ConcurrentQueue<int64_t>>("ConcurrentQueue", 0);
+    runBatchingBenchmark<BoundedConcurrentQueue<int64_t>>(
+        "BoundedConcurrentQueue", 0);
+    runBatchingBenchmark<BoundedConcurrentQueue<int64_t>>(
+        "BoundedConcurrentQueue, max batch 128", 128);
+}
+
+}  // namespace anonymous
+
+}  // namespace android
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <string>
 #include <thread>
 
 #include <gtest/gtest.h>
@@ -70,4 +72,151 @@ TEST(RecurrentTimerTest, multipleIntervals) {
     ASSERT_EQ_WITH_TOLERANCE(20, counter5ms.load(), 5);
 }
 
+// Waits until pred() holds, or fails after a timeout generous enough for a loaded machine.
+template <typename Predicate>
+bool waitFor(Predicate pred) {
+    for (int i = 0; i < 5000 && !pred(); i++) {
+        std::this_thread::sleep_for(milliseconds(1));
+    }
+    return pred();
+}
+
+TEST(RecurrentTimerTest, sameIntervalCoalesced) {
+    std::mutex lock;
+    std::vector<size_t> batchSizes;
+    RecurrentTimer timer([&lock, &batchSizes](const std::vector<int32_t>& cookies) {
+        std::lock_guard<std::mutex> g(lock);
+        batchSizes.push_back(cookies.size());
+    });
+
+    for (int32_t cookie = 0; cookie < 10; cookie++) {
+        timer.registerRecurrentEvent(milliseconds(5), cookie);
+    }
+    ASSERT_TRUE(waitFor([&lock, &batchSizes] {
+        std::lock_guard<std::mutex> g(lock);
+        return batchSizes.size() >= 3;
+    }));
+    timer.unregisterRecurrentEvent(0);
+    size_t batchesBefore;
+    {
+        std::lock_guard<std::mutex> g(lock);
+        // A batch collected before unregistering may still be delivered.
+        batchesBefore = batchSizes.size() + 1;
+    }
+    ASSERT_TRUE(waitFor([&lock, &batchSizes, batchesBefore] {
+        std::lock_guard<std::mutex> g(lock);
+        return batchSizes.size() > batchesBefore;
+    }));
+
+    size_t batches;
+    {
+        std::lock_guard<std::mutex> g(lock);
+        ASSERT_EQ(10u, *std::max_element(batchSizes.begin(), batchSizes.begin() + 3));
+        for (size_t i = batchesBefore; i < batchSizes.size(); i++) {
+            ASSERT_EQ(9u, batchSizes[i]);
+        }
+        batches = batchSizes.size();
+    }
+
+    // Every delivered batch was counted before it was delivered.
+    auto stats = timer.getIntervalStats();
+    ASSERT_EQ(1u, stats.size());
+    ASSERT_EQ(milliseconds(5), stats[0].interval);
+    ASSERT_EQ(9u, stats[0].numCookies);
+    ASSERT_GE(stats[0].numFired, batches);
+    ASSERT_GE(stats[0].maxJitter, stats[0].meanJitter);
+    ASSERT_GE(stats[0].meanJitter, nanoseconds(0));
+}
+
+TEST(RecurrentTimerTest, unregister) {
+    std::atomic<int64_t> counter { 0L };
+    RecurrentTimer timer([&counter](const std::vector<int32_t>&) { counter++; });
+
+    timer.registerRecurrentEvent(milliseconds(1), 0xdead);
+    ASSERT_TRUE(waitFor([&counter] { return counter.load() > 0; }));
+    timer.unregisterRecurrentEvent(0xdead);
+    int64_t fired = counter.load();
+    std::this_thread::sleep_for(milliseconds(20));
+    // Only a callback collected before unregistering may still come in.
+    ASSERT_LE(counter.load(), fired + 1);
+    ASSERT_TRUE(timer.getIntervalStats().empty());
+}
+
+/*
+ * 500 continuous properties spread over a handful of sample rates, as a
+ * fully populated emulated HAL would subscribe them. Reports wake-ups and
+ * the per-interval jitter measured by the timer, the delay between the time
+ * an interval was due and the time its properties fired.
+ */
+TEST(RecurrentTimerTest, benchmark500Properties) {
+    constexpr int32_t kProperties = 500;
+    const milliseconds kIntervals[] = { milliseconds(1), milliseconds(5), milliseconds(10),
+                                        milliseconds(50), milliseconds(100) };
+    constexpr int kNumIntervals = sizeof(kIntervals) / sizeof(kIntervals[0]);
+
+    // Only touched by the timer thread until the timer is destroyed.
+    int64_t intervalEvents[kNumIntervals] = {};
+    std::vector<int64_t> cookieEvents(kProperties, 0);
+    int64_t wakeups = 0;
+    int64_t events = 0;
+    std::atomic_bool registered { false };
+    bool skippedPartialBatch = false;
+    std::vector<RecurrentTimer::IntervalStats> stats;
+    std::string dump;
+    {
+        RecurrentTimer timer([&](const std::vector<int32_t>& cookies) {
+            // Count from the second batch after all properties are registered on, the first one
+            // may have been collected while they were still being registered.
+            if (!registered) return;
+            if (!skippedPartialBatch) {
+                skippedPartialBatch = true;
+                return;
+            }
+            bool seen[kNumIntervals] = {};
+            wakeups++;
+            events += cookies.size();
+            for (int32_t cookie : cookies) {
+                cookieEvents[cookie]++;
+                int index = cookie % kNumIntervals;
+                if (!seen[index]) {
+                    seen[index] = true;
+                    intervalEvents[index]++;
+                }
+            }
+        });
+
+        for (int32_t cookie = 0; cookie < kProperties; cookie++) {
+            timer.registerRecurrentEvent(kIntervals[cookie % kNumIntervals], cookie);
+        }
+        registered = true;
+        std::this_thread::sleep_for(milliseconds(1000));
+
+        stats = timer.getIntervalStats();
+        timer.dumpIntervalStats(&dump);
+    }
+
+    // 100 properties each at 1000, 200, 100, 20 and 10 Hz.
+    const int64_t expectedEvents = 100 * (1000 + 200 + 100 + 20 + 10);
+    printf("%lld wake-ups, %lld events (expected %lld)\n%s",
+           static_cast<long long>(wakeups), static_cast<long long>(events),
+           static_cast<long long>(expectedEvents), dump.c_str());
+
+    ASSERT_EQ(static_cast<size_t>(kNumIntervals), stats.size());
+    for (const auto& s : stats) {
+        ASSERT_EQ(static_cast<size_t>(kProperties / kNumIntervals), s.numCookies);
+        ASSERT_GT(s.numFired, 0u);
+        ASSERT_GE(s.maxJitter, s.meanJitter);
+        ASSERT_GE(s.meanJitter, nanoseconds(0));
+    }
+
+    // Every property fired, and properties sharing an interval always fired together.
+    for (int32_t cookie = 0; cookie < kProperties; cookie++) {
+        ASSERT_GT(cookieEvents[cookie], 0) << "cookie " << cookie;
+        ASSERT_EQ(intervalEvents[cookie % kNumIntervals], cookieEvents[cookie])
+                << "cookie " << cookie;
+    }
+    // Missed events are skipped, never fired in a burst.
+    ASSERT_LE(events, expectedEvents + kProperties);
+}
+
 }  // anonymous namespace
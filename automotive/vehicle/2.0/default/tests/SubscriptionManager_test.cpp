@@ -14,6 +14,9 @@
  * limitations under the License.
  */
 
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
 #include <functional>
 #include <iostream>
 #include <unordered_map>
@@ -24,6 +27,26 @@
 
 #include "VehicleHalTestUtils.h"
 
+// Counts allocations made by the test, to check that delivery doesn't allocate.
+static std::atomic<size_t> sAllocations { 0 };
+
+void* operator new(size_t size) {
+    sAllocations++;
+    void* p = malloc(size);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t /* size */) noexcept {
+    free(p);
+}
+
 namespace android {
 namespace hardware {
 namespace automotive {
@@ -229,6 +252,305 @@ TEST_F(SubscriptionManagerTest, unsubscribe) {
     assertLastUnsubscribedProperty(PROP1);
 }
 
+TEST_F(SubscriptionManagerTest, distributeValuesToClients) {
+    std::list<SubscribeOptions> updatedOptions;
+    ASSERT_EQ(StatusCode::OK,
+              manager.addOrUpdateSubscription(1, cb1, subscrToProp1, &updatedOptions));
+    ASSERT_EQ(StatusCode::OK,
+              manager.addOrUpdateSubscription(2, cb2, subscrToProp1and2, &updatedOptions));
+
+    VehiclePropValuePool pool;
+    std::vector<recyclable_ptr<VehiclePropValue>> values;
+    values.push_back(pool.obtainInt32(1));
+    values.back()->prop = PROP1;
+    values.back()->areaId = toInt(VehicleAreaZone::ROW_1_LEFT);
+    values.push_back(pool.obtainInt32(2));
+    values.back()->prop = PROP2;
+    values.push_back(pool.obtainInt32(3));
+    values.back()->prop = PROP1;
+    values.back()->areaId = toInt(VehicleAreaZone::ROW_2_LEFT);  // Nobody subscribed
+
+    std::vector<HalClientValues> clientValues;
+    manager.distributeValuesToClients(values, SubscribeFlags::HAL_EVENT, &clientValues);
+    ASSERT_EQ(2u, clientValues.size());
+    for (const auto& cv : clientValues) {
+        if (cv.client->getCallback() == cb1) {
+            ASSERT_EQ(std::vector<VehiclePropValue*>({ values[0].get() }), cv.values);
+        } else {
+            ASSERT_EQ(cb2, cv.client->getCallback());
+            ASSERT_EQ(std::vector<VehiclePropValue*>({ values[0].get(), values[1].get() }),
+                      cv.values);
+        }
+    }
+
+    // Buffers are reused, unsubscribed clients get no values.
+    values[0]->value.int32Values[0] = 10;
+    manager.unsubscribe(2, PROP1);
+    manager.unsubscribe(2, PROP2);
+    manager.distributeValuesToClients(values, SubscribeFlags::HAL_EVENT, &clientValues);
+    ASSERT_EQ(1u, clientValues.size());
+    ASSERT_EQ(cb1, clientValues[0].client->getCallback());
+    ASSERT_EQ(1u, clientValues[0].values.size());
+}
+
+TEST_F(SubscriptionManagerTest, onChangeValuesDeduplicated) {
+    std::list<SubscribeOptions> updatedOptions;
+    ASSERT_EQ(StatusCode::OK,
+              manager.addOrUpdateSubscription(1, cb1, subscrToProp2, &updatedOptions));
+
+    VehiclePropValuePool pool;
+    std::vector<recyclable_ptr<VehiclePropValue>> values;
+    for (int32_t value : { 1, 1, 2, 2, 1 }) {
+        values.push_back(pool.obtainInt32(value));
+        values.back()->prop = PROP2;
+        values.back()->areaId = 0;
+    }
+
+    std::vector<HalClientValues> clientValues;
+    manager.distributeValuesToClients(values, SubscribeFlags::HAL_EVENT, &clientValues);
+    ASSERT_EQ(1u, clientValues.size());
+    ASSERT_EQ(std::vector<VehiclePropValue*>({ values[0].get(), values[2].get(),
+                                               values[4].get() }),
+              clientValues[0].values);
+
+    // Same value in the next batch.
+    values.resize(1);
+    values[0]->value.int32Values[0] = 1;
+    manager.distributeValuesToClients(values, SubscribeFlags::HAL_EVENT, &clientValues);
+    ASSERT_TRUE(clientValues[0].values.empty());
+
+    DeliveryStats stats = manager.getDeliveryStats();
+    ASSERT_EQ(3u, stats.delivered);
+    ASSERT_EQ(3u, stats.deduplicated);
+}
+
+TEST_F(SubscriptionManagerTest, continuousValuesDecimated) {
+    constexpr int64_t kMsec = 1000000;
+    std::list<SubscribeOptions> updatedOptions;
+    hidl_vec<SubscribeOptions> subscrAt10Hz = {
+        SubscribeOptions {
+            .propId = PROP2,
+            .sampleRate = 10,
+            .flags = SubscribeFlags::HAL_EVENT
+        },
+    };
+    hidl_vec<SubscribeOptions> subscrAt100Hz = subscrAt10Hz;
+    subscrAt100Hz[0].sampleRate = 100;
+    ASSERT_EQ(StatusCode::OK,
+              manager.addOrUpdateSubscription(1, cb1, subscrAt10Hz, &updatedOptions));
+    ASSERT_EQ(StatusCode::OK,
+              manager.addOrUpdateSubscription(2, cb2, subscrAt100Hz, &updatedOptions));
+
+    // 200Hz source, first batch has 20ms of values.
+    VehiclePropValuePool pool;
+    std::vector<recyclable_ptr<VehiclePropValue>> values;
+    for (int i = 0; i < 4; i++) {
+        values.push_back(pool.obtainInt32(i));
+        values.back()->prop = PROP2;
+        values.back()->areaId = 0;
+        values.back()->timestamp = (i + 1) * 5 * kMsec;
+    }
+
+    std::vector<HalClientValues> clientValues;
+    manager.distributeValuesToClients(values, SubscribeFlags::HAL_EVENT, &clientValues);
+    ASSERT_EQ(2u, clientValues.size());
+    // 10Hz: one value per batch, the latest one.
+    ASSERT_EQ(std::vector<VehiclePropValue*>({ values[3].get() }), clientValues[0].values);
+    // 100Hz: every other value, the latest one of each sample period.
+    ASSERT_EQ(std::vector<VehiclePropValue*>({ values[1].get(), values[3].get() }),
+              clientValues[1].values);
+
+    // Next batch is still within the 10Hz sample period, the value is held back.
+    values.resize(1);
+    values[0]->timestamp = 30 * kMsec;
+    manager.distributeValuesToClients(values, SubscribeFlags::HAL_EVENT, &clientValues);
+    ASSERT_TRUE(clientValues[0].values.empty());
+    ASSERT_EQ(1u, clientValues[1].values.size());
+    ASSERT_TRUE(manager.hasPendingValues());
+
+    // A newer value within the period replaces it.
+    values[0]->timestamp = 60 * kMsec;
+    manager.distributeValuesToClients(values, SubscribeFlags::HAL_EVENT, &clientValues);
+    ASSERT_TRUE(clientValues[0].values.empty());
+    ASSERT_EQ(1u, clientValues[1].values.size());
+
+    // A value in the next period supersedes the held back one.
+    values[0]->timestamp = 130 * kMsec;
+    manager.distributeValuesToClients(values, SubscribeFlags::HAL_EVENT, &clientValues);
+    ASSERT_EQ(std::vector<VehiclePropValue*>({ values[0].get() }), clientValues[0].values);
+    ASSERT_EQ(1u, clientValues[1].values.size());
+    ASSERT_FALSE(manager.hasPendingValues());
+
+    DeliveryStats stats = manager.getDeliveryStats();
+    ASSERT_EQ(7u, stats.delivered);
+    ASSERT_EQ(2u, stats.decimated);
+    ASSERT_EQ(5u, stats.coalesced);
+}
+
+TEST_F(SubscriptionManagerTest, heldBackValueFlushedAfterPeriod) {
+    constexpr int64_t kMsec = 1000000;
+    std::list<SubscribeOptions> updatedOptions;
+    hidl_vec<SubscribeOptions> subscrAt10Hz = {
+        SubscribeOptions {
+            .propId = PROP2,
+            .sampleRate = 10,
+            .flags = SubscribeFlags::HAL_EVENT
+        },
+    };
+    ASSERT_EQ(StatusCode::OK,
+              manager.addOrUpdateSubscription(1, cb1, subscrAt10Hz, &updatedOptions));
+
+    VehiclePropValuePool pool;
+    std::vector<recyclable_ptr<VehiclePropValue>> values;
+    values.push_back(pool.obtainInt32(1));
+    values[0]->prop = PROP2;
+    values[0]->areaId = 0;
+    values[0]->timestamp = 10 * kMsec;
+
+    std::vector<HalClientValues> clientValues;
+    manager.distributeValuesToClients(values, SubscribeFlags::HAL_EVENT, &clientValues);
+    ASSERT_EQ(std::vector<VehiclePropValue*>({ values[0].get() }), clientValues[0].values);
+
+    // The source stops after two more values within the sample period.
+    for (int32_t i : { 2, 3 }) {
+        values[0]->value.int32Values[0] = i;
+        values[0]->timestamp = (10 + 30 * (i - 1)) * kMsec;
+        manager.distributeValuesToClients(values, SubscribeFlags::HAL_EVENT, &clientValues);
+        ASSERT_TRUE(clientValues[0].values.empty());
+    }
+    // The held back value is a copy.
+    values[0]->value.int32Values[0] = 4;
+
+    ASSERT_TRUE(manager.flushPendingValues(50 * kMsec, &clientValues));
+    ASSERT_TRUE(clientValues[0].values.empty());
+
+    ASSERT_FALSE(manager.flushPendingValues(100 * kMsec, &clientValues));
+    ASSERT_EQ(1u, clientValues[0].values.size());
+    const VehiclePropValue* flushed = clientValues[0].values[0];
+    ASSERT_EQ(PROP2, flushed->prop);
+    ASSERT_EQ(70 * kMsec, flushed->timestamp);
+    ASSERT_EQ(3, flushed->value.int32Values[0]);
+
+    ASSERT_FALSE(manager.flushPendingValues(1000 * kMsec, &clientValues));
+    ASSERT_TRUE(clientValues[0].values.empty());
+
+    // The next sample period starts at the flushed value.
+    values[0]->timestamp = 120 * kMsec;
+    manager.distributeValuesToClients(values, SubscribeFlags::HAL_EVENT, &clientValues);
+    ASSERT_TRUE(clientValues[0].values.empty());
+    ASSERT_TRUE(manager.hasPendingValues());
+
+    // Values held back for a client are dropped when it unsubscribes.
+    manager.unsubscribe(1, PROP2);
+    ASSERT_FALSE(manager.hasPendingValues());
+
+    DeliveryStats stats = manager.getDeliveryStats();
+    ASSERT_EQ(2u, stats.delivered);
+    ASSERT_EQ(1u, stats.decimated);
+}
+
+TEST_F(SubscriptionManagerTest, steadyStreamDoesNotAllocate) {
+    constexpr int64_t kMsec = 1000000;
+    std::list<SubscribeOptions> updatedOptions;
+    hidl_vec<SubscribeOptions> subscrAt10Hz = {
+        SubscribeOptions {
+            .propId = PROP2,
+            .sampleRate = 10,
+            .flags = SubscribeFlags::HAL_EVENT
+        },
+    };
+    ASSERT_EQ(StatusCode::OK,
+              manager.addOrUpdateSubscription(1, cb1, subscrAt10Hz, &updatedOptions));
+    ASSERT_EQ(StatusCode::OK,
+              manager.addOrUpdateSubscription(2, cb2, subscrToProp2, &updatedOptions));
+
+    VehiclePropValuePool pool;
+    std::vector<recyclable_ptr<VehiclePropValue>> values;
+    values.push_back(pool.obtainInt32(0));
+    values[0]->prop = PROP2;
+    values[0]->areaId = 0;
+
+    // One value every 20ms, decimated to 10Hz and held back, and never
+    // deduplicated at zero sample rate.
+    std::vector<HalClientValues> clientValues;
+    auto run = [&](int from, int to) {
+        for (int i = from; i < to; i++) {
+            values[0]->value.int32Values[0] = i;
+            values[0]->timestamp = (i + 1) * 20 * kMsec;
+            manager.distributeValuesToClients(values, SubscribeFlags::HAL_EVENT, &clientValues);
+            manager.flushPendingValues(values[0]->timestamp + 10 * kMsec, &clientValues);
+        }
+    };
+    run(0, 10);  // Warm up buffers and pools.
+
+    size_t allocations = sAllocations;
+    run(10, 1000);
+    ASSERT_EQ(allocations, sAllocations);
+
+    DeliveryStats stats = manager.getDeliveryStats();
+    ASSERT_EQ(0u, stats.deduplicated);
+    ASSERT_LT(0u, stats.decimated);
+}
+
+/*
+ * Fan-out cost of a HAL event batch with 20 clients, each subscribed to the
+ * same 300 properties.
+ */
+TEST_F(SubscriptionManagerTest, distributeValuesToClientsBenchmark) {
+    constexpr int kClients = 20;
+    constexpr int32_t kProperties = 300;
+    constexpr int32_t kPropBase = 0x1000
+            | VehiclePropertyGroup::VENDOR
+            | VehiclePropertyType::INT32
+            | VehicleArea::GLOBAL;
+    constexpr size_t kBatchSize = 128;
+    constexpr int kIterations = 2000;
+
+    hidl_vec<SubscribeOptions> options;
+    options.resize(kProperties);
+    for (int32_t i = 0; i < kProperties; i++) {
+        options[i] = SubscribeOptions {
+            .propId = kPropBase + i,
+            .flags = SubscribeFlags::HAL_EVENT
+        };
+    }
+    std::vector<sp<IVehicleCallback>> callbacks;
+    std::list<SubscribeOptions> updatedOptions;
+    for (int c = 0; c < kClients; c++) {
+        callbacks.push_back(new MockedVehicleCallback());
+        ASSERT_EQ(StatusCode::OK, manager.addOrUpdateSubscription(
+                100 + c, callbacks.back(), options, &updatedOptions));
+    }
+
+    VehiclePropValuePool pool;
+    std::vector<recyclable_ptr<VehiclePropValue>> values;
+    for (size_t i = 0; i < kBatchSize; i++) {
+        values.push_back(pool.obtainInt32(i));
+        values.back()->prop = kPropBase + (i * 7) % kProperties;
+    }
+
+    std::vector<HalClientValues> clientValues;
+    size_t delivered = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kIterations; i++) {
+        for (auto& v : values) {
+            v->value.int32Values[0] = i;  // Not to be deduplicated
+        }
+        manager.distributeValuesToClients(values, SubscribeFlags::HAL_EVENT, &clientValues);
+        for (const auto& cv : clientValues) {
+            delivered += cv.values.size();
+        }
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+    ASSERT_EQ(static_cast<size_t>(kIterations) * kBatchSize * kClients, delivered);
+    std::cout << "distributeValuesToClients: "
+              << kIterations * kBatchSize * 1000000LL / std::max<int64_t>(1, elapsed)
+              << " events/sec, " << delivered * 1000000LL / std::max<int64_t>(1, elapsed)
+              << " client deliveries/sec" << std::endl;
+}
+
 }  // namespace anonymous
 
 }  // namespace V2_0
@@ -114,6 +114,10 @@ public:
         return StatusCode::OK;
     }
 
+    void dump(std::string* outDump) override {
+        outDump->append("mocked hal\n");
+    }
+
     void sendPropEvent(recyclable_ptr<VehiclePropValue> value) {
         doHalEvent(std::move(value));
     }
@@ -294,6 +298,75 @@ TEST_F(VehicleHalManagerTest, subscribe) {
               toString(cb->getReceivedEvents().front()[0]));
 }
 
+TEST_F(VehicleHalManagerTest, subscribe_HeldBackValueDelivered) {
+    const auto PROP = toInt(VehicleProperty::PERF_VEHICLE_SPEED);
+
+    sp<MockedVehicleCallback> cb = new MockedVehicleCallback();
+
+    hidl_vec<SubscribeOptions> options = {
+        SubscribeOptions {
+            .propId = PROP,
+            .sampleRate = 10,
+            .flags = SubscribeFlags::DEFAULT
+        }
+    };
+
+    StatusCode res = manager->subscribe(cb, options);
+    ASSERT_EQ(StatusCode::OK, res);
+
+    // The second value comes in 10ms after the first one and is the last one,
+    // it's delivered once the 10Hz sample period is over.
+    int64_t timestamp = elapsedRealtimeNano();
+    for (float speed : { 10.0f, 20.0f }) {
+        auto value = objectPool->obtainFloat(speed);
+        value->prop = PROP;
+        value->areaId = 0;
+        value->timestamp = timestamp;
+        hal->sendPropEvent(std::move(value));
+        ASSERT_TRUE(cb->waitForExpectedEvents(speed == 10.0f ? 1 : 2))
+                << "Events received: " << cb->getReceivedEvents().size();
+        timestamp += 10000000;
+    }
+
+    ASSERT_EQ(20.0f, cb->getReceivedEvents().back()[0].value.floatValues[0]);
+}
+
+TEST_F(VehicleHalManagerTest, debugDump_IncludesHal) {
+    std::string dump;
+    manager->debugDump([&dump](const hidl_string& s) { dump = s; });
+
+    ASSERT_NE(std::string::npos, dump.find("HAL events to clients"));
+    ASSERT_NE(std::string::npos, dump.find("Flush timer:"));
+    ASSERT_NE(std::string::npos, dump.find("mocked hal\n"));
+}
+
+TEST_F(VehicleHalManagerTest, unsubscribe_ReleasesClient) {
+    const auto PROP = toInt(VehicleProperty::DISPLAY_BRIGHTNESS);
+
+    sp<MockedVehicleCallback> cb = new MockedVehicleCallback();
+
+    hidl_vec<SubscribeOptions> options = {
+        SubscribeOptions {
+            .propId = PROP,
+            .flags = SubscribeFlags::DEFAULT
+        }
+    };
+
+    StatusCode res = manager->subscribe(cb, options);
+    ASSERT_EQ(StatusCode::OK, res);
+
+    auto value = objectPool->obtainInt32(42);
+    value->prop = PROP;
+    value->areaId = 0;
+    hal->sendPropEvent(std::move(value));
+    ASSERT_TRUE(cb->waitForExpectedEvents(1));
+
+    manager->unsubscribe(cb, PROP);
+    // Only the reference of this test is left, nothing is kept for the next
+    // batch of events.
+    ASSERT_EQ(1, cb->getStrongCount());
+}
+
 TEST_F(VehicleHalManagerTest, subscribe_WriteOnly) {
     const auto PROP = toInt(VehicleProperty::HVAC_SEAT_TEMPERATURE);
 
@@ -33,26 +33,23 @@ namespace {
 class VehicleObjectPoolTest : public ::testing::Test {
 protected:
     void SetUp() override {
-        stats = PoolStats::instance();
-        resetStats();
+        PoolStats::reset();
         valuePool.reset(new VehiclePropValuePool);
     }
 
     void TearDown() override {
         // At the end, all created objects should be either recycled or deleted.
         // Some objects could be recycled multiple times, that's why it's <=
-        ASSERT_EQ(stats->Obtained, stats->Recycled);
-        ASSERT_LE(stats->Created, stats->Recycled);
+        PoolStats s = stats();
+        ASSERT_EQ(s.Obtained, s.Recycled);
+        ASSERT_LE(s.Created, s.Recycled);
     }
-private:
-    void resetStats() {
-        stats->Obtained = 0;
-        stats->Created = 0;
-        stats->Recycled = 0;
+
+    PoolStats stats() const {
+        return PoolStats::get();
     }
 
 public:
-    PoolStats* stats;
     std::unique_ptr<VehiclePropValuePool> valuePool;
 };
 
@@ -63,8 +60,8 @@ TEST_F(VehicleObjectPoolTest, valuePoolBasicCorrectness) {
     // Obtaining value of another type - should return a new object
     ASSERT_NE(raw, valuePool->obtain(VehiclePropertyType::FLOAT).get());
 
-    ASSERT_EQ(3u, stats->Obtained);
-    ASSERT_EQ(2u, stats->Created);
+    ASSERT_EQ(3u, stats().Obtained);
+    ASSERT_EQ(2u, stats().Created);
 }
 
 TEST_F(VehicleObjectPoolTest, valuePoolStrings) {
@@ -74,11 +71,55 @@ TEST_F(VehicleObjectPoolTest, valuePoolStrings) {
     void* raw = vs.get();
     vs.reset();  // delete the pointer
 
+    // Recycled with the string cleared.
     auto vs2 = valuePool->obtain(VehiclePropertyType::STRING);
+    ASSERT_EQ(raw, vs2.get());
     ASSERT_EQ(0u, vs2->value.stringValue.size());
     ASSERT_NE(raw, valuePool->obtain(VehiclePropertyType::STRING).get());
 
-    ASSERT_EQ(0u, stats->Obtained);
+    ASSERT_EQ(4u, stats().Obtained);
+    ASSERT_EQ(2u, stats().Created);
+}
+
+TEST_F(VehicleObjectPoolTest, valuePoolComplexAndLargeVectors) {
+    auto complex = valuePool->obtainComplex();
+    complex->value.int32Values.resize(10);
+    complex->value.bytes.resize(100);
+    void* raw = complex.get();
+    complex.reset();
+
+    complex = valuePool->obtainComplex();
+    ASSERT_EQ(raw, complex.get());
+    ASSERT_EQ(0u, complex->value.int32Values.size());
+    ASSERT_EQ(0u, complex->value.bytes.size());
+
+    // Vectors larger than maxRecyclableVectorSize are not pooled.
+    auto large = valuePool->obtain(VehiclePropertyType::INT32_VEC, 100);
+    ASSERT_EQ(100u, large->value.int32Values.size());
+    ASSERT_EQ(2u, stats().Obtained);
+}
+
+TEST_F(VehicleObjectPoolTest, valuePoolRecycledOnAnotherThread) {
+    // Values obtained by the HAL thread are usually released by the thread
+    // delivering them to clients.
+    const int N = 64;
+    std::vector<recyclable_ptr<VehiclePropValue>> values;
+    for (int i = 0; i < N; i++) {
+        values.push_back(valuePool->obtain(VehiclePropertyType::INT32));
+    }
+    ASSERT_EQ(static_cast<uint32_t>(N), stats().Created);
+
+    std::thread([&values] { values.clear(); }).join();
+
+    // Half of what the other thread recycled was shared and is taken in two
+    // magazine refills.
+    for (int i = 0; i < N / 2; i++) {
+        values.push_back(valuePool->obtain(VehiclePropertyType::INT32));
+    }
+    ASSERT_EQ(static_cast<uint32_t>(N), stats().Created);
+    ASSERT_EQ(2u, stats().SharedHits);
+    ASSERT_EQ(static_cast<uint32_t>(N / 2 - 2), stats().MagazineHits);
+    ASSERT_EQ(0u, stats().Discarded);
 }
 
 TEST_F(VehicleObjectPoolTest, valuePoolMultithreadedBenchmark) {
@@ -112,14 +153,22 @@ TEST_F(VehicleObjectPoolTest, valuePoolMultithreadedBenchmark) {
     }
     auto finish = elapsedRealtimeNano();
 
-    ASSERT_EQ(static_cast<uint32_t>(T * C * O), stats->Obtained);
-    ASSERT_EQ(static_cast<uint32_t>(T * C * O), stats->Recycled);
+    ASSERT_EQ(static_cast<uint32_t>(T * C * O), stats().Obtained);
+    ASSERT_EQ(static_cast<uint32_t>(T * C * O), stats().Recycled);
     // Created less than obtained.
-    ASSERT_GE(static_cast<uint32_t>(T * O), stats->Created);
+    ASSERT_GE(static_cast<uint32_t>(T * O), stats().Created);
 
     auto elapsedMs = (finish - start) / 1000000;
     ASSERT_GE(1000, elapsedMs);  // Less a second to access 100K objects.
                                  // Typically it takes about 0.1s on Nexus6P.
+
+    PoolStats s = stats();
+    printf("%lld ms, magazine hit rate %.1f%%, shared list hit rate %.1f%%, "
+           "%u contended, %u discarded\n",
+           static_cast<long long>(elapsedMs),
+           100.0 * s.MagazineHits / s.Obtained,
+           100.0 * s.SharedHits / s.Obtained,
+           s.Contended, s.Discarded);
 }
 
 }  // namespace anonymous
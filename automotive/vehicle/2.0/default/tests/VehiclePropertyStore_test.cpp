@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "vhal_v2_0/VehiclePropertyStore.h"
+#include "vhal_v2_0/VehicleUtils.h"
+
+namespace android {
+namespace hardware {
+namespace automotive {
+namespace vehicle {
+namespace V2_0 {
+
+namespace {
+
+constexpr int32_t kGlobalProp = 0x0100 | toInt(VehiclePropertyGroup::VENDOR)
+                                | toInt(VehicleArea::GLOBAL) | toInt(VehiclePropertyType::INT32);
+constexpr int32_t kZonedProp = 0x0200 | toInt(VehiclePropertyGroup::VENDOR)
+                               | toInt(VehicleArea::ZONE) | toInt(VehiclePropertyType::INT32);
+
+VehiclePropConfig makeConfig(int32_t prop) {
+    VehiclePropConfig config {};
+    config.prop = prop;
+    config.access = VehiclePropertyAccess::READ_WRITE;
+    config.changeMode = VehiclePropertyChangeMode::ON_CHANGE;
+    return config;
+}
+
+VehiclePropValue makeValue(int32_t prop, int32_t areaId, int32_t value) {
+    VehiclePropValue propValue {};
+    propValue.prop = prop;
+    propValue.areaId = areaId;
+    propValue.value.int32Values = { value };
+    return propValue;
+}
+
+class VehiclePropertyStoreTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        store.registerProperty(makeConfig(kGlobalProp));
+        store.registerProperty(makeConfig(kZonedProp));
+    }
+
+    VehiclePropertyStore store;
+};
+
+TEST_F(VehiclePropertyStoreTest, readWrite) {
+    ASSERT_EQ(nullptr, store.readValueOrNull(kGlobalProp));
+    ASSERT_FALSE(store.writeValue(makeValue(kGlobalProp + 1, 0, 1)));
+
+    ASSERT_TRUE(store.writeValue(makeValue(kGlobalProp, 0, 1)));
+    ASSERT_TRUE(store.writeValue(makeValue(kGlobalProp, 0, 2)));
+    auto value = store.readValueOrNull(kGlobalProp);
+    ASSERT_NE(nullptr, value);
+    ASSERT_EQ(2, value->value.int32Values[0]);
+
+    ASSERT_TRUE(store.writeValue(makeValue(kZonedProp, 1, 10)));
+    ASSERT_TRUE(store.writeValue(makeValue(kZonedProp, 2, 20)));
+    ASSERT_EQ(20, store.readValueOrNull(kZonedProp, 2)->value.int32Values[0]);
+    ASSERT_EQ(2u, store.readValuesForProperty(kZonedProp).size());
+    ASSERT_EQ(3u, store.readAllValues().size());
+
+    store.removeValue(makeValue(kZonedProp, 1, 0));
+    ASSERT_EQ(nullptr, store.readValueOrNull(kZonedProp, 1));
+    store.removeValuesForProperty(kZonedProp);
+    ASSERT_TRUE(store.readValuesForProperty(kZonedProp).empty());
+    ASSERT_NE(nullptr, store.readValueOrNull(kGlobalProp));
+}
+
+TEST_F(VehiclePropertyStoreTest, snapshotNotAffectedByWrites) {
+    ASSERT_TRUE(store.writeValue(makeValue(kZonedProp, 2, 20)));
+    ASSERT_TRUE(store.writeValue(makeValue(kGlobalProp, 0, 1)));
+    ASSERT_TRUE(store.writeValue(makeValue(kZonedProp, 1, 10)));
+
+    auto snapshot = store.snapshotAllValues();
+    ASSERT_TRUE(store.writeValue(makeValue(kGlobalProp, 0, 2)));
+    store.removeValuesForProperty(kZonedProp);
+
+    // Sorted by property and area.
+    ASSERT_EQ(3u, snapshot.size());
+    ASSERT_EQ(1, snapshot[0]->value.int32Values[0]);
+    ASSERT_EQ(10, snapshot[1]->value.int32Values[0]);
+    ASSERT_EQ(20, snapshot[2]->value.int32Values[0]);
+}
+
+/*
+ * HIDL get() calls on a few threads while the emulator and timers write
+ * other properties.
+ */
+TEST_F(VehiclePropertyStoreTest, concurrentReadWriteBenchmark) {
+    constexpr int32_t kProperties = 100;
+    constexpr int kReaders = 4;
+    constexpr int kWriters = 4;
+    constexpr int kOpsPerThread = 200000;
+
+    VehiclePropertyStore benchStore;
+    for (int32_t i = 0; i < kProperties; i++) {
+        benchStore.registerProperty(makeConfig(kGlobalProp + i));
+        benchStore.writeValue(makeValue(kGlobalProp + i, 0, 0));
+    }
+
+    std::atomic<int64_t> found { 0 };
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kWriters; t++) {
+        threads.emplace_back([&benchStore, t] {
+            VehiclePropValue value = makeValue(kGlobalProp, 0, 0);
+            for (int i = 0; i < kOpsPerThread; i++) {
+                value.prop = kGlobalProp + (i * kWriters + t) % kProperties;
+                value.value.int32Values[0] = i;
+                benchStore.writeValue(value);
+            }
+        });
+    }
+    for (int t = 0; t < kReaders; t++) {
+        threads.emplace_back([&benchStore, &found, t] {
+            int64_t localFound = 0;
+            for (int i = 0; i < kOpsPerThread; i++) {
+                if (benchStore.readValueOrNull(kGlobalProp + (i + t) % kProperties)) {
+                    localFound++;
+                }
+            }
+            found += localFound;
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+    ASSERT_EQ(static_cast<int64_t>(kReaders) * kOpsPerThread, found.load());
+    std::cout << "VehiclePropertyStore: " << kReaders << " readers, " << kWriters << " writers, "
+              << (kReaders + kWriters) * static_cast<int64_t>(kOpsPerThread) * 1000000
+                      / std::max<int64_t>(1, elapsed)
+              << " ops/sec" << std::endl;
+}
+
+}  // namespace anonymous
+
+}  // namespace V2_0
+}  // namespace vehicle
+}  // namespace automotive
+}  // namespace hardware
+}  // namespace android
@@ -27,24 +27,95 @@
 #include <utils/Log.h>
 #include <vector>
 #include "fcntl.h"
+#include "sys/epoll.h"
 #include "sys/select.h"
+#include "sys/timerfd.h"
 #include "unistd.h"
 
 static const int INVALID_FD = -1;
 
 static const int BT_RT_PRIORITY = 1;
 
+static const int MAX_EPOLL_EVENTS = 16;
+
+namespace {
+
+uint64_t ToNanoseconds(std::chrono::steady_clock::duration duration) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+}
+
+// Only the watcher thread updates the counters.
+void AddSample(std::atomic<uint64_t>* total, std::atomic<uint64_t>* max,
+               uint64_t value) {
+  total->store(total->load(std::memory_order_relaxed) + value,
+               std::memory_order_relaxed);
+  if (value > max->load(std::memory_order_relaxed)) {
+    max->store(value, std::memory_order_relaxed);
+  }
+}
+
+// Arms the timer to expire timeout after start, or disarms it if the timeout
+// is zero. steady_clock is CLOCK_MONOTONIC.
+void ArmTimer(int timer_fd, std::chrono::milliseconds timeout,
+              std::chrono::steady_clock::time_point start) {
+  struct itimerspec deadline = {};
+  if (timeout > std::chrono::milliseconds(0)) {
+    uint64_t ns = ToNanoseconds((start + timeout).time_since_epoch());
+    deadline.it_value.tv_sec = ns / 1000000000;
+    deadline.it_value.tv_nsec = ns % 1000000000;
+  }
+  timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &deadline, NULL);
+}
+
+}  // namespace
+
 namespace android {
 namespace hardware {
 namespace bluetooth {
 namespace async {
 
+AsyncFdWatcher::AsyncFdWatcher(Backend backend)
+    : backend_(backend),
+      notification_listen_fd_(INVALID_FD),
+      notification_write_fd_(INVALID_FD),
+      epoll_fd_(INVALID_FD),
+      timer_fd_(INVALID_FD) {}
+
 int AsyncFdWatcher::WatchFdForNonBlockingReads(
-    int file_descriptor, const ReadCallback& on_read_fd_ready_callback) {
+    int file_descriptor, const ReadCallback& on_read_fd_ready_callback,
+    int priority) {
+  return WatchFd(file_descriptor,
+                 {on_read_fd_ready_callback, priority, false});
+}
+
+int AsyncFdWatcher::WatchFdForEdgeTriggeredReads(
+    int file_descriptor, const ReadCallback& on_read_fd_ready_callback,
+    int priority) {
+  return WatchFd(file_descriptor, {on_read_fd_ready_callback, priority, true});
+}
+
+int AsyncFdWatcher::WatchFd(int file_descriptor, const WatchedFd& watched_fd) {
   // Add file descriptor and callback
   {
     std::unique_lock<std::mutex> guard(internal_mutex_);
-    watched_fds_[file_descriptor] = on_read_fd_ready_callback;
+    if (backend_ == Backend::EPOLL) {
+      // Registrations persist, unlike the fd_set which select() needs anew
+      // for every wait.
+      if (epoll_fd_ == INVALID_FD && !OpenEpoll()) return -1;
+      struct epoll_event event = {};
+      event.events = EPOLLIN | (watched_fd.edge_triggered ? EPOLLET : 0);
+      event.data.fd = file_descriptor;
+      int ret = epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, file_descriptor, &event);
+      if (ret && errno == EEXIST) {
+        ret = epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, file_descriptor, &event);
+      }
+      if (ret) {
+        ALOGE("%s unable to watch fd %d: %s", __func__, file_descriptor,
+              strerror(errno));
+        return -1;
+      }
+    }
+    watched_fds_[file_descriptor] = watched_fd;
   }
 
   // Start the thread if not started yet
@@ -67,6 +138,22 @@ int AsyncFdWatcher::ConfigureTimeout(
 
 void AsyncFdWatcher::StopWatchingFileDescriptors() { stopThread(); }
 
+AsyncFdWatcher::Stats AsyncFdWatcher::GetStats() const {
+  Stats stats;
+  stats.wakeups = wakeups_.load(std::memory_order_relaxed);
+  stats.dispatches = dispatches_.load(std::memory_order_relaxed);
+  stats.total_dispatch_latency_ns =
+      total_dispatch_latency_ns_.load(std::memory_order_relaxed);
+  stats.max_dispatch_latency_ns =
+      max_dispatch_latency_ns_.load(std::memory_order_relaxed);
+  stats.timeouts = timeouts_.load(std::memory_order_relaxed);
+  stats.total_timeout_latency_ns =
+      total_timeout_latency_ns_.load(std::memory_order_relaxed);
+  stats.max_timeout_latency_ns =
+      max_timeout_latency_ns_.load(std::memory_order_relaxed);
+  return stats;
+}
+
 AsyncFdWatcher::~AsyncFdWatcher() {}
 
 // Make sure to call this with at least one file descriptor ready to be
@@ -81,6 +168,17 @@ int AsyncFdWatcher::tryStartThread() {
   notification_listen_fd_ = pipe_fds[0];
   notification_write_fd_ = pipe_fds[1];
 
+  if (backend_ == Backend::EPOLL) {
+    std::unique_lock<std::mutex> guard(internal_mutex_);
+    if (epoll_fd_ == INVALID_FD && !OpenEpoll()) return -1;
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = notification_listen_fd_;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, notification_listen_fd_, &event)) {
+      return -1;
+    }
+  }
+
   thread_ = std::thread([this]() { ThreadRoutine(); });
   if (!thread_.joinable()) return -1;
 
@@ -98,6 +196,7 @@ int AsyncFdWatcher::stopThread() {
   {
     std::unique_lock<std::mutex> guard(internal_mutex_);
     watched_fds_.clear();
+    CloseEpoll();
   }
 
   {
@@ -116,6 +215,30 @@ int AsyncFdWatcher::notifyThread() {
   return 0;
 }
 
+// Called with internal_mutex_ held.
+bool AsyncFdWatcher::OpenEpoll() {
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = timer_fd_;
+  if (epoll_fd_ == INVALID_FD || timer_fd_ == INVALID_FD ||
+      epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, timer_fd_, &event)) {
+    ALOGE("%s unable to set up epoll: %s", __func__, strerror(errno));
+    CloseEpoll();
+    return false;
+  }
+  return true;
+}
+
+// Called with internal_mutex_ held.
+void AsyncFdWatcher::CloseEpoll() {
+  if (epoll_fd_ != INVALID_FD) close(epoll_fd_);
+  if (timer_fd_ != INVALID_FD) close(timer_fd_);
+  epoll_fd_ = INVALID_FD;
+  timer_fd_ = INVALID_FD;
+}
+
 void AsyncFdWatcher::ThreadRoutine() {
   // Make watching thread RT.
   struct sched_param rt_params;
@@ -125,42 +248,52 @@ void AsyncFdWatcher::ThreadRoutine() {
           getpid(), gettid(), strerror(errno));
   }
 
+  if (backend_ == Backend::EPOLL) {
+    EpollThreadRoutine();
+  } else {
+    SelectThreadRoutine();
+  }
+}
+
+void AsyncFdWatcher::SelectThreadRoutine() {
+  std::vector<int> ready_fds;
+
   while (running_) {
     fd_set read_fds;
     FD_ZERO(&read_fds);
     FD_SET(notification_listen_fd_, &read_fds);
     int max_read_fd = INVALID_FD;
-    for (auto& it : watched_fds_) {
-      FD_SET(it.first, &read_fds);
-      max_read_fd = std::max(max_read_fd, it.first);
+    {
+      std::unique_lock<std::mutex> guard(internal_mutex_);
+      for (auto& it : watched_fds_) {
+        FD_SET(it.first, &read_fds);
+        max_read_fd = std::max(max_read_fd, it.first);
+      }
     }
 
     struct timeval timeout;
     struct timeval* timeout_ptr = NULL;
-    if (timeout_ms_ > std::chrono::milliseconds(0)) {
-      timeout.tv_sec = timeout_ms_.count() / 1000;
-      timeout.tv_usec = (timeout_ms_.count() % 1000) * 1000;
+    std::chrono::milliseconds timeout_ms = timeout_ms_;
+    if (timeout_ms > std::chrono::milliseconds(0)) {
+      timeout.tv_sec = timeout_ms.count() / 1000;
+      timeout.tv_usec = (timeout_ms.count() % 1000) * 1000;
       timeout_ptr = &timeout;
     }
 
     // Wait until there is data available to read on some FD.
+    auto wait_start = std::chrono::steady_clock::now();
     int nfds = std::max(notification_listen_fd_, max_read_fd);
     int retval = select(nfds + 1, &read_fds, NULL, NULL, timeout_ptr);
 
     // There was some error.
     if (retval < 0) continue;
 
+    auto wakeup_time = std::chrono::steady_clock::now();
+    wakeups_.fetch_add(1, std::memory_order_relaxed);
+
     // Timeout.
     if (retval == 0) {
-      // Allow the timeout callback to modify the timeout.
-      TimeoutCallback saved_cb;
-      {
-        std::unique_lock<std::mutex> guard(timeout_mutex_);
-        if (timeout_ms_ > std::chrono::milliseconds(0))
-          saved_cb = timeout_cb_;
-      }
-      if (saved_cb != nullptr)
-        saved_cb();
+      RunTimeoutCallback(wakeup_time - (wait_start + timeout_ms));
       continue;
     }
 
@@ -172,15 +305,116 @@ void AsyncFdWatcher::ThreadRoutine() {
     }
 
     // Invoke the data ready callbacks if appropriate.
-    {
-      // Hold the mutex to make sure that the callbacks are still valid.
-      std::unique_lock<std::mutex> guard(internal_mutex_);
-      for (auto& it : watched_fds_) {
-        if (FD_ISSET(it.first, &read_fds)) {
-        it.second(it.first);
-        }
+    ready_fds.clear();
+    for (int fd = 0; fd <= max_read_fd; fd++) {
+      if (FD_ISSET(fd, &read_fds)) ready_fds.push_back(fd);
+    }
+    DispatchReads(ready_fds.data(), ready_fds.size(), wakeup_time);
+  }
+}
+
+void AsyncFdWatcher::EpollThreadRoutine() {
+  // The timeout restarts on every wakeup, as with select(). Instead of
+  // re-arming the timer each time, it is left to expire and then pushed back
+  // if there was activity meanwhile.
+  std::chrono::milliseconds timeout_ms;
+  {
+    std::unique_lock<std::mutex> guard(timeout_mutex_);
+    timeout_ms = timeout_ms_;
+  }
+  auto last_wakeup = std::chrono::steady_clock::now();
+  ArmTimer(timer_fd_, timeout_ms, last_wakeup);
+  struct epoll_event events[MAX_EPOLL_EVENTS];
+  int ready_fds[MAX_EPOLL_EVENTS];
+
+  while (running_) {
+    int nevents = epoll_wait(epoll_fd_, events, MAX_EPOLL_EVENTS, -1);
+
+    // There was some error.
+    if (nevents < 0) continue;
+
+    auto wakeup_time = std::chrono::steady_clock::now();
+    wakeups_.fetch_add(1, std::memory_order_relaxed);
+
+    bool notified = false;
+    bool timer_expired = false;
+    size_t ready_count = 0;
+    for (int i = 0; i < nevents; i++) {
+      int fd = events[i].data.fd;
+      if (fd == notification_listen_fd_) {
+        notified = true;
+      } else if (fd == timer_fd_) {
+        timer_expired = true;
+      } else {
+        ready_fds[ready_count++] = fd;
       }
     }
+
+    if (timer_expired) {
+      uint64_t expirations;
+      TEMP_FAILURE_RETRY(read(timer_fd_, &expirations, sizeof(expirations)));
+    }
+
+    // Read data from the notification FD, the timeout may have changed.
+    if (notified) {
+      char buffer[16];
+      while (TEMP_FAILURE_RETRY(
+                 read(notification_listen_fd_, buffer, sizeof(buffer))) > 0) {
+      }
+      std::unique_lock<std::mutex> guard(timeout_mutex_);
+      timeout_ms = timeout_ms_;
+    }
+
+    if (notified || ready_count > 0) {
+      last_wakeup = wakeup_time;
+      DispatchReads(ready_fds, ready_count, wakeup_time);
+    } else if (timer_expired && timeout_ms > std::chrono::milliseconds(0) &&
+               wakeup_time >= last_wakeup + timeout_ms) {
+      RunTimeoutCallback(wakeup_time - (last_wakeup + timeout_ms));
+      last_wakeup = wakeup_time;
+    }
+
+    if (notified || timer_expired) {
+      ArmTimer(timer_fd_, timeout_ms, last_wakeup);
+    }
+  }
+}
+
+void AsyncFdWatcher::RunTimeoutCallback(
+    std::chrono::steady_clock::duration latency) {
+  // Allow the timeout callback to modify the timeout.
+  TimeoutCallback saved_cb;
+  {
+    std::unique_lock<std::mutex> guard(timeout_mutex_);
+    if (timeout_ms_ > std::chrono::milliseconds(0)) saved_cb = timeout_cb_;
+  }
+  if (saved_cb != nullptr) {
+    timeouts_.fetch_add(1, std::memory_order_relaxed);
+    AddSample(&total_timeout_latency_ns_, &max_timeout_latency_ns_,
+              ToNanoseconds(std::max(latency, latency.zero())));
+    saved_cb();
+  }
+}
+
+void AsyncFdWatcher::DispatchReads(
+    int* fds, size_t count, std::chrono::steady_clock::time_point wakeup_time) {
+  // Hold the mutex to make sure that the callbacks are still valid.
+  std::unique_lock<std::mutex> guard(internal_mutex_);
+  auto priority = [this](int fd) {
+    auto it = watched_fds_.find(fd);
+    return it == watched_fds_.end() ? 0 : it->second.priority;
+  };
+  std::stable_sort(fds, fds + count, [&priority](int a, int b) {
+    return priority(a) > priority(b);
+  });
+
+  for (size_t i = 0; i < count; i++) {
+    auto it = watched_fds_.find(fds[i]);
+    if (it == watched_fds_.end()) continue;
+    dispatches_.fetch_add(1, std::memory_order_relaxed);
+    AddSample(&total_dispatch_latency_ns_, &max_dispatch_latency_ns_,
+              ToNanoseconds(std::chrono::steady_clock::now() - wakeup_time));
+    it->second.callback(fds[i]);
   }
 }
 
@@ -16,6 +16,9 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <map>
 #include <mutex>
 #include <thread>
@@ -30,34 +33,89 @@ using TimeoutCallback = std::function<void(void)>;
 
 class AsyncFdWatcher {
  public:
-  AsyncFdWatcher() = default;
+  enum class Backend { SELECT, EPOLL };
+
+  // Counters of the watcher thread, latencies are in nanoseconds.
+  struct Stats {
+    uint64_t wakeups;
+    uint64_t dispatches;
+    // From the thread waking up to the start of a read callback, this grows
+    // when a callback waits behind the ones of higher priority.
+    uint64_t total_dispatch_latency_ns;
+    uint64_t max_dispatch_latency_ns;
+    uint64_t timeouts;
+    // How late the timeout callback runs after the timeout expired.
+    uint64_t total_timeout_latency_ns;
+    uint64_t max_timeout_latency_ns;
+  };
+
+  explicit AsyncFdWatcher(Backend backend = Backend::EPOLL);
   ~AsyncFdWatcher();
 
+  // When several descriptors are ready at once, the callbacks with the
+  // higher priority run first.
   int WatchFdForNonBlockingReads(int file_descriptor,
-                                 const ReadCallback& on_read_fd_ready_callback);
+                                 const ReadCallback& on_read_fd_ready_callback,
+                                 int priority = 0);
+  // The callback is only called again after new data arrives, so it must
+  // read until EAGAIN. With the select() backend this is the same as
+  // WatchFdForNonBlockingReads().
+  int WatchFdForEdgeTriggeredReads(
+      int file_descriptor, const ReadCallback& on_read_fd_ready_callback,
+      int priority = 0);
+  // The timeout restarts whenever the watcher thread wakes up.
   int ConfigureTimeout(const std::chrono::milliseconds timeout,
                        const TimeoutCallback& on_timeout_callback);
   void StopWatchingFileDescriptors();
 
+  Stats GetStats() const;
+
  private:
   AsyncFdWatcher(const AsyncFdWatcher&) = delete;
   AsyncFdWatcher& operator=(const AsyncFdWatcher&) = delete;
 
+  struct WatchedFd {
+    ReadCallback callback;
+    int priority;
+    bool edge_triggered;
+  };
+
+  int WatchFd(int file_descriptor, const WatchedFd& watched_fd);
   int tryStartThread();
   int stopThread();
   int notifyThread();
   void ThreadRoutine();
+  void SelectThreadRoutine();
+  void EpollThreadRoutine();
+  bool OpenEpoll();
+  void CloseEpoll();
+  void RunTimeoutCallback(std::chrono::steady_clock::duration latency);
+  void DispatchReads(int* fds, size_t count,
+                     std::chrono::steady_clock::time_point wakeup_time);
 
+  const Backend backend_;
   std::atomic_bool running_{false};
   std::thread thread_;
   std::mutex internal_mutex_;
   std::mutex timeout_mutex_;
 
-  std::map<int, ReadCallback> watched_fds_;
+  std::map<int, WatchedFd> watched_fds_;
   int notification_listen_fd_;
   int notification_write_fd_;
   TimeoutCallback timeout_cb_;
-  std::chrono::milliseconds timeout_ms_;
+  std::chrono::milliseconds timeout_ms_{0};
+
+  // Only used by the epoll backend.
+  int epoll_fd_;
+  int timer_fd_;
+
+  std::atomic<uint64_t> wakeups_{0};
+  std::atomic<uint64_t> dispatches_{0};
+  std::atomic<uint64_t> total_dispatch_latency_ns_{0};
+  std::atomic<uint64_t> max_dispatch_latency_ns_{0};
+  std::atomic<uint64_t> timeouts_{0};
+  std::atomic<uint64_t> total_timeout_latency_ns_{0};
+  std::atomic<uint64_t> max_timeout_latency_ns_{0};
 };
 
 
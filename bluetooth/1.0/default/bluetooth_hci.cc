@@ -19,6 +19,7 @@
 
 #include <log/log.h>
 
+#include "hci_packet_pool.h"
 #include "vendor_interface.h"
 
 namespace android {
@@ -129,6 +130,14 @@ Return<void> BluetoothHci::sendScoData(const hidl_vec<uint8_t>& data) {
   return Void();
 }
 
+Return<void> BluetoothHci::debug(const hidl_handle& fd,
+                                 const hidl_vec<hidl_string>& /* options */) {
+  if (fd.getNativeHandle() != nullptr && fd->numFds == 1) {
+    hci::HciPacketPool::Get().Dump(fd->data[0]);
+  }
+  return Void();
+}
+
 void BluetoothHci::sendDataToController(const uint8_t type,
                                         const hidl_vec<uint8_t>& data) {
   VendorInterface::get()->Send(type, data.data(), data.size());
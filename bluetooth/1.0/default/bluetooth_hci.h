@@ -28,6 +28,8 @@ namespace V1_0 {
 namespace implementation {
 
 using ::android::hardware::Return;
+using ::android::hardware::hidl_handle;
+using ::android::hardware::hidl_string;
 using ::android::hardware::hidl_vec;
 
 class BluetoothDeathRecipient;
@@ -41,6 +43,9 @@ class BluetoothHci : public IBluetoothHci {
   Return<void> sendAclData(const hidl_vec<uint8_t>& data) override;
   Return<void> sendScoData(const hidl_vec<uint8_t>& data) override;
   Return<void> close() override;
+  // Dumps the receive buffer pool counters.
+  Return<void> debug(const hidl_handle& fd,
+                     const hidl_vec<hidl_string>& options) override;
 
  private:
   void sendDataToController(const uint8_t type, const hidl_vec<uint8_t>& data);
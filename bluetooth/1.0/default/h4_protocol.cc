@@ -21,17 +21,52 @@
 #include <assert.h>
 #include <fcntl.h>
 
+#include <algorithm>
+
 namespace android {
 namespace hardware {
 namespace bluetooth {
 namespace hci {
 
 size_t H4Protocol::Send(uint8_t type, const uint8_t* data, size_t length) {
-  int rv = WriteSafely(uart_fd_, &type, sizeof(type));
-  if (rv == sizeof(type)) {
-    rv = WriteSafely(uart_fd_, data, length);
+  OutboundPacket packet = {type, data, length, 0, false};
+
+  std::unique_lock<std::mutex> lock(tx_mutex_);
+  tx_queue_.push_back(&packet);
+  tx_done_.wait(lock, [this, &packet] { return packet.done || !tx_busy_; });
+  if (packet.done) return packet.bytes_written;
+
+  // Write everything queued so far, this packet included.
+  tx_busy_ = true;
+  tx_batch_.swap(tx_queue_);
+  lock.unlock();
+
+  WritePackets(tx_batch_);
+
+  lock.lock();
+  for (OutboundPacket* queued : tx_batch_) queued->done = true;
+  tx_batch_.clear();
+  tx_busy_ = false;
+  tx_done_.notify_all();
+  return packet.bytes_written;
+}
+
+void H4Protocol::WritePackets(const std::vector<OutboundPacket*>& packets) {
+  tx_iov_.clear();
+  for (OutboundPacket* packet : packets) {
+    tx_iov_.push_back({&packet->type, sizeof(packet->type)});
+    tx_iov_.push_back({const_cast<uint8_t*>(packet->data), packet->length});
+  }
+  size_t transmitted = WritevSafely(uart_fd_, tx_iov_.data(), tx_iov_.size());
+
+  // Like WriteSafely() for the payload, the type byte isn't counted.
+  for (OutboundPacket* packet : packets) {
+    size_t packet_size = sizeof(packet->type) + packet->length;
+    size_t packet_transmitted = std::min(transmitted, packet_size);
+    packet->bytes_written =
+        packet_transmitted > 0 ? packet_transmitted - sizeof(packet->type) : 0;
+    transmitted -= packet_transmitted;
   }
-  return rv;
 }
 
 void H4Protocol::OnPacketReady() {
@@ -55,13 +90,26 @@ void H4Protocol::OnPacketReady() {
 }
 
 void H4Protocol::OnDataReady(int fd) {
-  if (hci_packet_type_ == HCI_PACKET_TYPE_UNKNOWN) {
-    uint8_t buffer[1] = {0};
-    size_t bytes_read = TEMP_FAILURE_RETRY(read(fd, buffer, 1));
-    CHECK(bytes_read == 1);
-    hci_packet_type_ = static_cast<HciPacketType>(buffer[0]);
-  } else {
-    hci_packetizer_.OnDataReady(fd, hci_packet_type_);
+  ssize_t bytes_read =
+      TEMP_FAILURE_RETRY(read(fd, rx_buffer_, sizeof(rx_buffer_)));
+  CHECK(bytes_read > 0);
+
+  const uint8_t* data = rx_buffer_;
+  size_t remaining = bytes_read;
+  while (remaining > 0) {
+    if (hci_packet_type_ == HCI_PACKET_TYPE_UNKNOWN) {
+      hci_packet_type_ = static_cast<HciPacketType>(*data);
+      CHECK(hci_packet_type_ >= HCI_PACKET_TYPE_ACL_DATA &&
+            hci_packet_type_ <= HCI_PACKET_TYPE_EVENT)
+          << "Unexpected packet type " << static_cast<int>(hci_packet_type_);
+      data++;
+      remaining--;
+      continue;
+    }
+    size_t consumed =
+        hci_packetizer_.OnDataReady(hci_packet_type_, data, remaining);
+    data += consumed;
+    remaining -= consumed;
   }
 }
 
@@ -16,6 +16,10 @@
 
 #pragma once
 
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
 #include <hidl/HidlSupport.h>
 
 #include "async_fd_watcher.h"
@@ -38,6 +42,9 @@ class H4Protocol : public HciProtocol {
         sco_cb_(sco_cb),
         hci_packetizer_([this]() { OnPacketReady(); }) {}
 
+  // Thread safe. Packets sent while another sender is writing to the UART
+  // are queued and written together with a single writev() by the next
+  // sender, which returns once its own packet is written.
   size_t Send(uint8_t type, const uint8_t* data, size_t length);
 
   void OnPacketReady();
@@ -45,14 +52,37 @@ class H4Protocol : public HciProtocol {
   void OnDataReady(int fd);
 
  private:
+  struct OutboundPacket {
+    uint8_t type;
+    const uint8_t* data;
+    size_t length;
+    size_t bytes_written;
+    bool done;
+  };
+
+  void WritePackets(const std::vector<OutboundPacket*>& packets);
+
   int uart_fd_;
 
+  std::mutex tx_mutex_;
+  std::condition_variable tx_done_;
+  bool tx_busy_{false};
+  std::vector<OutboundPacket*> tx_queue_;
+  // Only used by the sender that writes, reused to avoid allocations.
+  std::vector<OutboundPacket*> tx_batch_;
+  std::vector<struct iovec> tx_iov_;
+
   PacketReadCallback event_cb_;
   PacketReadCallback acl_cb_;
   PacketReadCallback sco_cb_;
 
   HciPacketType hci_packet_type_{HCI_PACKET_TYPE_UNKNOWN};
   hci::HciPacketizer hci_packetizer_;
+
+  // Everything the UART has is read at once, a read may hold the tail of one
+  // packet and any number of following packets.
+  static const size_t kRxBufferSize = 4096;
+  uint8_t rx_buffer_[kRxBufferSize];
 };
 
 }  // namespace hci
@@ -0,0 +1,127 @@
+//
+// Copyright 2017 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "hci_packet_pool.h"
+
+#define LOG_TAG "android.hardware.bluetooth.hci_packet_pool"
+#include <android-base/logging.h>
+#include <utils/Log.h>
+
+#include <algorithm>
+#include <inttypes.h>
+#include <stdio.h>
+
+namespace {
+
+// The H4 transport has one packet in flight, MCT one event and one ACL
+// packet.
+const size_t kSmallSlots = 4;
+const size_t kLargeSlots = 2;
+
+}  // namespace
+
+namespace android {
+namespace hardware {
+namespace bluetooth {
+namespace hci {
+
+const size_t HciPacketPool::kSmallSlotSize;
+const size_t HciPacketPool::kLargeSlotSize;
+
+HciPacketPool::SizeClass::SizeClass(size_t slot_size, size_t slots)
+    : slot_size(slot_size),
+      slots(slots),
+      storage(new uint8_t[slot_size * slots]) {
+  free_slots.reserve(slots);
+  // Hand out the first slot first, it is the most likely to be cached.
+  for (size_t i = slots; i > 0; i--) {
+    free_slots.push_back(storage.get() + (i - 1) * slot_size);
+  }
+}
+
+bool HciPacketPool::SizeClass::Owns(const uint8_t* buffer) const {
+  return buffer >= storage.get() && buffer < storage.get() + slot_size * slots;
+}
+
+HciPacketPool::HciPacketPool(size_t small_slots, size_t large_slots)
+    : small_(kSmallSlotSize, small_slots),
+      large_(kLargeSlotSize, large_slots) {}
+
+HciPacketPool& HciPacketPool::Get() {
+  static HciPacketPool pool(kSmallSlots, kLargeSlots);
+  return pool;
+}
+
+uint8_t* HciPacketPool::Acquire(size_t length) {
+  uint8_t* buffer = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // A small packet may take a large slot rather than go to the heap.
+    if (length <= small_.slot_size && !small_.free_slots.empty()) {
+      buffer = small_.free_slots.back();
+      small_.free_slots.pop_back();
+      stats_.small_acquired++;
+    } else if (length <= large_.slot_size && !large_.free_slots.empty()) {
+      buffer = large_.free_slots.back();
+      large_.free_slots.pop_back();
+      stats_.large_acquired++;
+    } else {
+      stats_.heap_allocations++;
+    }
+    stats_.in_use++;
+    stats_.max_in_use = std::max(stats_.max_in_use, stats_.in_use);
+  }
+  if (buffer == nullptr) {
+    ALOGW("%s: no free slot for %zu bytes", __func__, length);
+    buffer = new uint8_t[length];
+  }
+  return buffer;
+}
+
+void HciPacketPool::Release(uint8_t* buffer) {
+  if (buffer == nullptr) return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  CHECK(stats_.in_use > 0);
+  stats_.in_use--;
+  if (small_.Owns(buffer)) {
+    small_.free_slots.push_back(buffer);
+  } else if (large_.Owns(buffer)) {
+    large_.free_slots.push_back(buffer);
+  } else {
+    delete[] buffer;
+  }
+}
+
+HciPacketPool::Stats HciPacketPool::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+void HciPacketPool::Dump(int fd) const {
+  Stats stats = GetStats();
+  dprintf(fd, "HCI packet pool:\n");
+  dprintf(fd, "  %zu slots of %zu bytes, %" PRIu64 " acquired\n", small_.slots,
+          small_.slot_size, stats.small_acquired);
+  dprintf(fd, "  %zu slots of %zu bytes, %" PRIu64 " acquired\n", large_.slots,
+          large_.slot_size, stats.large_acquired);
+  dprintf(fd, "  %" PRIu64 " heap allocations\n", stats.heap_allocations);
+  dprintf(fd, "  %zu in use, at most %zu\n", stats.in_use, stats.max_in_use);
+}
+
+}  // namespace hci
+}  // namespace bluetooth
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,85 @@
+//
+// Copyright 2017 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "hci_internals.h"
+
+namespace android {
+namespace hardware {
+namespace bluetooth {
+namespace hci {
+
+// Preallocated buffers for received packets. A packet only lives until its
+// callback returns, so a few slots per size are enough to never allocate
+// while the controller is streaming.
+class HciPacketPool {
+ public:
+  // Events and SCO packets have a one byte length.
+  static const size_t kSmallSlotSize = HCI_SCO_PREAMBLE_SIZE + 0xFF;
+  // ACL packets have a two byte length.
+  static const size_t kLargeSlotSize = HCI_ACL_PREAMBLE_SIZE + 0xFFFF;
+
+  struct Stats {
+    uint64_t small_acquired;
+    uint64_t large_acquired;
+    // Packets that found no free slot and were allocated on the heap.
+    uint64_t heap_allocations;
+    size_t in_use;
+    size_t max_in_use;
+  };
+
+  HciPacketPool(size_t small_slots, size_t large_slots);
+
+  // The pool shared by all the transports of the process.
+  static HciPacketPool& Get();
+
+  // Never fails, falls back to the heap when no slot is free.
+  uint8_t* Acquire(size_t length);
+  void Release(uint8_t* buffer);
+
+  Stats GetStats() const;
+  void Dump(int fd) const;
+
+ private:
+  HciPacketPool(const HciPacketPool&) = delete;
+  HciPacketPool& operator=(const HciPacketPool&) = delete;
+
+  struct SizeClass {
+    SizeClass(size_t slot_size, size_t slots);
+    bool Owns(const uint8_t* buffer) const;
+
+    const size_t slot_size;
+    const size_t slots;
+    std::unique_ptr<uint8_t[]> storage;
+    std::vector<uint8_t*> free_slots;
+  };
+
+  mutable std::mutex mutex_;
+  SizeClass small_;
+  SizeClass large_;
+  Stats stats_{};
+};
+
+}  // namespace hci
+}  // namespace bluetooth
+}  // namespace hardware
+}  // namespace android
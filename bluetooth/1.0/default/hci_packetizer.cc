@@ -20,6 +20,7 @@
 #include <android-base/logging.h>
 #include <utils/Log.h>
 
+#include <algorithm>
 #include <dlfcn.h>
 #include <fcntl.h>
 
@@ -45,8 +46,33 @@ namespace hardware {
 namespace bluetooth {
 namespace hci {
 
+HciPacketizer::~HciPacketizer() {
+  HciPacketPool::Get().Release(packet_buffer_);
+}
+
 const hidl_vec<uint8_t>& HciPacketizer::GetPacket() const { return packet_; }
 
+void HciPacketizer::StartPacket(HciPacketType packet_type) {
+  size_t preamble_size = preamble_size_for_type[packet_type];
+  size_t packet_length = HciGetPacketLengthForType(packet_type, preamble_);
+  packet_size_ = preamble_size + packet_length;
+  packet_buffer_ = HciPacketPool::Get().Acquire(packet_size_);
+  memcpy(packet_buffer_, preamble_, preamble_size);
+  bytes_remaining_ = packet_length;
+  state_ = HCI_PAYLOAD;
+  bytes_read_ = 0;
+}
+
+void HciPacketizer::FinishPacket() {
+  packet_.setToExternal(packet_buffer_, packet_size_);
+  packet_ready_cb_();
+  packet_.setToExternal(nullptr, 0);
+  HciPacketPool::Get().Release(packet_buffer_);
+  packet_buffer_ = nullptr;
+  state_ = HCI_PREAMBLE;
+  bytes_read_ = 0;
+}
+
 void HciPacketizer::OnDataReady(int fd, HciPacketType packet_type) {
   switch (state_) {
     case HCI_PREAMBLE: {
@@ -56,13 +82,7 @@ void HciPacketizer::OnDataReady(int fd, HciPacketType packet_type) {
       CHECK(bytes_read > 0);
       bytes_read_ += bytes_read;
       if (bytes_read_ == preamble_size_for_type[packet_type]) {
-        size_t packet_length =
-            HciGetPacketLengthForType(packet_type, preamble_);
-        packet_.resize(preamble_size_for_type[packet_type] + packet_length);
-        memcpy(packet_.data(), preamble_, preamble_size_for_type[packet_type]);
-        bytes_remaining_ = packet_length;
-        state_ = HCI_PAYLOAD;
-        bytes_read_ = 0;
+        StartPacket(packet_type);
       }
       break;
     }
@@ -70,21 +90,39 @@ void HciPacketizer::OnDataReady(int fd, HciPacketType packet_type) {
     case HCI_PAYLOAD: {
       size_t bytes_read = TEMP_FAILURE_RETRY(read(
           fd,
-          packet_.data() + preamble_size_for_type[packet_type] + bytes_read_,
+          packet_buffer_ + preamble_size_for_type[packet_type] + bytes_read_,
           bytes_remaining_));
       CHECK(bytes_read > 0);
       bytes_remaining_ -= bytes_read;
       bytes_read_ += bytes_read;
-      if (bytes_remaining_ == 0) {
-        packet_ready_cb_();
-        state_ = HCI_PREAMBLE;
-        bytes_read_ = 0;
-      }
+      if (bytes_remaining_ == 0) FinishPacket();
       break;
     }
   }
 }
 
+size_t HciPacketizer::OnDataReady(HciPacketType packet_type,
+                                  const uint8_t* data, size_t length) {
+  size_t consumed = 0;
+  if (state_ == HCI_PREAMBLE) {
+    size_t preamble_size = preamble_size_for_type[packet_type];
+    consumed = std::min(length, preamble_size - bytes_read_);
+    memcpy(preamble_ + bytes_read_, data, consumed);
+    bytes_read_ += consumed;
+    if (bytes_read_ < preamble_size) return consumed;
+    StartPacket(packet_type);
+  }
+
+  size_t payload_bytes = std::min(length - consumed, bytes_remaining_);
+  memcpy(packet_buffer_ + preamble_size_for_type[packet_type] + bytes_read_,
+         data + consumed, payload_bytes);
+  consumed += payload_bytes;
+  bytes_remaining_ -= payload_bytes;
+  bytes_read_ += payload_bytes;
+  if (bytes_remaining_ == 0) FinishPacket();
+  return consumed;
+}
+
 }  // namespace hci
 }  // namespace bluetooth
 }  // namespace hardware
@@ -21,6 +21,7 @@
 #include <hidl/HidlSupport.h>
 
 #include "hci_internals.h"
+#include "hci_packet_pool.h"
 
 namespace android {
 namespace hardware {
@@ -34,7 +35,14 @@ class HciPacketizer {
  public:
   HciPacketizer(HciPacketReadyCallback packet_cb)
       : packet_ready_cb_(packet_cb){};
+  ~HciPacketizer();
   void OnDataReady(int fd, HciPacketType packet_type);
+  // Consumes bytes of a packet that were already read from the UART. Returns
+  // the number of bytes used, which stops at the end of the current packet.
+  size_t OnDataReady(HciPacketType packet_type, const uint8_t* data,
+                     size_t length);
+  // Only valid in the packet ready callback, the packet is stored in a slot
+  // of the HciPacketPool which is returned when the callback is done.
   const hidl_vec<uint8_t>& GetPacket() const;
 
  protected:
@@ -42,9 +50,15 @@ class HciPacketizer {
   State state_{HCI_PREAMBLE};
   uint8_t preamble_[HCI_PREAMBLE_SIZE_MAX];
   hidl_vec<uint8_t> packet_;
+  uint8_t* packet_buffer_{nullptr};
+  size_t packet_size_{0};
   size_t bytes_remaining_{0};
   size_t bytes_read_{0};
   HciPacketReadyCallback packet_ready_cb_;
+
+ private:
+  void StartPacket(HciPacketType packet_type);
+  void FinishPacket();
 };
 
 }  // namespace hci
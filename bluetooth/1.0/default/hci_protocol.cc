@@ -17,8 +17,10 @@
 #include "hci_protocol.h"
 
 #define LOG_TAG "android.hardware.bluetooth-hci-hci_protocol"
+#include <algorithm>
 #include <assert.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <log/log.h>
 
 namespace android {
@@ -50,6 +52,39 @@ size_t HciProtocol::WriteSafely(int fd, const uint8_t* data, size_t length) {
   return transmitted_length;
 }
 
+size_t HciProtocol::WritevSafely(int fd, struct iovec* iov, int iovcnt) {
+  size_t transmitted_length = 0;
+  while (iovcnt > 0) {
+    ssize_t ret = TEMP_FAILURE_RETRY(writev(fd, iov, std::min(iovcnt, IOV_MAX)));
+
+    if (ret == -1) {
+      if (errno == EAGAIN) continue;
+      ALOGE("%s error writing to UART (%s)", __func__, strerror(errno));
+      break;
+
+    } else if (ret == 0) {
+      // Nothing written :(
+      ALOGE("%s zero bytes written - something went wrong...", __func__);
+      break;
+    }
+
+    transmitted_length += ret;
+    // Skip what was written, including buffers that are empty.
+    size_t written = ret;
+    while (iovcnt > 0 && written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + written;
+      iov->iov_len -= written;
+    }
+  }
+
+  return transmitted_length;
+}
+
 }  // namespace hci
 }  // namespace bluetooth
 }  // namespace hardware
@@ -16,6 +16,8 @@
 
 #pragma once
 
+#include <sys/uio.h>
+
 #include <hidl/HidlSupport.h>
 
 #include "bt_vendor_lib.h"
@@ -41,6 +43,8 @@ class HciProtocol {
 
  protected:
   static size_t WriteSafely(int fd, const uint8_t* data, size_t length);
+  // Writes all the buffers, the iovec array is modified on partial writes.
+  static size_t WritevSafely(int fd, struct iovec* iov, int iovcnt);
 };
 
 }  // namespace hci
@@ -20,10 +20,12 @@
 #include <gtest/gtest.h>
 #include <cstdint>
 #include <cstring>
+#include <mutex>
 #include <vector>
 
 #include <log/log.h>
 #include <netdb.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -37,7 +39,8 @@ namespace implementation {
 
 using android::hardware::bluetooth::async::AsyncFdWatcher;
 
-class AsyncFdWatcherSocketTest : public ::testing::Test {
+class AsyncFdWatcherSocketTest
+    : public ::testing::TestWithParam<AsyncFdWatcher::Backend> {
  public:
   static const uint16_t kPort = 6111;
   static const size_t kBufferSize = 16;
@@ -188,8 +191,8 @@ class AsyncFdWatcherSocketTest : public ::testing::Test {
   }
 
  private:
-  AsyncFdWatcher async_fd_watcher_;
-  AsyncFdWatcher conn_watcher_;
+  AsyncFdWatcher async_fd_watcher_{GetParam()};
+  AsyncFdWatcher conn_watcher_{GetParam()};
   int socket_fd_;
   char server_buffer_[kBufferSize];
   char client_buffer_[kBufferSize];
@@ -197,10 +200,10 @@ class AsyncFdWatcherSocketTest : public ::testing::Test {
 };
 
 // Use a single AsyncFdWatcher to signal a connection to the server socket.
-TEST_F(AsyncFdWatcherSocketTest, Connect) {
+TEST_P(AsyncFdWatcherSocketTest, Connect) {
   int socket_fd = StartServer();
 
-  AsyncFdWatcher conn_watcher;
+  AsyncFdWatcher conn_watcher(GetParam());
   conn_watcher.WatchFdForNonBlockingReads(socket_fd, [this](int fd) {
     int connection_fd = AcceptConnection(fd);
     close(connection_fd);
@@ -218,12 +221,12 @@ TEST_F(AsyncFdWatcherSocketTest, Connect) {
 }
 
 // Use a single AsyncFdWatcher to signal a connection to the server socket.
-TEST_F(AsyncFdWatcherSocketTest, TimedOutConnect) {
+TEST_P(AsyncFdWatcherSocketTest, TimedOutConnect) {
   int socket_fd = StartServer();
   bool timed_out = false;
   bool* timeout_ptr = &timed_out;
 
-  AsyncFdWatcher conn_watcher;
+  AsyncFdWatcher conn_watcher(GetParam());
   conn_watcher.WatchFdForNonBlockingReads(socket_fd, [this](int fd) {
     int connection_fd = AcceptConnection(fd);
     close(connection_fd);
@@ -240,12 +243,12 @@ TEST_F(AsyncFdWatcherSocketTest, TimedOutConnect) {
 }
 
 // Modify the timeout in a timeout callback.
-TEST_F(AsyncFdWatcherSocketTest, TimedOutSchedulesTimeout) {
+TEST_P(AsyncFdWatcherSocketTest, TimedOutSchedulesTimeout) {
   int socket_fd = StartServer();
   bool timed_out = false;
   bool timed_out2 = false;
 
-  AsyncFdWatcher conn_watcher;
+  AsyncFdWatcher conn_watcher(GetParam());
   conn_watcher.WatchFdForNonBlockingReads(socket_fd, [this](int fd) {
     int connection_fd = AcceptConnection(fd);
     close(connection_fd);
@@ -272,7 +275,7 @@ TEST_F(AsyncFdWatcherSocketTest, TimedOutSchedulesTimeout) {
 }
 
 // Use a single AsyncFdWatcher to watch two file descriptors.
-TEST_F(AsyncFdWatcherSocketTest, WatchTwoFileDescriptors) {
+TEST_P(AsyncFdWatcherSocketTest, WatchTwoFileDescriptors) {
   int sockfd[2];
   socketpair(AF_LOCAL, SOCK_STREAM, 0, sockfd);
   bool cb1_called = false;
@@ -280,7 +283,7 @@ TEST_F(AsyncFdWatcherSocketTest, WatchTwoFileDescriptors) {
   bool cb2_called = false;
   bool* cb2_called_ptr = &cb2_called;
 
-  AsyncFdWatcher watcher;
+  AsyncFdWatcher watcher(GetParam());
   watcher.WatchFdForNonBlockingReads(sockfd[0], [cb1_called_ptr](int fd) {
     char read_buf[1] = {0};
     int n = TEMP_FAILURE_RETRY(read(fd, read_buf, sizeof(read_buf)));
@@ -326,7 +329,7 @@ TEST_F(AsyncFdWatcherSocketTest, WatchTwoFileDescriptors) {
 }
 
 // Use two AsyncFdWatchers to set up a server socket.
-TEST_F(AsyncFdWatcherSocketTest, ClientServer) {
+TEST_P(AsyncFdWatcherSocketTest, ClientServer) {
   ConfigureServer();
   int socket_cli_fd = ConnectClient();
 
@@ -339,7 +342,7 @@ TEST_F(AsyncFdWatcherSocketTest, ClientServer) {
 }
 
 // Use two AsyncFdWatchers to set up a server socket, which times out.
-TEST_F(AsyncFdWatcherSocketTest, TimeOutTest) {
+TEST_P(AsyncFdWatcherSocketTest, TimeOutTest) {
   ConfigureServer();
   int socket_cli_fd = ConnectClient();
 
@@ -350,7 +353,7 @@ TEST_F(AsyncFdWatcherSocketTest, TimeOutTest) {
 }
 
 // Use two AsyncFdWatchers to set up a server socket, which times out.
-TEST_F(AsyncFdWatcherSocketTest, RepeatedTimeOutTest) {
+TEST_P(AsyncFdWatcherSocketTest, RepeatedTimeOutTest) {
   ConfigureServer();
   int socket_cli_fd = ConnectClient();
   ClearTimeout();
@@ -385,6 +388,128 @@ TEST_F(AsyncFdWatcherSocketTest, RepeatedTimeOutTest) {
   CleanUpServer();
 }
 
+// Callbacks of descriptors that are ready together run by priority.
+TEST_P(AsyncFdWatcherSocketTest, DispatchByPriority) {
+  int low_fds[2];
+  int high_fds[2];
+  socketpair(AF_LOCAL, SOCK_STREAM, 0, low_fds);
+  socketpair(AF_LOCAL, SOCK_STREAM, 0, high_fds);
+  std::mutex order_mutex;
+  std::vector<int> order;
+
+  AsyncFdWatcher watcher(GetParam());
+  // Keep the thread busy so that both descriptors become ready before the
+  // next wakeup.
+  int block_fds[2];
+  socketpair(AF_LOCAL, SOCK_STREAM, 0, block_fds);
+  watcher.WatchFdForNonBlockingReads(block_fds[0], [](int fd) {
+    char read_buf[1];
+    TEMP_FAILURE_RETRY(read(fd, read_buf, sizeof(read_buf)));
+    usleep(100000);
+  });
+  auto record = [&order_mutex, &order](int id) {
+    return [&order_mutex, &order, id](int fd) {
+      char read_buf[1];
+      TEMP_FAILURE_RETRY(read(fd, read_buf, sizeof(read_buf)));
+      std::lock_guard<std::mutex> lock(order_mutex);
+      order.push_back(id);
+    };
+  };
+  watcher.WatchFdForNonBlockingReads(low_fds[0], record(0));
+  watcher.WatchFdForNonBlockingReads(high_fds[0], record(1), 1);
+
+  char buf[1] = {'1'};
+  TEMP_FAILURE_RETRY(write(block_fds[1], buf, sizeof(buf)));
+  usleep(10000);
+  TEMP_FAILURE_RETRY(write(low_fds[1], buf, sizeof(buf)));
+  TEMP_FAILURE_RETRY(write(high_fds[1], buf, sizeof(buf)));
+  usleep(300000);
+
+  watcher.StopWatchingFileDescriptors();
+  {
+    std::lock_guard<std::mutex> lock(order_mutex);
+    ASSERT_EQ(2u, order.size());
+    EXPECT_EQ(1, order[0]);
+    EXPECT_EQ(0, order[1]);
+  }
+
+  AsyncFdWatcher::Stats stats = watcher.GetStats();
+  EXPECT_EQ(3u, stats.dispatches);
+  EXPECT_LE(2u, stats.wakeups);
+  EXPECT_GE(stats.total_dispatch_latency_ns, stats.max_dispatch_latency_ns);
+  EXPECT_LT(0u, stats.max_dispatch_latency_ns);
+
+  for (int fd : {low_fds[0], low_fds[1], high_fds[0], high_fds[1],
+                 block_fds[0], block_fds[1]}) {
+    close(fd);
+  }
+}
+
+// An edge-triggered callback drains the descriptor and runs once per write.
+TEST_P(AsyncFdWatcherSocketTest, EdgeTriggeredReads) {
+  int sockfd[2];
+  socketpair(AF_LOCAL, SOCK_STREAM, 0, sockfd);
+  fcntl(sockfd[0], F_SETFL, fcntl(sockfd[0], F_GETFL) | O_NONBLOCK);
+  std::atomic<int> calls{0};
+  std::atomic<int> bytes{0};
+
+  AsyncFdWatcher watcher(GetParam());
+  watcher.WatchFdForEdgeTriggeredReads(sockfd[0], [&](int fd) {
+    char read_buf[4];
+    ssize_t n;
+    do {
+      n = TEMP_FAILURE_RETRY(read(fd, read_buf, sizeof(read_buf)));
+      if (n > 0) bytes += n;
+    } while (n > 0);
+    EXPECT_TRUE(n < 0 && errno == EAGAIN);
+    calls++;
+  });
+
+  char buf[10] = {0};
+  TEMP_FAILURE_RETRY(write(sockfd[1], buf, sizeof(buf)));
+  usleep(100000);
+  EXPECT_EQ(1, calls);
+  EXPECT_EQ(10, bytes);
+
+  TEMP_FAILURE_RETRY(write(sockfd[1], buf, sizeof(buf)));
+  usleep(100000);
+  EXPECT_EQ(2, calls);
+  EXPECT_EQ(20, bytes);
+
+  watcher.StopWatchingFileDescriptors();
+  close(sockfd[0]);
+  close(sockfd[1]);
+}
+
+// The timeout callback is counted with its latency.
+TEST_P(AsyncFdWatcherSocketTest, TimeoutStats) {
+  int sockfd[2];
+  socketpair(AF_LOCAL, SOCK_STREAM, 0, sockfd);
+  std::atomic<int> timeouts{0};
+
+  AsyncFdWatcher watcher(GetParam());
+  watcher.WatchFdForNonBlockingReads(sockfd[0], [](int) {});
+  watcher.ConfigureTimeout(std::chrono::milliseconds(50),
+                           [&timeouts]() { timeouts++; });
+  usleep(320000);
+  watcher.StopWatchingFileDescriptors();
+
+  AsyncFdWatcher::Stats stats = watcher.GetStats();
+  EXPECT_LE(4, timeouts);
+  EXPECT_EQ(static_cast<uint64_t>(timeouts.load()), stats.timeouts);
+  EXPECT_EQ(0u, stats.dispatches);
+  EXPECT_GE(stats.total_timeout_latency_ns, stats.max_timeout_latency_ns);
+  // A timeout that fires more than 20 ms late defeats its purpose.
+  EXPECT_GT(20000000u, stats.max_timeout_latency_ns);
+
+  close(sockfd[0]);
+  close(sockfd[1]);
+}
+
+INSTANTIATE_TEST_CASE_P(AsyncFdWatcherBackends, AsyncFdWatcherSocketTest,
+                        ::testing::Values(AsyncFdWatcher::Backend::SELECT,
+                                          AsyncFdWatcher::Backend::EPOLL));
+
 } // namespace implementation
 } // namespace V1_0
 } // namespace bluetooth
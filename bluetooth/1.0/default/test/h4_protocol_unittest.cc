@@ -19,13 +19,19 @@
 #include "h4_protocol.h"
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <cstdint>
 #include <cstring>
+#include <iostream>
+#include <memory>
 #include <mutex>
+#include <thread>
 #include <vector>
 
 #include <log/log.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -118,10 +124,6 @@ class H4ProtocolTest : public ::testing::Test {
     preamble[3] = length & 0xFF;
     preamble[4] = (length >> 8) & 0xFF;
 
-    ALOGD("%s writing", __func__);
-    TEMP_FAILURE_RETRY(write(fake_uart_, preamble, sizeof(preamble)));
-    TEMP_FAILURE_RETRY(write(fake_uart_, payload, strlen(payload)));
-
     ALOGD("%s waiting", __func__);
     std::mutex mutex;
     std::condition_variable done;
@@ -133,7 +135,11 @@ class H4ProtocolTest : public ::testing::Test {
     auto timeout_time =
         std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
     {
+      // Hold the lock while writing, the packet may be read before waiting.
       std::unique_lock<std::mutex> lock(mutex);
+      ALOGD("%s writing", __func__);
+      TEMP_FAILURE_RETRY(write(fake_uart_, preamble, sizeof(preamble)));
+      TEMP_FAILURE_RETRY(write(fake_uart_, payload, strlen(payload)));
       done.wait_until(lock, timeout_time);
     }
   }
@@ -143,10 +149,6 @@ class H4ProtocolTest : public ::testing::Test {
     char preamble[4] = {HCI_PACKET_TYPE_SCO_DATA, 20, 17, 0};
     preamble[3] = strlen(payload) & 0xFF;
 
-    ALOGD("%s writing", __func__);
-    TEMP_FAILURE_RETRY(write(fake_uart_, preamble, sizeof(preamble)));
-    TEMP_FAILURE_RETRY(write(fake_uart_, payload, strlen(payload)));
-
     ALOGD("%s waiting", __func__);
     std::mutex mutex;
     std::condition_variable done;
@@ -159,6 +161,9 @@ class H4ProtocolTest : public ::testing::Test {
         std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
     {
       std::unique_lock<std::mutex> lock(mutex);
+      ALOGD("%s writing", __func__);
+      TEMP_FAILURE_RETRY(write(fake_uart_, preamble, sizeof(preamble)));
+      TEMP_FAILURE_RETRY(write(fake_uart_, payload, strlen(payload)));
       done.wait_until(lock, timeout_time);
     }
   }
@@ -167,10 +172,6 @@ class H4ProtocolTest : public ::testing::Test {
     // h4 type[1] + event_code[1] + size[1]
     char preamble[3] = {HCI_PACKET_TYPE_EVENT, 9, 0};
     preamble[2] = strlen(payload) & 0xFF;
-    ALOGD("%s writing", __func__);
-    TEMP_FAILURE_RETRY(write(fake_uart_, preamble, sizeof(preamble)));
-    TEMP_FAILURE_RETRY(write(fake_uart_, payload, strlen(payload)));
-
     ALOGD("%s waiting", __func__);
     std::mutex mutex;
     std::condition_variable done;
@@ -180,6 +181,9 @@ class H4ProtocolTest : public ::testing::Test {
 
     {
       std::unique_lock<std::mutex> lock(mutex);
+      ALOGD("%s writing", __func__);
+      TEMP_FAILURE_RETRY(write(fake_uart_, preamble, sizeof(preamble)));
+      TEMP_FAILURE_RETRY(write(fake_uart_, payload, strlen(payload)));
       done.wait(lock);
     }
   }
@@ -206,6 +210,262 @@ TEST_F(H4ProtocolTest, TestReads) {
   WriteAndExpectInboundEvent(event_data);
 }
 
+// Feeds the UART byte stream to OnDataReady() directly, so that the test
+// decides how the packets are split and coalesced across reads.
+class H4ProtocolReadTest : public ::testing::Test {
+ protected:
+  struct Packet {
+    uint8_t type;
+    std::vector<uint8_t> bytes;
+  };
+
+  void SetUp() override {
+    int sockfd[2];
+    ASSERT_EQ(0, socketpair(AF_LOCAL, SOCK_STREAM, 0, sockfd));
+    protocol_fd_ = sockfd[0];
+    fake_uart_ = sockfd[1];
+    protocol_.reset(new H4Protocol(protocol_fd_,
+                                   MakeCallback(HCI_PACKET_TYPE_EVENT),
+                                   MakeCallback(HCI_PACKET_TYPE_ACL_DATA),
+                                   MakeCallback(HCI_PACKET_TYPE_SCO_DATA)));
+  }
+
+  void TearDown() override {
+    close(protocol_fd_);
+    close(fake_uart_);
+  }
+
+  hci::PacketReadCallback MakeCallback(uint8_t type) {
+    return [this, type](const hidl_vec<uint8_t>& packet) {
+      received_.push_back(
+          {type, std::vector<uint8_t>(packet.data(),
+                                      packet.data() + packet.size())});
+    };
+  }
+
+  // ACL, SCO, an event and an event without parameters, with their H4 type.
+  void MakeStream() {
+    std::vector<uint8_t> acl = {19, 92, 0, 0};
+    size_t acl_length = strlen(acl_data);
+    acl[2] = acl_length & 0xFF;
+    acl[3] = (acl_length >> 8) & 0xFF;
+    acl.insert(acl.end(), acl_data, acl_data + acl_length);
+    expected_.push_back({HCI_PACKET_TYPE_ACL_DATA, acl});
+
+    std::vector<uint8_t> sco = {20, 17, static_cast<uint8_t>(strlen(sco_data))};
+    sco.insert(sco.end(), sco_data, sco_data + strlen(sco_data));
+    expected_.push_back({HCI_PACKET_TYPE_SCO_DATA, sco});
+
+    std::vector<uint8_t> event = {9, static_cast<uint8_t>(strlen(event_data))};
+    event.insert(event.end(), event_data, event_data + strlen(event_data));
+    expected_.push_back({HCI_PACKET_TYPE_EVENT, event});
+
+    expected_.push_back({HCI_PACKET_TYPE_EVENT, {HCI_COMMAND_COMPLETE_EVENT, 0}});
+
+    for (const auto& packet : expected_) {
+      stream_.push_back(packet.type);
+      stream_.insert(stream_.end(), packet.bytes.begin(), packet.bytes.end());
+    }
+  }
+
+  void WriteAndRead(size_t begin, size_t end) {
+    ASSERT_EQ(static_cast<ssize_t>(end - begin),
+              TEMP_FAILURE_RETRY(
+                  write(fake_uart_, stream_.data() + begin, end - begin)));
+    struct pollfd pfd = {protocol_fd_, POLLIN, 0};
+    while (TEMP_FAILURE_RETRY(poll(&pfd, 1, 0)) > 0) {
+      protocol_->OnDataReady(protocol_fd_);
+    }
+  }
+
+  void ExpectReceived(size_t repeat) {
+    ASSERT_EQ(expected_.size() * repeat, received_.size());
+    for (size_t i = 0; i < received_.size(); i++) {
+      const Packet& expected = expected_[i % expected_.size()];
+      EXPECT_EQ(expected.type, received_[i].type) << "packet " << i;
+      EXPECT_EQ(expected.bytes, received_[i].bytes) << "packet " << i;
+    }
+    received_.clear();
+  }
+
+  std::unique_ptr<H4Protocol> protocol_;
+  int protocol_fd_;
+  int fake_uart_;
+  std::vector<Packet> expected_;
+  std::vector<Packet> received_;
+  std::vector<uint8_t> stream_;
+};
+
+// Several packets arriving in a single read are all dispatched.
+TEST_F(H4ProtocolReadTest, TestCoalescedReads) {
+  MakeStream();
+  size_t length = stream_.size();
+  stream_.insert(stream_.end(), stream_.begin(), stream_.end());
+  stream_.insert(stream_.end(), stream_.begin(), stream_.begin() + length);
+
+  WriteAndRead(0, stream_.size());
+  ExpectReceived(3);
+}
+
+// Packets are reassembled wherever the reads split them.
+TEST_F(H4ProtocolReadTest, TestSplitReads) {
+  MakeStream();
+
+  for (size_t split = 1; split < stream_.size(); split++) {
+    WriteAndRead(0, split);
+    WriteAndRead(split, stream_.size());
+    ExpectReceived(1);
+  }
+
+  for (size_t chunk = 1; chunk <= 7; chunk++) {
+    for (size_t begin = 0; begin < stream_.size(); begin += chunk) {
+      WriteAndRead(begin, std::min(begin + chunk, stream_.size()));
+    }
+    ExpectReceived(1);
+  }
+}
+
+// Throughput of ACL data sent back to back by the controller, through the
+// AsyncFdWatcher as in the HAL.
+TEST(H4ProtocolBenchmark, TestAclReadThroughput) {
+  constexpr int kPackets = 100000;
+  constexpr size_t kPayloadSize = 672;  // A typical A2DP media packet.
+
+  int sockfd[2];
+  ASSERT_EQ(0, socketpair(AF_LOCAL, SOCK_STREAM, 0, sockfd));
+
+  std::mutex mutex;
+  std::condition_variable done;
+  std::atomic<int> received{0};
+  auto acl_cb = [&](const hidl_vec<uint8_t>& packet) {
+    EXPECT_EQ(HCI_ACL_PREAMBLE_SIZE + kPayloadSize, packet.size());
+    if (++received == kPackets) {
+      std::unique_lock<std::mutex> lock(mutex);
+      done.notify_one();
+    }
+  };
+  auto unexpected_cb = [](const hidl_vec<uint8_t>&) { ADD_FAILURE(); };
+  H4Protocol h4_hci(sockfd[0], unexpected_cb, acl_cb, unexpected_cb);
+
+  int reads = 0;
+  async::AsyncFdWatcher fd_watcher;
+  fd_watcher.WatchFdForNonBlockingReads(sockfd[0], [&](int fd) {
+    reads++;
+    h4_hci.OnDataReady(fd);
+  });
+
+  std::vector<uint8_t> packet(1 + HCI_ACL_PREAMBLE_SIZE + kPayloadSize, 0x5a);
+  packet[0] = HCI_PACKET_TYPE_ACL_DATA;
+  uint64_t heap_allocations =
+      hci::HciPacketPool::Get().GetStats().heap_allocations;
+  packet[3] = kPayloadSize & 0xFF;
+  packet[4] = (kPayloadSize >> 8) & 0xFF;
+
+  auto start = std::chrono::steady_clock::now();
+  std::thread controller([&] {
+    for (int i = 0; i < kPackets; i++) {
+      TEMP_FAILURE_RETRY(write(sockfd[1], packet.data(), packet.size()));
+    }
+  });
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait_for(lock, std::chrono::seconds(30),
+                  [&] { return received == kPackets; });
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  controller.join();
+  fd_watcher.StopWatchingFileDescriptors();
+  close(sockfd[0]);
+  close(sockfd[1]);
+
+  ASSERT_EQ(kPackets, received.load());
+  // Every packet was received in a pool slot.
+  EXPECT_EQ(heap_allocations,
+            hci::HciPacketPool::Get().GetStats().heap_allocations);
+  std::cout << "H4Protocol: " << kPackets * 1000000LL / std::max<int64_t>(1, elapsed)
+            << " ACL packets/sec, " << static_cast<double>(reads) / kPackets
+            << " reads/packet" << std::endl;
+}
+
+// Sends ACL data from several threads, as the HIDL threads do, and checks
+// that the controller gets every packet intact. The controller side is a
+// SOCK_SEQPACKET socket, so each of its reads matches one write by the HAL.
+static void SendAclPackets(int senders) {
+  constexpr int kPacketsPerSender = 25000;
+  constexpr size_t kPayloadSize = 672;  // A typical A2DP media packet.
+  constexpr size_t kPacketSize = 1 + HCI_ACL_PREAMBLE_SIZE + kPayloadSize;
+
+  int sockfd[2];
+  ASSERT_EQ(0, socketpair(AF_LOCAL, SOCK_SEQPACKET, 0, sockfd));
+  auto unexpected_cb = [](const hidl_vec<uint8_t>&) { ADD_FAILURE(); };
+  H4Protocol h4_hci(sockfd[0], unexpected_cb, unexpected_cb, unexpected_cb);
+
+  const size_t total_packets = static_cast<size_t>(senders) * kPacketsPerSender;
+  size_t writes = 0;
+  std::vector<int> next_sequence(senders, 0);
+  std::thread controller([&] {
+    std::vector<uint8_t> buffer(256 * 1024);
+    size_t packets = 0;
+    while (packets < total_packets) {
+      ssize_t bytes_read =
+          TEMP_FAILURE_RETRY(read(sockfd[1], buffer.data(), buffer.size()));
+      ASSERT_GT(bytes_read, 0);
+      ASSERT_EQ(0u, bytes_read % kPacketSize);
+      writes++;
+      for (size_t offset = 0; offset < static_cast<size_t>(bytes_read);
+           offset += kPacketSize) {
+        const uint8_t* packet = buffer.data() + offset;
+        ASSERT_EQ(HCI_PACKET_TYPE_ACL_DATA, packet[0]);
+        int sender = packet[1];
+        ASSERT_LT(sender, senders);
+        int sequence = packet[5] | (packet[6] << 8) | (packet[7] << 16);
+        EXPECT_EQ(next_sequence[sender]++, sequence);
+        packets++;
+      }
+    }
+  });
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < senders; t++) {
+    threads.emplace_back([&h4_hci, t] {
+      std::vector<uint8_t> packet(HCI_ACL_PREAMBLE_SIZE + kPayloadSize, 0x5a);
+      packet[0] = t;
+      packet[2] = kPayloadSize & 0xFF;
+      packet[3] = (kPayloadSize >> 8) & 0xFF;
+      for (int i = 0; i < kPacketsPerSender; i++) {
+        packet[4] = i & 0xFF;
+        packet[5] = (i >> 8) & 0xFF;
+        packet[6] = (i >> 16) & 0xFF;
+        EXPECT_EQ(packet.size(), h4_hci.Send(HCI_PACKET_TYPE_ACL_DATA,
+                                             packet.data(), packet.size()));
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  controller.join();
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+  close(sockfd[0]);
+  close(sockfd[1]);
+
+  std::cout << "H4Protocol: " << senders << " senders, "
+            << total_packets * 1000000LL / std::max<int64_t>(1, elapsed)
+            << " ACL packets/sec, "
+            << static_cast<double>(writes) / total_packets
+            << " writes/packet" << std::endl;
+}
+
+TEST(H4ProtocolBenchmark, TestAclSendThroughput) {
+  SendAclPackets(1);
+  SendAclPackets(4);
+}
+
 }  // namespace implementation
 }  // namespace V1_0
 }  // namespace bluetooth
@@ -0,0 +1,120 @@
+//
+// Copyright 2017 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#define LOG_TAG "bt_hci_packet_pool_unittest"
+
+#include "hci_packet_pool.h"
+#include <gtest/gtest.h>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <log/log.h>
+#include <unistd.h>
+
+namespace android {
+namespace hardware {
+namespace bluetooth {
+namespace V1_0 {
+namespace implementation {
+
+using hci::HciPacketPool;
+
+TEST(HciPacketPoolTest, AcquireBySize) {
+  HciPacketPool pool(1, 1);
+
+  uint8_t* event = pool.Acquire(HCI_EVENT_PREAMBLE_SIZE + 0xFF);
+  uint8_t* acl = pool.Acquire(HCI_ACL_PREAMBLE_SIZE + 0xFFFF);
+  memset(event, 0, HciPacketPool::kSmallSlotSize);
+  memset(acl, 0, HciPacketPool::kLargeSlotSize);
+
+  HciPacketPool::Stats stats = pool.GetStats();
+  EXPECT_EQ(1u, stats.small_acquired);
+  EXPECT_EQ(1u, stats.large_acquired);
+  EXPECT_EQ(0u, stats.heap_allocations);
+  EXPECT_EQ(2u, stats.in_use);
+
+  // Released slots are handed out again.
+  pool.Release(event);
+  pool.Release(acl);
+  EXPECT_EQ(event, pool.Acquire(10));
+  EXPECT_EQ(acl, pool.Acquire(1000));
+  pool.Release(event);
+  pool.Release(acl);
+
+  stats = pool.GetStats();
+  EXPECT_EQ(0u, stats.in_use);
+  EXPECT_EQ(2u, stats.max_in_use);
+}
+
+TEST(HciPacketPoolTest, SmallPacketTakesLargeSlot) {
+  HciPacketPool pool(1, 1);
+
+  uint8_t* first = pool.Acquire(10);
+  uint8_t* second = pool.Acquire(10);
+  memset(second, 0, 10);
+
+  HciPacketPool::Stats stats = pool.GetStats();
+  EXPECT_EQ(1u, stats.small_acquired);
+  EXPECT_EQ(1u, stats.large_acquired);
+  EXPECT_EQ(0u, stats.heap_allocations);
+
+  pool.Release(first);
+  pool.Release(second);
+}
+
+TEST(HciPacketPoolTest, FallBackToHeap) {
+  HciPacketPool pool(0, 1);
+
+  uint8_t* acl = pool.Acquire(1000);
+  uint8_t* heap = pool.Acquire(1000);
+  ASSERT_NE(nullptr, heap);
+  memset(heap, 0, 1000);
+
+  HciPacketPool::Stats stats = pool.GetStats();
+  EXPECT_EQ(1u, stats.large_acquired);
+  EXPECT_EQ(1u, stats.heap_allocations);
+  EXPECT_EQ(2u, stats.in_use);
+
+  pool.Release(heap);
+  pool.Release(acl);
+  EXPECT_EQ(0u, pool.GetStats().in_use);
+  EXPECT_EQ(acl, pool.Acquire(1000));
+  pool.Release(acl);
+}
+
+TEST(HciPacketPoolTest, Dump) {
+  HciPacketPool pool(1, 1);
+  pool.Release(pool.Acquire(10));
+
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  pool.Dump(fds[1]);
+  close(fds[1]);
+  char buffer[512] = {0};
+  ASSERT_LT(0, TEMP_FAILURE_RETRY(read(fds[0], buffer, sizeof(buffer) - 1)));
+  close(fds[0]);
+
+  std::string dump(buffer);
+  EXPECT_NE(std::string::npos, dump.find("1 acquired"));
+  EXPECT_NE(std::string::npos, dump.find("0 heap allocations"));
+}
+
+}  // namespace implementation
+}  // namespace V1_0
+}  // namespace bluetooth
+}  // namespace hardware
+}  // namespace android
@@ -23,6 +23,9 @@
 #include <cutils/properties.h>
 #include <utils/Log.h>
 
+#include <atomic>
+#include <mutex>
+
 #include <dlfcn.h>
 #include <fcntl.h>
 
@@ -36,6 +39,10 @@ static const char* VENDOR_LIBRARY_SYMBOL_NAME =
 
 static const int INVALID_FD = -1;
 
+// In MCT mode, incoming ACL data is read before the events that are ready at
+// the same time.
+static const int ACL_READ_PRIORITY = 1;
+
 namespace {
 
 using android::hardware::bluetooth::V1_0::implementation::VendorInterface;
@@ -47,9 +54,12 @@ struct {
 } internal_command;
 
 // True when LPM is not enabled yet or wake is not asserted.
-bool lpm_wake_deasserted;
+std::atomic<bool> lpm_wake_deasserted;
 uint32_t lpm_timeout_ms;
-bool recent_activity_flag;
+std::atomic<bool> recent_activity_flag;
+// Serializes the wake transitions. Send() only takes it when it finds the
+// wake deasserted, so the per packet path stays lock free.
+std::mutex lpm_mutex;
 
 VendorInterface* g_vendor_interface = nullptr;
 
@@ -250,7 +260,7 @@ bool VendorInterface::Open(InitializeCompleteCallback initialize_complete_cb,
         fd_list[CH_EVT], [mct_hci](int fd) { mct_hci->OnEventDataReady(fd); });
     fd_watcher_.WatchFdForNonBlockingReads(
         fd_list[CH_ACL_IN],
-        [mct_hci](int fd) { mct_hci->OnAclDataReady(fd); });
+        [mct_hci](int fd) { mct_hci->OnAclDataReady(fd); }, ACL_READ_PRIORITY);
     hci_ = mct_hci;
   }
 
@@ -300,17 +310,22 @@ void VendorInterface::Close() {
 }
 
 size_t VendorInterface::Send(uint8_t type, const uint8_t* data, size_t length) {
+  // Pairs with OnTimeout(), which sets lpm_wake_deasserted before checking
+  // the activity again.
   recent_activity_flag = true;
 
-  if (lpm_wake_deasserted == true) {
-    // Restart the timer.
-    fd_watcher_.ConfigureTimeout(std::chrono::milliseconds(lpm_timeout_ms),
-                                 [this]() { OnTimeout(); });
-    // Assert wake.
-    lpm_wake_deasserted = false;
-    bt_vendor_lpm_wake_state_t wakeState = BT_VND_LPM_WAKE_ASSERT;
-    lib_interface_->op(BT_VND_OP_LPM_WAKE_SET_STATE, &wakeState);
-    ALOGV("%s: Sent wake before (%02x)", __func__, data[0] | (data[1] << 8));
+  if (lpm_wake_deasserted) {
+    std::lock_guard<std::mutex> guard(lpm_mutex);
+    if (lpm_wake_deasserted) {
+      // Restart the timer.
+      fd_watcher_.ConfigureTimeout(std::chrono::milliseconds(lpm_timeout_ms),
+                                   [this]() { OnTimeout(); });
+      // Assert wake.
+      lpm_wake_deasserted = false;
+      bt_vendor_lpm_wake_state_t wakeState = BT_VND_LPM_WAKE_ASSERT;
+      lib_interface_->op(BT_VND_OP_LPM_WAKE_SET_STATE, &wakeState);
+      ALOGV("%s: Sent wake before (%02x)", __func__, data[0] | (data[1] << 8));
+    }
   }
 
   return hci_->Send(type, data, length);
@@ -342,15 +357,20 @@ void VendorInterface::OnFirmwareConfigured(uint8_t result) {
 
 void VendorInterface::OnTimeout() {
   ALOGV("%s", __func__);
-  if (recent_activity_flag == false) {
-    lpm_wake_deasserted = true;
-    bt_vendor_lpm_wake_state_t wakeState = BT_VND_LPM_WAKE_DEASSERT;
-    lib_interface_->op(BT_VND_OP_LPM_WAKE_SET_STATE, &wakeState);
-    fd_watcher_.ConfigureTimeout(std::chrono::seconds(0), []() {
-      ALOGE("Zero timeout! Should never happen.");
-    });
+  if (recent_activity_flag.exchange(false)) return;
+
+  std::lock_guard<std::mutex> guard(lpm_mutex);
+  lpm_wake_deasserted = true;
+  if (recent_activity_flag) {
+    // A packet was sent meanwhile without waking the controller, stay awake.
+    lpm_wake_deasserted = false;
+    return;
   }
-  recent_activity_flag = false;
+  bt_vendor_lpm_wake_state_t wakeState = BT_VND_LPM_WAKE_DEASSERT;
+  lib_interface_->op(BT_VND_OP_LPM_WAKE_SET_STATE, &wakeState);
+  fd_watcher_.ConfigureTimeout(std::chrono::seconds(0), []() {
+    ALOGE("Zero timeout! Should never happen.");
+  });
 }
 
 void VendorInterface::HandleIncomingEvent(const hidl_vec<uint8_t>& hci_packet) {
@@ -34,12 +34,14 @@ namespace helper {
 class HandleImporter {
 public:
     HandleImporter();
+    virtual ~HandleImporter() = default;
 
     // In IComposer, any buffer_handle_t is owned by the caller and we need to
     // make a clone for hwcomposer2.  We also need to translate empty handle
     // to nullptr.  This function does that, in-place.
-    bool importBuffer(buffer_handle_t& handle);
-    void freeBuffer(buffer_handle_t handle);
+    // Virtual so that tests can track imported buffers without a mapper.
+    virtual bool importBuffer(buffer_handle_t& handle);
+    virtual void freeBuffer(buffer_handle_t handle);
     bool importFence(const native_handle_t* handle, int& fd) const;
     void closeFence(int fd) const;
 
@@ -17,7 +17,9 @@
 #define LOG_TAG "CamDevSession@3.2-impl"
 #include <android/log.h>
 
+#include <algorithm>
 #include <set>
+#include <cutils/properties.h>
 #include <utils/Trace.h>
 #include <hardware/gralloc.h>
 #include <hardware/gralloc1.h>
@@ -34,8 +36,14 @@ namespace implementation {
 static constexpr size_t CAMERA_REQUEST_METADATA_QUEUE_SIZE = 1 << 20 /* 1MB */;
 // Size of result metadata fast message queue. Change to 0 to always use hwbinder buffer.
 static constexpr size_t CAMERA_RESULT_METADATA_QUEUE_SIZE  = 1 << 20 /* 1MB */;
+// Inflight frame ring depth used when the HAL doesn't report ANDROID_REQUEST_PIPELINE_MAX_DEPTH.
+static constexpr uint32_t DEFAULT_PIPELINE_MAX_DEPTH = 8;
+// Max number of queued results merged into one processCaptureResult call. Override with the
+// persist.camera.max_coalesced_results property; 1 disables coalescing.
+static constexpr int32_t DEFAULT_MAX_COALESCED_RESULTS = 4;
 
 HandleImporter CameraDeviceSession::sHandleImporter;
+HandleImporter* CameraDeviceSession::sBufferImporter = &CameraDeviceSession::sHandleImporter;
 const int CameraDeviceSession::ResultBatcher::NOT_BATCHED;
 
 CameraDeviceSession::CameraDeviceSession(
@@ -48,6 +56,7 @@ CameraDeviceSession::CameraDeviceSession(
         mIsAELockAvailable(false),
         mDerivePostRawSensKey(false),
         mNumPartialResults(1),
+        mPipelineMaxDepth(DEFAULT_PIPELINE_MAX_DEPTH),
         mResultBatcher(callback) {
 
     mDeviceInfo = deviceInfo;
@@ -57,6 +66,14 @@ CameraDeviceSession::CameraDeviceSession(
         mNumPartialResults = partialResultsCount.data.i32[0];
     }
     mResultBatcher.setNumPartialResults(mNumPartialResults);
+    mResultBatcher.setMaxCoalescedResults(property_get_int32(
+            "persist.camera.max_coalesced_results", DEFAULT_MAX_COALESCED_RESULTS));
+
+    camera_metadata_entry pipelineMaxDepth =
+            mDeviceInfo.find(ANDROID_REQUEST_PIPELINE_MAX_DEPTH);
+    if (pipelineMaxDepth.count > 0 && pipelineMaxDepth.data.u8[0] > 0) {
+        mPipelineMaxDepth = pipelineMaxDepth.data.u8[0];
+    }
 
     camera_metadata_entry aeLockAvailableEntry = mDeviceInfo.find(
             ANDROID_CONTROL_AE_LOCK_AVAILABLE);
@@ -145,6 +162,7 @@ void CameraDeviceSession::dumpState(const native_handle_t* fd) {
     if (!isClosed()) {
         mDevice->ops->dump(mDevice, fd->data[0]);
     }
+    mResultBatcher.dump(fd->data[0]);
 }
 
 /**
@@ -164,6 +182,15 @@ bool CameraDeviceSession::handleAePrecaptureCancelRequestLocked(
         return false;
     }
 
+    // Only copy the settings when they actually need to be overridden
+    camera_metadata_ro_entry_t requestTrigger;
+    if (find_camera_metadata_ro_entry(halRequest.settings,
+            ANDROID_CONTROL_AE_PRECAPTURE_TRIGGER, &requestTrigger) != OK ||
+            requestTrigger.count == 0 ||
+            requestTrigger.data.u8[0] != ANDROID_CONTROL_AE_PRECAPTURE_TRIGGER_CANCEL) {
+        return false;
+    }
+
     settings->clear();
     settings->append(halRequest.settings);
     camera_metadata_entry_t aePrecaptureTrigger =
@@ -249,25 +276,36 @@ Status CameraDeviceSession::importRequest(
     }
 
     for (size_t i = 0; i < numBufs; i++) {
+        auto streamIt = mStreamMap.find(streamIds[i]);
+        if (streamIt == mStreamMap.end()) {
+            ALOGE("%s: stream %d is not configured!", __FUNCTION__, streamIds[i]);
+            return Status::ILLEGAL_ARGUMENT;
+        }
+        int slot = streamIt->second.mSlot;
+        if (slot < 0 || static_cast<size_t>(slot) >= mCirculatingBuffers.size()) {
+            ALOGE("%s: stream %d has no buffer cache!", __FUNCTION__, streamIds[i]);
+            return Status::INTERNAL_ERROR;
+        }
         buffer_handle_t buf = allBufs[i];
         uint64_t bufId = allBufIds[i];
-        CirculatingBuffers& cbs = mCirculatingBuffers[streamIds[i]];
-        if (cbs.count(bufId) == 0) {
+        CirculatingBuffers& cbs = mCirculatingBuffers[slot];
+        buffer_handle_t* cachedBuf = cbs.find(bufId);
+        if (cachedBuf == nullptr) {
             if (buf == nullptr) {
                 ALOGE("%s: bufferId %" PRIu64 " has null buffer handle!", __FUNCTION__, bufId);
                 return Status::ILLEGAL_ARGUMENT;
             }
             // Register a newly seen buffer
             buffer_handle_t importedBuf = buf;
-            sHandleImporter.importBuffer(importedBuf);
+            sBufferImporter->importBuffer(importedBuf);
             if (importedBuf == nullptr) {
                 ALOGE("%s: output buffer %zu is invalid!", __FUNCTION__, i);
                 return Status::INTERNAL_ERROR;
             } else {
-                cbs[bufId] = importedBuf;
+                cachedBuf = cbs.add(bufId, importedBuf);
             }
         }
-        allBufPtrs[i] = &cbs[bufId];
+        allBufPtrs[i] = cachedBuf;
     }
 
     // All buffers are imported. Now validate output buffer acquire fences
@@ -292,6 +330,30 @@ Status CameraDeviceSession::importRequest(
     return Status::OK;
 }
 
+bool CameraDeviceSession::readFmqSettings(
+        size_t size, const camera_metadata_t** settings /*out*/) {
+    // non-blocking read; client must write metadata before calling
+    // processOneCaptureRequest
+    mFmqSettingsScratch.resize(size);
+    if (!mRequestMetadataQueue->read(mFmqSettingsScratch.data(), size)) {
+        ALOGE("%s: capture request settings metadata couldn't be read from fmq!", __FUNCTION__);
+        return false;
+    }
+
+    // Repeating requests usually carry the same settings as the previous one, which has
+    // already been validated
+    if (mFmqSettingsValid && mFmqSettingsScratch == mFmqSettings) {
+        *settings = reinterpret_cast<const camera_metadata_t*>(mFmqSettings.data());
+        return true;
+    }
+
+    std::swap(mFmqSettings, mFmqSettingsScratch);
+    CameraMetadata hidlSettings;
+    hidlSettings.setToExternal(mFmqSettings.data(), mFmqSettings.size());
+    mFmqSettingsValid = convertFromHidl(hidlSettings, settings);
+    return mFmqSettingsValid;
+}
+
 void CameraDeviceSession::cleanupInflightFences(
         hidl_vec<int>& allFences, size_t numFences) {
     for (size_t j = 0; j < numFences; j++) {
@@ -299,8 +361,353 @@ void CameraDeviceSession::cleanupInflightFences(
     }
 }
 
+void CameraDeviceSession::InflightFrames::configure(size_t depth, size_t numSlots) {
+    Frame frame;
+    frame.mBuffers.resize(numSlots);
+    mNumSlots = numSlots;
+    mRing.assign(depth, frame);
+    mOverflow.clear();
+    mNumBuffers = 0;
+    mNumAETriggerOverrides = 0;
+    mNumRawBoostPresent = 0;
+}
+
+CameraDeviceSession::InflightFrames::Frame* CameraDeviceSession::InflightFrames::find(
+        uint32_t frameNumber) {
+    if (!mRing.empty()) {
+        Frame& frame = mRing[frameNumber % mRing.size()];
+        if (frame.inUse() && frame.mFrameNumber == frameNumber) {
+            return &frame;
+        }
+    }
+    if (mOverflow.empty()) {
+        return nullptr;
+    }
+    auto it = mOverflow.find(frameNumber);
+    return (it != mOverflow.end()) ? &it->second : nullptr;
+}
+
+CameraDeviceSession::InflightFrames::Frame* CameraDeviceSession::InflightFrames::findOrAdd(
+        uint32_t frameNumber) {
+    Frame* frame = find(frameNumber);
+    if (frame != nullptr) {
+        return frame;
+    }
+    if (!mRing.empty()) {
+        Frame& ringFrame = mRing[frameNumber % mRing.size()];
+        if (!ringFrame.inUse()) {
+            ringFrame.mFrameNumber = frameNumber;
+            return &ringFrame;
+        }
+    }
+    ALOGV("%s: frame %u does not fit in inflight ring of depth %zu",
+            __FUNCTION__, frameNumber, mRing.size());
+    Frame& overflowFrame = mOverflow[frameNumber];
+    overflowFrame.mFrameNumber = frameNumber;
+    overflowFrame.mBuffers.resize(mNumSlots);
+    return &overflowFrame;
+}
+
+void CameraDeviceSession::InflightFrames::releaseIfUnused(Frame* frame) {
+    // A frame number is either in the ring or in the overflow map, never both
+    if (!frame->inUse() && !mOverflow.empty()) {
+        mOverflow.erase(frame->mFrameNumber);
+    }
+}
+
+camera3_stream_buffer_t* CameraDeviceSession::InflightFrames::addBuffer(
+        uint32_t frameNumber, int slot) {
+    if (slot < 0 || static_cast<size_t>(slot) >= mNumSlots) {
+        return nullptr;
+    }
+    Frame* frame = findOrAdd(frameNumber);
+    Buffer& buffer = frame->mBuffers[slot];
+    if (!buffer.mInflight) {
+        buffer.mInflight = true;
+        frame->mNumBuffers++;
+        mNumBuffers++;
+    }
+    buffer.mBuffer = camera3_stream_buffer_t{};
+    return &buffer.mBuffer;
+}
+
+bool CameraDeviceSession::InflightFrames::hasBuffer(uint32_t frameNumber, int slot) {
+    if (slot < 0 || static_cast<size_t>(slot) >= mNumSlots) {
+        return false;
+    }
+    Frame* frame = find(frameNumber);
+    return frame != nullptr && frame->mBuffers[slot].mInflight;
+}
+
+void CameraDeviceSession::InflightFrames::removeBuffer(uint32_t frameNumber, int slot) {
+    if (slot < 0 || static_cast<size_t>(slot) >= mNumSlots) {
+        return;
+    }
+    Frame* frame = find(frameNumber);
+    if (frame == nullptr || !frame->mBuffers[slot].mInflight) {
+        return;
+    }
+    frame->mBuffers[slot].mInflight = false;
+    frame->mNumBuffers--;
+    mNumBuffers--;
+    releaseIfUnused(frame);
+}
+
+void CameraDeviceSession::InflightFrames::setAETriggerOverride(
+        uint32_t frameNumber, const AETriggerCancelOverride& override) {
+    Frame* frame = findOrAdd(frameNumber);
+    if (!frame->mHasAETriggerOverride) {
+        frame->mHasAETriggerOverride = true;
+        mNumAETriggerOverrides++;
+    }
+    frame->mAETriggerOverride = override;
+}
+
+const CameraDeviceSession::AETriggerCancelOverride*
+CameraDeviceSession::InflightFrames::getAETriggerOverride(uint32_t frameNumber) {
+    Frame* frame = find(frameNumber);
+    if (frame == nullptr || !frame->mHasAETriggerOverride) {
+        return nullptr;
+    }
+    return &frame->mAETriggerOverride;
+}
+
+void CameraDeviceSession::InflightFrames::removeAETriggerOverride(uint32_t frameNumber) {
+    Frame* frame = find(frameNumber);
+    if (frame == nullptr || !frame->mHasAETriggerOverride) {
+        return;
+    }
+    frame->mHasAETriggerOverride = false;
+    mNumAETriggerOverrides--;
+    releaseIfUnused(frame);
+}
+
+void CameraDeviceSession::InflightFrames::setRawBoostPresent(
+        uint32_t frameNumber, bool present) {
+    Frame* frame = findOrAdd(frameNumber);
+    if (!frame->mHasRawBoostPresent) {
+        frame->mHasRawBoostPresent = true;
+        mNumRawBoostPresent++;
+    }
+    frame->mRawBoostPresent = present;
+}
+
+bool CameraDeviceSession::InflightFrames::getRawBoostPresent(
+        uint32_t frameNumber, bool* present /*out*/) {
+    Frame* frame = find(frameNumber);
+    if (frame == nullptr || !frame->mHasRawBoostPresent) {
+        return false;
+    }
+    *present = frame->mRawBoostPresent;
+    return true;
+}
+
+void CameraDeviceSession::InflightFrames::removeRawBoostPresent(uint32_t frameNumber) {
+    Frame* frame = find(frameNumber);
+    if (frame == nullptr || !frame->mHasRawBoostPresent) {
+        return;
+    }
+    frame->mHasRawBoostPresent = false;
+    mNumRawBoostPresent--;
+    releaseIfUnused(frame);
+}
+
+buffer_handle_t* CameraDeviceSession::CirculatingBuffers::find(uint64_t bufferId) {
+    for (auto& entry : mEntries) {
+        if (entry.mBufferId == bufferId && entry.mGeneration == mGeneration) {
+            return &entry.mHandle;
+        }
+    }
+    return nullptr;
+}
+
+buffer_handle_t* CameraDeviceSession::CirculatingBuffers::add(
+        uint64_t bufferId, buffer_handle_t handle) {
+    Entry* freeEntry = nullptr;
+    for (auto& entry : mEntries) {
+        if (entry.mGeneration != mGeneration) {
+            freeEntry = &entry;
+            break;
+        }
+    }
+    if (freeEntry == nullptr) {
+        mEntries.push_back(Entry{});
+        freeEntry = &mEntries.back();
+    }
+    *freeEntry = Entry{bufferId, mGeneration, handle};
+    mSize++;
+    return &freeEntry->mHandle;
+}
+
+bool CameraDeviceSession::CirculatingBuffers::remove(uint64_t bufferId) {
+    for (auto& entry : mEntries) {
+        if (entry.mBufferId == bufferId && entry.mGeneration == mGeneration) {
+            sBufferImporter->freeBuffer(entry.mHandle);
+            entry.mGeneration = 0;
+            mSize--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void CameraDeviceSession::CirculatingBuffers::clear() {
+    if (mSize > 0) {
+        for (auto& entry : mEntries) {
+            if (entry.mGeneration == mGeneration) {
+                sBufferImporter->freeBuffer(entry.mHandle);
+            }
+        }
+    }
+    // Invalidates all entries while keeping their storage for reuse
+    mGeneration++;
+    mSize = 0;
+}
+
 CameraDeviceSession::ResultBatcher::ResultBatcher(
-        const sp<ICameraDeviceCallback>& callback) : mCallback(callback) {};
+        const sp<ICameraDeviceCallback>& callback) :
+        mCallback(callback),
+        mMaxCoalescedResults(DEFAULT_MAX_COALESCED_RESULTS),
+        mDeliveryThread(&ResultBatcher::deliveryLoop, this) {}
+
+CameraDeviceSession::ResultBatcher::~ResultBatcher() {
+    {
+        Mutex::Autolock _l(mDeliveryLock);
+        mExitDelivery = true;
+        mDeliveryCond.broadcast();
+    }
+    // deliveryLoop drains the queue before exiting
+    mDeliveryThread.join();
+}
+
+void CameraDeviceSession::ResultBatcher::setMaxCoalescedResults(size_t n) {
+    Mutex::Autolock _l(mDeliveryLock);
+    mMaxCoalescedResults = std::max<size_t>(n, 1);
+}
+
+void CameraDeviceSession::ResultBatcher::LatencyStats::add(nsecs_t latency) {
+    mCount++;
+    mTotal += latency;
+    mMax = std::max(mMax, latency);
+}
+
+void CameraDeviceSession::ResultBatcher::LatencyStats::dump(int fd, const char* name) const {
+    dprintf(fd, "    %s: count %" PRIu64 ", avg %" PRId64 " us, max %" PRId64 " us\n",
+            name, mCount, (mCount > 0) ? ns2us(mTotal / static_cast<nsecs_t>(mCount)) : 0,
+            ns2us(mMax));
+}
+
+void CameraDeviceSession::ResultBatcher::dump(int fd) {
+    Mutex::Autolock _l(mDeliveryLock);
+    dprintf(fd, "  Result delivery: %zu queued, %" PRIu64 " items in %" PRIu64
+            " calls, max coalesced %zu\n", mDeliveryQueue.size(), mNumDeliveredItems,
+            mNumDeliveryCalls, mMaxCoalescedResults);
+    mAssemblyLatency.dump(fd, "assembly");
+    mQueueLatency.dump(fd, "queue");
+    mDeliveryLatency.dump(fd, "delivery");
+}
+
+void CameraDeviceSession::ResultBatcher::recordAssembly(nsecs_t start) {
+    nsecs_t latency = systemTime() - start;
+    Mutex::Autolock _l(mDeliveryLock);
+    mAssemblyLatency.add(latency);
+}
+
+void CameraDeviceSession::ResultBatcher::queueDelivery(Delivery&& delivery) {
+    Mutex::Autolock _l(mDeliveryLock);
+    delivery.mQueuedTime = systemTime();
+    mDeliveryQueue.push_back(std::move(delivery));
+    mDeliveryCond.signal();
+}
+
+void CameraDeviceSession::ResultBatcher::waitForDelivery() {
+    Mutex::Autolock _l(mDeliveryLock);
+    while (!mDeliveryQueue.empty() || mDelivering) {
+        mDeliveryDoneCond.wait(mDeliveryLock);
+    }
+}
+
+void CameraDeviceSession::ResultBatcher::deliveryLoop() {
+    std::vector<Delivery> deliveries;
+    Mutex::Autolock _l(mDeliveryLock);
+    while (true) {
+        while (mDeliveryQueue.empty() && !mExitDelivery) {
+            mDeliveryCond.wait(mDeliveryLock);
+        }
+        if (mDeliveryQueue.empty()) {
+            break;
+        }
+
+        // Take the first entry plus any following entries of the same kind, up to
+        // mMaxCoalescedResults items
+        nsecs_t now = systemTime();
+        bool isNotify = mDeliveryQueue.front().mIsNotify;
+        size_t numItems = 0;
+        deliveries.clear();
+        while (!mDeliveryQueue.empty() && mDeliveryQueue.front().mIsNotify == isNotify) {
+            const Delivery& next = mDeliveryQueue.front();
+            size_t n = isNotify ? next.mMsgs.size() : next.mResults.size();
+            if (numItems > 0 && numItems + n > mMaxCoalescedResults) {
+                break;
+            }
+            mQueueLatency.add(now - next.mQueuedTime);
+            numItems += n;
+            deliveries.push_back(std::move(mDeliveryQueue.front()));
+            mDeliveryQueue.pop_front();
+        }
+        mDelivering = true;
+
+        mDeliveryLock.unlock();
+        nsecs_t start = systemTime();
+        if (isNotify) {
+            if (deliveries.size() == 1) {
+                invokeNotifyCallback(deliveries[0].mMsgs);
+            } else {
+                hidl_vec<NotifyMsg> msgs;
+                msgs.resize(numItems);
+                size_t i = 0;
+                for (auto& delivery : deliveries) {
+                    for (auto& msg : delivery.mMsgs) {
+                        msgs[i++] = msg;
+                    }
+                }
+                invokeNotifyCallback(msgs);
+            }
+        } else {
+            if (deliveries.size() == 1) {
+                invokeProcessCaptureResultCallback(
+                        deliveries[0].mResults, deliveries[0].mTryWriteFmq);
+                freeReleaseFences(deliveries[0].mResults);
+            } else {
+                // Each entry decides separately whether its metadata may go through the fmq
+                hidl_vec<CaptureResult> results;
+                results.resize(numItems);
+                size_t i = 0;
+                for (auto& delivery : deliveries) {
+                    if (delivery.mTryWriteFmq) {
+                        writeResultMetadataToFmq(delivery.mResults);
+                    }
+                    for (auto& result : delivery.mResults) {
+                        results[i++] = std::move(result);
+                    }
+                }
+                invokeProcessCaptureResultCallback(results, /* tryWriteFmq */false);
+                freeReleaseFences(results);
+            }
+        }
+        nsecs_t end = systemTime();
+        deliveries.clear();
+        mDeliveryLock.lock();
+
+        mDeliveryLatency.add(end - start);
+        mNumDeliveryCalls++;
+        mNumDeliveredItems += numItems;
+        mDelivering = false;
+        if (mDeliveryQueue.empty()) {
+            mDeliveryDoneCond.broadcast();
+        }
+    }
+}
 
 bool CameraDeviceSession::ResultBatcher::InflightBatch::allDelivered() const {
     if (!mShutterDelivered) return false;
@@ -393,7 +800,7 @@ void CameraDeviceSession::ResultBatcher::sendBatchShutterCbsLocked(std::shared_p
         return;
     }
 
-    mCallback->notify(batch->mShutterMsgs);
+    queueNotify(hidl_vec<NotifyMsg>(batch->mShutterMsgs));
     batch->mShutterDelivered = true;
     batch->mShutterMsgs.clear();
 }
@@ -508,8 +915,7 @@ void CameraDeviceSession::ResultBatcher::sendBatchBuffersLocked(
             moveStreamBuffer(std::move(outBufs[j]), results[i].outputBuffers[j]);
         }
     }
-    invokeProcessCaptureResultCallback(results, /* tryWriteFmq */false);
-    freeReleaseFences(results);
+    queueResults(std::move(results), /* tryWriteFmq */false);
     for (int streamId : streams) {
         auto it = batch->mBatchBufs.find(streamId);
         if (it == batch->mBatchBufs.end()) {
@@ -553,8 +959,11 @@ void CameraDeviceSession::ResultBatcher::sendBatchMetadataLocked(
         mb.mMds.clear();
     }
     hidl_vec<CaptureResult> hResults;
-    hResults.setToExternal(results.data(), results.size());
-    invokeProcessCaptureResultCallback(hResults, /* tryWriteFmq */true);
+    hResults.resize(results.size());
+    for (size_t i = 0; i < results.size(); i++) {
+        hResults[i] = std::move(results[i]);
+    }
+    queueResults(std::move(hResults), /* tryWriteFmq */true);
     batch->mPartialResultProgress = lastPartialResultIdx;
     for (uint32_t partialIdx : toBeRemovedIdxes) {
         batch->mResultMds.erase(partialIdx);
@@ -562,11 +971,17 @@ void CameraDeviceSession::ResultBatcher::sendBatchMetadataLocked(
 }
 
 void CameraDeviceSession::ResultBatcher::notifySingleMsg(NotifyMsg& msg) {
-    mCallback->notify({msg});
+    queueNotify({msg});
     return;
 }
 
 void CameraDeviceSession::ResultBatcher::notify(NotifyMsg& msg) {
+    nsecs_t start = systemTime();
+    batchNotify(msg);
+    recordAssembly(start);
+}
+
+void CameraDeviceSession::ResultBatcher::batchNotify(NotifyMsg& msg) {
     uint32_t frameNumber;
     if (CC_LIKELY(msg.type == MsgType::SHUTTER)) {
         frameNumber = msg.msg.shutter.frameNumber;
@@ -627,17 +1042,9 @@ void CameraDeviceSession::ResultBatcher::notify(NotifyMsg& msg) {
     }
 }
 
-void CameraDeviceSession::ResultBatcher::invokeProcessCaptureResultCallback(
-        hidl_vec<CaptureResult> &results, bool tryWriteFmq) {
-    if (mProcessCaptureResultLock.tryLock() != OK) {
-        ALOGV("%s: previous call is not finished! waiting 1s...", __FUNCTION__);
-        if (mProcessCaptureResultLock.timedLock(1000000000 /* 1s */) != OK) {
-            ALOGE("%s: cannot acquire lock in 1s, cannot proceed",
-                    __FUNCTION__);
-            return;
-        }
-    }
-    if (tryWriteFmq && mResultMetadataQueue->availableToWrite() > 0) {
+void CameraDeviceSession::ResultBatcher::writeResultMetadataToFmq(
+        hidl_vec<CaptureResult> &results) {
+    if (mResultMetadataQueue->availableToWrite() > 0) {
         for (CaptureResult &result : results) {
             if (result.result.size() > 0) {
                 if (mResultMetadataQueue->write(result.result.data(), result.result.size())) {
@@ -650,20 +1057,63 @@ void CameraDeviceSession::ResultBatcher::invokeProcessCaptureResultCallback(
             }
         }
     }
+}
+
+// Only called from deliveryLoop
+void CameraDeviceSession::ResultBatcher::invokeProcessCaptureResultCallback(
+        hidl_vec<CaptureResult> &results, bool tryWriteFmq) {
+    if (tryWriteFmq) {
+        writeResultMetadataToFmq(results);
+    }
+    ATRACE_BEGIN("processCaptureResult callback");
     mCallback->processCaptureResult(results);
-    mProcessCaptureResultLock.unlock();
+    ATRACE_END();
+}
+
+// Only called from deliveryLoop
+void CameraDeviceSession::ResultBatcher::invokeNotifyCallback(hidl_vec<NotifyMsg> &msgs) {
+    ATRACE_BEGIN("notify callback");
+    mCallback->notify(msgs);
+    ATRACE_END();
+}
+
+void CameraDeviceSession::ResultBatcher::queueResults(
+        hidl_vec<CaptureResult>&& results, bool tryWriteFmq) {
+    Delivery delivery;
+    delivery.mIsNotify = false;
+    delivery.mResults = std::move(results);
+    delivery.mTryWriteFmq = tryWriteFmq;
+    queueDelivery(std::move(delivery));
+}
+
+void CameraDeviceSession::ResultBatcher::queueNotify(hidl_vec<NotifyMsg>&& msgs) {
+    Delivery delivery;
+    delivery.mIsNotify = true;
+    delivery.mMsgs = std::move(msgs);
+    delivery.mTryWriteFmq = false;
+    queueDelivery(std::move(delivery));
 }
 
 void CameraDeviceSession::ResultBatcher::processOneCaptureResult(CaptureResult& result) {
+    // result.result usually wraps memory owned by the HAL (or mOverridenResult), which is
+    // only valid until process_capture_result returns, so the delivery thread needs its own
+    // copy. The copy constructor of hidl_vec always allocates an owned buffer.
+    CameraMetadata ownedMetadata(result.result);
     hidl_vec<CaptureResult> results;
     results.resize(1);
     results[0] = std::move(result);
-    invokeProcessCaptureResultCallback(results, /* tryWriteFmq */true);
-    freeReleaseFences(results);
+    results[0].result = std::move(ownedMetadata);
+    queueResults(std::move(results), /* tryWriteFmq */true);
     return;
 }
 
 void CameraDeviceSession::ResultBatcher::processCaptureResult(CaptureResult& result) {
+    nsecs_t start = systemTime();
+    batchCaptureResult(result);
+    recordAssembly(start);
+}
+
+void CameraDeviceSession::ResultBatcher::batchCaptureResult(CaptureResult& result) {
     auto pair = getBatch(result.frameNumber);
     int batchIdx = pair.first;
     if (batchIdx == NOT_BATCHED) {
@@ -809,25 +1259,25 @@ Return<void> CameraDeviceSession::configureStreams(
     // hold the inflight lock for entire configureStreams scope since there must not be any
     // inflight request/results during stream configuration.
     Mutex::Autolock _l(mInflightLock);
-    if (!mInflightBuffers.empty()) {
+    if (mInflightFrames.numBuffers() > 0) {
         ALOGE("%s: trying to configureStreams while there are still %zu inflight buffers!",
-                __FUNCTION__, mInflightBuffers.size());
+                __FUNCTION__, mInflightFrames.numBuffers());
         _hidl_cb(Status::INTERNAL_ERROR, outStreams);
         return Void();
     }
 
-    if (!mInflightAETriggerOverrides.empty()) {
+    if (mInflightFrames.numAETriggerOverrides() > 0) {
         ALOGE("%s: trying to configureStreams while there are still %zu inflight"
                 " trigger overrides!", __FUNCTION__,
-                mInflightAETriggerOverrides.size());
+                mInflightFrames.numAETriggerOverrides());
         _hidl_cb(Status::INTERNAL_ERROR, outStreams);
         return Void();
     }
 
-    if (!mInflightRawBoostPresent.empty()) {
+    if (mInflightFrames.numRawBoostPresent() > 0) {
         ALOGE("%s: trying to configureStreams while there are still %zu inflight"
                 " boost overrides!", __FUNCTION__,
-                mInflightRawBoostPresent.size());
+                mInflightFrames.numRawBoostPresent());
         _hidl_cb(Status::INTERNAL_ERROR, outStreams);
         return Void();
     }
@@ -844,6 +1294,8 @@ Return<void> CameraDeviceSession::configureStreams(
     stream_list.num_streams = requestedConfiguration.streams.size();
     streams.resize(stream_list.num_streams);
     stream_list.streams = streams.data();
+    // Streams added by this call, which have no slot until updateStreamSlotsLocked
+    std::vector<int> addedStreamIds;
 
     for (uint32_t i = 0; i < stream_list.num_streams; i++) {
         int id = requestedConfiguration.streams[i].id;
@@ -852,9 +1304,9 @@ Return<void> CameraDeviceSession::configureStreams(
             Camera3Stream stream;
             convertFromHidl(requestedConfiguration.streams[i], &stream);
             mStreamMap[id] = stream;
+            addedStreamIds.push_back(id);
             mStreamMap[id].data_space = mapToLegacyDataspace(
                     mStreamMap[id].data_space);
-            mCirculatingBuffers.emplace(stream.mId, CirculatingBuffers{});
         } else {
             // width/height/format must not change, but usage/rotation might need to change
             if (mStreamMap[id].stream_type !=
@@ -866,6 +1318,11 @@ Return<void> CameraDeviceSession::configureStreams(
                             mapToLegacyDataspace( static_cast<android_dataspace_t> (
                                     requestedConfiguration.streams[i].dataSpace))) {
                 ALOGE("%s: stream %d configuration changed!", __FUNCTION__, id);
+                // The HAL has not seen the new streams yet, drop them so that no stream is
+                // left without a slot
+                for (int addedId : addedStreamIds) {
+                    mStreamMap.erase(addedId);
+                }
                 _hidl_cb(Status::INTERNAL_ERROR, outStreams);
                 return Void();
             }
@@ -917,6 +1374,10 @@ Return<void> CameraDeviceSession::configureStreams(
         mResultBatcher.setBatchedStreams(mVideoStreamIds);
     }
 
+    // This is also needed when configure_streams failed, since new streams were added to
+    // mStreamMap.
+    updateStreamSlotsLocked();
+
     if (ret == -EINVAL) {
         status = Status::ILLEGAL_ARGUMENT;
     } else if (ret != OK) {
@@ -931,27 +1392,63 @@ Return<void> CameraDeviceSession::configureStreams(
 
 // Needs to get called after acquiring 'mInflightLock'
 void CameraDeviceSession::cleanupBuffersLocked(int id) {
-    for (auto& pair : mCirculatingBuffers.at(id)) {
-        sHandleImporter.freeBuffer(pair.second);
+    int slot = mStreamMap.at(id).mSlot;
+    if (slot < 0 || static_cast<size_t>(slot) >= mCirculatingBuffers.size()) {
+        // Stream was never given a slot, so nothing was cached for it
+        return;
+    }
+    mCirculatingBuffers[slot].clear();
+}
+
+// Needs to get called after acquiring 'mInflightLock', with nothing inflight
+void CameraDeviceSession::updateStreamSlotsLocked() {
+    // Existing streams take their buffer cache along to the new slot. New streams recycle the
+    // caches of deleted streams, which cleanupBuffersLocked has already cleared.
+    std::vector<CirculatingBuffers> circulatingBuffers(mStreamMap.size());
+    std::vector<bool> reused(mCirculatingBuffers.size(), false);
+    std::vector<int> newSlots;
+    size_t depth = mPipelineMaxDepth;
+    int slot = 0;
+    for (auto& pair : mStreamMap) {
+        Camera3Stream& stream = pair.second;
+        if (stream.mSlot >= 0) {
+            circulatingBuffers[slot] = std::move(mCirculatingBuffers[stream.mSlot]);
+            reused[stream.mSlot] = true;
+        } else {
+            newSlots.push_back(slot);
+        }
+        stream.mSlot = slot++;
+        depth = std::max<size_t>(depth, stream.max_buffers);
+    }
+    size_t oldSlot = 0;
+    for (int newSlot : newSlots) {
+        while (oldSlot < reused.size() && reused[oldSlot]) {
+            oldSlot++;
+        }
+        if (oldSlot == reused.size()) {
+            break;
+        }
+        circulatingBuffers[newSlot] = std::move(mCirculatingBuffers[oldSlot++]);
     }
-    mCirculatingBuffers[id].clear();
-    mCirculatingBuffers.erase(id);
+    mCirculatingBuffers = std::move(circulatingBuffers);
+
+    mInflightFrames.configure(depth, mStreamMap.size());
 }
 
 void CameraDeviceSession::updateBufferCaches(const hidl_vec<BufferCache>& cachesToRemove) {
     Mutex::Autolock _l(mInflightLock);
     for (auto& cache : cachesToRemove) {
-        auto cbsIt = mCirculatingBuffers.find(cache.streamId);
-        if (cbsIt == mCirculatingBuffers.end()) {
+        auto streamIt = mStreamMap.find(cache.streamId);
+        if (streamIt == mStreamMap.end()) {
             // The stream could have been removed
             continue;
         }
-        CirculatingBuffers& cbs = cbsIt->second;
-        auto it = cbs.find(cache.bufferId);
-        if (it != cbs.end()) {
-            sHandleImporter.freeBuffer(it->second);
-            cbs.erase(it);
-        } else {
+        int slot = streamIt->second.mSlot;
+        if (slot < 0 || static_cast<size_t>(slot) >= mCirculatingBuffers.size()) {
+            continue;
+        }
+        CirculatingBuffers& cbs = mCirculatingBuffers[slot];
+        if (!cbs.remove(cache.bufferId)) {
             ALOGE("%s: stream %d buffer %" PRIu64 " is not cached",
                     __FUNCTION__, cache.streamId, cache.bufferId);
         }
@@ -1004,18 +1501,8 @@ Status CameraDeviceSession::processOneCaptureRequest(const CaptureRequest& reque
     halRequest.frame_number = request.frameNumber;
 
     bool converted = true;
-    CameraMetadata settingsFmq;  // settings from FMQ
     if (request.fmqSettingsSize > 0) {
-        // non-blocking read; client must write metadata before calling
-        // processOneCaptureRequest
-        settingsFmq.resize(request.fmqSettingsSize);
-        bool read = mRequestMetadataQueue->read(settingsFmq.data(), request.fmqSettingsSize);
-        if (read) {
-            converted = convertFromHidl(settingsFmq, &halRequest.settings);
-        } else {
-            ALOGE("%s: capture request settings metadata couldn't be read from fmq!", __FUNCTION__);
-            converted = false;
-        }
+        converted = readFmqSettings(request.fmqSettingsSize, &halRequest.settings);
     } else {
         converted = convertFromHidl(request.settings, &halRequest.settings);
     }
@@ -1042,27 +1529,48 @@ Status CameraDeviceSession::processOneCaptureRequest(const CaptureRequest& reque
     ::android::hardware::camera::common::V1_0::helper::CameraMetadata settingsOverride;
     {
         Mutex::Autolock _l(mInflightLock);
+        // importRequest has checked that all streams are configured
         if (hasInputBuf) {
-            auto key = std::make_pair(request.inputBuffer.streamId, request.frameNumber);
-            auto& bufCache = mInflightBuffers[key] = camera3_stream_buffer_t{};
+            Camera3Stream* stream = &mStreamMap.at(request.inputBuffer.streamId);
+            camera3_stream_buffer_t* bufCache =
+                    mInflightFrames.addBuffer(request.frameNumber, stream->mSlot);
+            if (bufCache == nullptr) {
+                ALOGE("%s: no inflight entry for input stream %d!", __FUNCTION__,
+                        request.inputBuffer.streamId);
+                cleanupInflightFences(allFences, numBufs);
+                return Status::INTERNAL_ERROR;
+            }
             convertFromHidl(
                     allBufPtrs[numOutputBufs], request.inputBuffer.status,
-                    &mStreamMap[request.inputBuffer.streamId], allFences[numOutputBufs],
-                    &bufCache);
-            halRequest.input_buffer = &bufCache;
+                    stream, allFences[numOutputBufs], bufCache);
+            halRequest.input_buffer = bufCache;
         } else {
             halRequest.input_buffer = nullptr;
         }
 
         halRequest.num_output_buffers = numOutputBufs;
         for (size_t i = 0; i < numOutputBufs; i++) {
-            auto key = std::make_pair(request.outputBuffers[i].streamId, request.frameNumber);
-            auto& bufCache = mInflightBuffers[key] = camera3_stream_buffer_t{};
+            Camera3Stream* stream = &mStreamMap.at(request.outputBuffers[i].streamId);
+            camera3_stream_buffer_t* bufCache =
+                    mInflightFrames.addBuffer(request.frameNumber, stream->mSlot);
+            if (bufCache == nullptr) {
+                ALOGE("%s: no inflight entry for output stream %d!", __FUNCTION__,
+                        request.outputBuffers[i].streamId);
+                cleanupInflightFences(allFences, numBufs);
+                if (hasInputBuf) {
+                    mInflightFrames.removeBuffer(request.frameNumber,
+                            mStreamMap.at(request.inputBuffer.streamId).mSlot);
+                }
+                for (size_t j = 0; j < i; j++) {
+                    mInflightFrames.removeBuffer(request.frameNumber,
+                            mStreamMap.at(request.outputBuffers[j].streamId).mSlot);
+                }
+                return Status::INTERNAL_ERROR;
+            }
             convertFromHidl(
                     allBufPtrs[i], request.outputBuffers[i].status,
-                    &mStreamMap[request.outputBuffers[i].streamId], allFences[i],
-                    &bufCache);
-            outHalBufs[i] = bufCache;
+                    stream, allFences[i], bufCache);
+            outHalBufs[i] = *bufCache;
         }
         halRequest.output_buffers = outHalBufs.data();
 
@@ -1070,8 +1578,7 @@ Status CameraDeviceSession::processOneCaptureRequest(const CaptureRequest& reque
         aeCancelTriggerNeeded = handleAePrecaptureCancelRequestLocked(
                 halRequest, &settingsOverride /*out*/, &triggerOverride/*out*/);
         if (aeCancelTriggerNeeded) {
-            mInflightAETriggerOverrides[halRequest.frame_number] =
-                    triggerOverride;
+            mInflightFrames.setAETriggerOverride(halRequest.frame_number, triggerOverride);
             halRequest.settings = settingsOverride.getAndLock();
         }
     }
@@ -1089,15 +1596,15 @@ Status CameraDeviceSession::processOneCaptureRequest(const CaptureRequest& reque
 
         cleanupInflightFences(allFences, numBufs);
         if (hasInputBuf) {
-            auto key = std::make_pair(request.inputBuffer.streamId, request.frameNumber);
-            mInflightBuffers.erase(key);
+            mInflightFrames.removeBuffer(request.frameNumber,
+                    mStreamMap.at(request.inputBuffer.streamId).mSlot);
         }
         for (size_t i = 0; i < numOutputBufs; i++) {
-            auto key = std::make_pair(request.outputBuffers[i].streamId, request.frameNumber);
-            mInflightBuffers.erase(key);
+            mInflightFrames.removeBuffer(request.frameNumber,
+                    mStreamMap.at(request.outputBuffers[i].streamId).mSlot);
         }
         if (aeCancelTriggerNeeded) {
-            mInflightAETriggerOverrides.erase(request.frameNumber);
+            mInflightFrames.removeAETriggerOverride(request.frameNumber);
         }
         return Status::INTERNAL_ERROR;
     }
@@ -1113,6 +1620,8 @@ Return<Status> CameraDeviceSession::flush()  {
         if (ret != OK) {
             status = Status::INTERNAL_ERROR;
         }
+        // The HAL has returned everything by now; make sure it has reached the framework too
+        mResultBatcher.waitForDelivery();
     }
     return status;
 }
@@ -1122,19 +1631,19 @@ Return<void> CameraDeviceSession::close()  {
     if (!mClosed) {
         {
             Mutex::Autolock _l(mInflightLock);
-            if (!mInflightBuffers.empty()) {
+            if (mInflightFrames.numBuffers() > 0) {
                 ALOGE("%s: trying to close while there are still %zu inflight buffers!",
-                        __FUNCTION__, mInflightBuffers.size());
+                        __FUNCTION__, mInflightFrames.numBuffers());
             }
-            if (!mInflightAETriggerOverrides.empty()) {
+            if (mInflightFrames.numAETriggerOverrides() > 0) {
                 ALOGE("%s: trying to close while there are still %zu inflight "
                         "trigger overrides!", __FUNCTION__,
-                        mInflightAETriggerOverrides.size());
+                        mInflightFrames.numAETriggerOverrides());
             }
-            if (!mInflightRawBoostPresent.empty()) {
+            if (mInflightFrames.numRawBoostPresent() > 0) {
                 ALOGE("%s: trying to close while there are still %zu inflight "
                         " RAW boost overrides!", __FUNCTION__,
-                        mInflightRawBoostPresent.size());
+                        mInflightFrames.numRawBoostPresent());
             }
 
         }
@@ -1143,12 +1652,12 @@ Return<void> CameraDeviceSession::close()  {
         mDevice->common.close(&mDevice->common);
         ATRACE_END();
 
+        // Deliver whatever the HAL returned before it was closed
+        mResultBatcher.waitForDelivery();
+
         // free all imported buffers
-        for(auto& pair : mCirculatingBuffers) {
-            CirculatingBuffers& buffers = pair.second;
-            for (auto& p2 : buffers) {
-                sHandleImporter.freeBuffer(p2.second);
-            }
+        for (auto& buffers : mCirculatingBuffers) {
+            buffers.clear();
         }
 
         mClosed = true;
@@ -1172,29 +1681,29 @@ void CameraDeviceSession::sProcessCaptureResult(
     if (numBufs > 0) {
         Mutex::Autolock _l(d->mInflightLock);
         if (hasInputBuf) {
-            int streamId = static_cast<Camera3Stream*>(hal_result->input_buffer->stream)->mId;
+            Camera3Stream* stream = static_cast<Camera3Stream*>(hal_result->input_buffer->stream);
             // validate if buffer is inflight
-            auto key = std::make_pair(streamId, frameNumber);
-            if (d->mInflightBuffers.count(key) != 1) {
+            if (!d->mInflightFrames.hasBuffer(frameNumber, stream->mSlot)) {
                 ALOGE("%s: input buffer for stream %d frame %d is not inflight!",
-                        __FUNCTION__, streamId, frameNumber);
+                        __FUNCTION__, stream->mId, frameNumber);
                 return;
             }
         }
 
         for (size_t i = 0; i < numOutputBufs; i++) {
-            int streamId = static_cast<Camera3Stream*>(hal_result->output_buffers[i].stream)->mId;
+            Camera3Stream* stream =
+                    static_cast<Camera3Stream*>(hal_result->output_buffers[i].stream);
             // validate if buffer is inflight
-            auto key = std::make_pair(streamId, frameNumber);
-            if (d->mInflightBuffers.count(key) != 1) {
+            if (!d->mInflightFrames.hasBuffer(frameNumber, stream->mSlot)) {
                 ALOGE("%s: output buffer for stream %d frame %d is not inflight!",
-                        __FUNCTION__, streamId, frameNumber);
+                        __FUNCTION__, stream->mId, frameNumber);
                 return;
             }
         }
     }
-    // We don't need to validate/import fences here since we will be passing them to camera service
-    // within the scope of this function
+    // We don't need to validate/import fences here since we will be passing them to camera service.
+    // The handles created below own the fence fds until the delivery thread has sent them.
+    // result.result still points to HAL memory here, ResultBatcher copies it before queueing.
     CaptureResult result;
     result.frameNumber = frameNumber;
     result.fmqResultSize = 0;
@@ -1206,19 +1715,16 @@ void CameraDeviceSession::sProcessCaptureResult(
 
         // Derive some new keys for backward compatibility
         if (d->mDerivePostRawSensKey) {
+            bool rawBoostPresent = false;
+            d->mInflightFrames.getRawBoostPresent(frameNumber, &rawBoostPresent);
             camera_metadata_ro_entry entry;
             if (find_camera_metadata_ro_entry(hal_result->result,
                     ANDROID_CONTROL_POST_RAW_SENSITIVITY_BOOST, &entry) == 0) {
-                d->mInflightRawBoostPresent[frameNumber] = true;
-            } else {
-                auto entry = d->mInflightRawBoostPresent.find(frameNumber);
-                if (d->mInflightRawBoostPresent.end() == entry) {
-                    d->mInflightRawBoostPresent[frameNumber] = false;
-                }
+                rawBoostPresent = true;
             }
 
             if ((hal_result->partial_result == d->mNumPartialResults)) {
-                if (!d->mInflightRawBoostPresent[frameNumber]) {
+                if (!rawBoostPresent) {
                     if (!resultOverriden) {
                         d->mOverridenResult.clear();
                         d->mOverridenResult.append(hal_result->result);
@@ -1230,21 +1736,24 @@ void CameraDeviceSession::sProcessCaptureResult(
                             defaultBoost, 1);
                 }
 
-                d->mInflightRawBoostPresent.erase(frameNumber);
+                d->mInflightFrames.removeRawBoostPresent(frameNumber);
+            } else {
+                d->mInflightFrames.setRawBoostPresent(frameNumber, rawBoostPresent);
             }
         }
 
-        auto entry = d->mInflightAETriggerOverrides.find(frameNumber);
-        if (d->mInflightAETriggerOverrides.end() != entry) {
+        const AETriggerCancelOverride* triggerOverride =
+                d->mInflightFrames.getAETriggerOverride(frameNumber);
+        if (triggerOverride != nullptr) {
             if (!resultOverriden) {
                 d->mOverridenResult.clear();
                 d->mOverridenResult.append(hal_result->result);
                 resultOverriden = true;
             }
-            d->overrideResultForPrecaptureCancelLocked(entry->second,
+            d->overrideResultForPrecaptureCancelLocked(*triggerOverride,
                     &d->mOverridenResult);
             if (hal_result->partial_result == d->mNumPartialResults) {
-                d->mInflightAETriggerOverrides.erase(frameNumber);
+                d->mInflightFrames.removeAETriggerOverride(frameNumber);
             }
         }
 
@@ -1295,18 +1804,16 @@ void CameraDeviceSession::sProcessCaptureResult(
     if (numBufs > 0) {
         Mutex::Autolock _l(d->mInflightLock);
         if (hasInputBuf) {
-            int streamId = static_cast<Camera3Stream*>(hal_result->input_buffer->stream)->mId;
-            auto key = std::make_pair(streamId, frameNumber);
-            d->mInflightBuffers.erase(key);
+            int slot = static_cast<Camera3Stream*>(hal_result->input_buffer->stream)->mSlot;
+            d->mInflightFrames.removeBuffer(frameNumber, slot);
         }
 
         for (size_t i = 0; i < numOutputBufs; i++) {
-            int streamId = static_cast<Camera3Stream*>(hal_result->output_buffers[i].stream)->mId;
-            auto key = std::make_pair(streamId, frameNumber);
-            d->mInflightBuffers.erase(key);
+            int slot = static_cast<Camera3Stream*>(hal_result->output_buffers[i].stream)->mSlot;
+            d->mInflightFrames.removeBuffer(frameNumber, slot);
         }
 
-        if (d->mInflightBuffers.empty()) {
+        if (d->mInflightFrames.numBuffers() == 0) {
             ALOGV("%s: inflight buffer queue is now empty!", __FUNCTION__);
         }
     }
@@ -1337,19 +1844,10 @@ void CameraDeviceSession::sNotify(
             case ErrorCode::ERROR_REQUEST:
             case ErrorCode::ERROR_RESULT: {
                 Mutex::Autolock _l(d->mInflightLock);
-                auto entry = d->mInflightAETriggerOverrides.find(
+                d->mInflightFrames.removeAETriggerOverride(
                         hidlMsg.msg.error.frameNumber);
-                if (d->mInflightAETriggerOverrides.end() != entry) {
-                    d->mInflightAETriggerOverrides.erase(
-                            hidlMsg.msg.error.frameNumber);
-                }
-
-                auto boostEntry = d->mInflightRawBoostPresent.find(
+                d->mInflightFrames.removeRawBoostPresent(
                         hidlMsg.msg.error.frameNumber);
-                if (d->mInflightRawBoostPresent.end() != boostEntry) {
-                    d->mInflightRawBoostPresent.erase(
-                            hidlMsg.msg.error.frameNumber);
-                }
 
             }
                 break;
@@ -25,12 +25,15 @@
 #include <include/convert.h>
 #include <deque>
 #include <map>
+#include <thread>
 #include <unordered_map>
 #include "CameraMetadata.h"
 #include "HandleImporter.h"
 #include "hardware/camera3.h"
 #include "hardware/camera_common.h"
+#include "utils/Condition.h"
 #include "utils/Mutex.h"
+#include "utils/Timers.h"
 
 namespace android {
 namespace hardware {
@@ -100,6 +103,9 @@ struct CameraDeviceSession : public ICameraDeviceSession, private camera3_callba
     Return<void> close() override;
 
 private:
+    friend class CameraDeviceSessionTest;
+    friend class InflightFramesBenchmark;
+
     // protecting mClosed/mDisconnected/mInitFail
     mutable Mutex mStateLock;
     // device is closed either
@@ -123,17 +129,81 @@ private:
     bool mIsAELockAvailable;
     bool mDerivePostRawSensKey;
     uint32_t mNumPartialResults;
+    uint32_t mPipelineMaxDepth;
     // Stream ID -> Camera3Stream cache
     std::map<int, Camera3Stream> mStreamMap;
 
-    mutable Mutex mInflightLock; // protecting mInflightBuffers and mCirculatingBuffers
-    // (streamID, frameNumber) -> inflight buffer cache
-    std::map<std::pair<int, uint32_t>, camera3_stream_buffer_t>  mInflightBuffers;
+    // Inflight buffers, AE trigger overrides and RAW boost state, tracked per frame.
+    // Frames live in a ring indexed by frameNumber % depth, each holding one buffer entry per
+    // stream slot (Camera3Stream::mSlot), so the request and result paths do not allocate.
+    // A frame whose ring entry is still taken by an older inflight frame goes to an overflow
+    // map instead, so the depth only needs to be a good estimate.
+    // The ring is only resized in configure(), which must not be called while anything is
+    // inflight since the HAL holds pointers to the buffer entries.
+    class InflightFrames {
+    public:
+        // Drop all entries and size the ring for depth frames of numSlots streams
+        void configure(size_t depth, size_t numSlots);
+
+        // Returns the buffer entry to fill in, or nullptr if slot is out of range
+        camera3_stream_buffer_t* addBuffer(uint32_t frameNumber, int slot);
+        bool hasBuffer(uint32_t frameNumber, int slot);
+        void removeBuffer(uint32_t frameNumber, int slot);
+
+        void setAETriggerOverride(uint32_t frameNumber, const AETriggerCancelOverride& override);
+        // Returns nullptr if the frame has no override
+        const AETriggerCancelOverride* getAETriggerOverride(uint32_t frameNumber);
+        void removeAETriggerOverride(uint32_t frameNumber);
+
+        void setRawBoostPresent(uint32_t frameNumber, bool present);
+        // Returns false if the frame has no RAW boost state
+        bool getRawBoostPresent(uint32_t frameNumber, bool* present /*out*/);
+        void removeRawBoostPresent(uint32_t frameNumber);
+
+        size_t numBuffers() const { return mNumBuffers; }
+        size_t numAETriggerOverrides() const { return mNumAETriggerOverrides; }
+        size_t numRawBoostPresent() const { return mNumRawBoostPresent; }
+
+    private:
+        struct Buffer {
+            bool mInflight = false;
+            camera3_stream_buffer_t mBuffer{};
+        };
+
+        struct Frame {
+            bool inUse() const {
+                return mNumBuffers > 0 || mHasAETriggerOverride || mHasRawBoostPresent;
+            }
+
+            uint32_t mFrameNumber = 0;
+            // Stream slot -> buffer
+            std::vector<Buffer> mBuffers;
+            uint32_t mNumBuffers = 0;
+            bool mHasAETriggerOverride = false;
+            AETriggerCancelOverride mAETriggerOverride;
+            bool mHasRawBoostPresent = false;
+            bool mRawBoostPresent = false;
+        };
+
+        Frame* find(uint32_t frameNumber);
+        Frame* findOrAdd(uint32_t frameNumber);
+        // Remove frame from the overflow map once nothing of it is inflight
+        void releaseIfUnused(Frame* frame);
+
+        size_t mNumSlots = 0;
+        std::vector<Frame> mRing;
+        // frameNumber -> frame, for frames that did not fit in the ring
+        std::map<uint32_t, Frame> mOverflow;
+
+        size_t mNumBuffers = 0;
+        size_t mNumAETriggerOverrides = 0;
+        size_t mNumRawBoostPresent = 0;
+    };
+
+    mutable Mutex mInflightLock; // protecting mInflightFrames and mCirculatingBuffers
+    InflightFrames mInflightFrames;
 
-    // (frameNumber, AETriggerOverride) -> inflight request AETriggerOverrides
-    std::map<uint32_t, AETriggerCancelOverride> mInflightAETriggerOverrides;
     ::android::hardware::camera::common::V1_0::helper::CameraMetadata mOverridenResult;
-    std::map<uint32_t, bool> mInflightRawBoostPresent;
     ::android::hardware::camera::common::V1_0::helper::CameraMetadata mOverridenRequest;
 
     // buffers currently ciculating between HAL and camera service
@@ -141,11 +211,44 @@ private:
     // value: imported buffer_handle_t
     // Buffer will be imported during process_capture_request and will be freed
     // when the its stream is deleted or camera device session is closed
-    typedef std::unordered_map<uint64_t, buffer_handle_t> CirculatingBuffers;
-    // Stream ID -> circulating buffers map
-    std::map<int, CirculatingBuffers> mCirculatingBuffers;
+    // A stream only circulates a handful of buffers, so entries are kept in a flat array that
+    // is searched linearly. Removed entries are reused and clear() evicts everything at once
+    // by bumping the generation, so steady-state requests don't allocate. Entries live in a
+    // deque so that the handle pointers given to the HAL stay valid while the cache grows.
+    class CirculatingBuffers {
+    public:
+        // Returns nullptr if bufferId is not cached
+        buffer_handle_t* find(uint64_t bufferId);
+        // Cache an imported handle. The returned pointer is valid until the entry is removed
+        buffer_handle_t* add(uint64_t bufferId, buffer_handle_t handle);
+        // Free the cached handle. Returns false if bufferId is not cached
+        bool remove(uint64_t bufferId);
+        // Free all cached handles
+        void clear();
+        size_t size() const { return mSize; }
+        // Entries held, including removed ones kept for reuse
+        size_t capacity() const { return mEntries.size(); }
+
+    private:
+        struct Entry {
+            uint64_t mBufferId;
+            // Entry is valid only if this matches CirculatingBuffers::mGeneration
+            uint32_t mGeneration;
+            buffer_handle_t mHandle;
+        };
+
+        std::deque<Entry> mEntries;
+        // Starts at 1 so that 0 can mark removed entries
+        uint32_t mGeneration = 1;
+        size_t mSize = 0;
+    };
+    // Stream slot (Camera3Stream::mSlot) -> circulating buffers
+    std::vector<CirculatingBuffers> mCirculatingBuffers;
 
     static HandleImporter sHandleImporter;
+    // Imports and frees the circulating buffers. Points to sHandleImporter; tests replace it
+    // to keep track of the imported buffers.
+    static HandleImporter* sBufferImporter;
 
     bool mInitFail;
 
@@ -153,25 +256,37 @@ private:
 
     using RequestMetadataQueue = MessageQueue<uint8_t, kSynchronizedReadWrite>;
     std::unique_ptr<RequestMetadataQueue> mRequestMetadataQueue;
+    // Settings of the last request that came through mRequestMetadataQueue, and the buffer
+    // the next one is read into. Both are kept across requests so reading settings doesn't
+    // allocate, and settings identical to the last ones are not validated again.
+    std::vector<uint8_t> mFmqSettings;
+    std::vector<uint8_t> mFmqSettingsScratch;
+    bool mFmqSettingsValid = false;
     using ResultMetadataQueue = MessageQueue<uint8_t, kSynchronizedReadWrite>;
     std::shared_ptr<ResultMetadataQueue> mResultMetadataQueue;
 
     class ResultBatcher {
     public:
         ResultBatcher(const sp<ICameraDeviceCallback>& callback);
+        ~ResultBatcher();
         void setNumPartialResults(uint32_t n);
         void setBatchedStreams(const std::vector<int>& streamsToBatch);
         void setResultMetadataQueue(std::shared_ptr<ResultMetadataQueue> q);
+        // Max number of queued results (or notify messages) sent in one HIDL call
+        void setMaxCoalescedResults(size_t n);
 
         void registerBatch(const hidl_vec<CaptureRequest>& requests);
         void notify(NotifyMsg& msg);
         void processCaptureResult(CaptureResult& result);
 
+        // Block until everything queued so far has been delivered to the callback
+        void waitForDelivery();
+        void dump(int fd);
+
     private:
         struct InflightBatch {
             // Protect access to entire struct. Acquire this lock before read/write any data or
             // calling any methods. processCaptureResult and notify will compete for this lock
-            // HIDL IPCs might be issued while the lock is held
             Mutex mLock;
 
             bool allDelivered() const;
@@ -227,7 +342,7 @@ private:
         void checkAndRemoveFirstBatch();
 
         // The following sendXXXX methods must be called while the InflightBatch::mLock is locked
-        // HIDL IPC methods will be called during these methods.
+        // They only queue data for the delivery thread, no HIDL IPC is issued here.
         void sendBatchShutterCbsLocked(std::shared_ptr<InflightBatch> batch);
         // send buffers for all batched streams
         void sendBatchBuffersLocked(std::shared_ptr<InflightBatch> batch);
@@ -238,11 +353,19 @@ private:
                 std::shared_ptr<InflightBatch> batch, uint32_t lastPartialResultIdx);
         // End of sendXXXX methods
 
+        // notify/processCaptureResult minus the latency bookkeeping
+        void batchNotify(NotifyMsg& msg);
+        void batchCaptureResult(CaptureResult& result);
+
         // helper methods
         void freeReleaseFences(hidl_vec<CaptureResult>&);
         void notifySingleMsg(NotifyMsg& msg);
         void processOneCaptureResult(CaptureResult& result);
+        void queueResults(hidl_vec<CaptureResult>&& results, bool tryWriteFmq);
+        void queueNotify(hidl_vec<NotifyMsg>&& msgs);
+        void writeResultMetadataToFmq(hidl_vec<CaptureResult> &results);
         void invokeProcessCaptureResultCallback(hidl_vec<CaptureResult> &results, bool tryWriteFmq);
+        void invokeNotifyCallback(hidl_vec<NotifyMsg> &msgs);
 
         // move/push function avoids "hidl_handle& operator=(hidl_handle&)", which clones native
         // handle
@@ -251,7 +374,7 @@ private:
 
         // Protect access to mInflightBatches, mNumPartialResults and mStreamsToBatch
         // processCaptureRequest, processCaptureResult, notify will compete for this lock
-        // Do NOT issue HIDL IPCs while holding this lock (except when HAL reports error)
+        // HIDL IPCs are never issued while holding this lock, they happen on mDeliveryThread
         mutable Mutex mLock;
         std::deque<std::shared_ptr<InflightBatch>> mInflightBatches;
         uint32_t mNumPartialResults;
@@ -259,8 +382,52 @@ private:
         const sp<ICameraDeviceCallback> mCallback;
         std::shared_ptr<ResultMetadataQueue> mResultMetadataQueue;
 
-        // Protect against invokeProcessCaptureResultCallback()
-        Mutex mProcessCaptureResultLock;
+        // Results and notify messages waiting to be sent to mCallback. Assembling results above
+        // only queues them here; deliveryLoop() sends them in order on mDeliveryThread, merging
+        // consecutive entries of the same kind into one HIDL call, so a slow client doesn't
+        // stall the HAL's result thread.
+        struct Delivery {
+            bool mIsNotify;
+            hidl_vec<NotifyMsg> mMsgs;
+            hidl_vec<CaptureResult> mResults;
+            bool mTryWriteFmq;
+            nsecs_t mQueuedTime;
+        };
+
+        struct LatencyStats {
+            void add(nsecs_t latency);
+            void dump(int fd, const char* name) const;
+
+            uint64_t mCount = 0;
+            nsecs_t mTotal = 0;
+            nsecs_t mMax = 0;
+        };
+
+        void queueDelivery(Delivery&& delivery);
+        void deliveryLoop();
+        void recordAssembly(nsecs_t start);
+
+        // Protect access to mDeliveryQueue, mDelivering, mExitDelivery, mMaxCoalescedResults and
+        // the latency stats. Never held across HIDL IPCs.
+        Mutex mDeliveryLock;
+        // Signaled when an entry is queued or the delivery thread should exit
+        Condition mDeliveryCond;
+        // Signaled when the queue has been drained
+        Condition mDeliveryDoneCond;
+        std::deque<Delivery> mDeliveryQueue;
+        bool mDelivering = false;
+        bool mExitDelivery = false;
+        size_t mMaxCoalescedResults;
+        // Time spent in processCaptureResult/notify before the data is queued
+        LatencyStats mAssemblyLatency;
+        // Time between queueing and the delivery thread picking the data up
+        LatencyStats mQueueLatency;
+        // Duration of the processCaptureResult/notify HIDL calls
+        LatencyStats mDeliveryLatency;
+        uint64_t mNumDeliveryCalls = 0;
+        uint64_t mNumDeliveredItems = 0;
+        // Must stay last so that it is started after everything above is constructed
+        std::thread mDeliveryThread;
 
     } mResultBatcher;
 
@@ -276,11 +443,18 @@ private:
             hidl_vec<buffer_handle_t*>& allBufPtrs,
             hidl_vec<int>& allFences);
 
+    // Read capture settings from mRequestMetadataQueue. *settings stays valid until the next
+    // call
+    bool readFmqSettings(size_t size, const camera_metadata_t** settings /*out*/);
+
     static void cleanupInflightFences(
             hidl_vec<int>& allFences, size_t numFences);
 
     void cleanupBuffersLocked(int id);
 
+    // Assign stream slots and move the per slot state along, after mStreamMap has changed
+    void updateStreamSlotsLocked();
+
     void updateBufferCaches(const hidl_vec<BufferCache>& cachesToRemove);
 
     android_dataspace mapToLegacyDataspace(
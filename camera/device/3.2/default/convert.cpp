@@ -59,6 +59,7 @@ void convertToHidl(const camera_metadata_t *src, CameraMetadata* dst) {
 
 void convertFromHidl(const Stream &src, Camera3Stream* dst) {
     dst->mId = src.id;
+    dst->mSlot = -1;
     dst->stream_type = (int) src.streamType;
     dst->width = src.width;
     dst->height = src.height;
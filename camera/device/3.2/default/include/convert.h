@@ -36,6 +36,8 @@ namespace implementation {
 // fromt a downcasted camera3_stream
 struct Camera3Stream : public camera3_stream {
     int mId;
+    // Index of this stream in the session's in-flight buffer table, -1 until assigned
+    int mSlot;
 };
 
 // *dst will point to the data owned by src, but src still owns the data after this call returns.
@@ -0,0 +1,344 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "CamDevSession@3.2-test"
+
+#include <errno.h>
+
+#include <set>
+#include <vector>
+
+#include <cutils/native_handle.h>
+#include <gtest/gtest.h>
+#include <log/log.h>
+#include <system/camera_metadata.h>
+
+#include "CameraDeviceSession.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace device {
+namespace V3_2 {
+namespace implementation {
+
+namespace {
+
+// A camera3 HAL that accepts every call without doing any work. The result of
+// configure_streams can be set by the test.
+struct FakeDevice {
+    camera3_device_t device;
+    int configureResult = 0;
+    int numConfigured = 0;
+};
+
+FakeDevice* getFakeDevice(const camera3_device_t* device) {
+    return reinterpret_cast<FakeDevice*>(const_cast<camera3_device_t*>(device));
+}
+
+int fakeClose(hw_device_t*) {
+    return 0;
+}
+
+int fakeInitialize(const camera3_device_t*, const camera3_callback_ops_t*) {
+    return 0;
+}
+
+int fakeConfigureStreams(const camera3_device_t* device,
+        camera3_stream_configuration_t* streamList) {
+    FakeDevice* fake = getFakeDevice(device);
+    if (fake->configureResult != 0) {
+        return fake->configureResult;
+    }
+    for (uint32_t i = 0; i < streamList->num_streams; i++) {
+        streamList->streams[i]->max_buffers = 4;
+    }
+    fake->numConfigured++;
+    return 0;
+}
+
+const camera_metadata_t* fakeConstructDefaultRequestSettings(const camera3_device_t*, int) {
+    return nullptr;
+}
+
+int fakeProcessCaptureRequest(const camera3_device_t*, camera3_capture_request_t*) {
+    return 0;
+}
+
+void fakeDump(const camera3_device_t*, int) {}
+
+int fakeFlush(const camera3_device_t*) {
+    return 0;
+}
+
+camera3_device_ops_t sFakeOps = {
+    .initialize = fakeInitialize,
+    .configure_streams = fakeConfigureStreams,
+    .register_stream_buffers = nullptr,
+    .construct_default_request_settings = fakeConstructDefaultRequestSettings,
+    .process_capture_request = fakeProcessCaptureRequest,
+    .get_metadata_vendor_tag_ops = nullptr,
+    .dump = fakeDump,
+    .flush = fakeFlush,
+    .reserved = {},
+};
+
+class StubCallback : public ICameraDeviceCallback {
+public:
+    Return<void> processCaptureResult(const hidl_vec<CaptureResult>&) override {
+        return Void();
+    }
+    Return<void> notify(const hidl_vec<NotifyMsg>&) override {
+        return Void();
+    }
+};
+
+// Stands in for the gralloc mapper. Importing clones the caller's handle, and every imported
+// handle must be freed exactly once.
+class CountingImporter : public HandleImporter {
+public:
+    bool importBuffer(buffer_handle_t& handle) override {
+        native_handle_t* imported = native_handle_clone(handle);
+        if (imported == nullptr) {
+            handle = nullptr;
+            return false;
+        }
+        mImported.insert(imported);
+        mNumImported++;
+        handle = imported;
+        return true;
+    }
+
+    void freeBuffer(buffer_handle_t handle) override {
+        if (handle == nullptr) {
+            return;
+        }
+        if (mImported.erase(handle) == 0) {
+            ADD_FAILURE() << "freeing buffer " << handle << " that is not imported";
+            return;
+        }
+        mNumFreed++;
+        native_handle_delete(const_cast<native_handle_t*>(handle));
+    }
+
+    uint64_t numImported() const { return mNumImported; }
+    uint64_t numFreed() const { return mNumFreed; }
+
+private:
+    std::set<buffer_handle_t> mImported;
+    uint64_t mNumImported = 0;
+    uint64_t mNumFreed = 0;
+};
+
+Stream makeStream(int32_t id, uint32_t width, uint32_t height) {
+    Stream stream = {};
+    stream.id = id;
+    stream.streamType = StreamType::OUTPUT;
+    stream.width = width;
+    stream.height = height;
+    stream.format = graphics::common::V1_0::PixelFormat::IMPLEMENTATION_DEFINED;
+    stream.rotation = StreamRotation::ROTATION_0;
+    return stream;
+}
+
+} // anonymous namespace
+
+class CameraDeviceSessionTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        mFake.device.common.tag = HARDWARE_DEVICE_TAG;
+        mFake.device.common.version = CAMERA_DEVICE_API_VERSION_3_2;
+        mFake.device.common.close = fakeClose;
+        mFake.device.ops = &sFakeOps;
+        mDeviceInfo = allocate_camera_metadata(1, 0);
+        CameraDeviceSession::sBufferImporter = &mImporter;
+        mSession = new CameraDeviceSession(&mFake.device, mDeviceInfo, new StubCallback());
+        ASSERT_FALSE(mSession->isInitFailed());
+    }
+
+    void TearDown() override {
+        mSession->close();
+        mSession.clear();
+        free_camera_metadata(mDeviceInfo);
+        EXPECT_EQ(mImporter.numImported(), mImporter.numFreed());
+        CameraDeviceSession::sBufferImporter = &CameraDeviceSession::sHandleImporter;
+    }
+
+    Status configure(const std::vector<Stream>& streams) {
+        StreamConfiguration config;
+        config.streams = streams;
+        config.operationMode = StreamConfigurationMode::NORMAL_MODE;
+        Status status = Status::INTERNAL_ERROR;
+        mSession->configureStreams(config,
+                [&status](Status s, const HalStreamConfiguration&) { status = s; });
+        return status;
+    }
+
+    // Every stream must own exactly one valid slot, and there must be no other slots
+    void expectValidSlots() {
+        Mutex::Autolock _l(mSession->mInflightLock);
+        ASSERT_EQ(mSession->mStreamMap.size(), mSession->mCirculatingBuffers.size());
+        std::vector<bool> taken(mSession->mCirculatingBuffers.size(), false);
+        for (const auto& pair : mSession->mStreamMap) {
+            int slot = pair.second.mSlot;
+            ASSERT_GE(slot, 0) << "stream " << pair.first;
+            ASSERT_LT(static_cast<size_t>(slot), taken.size()) << "stream " << pair.first;
+            EXPECT_FALSE(taken[slot]) << "stream " << pair.first;
+            taken[slot] = true;
+        }
+    }
+
+    std::vector<int> streamIds() {
+        Mutex::Autolock _l(mSession->mInflightLock);
+        std::vector<int> ids;
+        for (const auto& pair : mSession->mStreamMap) {
+            ids.push_back(pair.first);
+        }
+        return ids;
+    }
+
+    size_t numStreams() {
+        Mutex::Autolock _l(mSession->mInflightLock);
+        return mSession->mStreamMap.size();
+    }
+
+    // Imports and caches count distinct buffers for the stream, as importRequest would
+    void cacheBuffers(int streamId, uint64_t firstBufferId, size_t count) {
+        Mutex::Autolock _l(mSession->mInflightLock);
+        auto& cbs = mSession->mCirculatingBuffers[mSession->mStreamMap.at(streamId).mSlot];
+        for (size_t i = 0; i < count; i++) {
+            native_handle_t* buffer = native_handle_create(0, 1);
+            ASSERT_NE(nullptr, buffer);
+            buffer->data[0] = static_cast<int>(firstBufferId + i);
+            buffer_handle_t imported = buffer;
+            ASSERT_TRUE(CameraDeviceSession::sBufferImporter->importBuffer(imported));
+            native_handle_delete(buffer);
+            cbs.add(firstBufferId + i, imported);
+        }
+    }
+
+    size_t numCachedBuffers(int streamId) {
+        Mutex::Autolock _l(mSession->mInflightLock);
+        return mSession->mCirculatingBuffers[mSession->mStreamMap.at(streamId).mSlot].size();
+    }
+
+    // Handles cached for all streams, which must be exactly the imported ones not yet freed
+    size_t numCachedHandles() {
+        Mutex::Autolock _l(mSession->mInflightLock);
+        size_t handles = 0;
+        for (const auto& cbs : mSession->mCirculatingBuffers) {
+            handles += cbs.size();
+        }
+        return handles;
+    }
+
+    // Storage held by all caches, including evicted entries kept for reuse
+    size_t numCacheEntries() {
+        Mutex::Autolock _l(mSession->mInflightLock);
+        size_t entries = 0;
+        for (const auto& cbs : mSession->mCirculatingBuffers) {
+            entries += cbs.capacity();
+        }
+        return entries;
+    }
+
+    FakeDevice mFake;
+    CountingImporter mImporter;
+    camera_metadata_t* mDeviceInfo = nullptr;
+    sp<CameraDeviceSession> mSession;
+};
+
+TEST_F(CameraDeviceSessionTest, ConfigurationChangeDropsNewStreams) {
+    ASSERT_EQ(Status::OK, configure({makeStream(1, 640, 480)}));
+    cacheBuffers(1, 100, 3);
+
+    // Stream 2 is new, stream 1 changed size, so the call fails before reaching the HAL
+    EXPECT_EQ(Status::INTERNAL_ERROR,
+            configure({makeStream(2, 320, 240), makeStream(1, 1280, 720)}));
+    EXPECT_EQ(1, mFake.numConfigured);
+    EXPECT_EQ(1u, numStreams());
+    expectValidSlots();
+    EXPECT_EQ(3u, numCachedBuffers(1));
+
+    ASSERT_EQ(Status::OK, configure({makeStream(1, 640, 480), makeStream(2, 320, 240)}));
+    expectValidSlots();
+    EXPECT_EQ(3u, numCachedBuffers(1));
+    EXPECT_EQ(0u, numCachedBuffers(2));
+}
+
+TEST_F(CameraDeviceSessionTest, HalFailureKeepsSlotsValid) {
+    ASSERT_EQ(Status::OK, configure({makeStream(1, 640, 480)}));
+
+    mFake.configureResult = -EINVAL;
+    EXPECT_EQ(Status::ILLEGAL_ARGUMENT,
+            configure({makeStream(1, 640, 480), makeStream(2, 320, 240)}));
+    expectValidSlots();
+    cacheBuffers(2, 200, 2);
+
+    mFake.configureResult = 0;
+    ASSERT_EQ(Status::OK, configure({makeStream(1, 640, 480)}));
+    EXPECT_EQ(1u, numStreams());
+    expectValidSlots();
+}
+
+TEST_F(CameraDeviceSessionTest, ReconfigureDoesNotLeakBuffers) {
+    const size_t kBuffersPerStream = 4;
+    const size_t kMaxStreams = 3;
+    const int kIterations = 10000;
+    uint64_t nextBufferId = 1;
+
+    for (int i = 0; i < kIterations; i++) {
+        // Cycle through stream sets sharing some streams with the previous set, with every
+        // third reconfiguration failing in one of the two ways
+        std::vector<Stream> streams;
+        for (size_t s = 0; s < 1 + i % kMaxStreams; s++) {
+            streams.push_back(makeStream(i + s, 640, 480));
+        }
+        if (i % 6 == 2) {
+            streams.push_back(makeStream(i - 1, 1920, 1080));
+        }
+        mFake.configureResult = (i % 6 == 5) ? -ENODEV : 0;
+        configure(streams);
+        expectValidSlots();
+        ASSERT_EQ(mImporter.numImported() - mImporter.numFreed(), numCachedHandles())
+                << "iteration " << i;
+
+        for (int id : streamIds()) {
+            if (numCachedBuffers(id) == 0) {
+                cacheBuffers(id, nextBufferId, kBuffersPerStream);
+                nextBufferId += kBuffersPerStream;
+            }
+            EXPECT_EQ(kBuffersPerStream, numCachedBuffers(id));
+        }
+    }
+
+    // A failed configuration leaves the new streams in place alongside the old ones, so at
+    // most twice the largest stream set ever holds cache storage
+    EXPECT_LE(numStreams(), 2 * kMaxStreams);
+    EXPECT_LE(numCacheEntries(), 2 * kMaxStreams * kBuffersPerStream);
+
+    mSession->close();
+    EXPECT_EQ(0u, numCachedHandles());
+    EXPECT_EQ(mImporter.numImported(), mImporter.numFreed());
+    EXPECT_GT(mImporter.numFreed(), 0u);
+}
+
+}  // namespace implementation
+}  // namespace V3_2
+}  // namespace device
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <map>
+#include <utility>
+
+#include "CameraDeviceSession.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace device {
+namespace V3_2 {
+namespace implementation {
+
+class InflightFramesBenchmark {
+public:
+    using InflightFrames = CameraDeviceSession::InflightFrames;
+};
+
+namespace {
+
+using InflightFrames = InflightFramesBenchmark::InflightFrames;
+
+// Preview, video, still capture and analysis streams
+constexpr int kNumStreams = 4;
+// Time from request to result, so fps * latency frames are in flight
+constexpr int kPipelineLatencyMs = 100;
+constexpr size_t kPipelineMaxDepth = 8;
+
+int framesInFlight(int fps) {
+    return std::max(1, fps * kPipelineLatencyMs / 1000);
+}
+
+// What CameraDeviceSession used to do: one tree node per (stream, frame) buffer.
+void BM_InflightMap(benchmark::State& state) {
+    const int inflight = framesInFlight(state.range(0));
+    std::map<std::pair<int, uint32_t>, camera3_stream_buffer_t> inflightBuffers;
+    uint32_t frameNumber = 0;
+    while (state.KeepRunning()) {
+        for (int stream = 0; stream < kNumStreams; stream++) {
+            inflightBuffers[std::make_pair(stream, frameNumber)] = camera3_stream_buffer_t{};
+        }
+        if (frameNumber >= static_cast<uint32_t>(inflight)) {
+            uint32_t resultFrame = frameNumber - inflight;
+            for (int stream = 0; stream < kNumStreams; stream++) {
+                auto key = std::make_pair(stream, resultFrame);
+                auto it = inflightBuffers.find(key);
+                benchmark::DoNotOptimize(it);
+                inflightBuffers.erase(it);
+            }
+        }
+        frameNumber++;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_InflightMap)->Arg(30)->Arg(120)->Arg(240);
+
+// What it does now: a ring of frames with preallocated per-slot entries, sized from the
+// pipeline depth and the streams' max_buffers.
+void BM_InflightFrames(benchmark::State& state) {
+    const int inflight = framesInFlight(state.range(0));
+    InflightFrames frames;
+    frames.configure(std::max<size_t>(kPipelineMaxDepth, inflight + 1), kNumStreams);
+    uint32_t frameNumber = 0;
+    while (state.KeepRunning()) {
+        for (int slot = 0; slot < kNumStreams; slot++) {
+            benchmark::DoNotOptimize(frames.addBuffer(frameNumber, slot));
+        }
+        if (frameNumber >= static_cast<uint32_t>(inflight)) {
+            uint32_t resultFrame = frameNumber - inflight;
+            for (int slot = 0; slot < kNumStreams; slot++) {
+                benchmark::DoNotOptimize(frames.hasBuffer(resultFrame, slot));
+                frames.removeBuffer(resultFrame, slot);
+            }
+        }
+        frameNumber++;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_InflightFrames)->Arg(30)->Arg(120)->Arg(240);
+
+}  // namespace
+
+}  // namespace implementation
+}  // namespace V3_2
+}  // namespace device
+}  // namespace camera
+}  // namespace hardware
+}  // namespace android
+
+BENCHMARK_MAIN();
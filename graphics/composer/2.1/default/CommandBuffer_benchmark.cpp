@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures how many commands per second CommandReaderBase reads out of the
+// input queue, with and without in-place reads, for frames of 10, 50 and
+// 200 layers as SurfaceFlinger writes them.
+
+#define LOG_TAG "HwcCommandBufferBenchmark"
+
+#include <benchmark/benchmark.h>
+
+#include "IComposerCommandBuffer.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace {
+
+// same as ComposerClient
+constexpr size_t kWriterInitialSize = 64 * 1024 / sizeof(uint32_t) - 16;
+
+// Walks the command stream like ComposerClient::CommandReader::parse,
+// reading every word of every command.
+class FrameReader : public CommandReaderBase {
+public:
+    bool parse(uint32_t* outCommandCount, uint32_t* outChecksum)
+    {
+        IComposerClient::Command command;
+        uint16_t length;
+        while (!isEmpty()) {
+            if (!beginCommand(&command, &length)) {
+                return false;
+            }
+
+            for (uint16_t i = 0; i < length; i++) {
+                *outChecksum += read();
+            }
+            endCommand();
+            (*outCommandCount)++;
+        }
+
+        return true;
+    }
+};
+
+void writeFrame(CommandWriterBase* writer, size_t layerCount)
+{
+    writer->selectDisplay(1);
+    for (size_t i = 0; i < layerCount; i++) {
+        int32_t offset = static_cast<int32_t>(i);
+        writer->selectLayer(100 + i);
+        writer->setLayerBuffer(i % 3, nullptr, -1);
+        writer->setLayerCompositionType(IComposerClient::Composition::DEVICE);
+        writer->setLayerDataspace(Dataspace::UNKNOWN);
+        writer->setLayerDisplayFrame({offset, offset, offset + 64, offset + 64});
+        writer->setLayerSourceCrop({0.0f, 0.0f, 64.0f, 64.0f});
+        writer->setLayerPlaneAlpha(1.0f);
+        writer->setLayerZOrder(i);
+    }
+    writer->validateDisplay();
+    writer->presentDisplay();
+}
+
+// state.range(0) is the number of layers, state.range(1) selects in-place
+// reads.  Writing the frame into the queue is part of every iteration; it
+// costs the same in both modes.
+void BM_ReadFrame(benchmark::State& state)
+{
+    CommandWriterBase writer(kWriterInitialSize);
+    writeFrame(&writer, state.range(0));
+
+    FrameReader reader;
+    reader.setInPlaceRead(state.range(1) != 0);
+
+    bool queueChanged;
+    uint32_t commandLength;
+    hidl_vec<hidl_handle> commandHandles;
+    if (!writer.writeQueue(&queueChanged, &commandLength, &commandHandles) ||
+            !reader.setMQDescriptor(*writer.getMQDescriptor())) {
+        state.SkipWithError("failed to set up the command queue");
+        return;
+    }
+
+    uint32_t commandCount = 0;
+    uint32_t checksum = 0;
+    bool first = true;
+    while (state.KeepRunning()) {
+        if ((!first && !writer.writeQueue(&queueChanged, &commandLength,
+                        &commandHandles)) ||
+                !reader.readQueue(commandLength, commandHandles) ||
+                !reader.parse(&commandCount, &checksum)) {
+            state.SkipWithError("failed to read the frame");
+            break;
+        }
+        reader.reset();
+        first = false;
+    }
+
+    benchmark::DoNotOptimize(checksum);
+    state.SetItemsProcessed(commandCount);
+}
+BENCHMARK(BM_ReadFrame)
+    ->Args({10, 0})->Args({10, 1})
+    ->Args({50, 0})->Args({50, 1})
+    ->Args({200, 0})->Args({200, 1});
+
+} // anonymous namespace
+} // namespace V2_1
+} // namespace composer
+} // namespace graphics
+} // namespace hardware
+} // namespace android
+
+BENCHMARK_MAIN();
@@ -0,0 +1,180 @@
+/*
+ * Copyright 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "HwcPassthrough"
+
+#include "CommandRecorder.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <log/log.h>
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace implementation {
+
+constexpr uint32_t CommandRecorder::kMagic;
+constexpr uint32_t CommandRecorder::kVersion;
+constexpr uint32_t CommandRecorder::kNullHandle;
+
+std::unique_ptr<CommandRecorder> CommandRecorder::create(const char* path)
+{
+    FILE* file = fopen(path, "we");
+    if (!file) {
+        ALOGE("failed to open %s for recording: %s", path, strerror(errno));
+        return nullptr;
+    }
+
+    const uint32_t header[] = { kMagic, kVersion };
+    if (fwrite(header, sizeof(header), 1, file) != 1) {
+        ALOGE("failed to write recording header to %s", path);
+        fclose(file);
+        return nullptr;
+    }
+
+    ALOGI("recording composer commands to %s", path);
+
+    return std::unique_ptr<CommandRecorder>(new CommandRecorder(file));
+}
+
+CommandRecorder::CommandRecorder(FILE* file)
+    : mFile(file)
+{
+}
+
+CommandRecorder::~CommandRecorder()
+{
+    fclose(mFile);
+}
+
+void CommandRecorder::recordHotplug(Display display,
+        IComposerCallback::Connection connected)
+{
+    std::vector<uint32_t> payload;
+    append64(&payload, display);
+    payload.push_back(static_cast<uint32_t>(connected));
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    writeRecordLocked(RecordType::HOTPLUG, payload);
+}
+
+void CommandRecorder::recordCreateVirtualDisplay(Display display,
+        uint32_t outputBufferSlotCount)
+{
+    std::vector<uint32_t> payload;
+    append64(&payload, display);
+    payload.push_back(outputBufferSlotCount);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    writeRecordLocked(RecordType::CREATE_VIRTUAL_DISPLAY, payload);
+}
+
+void CommandRecorder::recordDestroyVirtualDisplay(Display display)
+{
+    std::vector<uint32_t> payload;
+    append64(&payload, display);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    writeRecordLocked(RecordType::DESTROY_VIRTUAL_DISPLAY, payload);
+}
+
+void CommandRecorder::recordCreateLayer(Display display, Layer layer,
+        uint32_t bufferSlotCount)
+{
+    std::vector<uint32_t> payload;
+    append64(&payload, display);
+    append64(&payload, layer);
+    payload.push_back(bufferSlotCount);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    writeRecordLocked(RecordType::CREATE_LAYER, payload);
+}
+
+void CommandRecorder::recordDestroyLayer(Display display, Layer layer)
+{
+    std::vector<uint32_t> payload;
+    append64(&payload, display);
+    append64(&payload, layer);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    writeRecordLocked(RecordType::DESTROY_LAYER, payload);
+}
+
+void CommandRecorder::recordSetClientTargetSlotCount(Display display,
+        uint32_t clientTargetSlotCount)
+{
+    std::vector<uint32_t> payload;
+    append64(&payload, display);
+    payload.push_back(clientTargetSlotCount);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    writeRecordLocked(RecordType::SET_CLIENT_TARGET_SLOT_COUNT, payload);
+}
+
+void CommandRecorder::recordExecuteCommands(
+        const std::vector<uint32_t>& commands,
+        const std::vector<const native_handle_t*>& handles)
+{
+    std::vector<uint32_t> payload;
+    payload.reserve(1 + handles.size() * 2 + commands.size());
+
+    payload.push_back(handles.size());
+    for (auto handle : handles) {
+        if (handle) {
+            payload.push_back(handle->numFds);
+            payload.push_back(handle->numInts);
+        } else {
+            payload.push_back(kNullHandle);
+            payload.push_back(kNullHandle);
+        }
+    }
+    payload.insert(payload.end(), commands.cbegin(), commands.cend());
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    writeRecordLocked(RecordType::EXECUTE_COMMANDS, payload);
+}
+
+void CommandRecorder::writeRecordLocked(RecordType type,
+        const std::vector<uint32_t>& payload)
+{
+    const uint32_t header[] = {
+        static_cast<uint32_t>(type),
+        static_cast<uint32_t>(payload.size()),
+    };
+
+    if (fwrite(header, sizeof(header), 1, mFile) != 1 ||
+            fwrite(payload.data(), sizeof(uint32_t), payload.size(), mFile) !=
+            payload.size()) {
+        ALOGE("failed to write record %u", header[0]);
+    }
+}
+
+void CommandRecorder::append64(std::vector<uint32_t>* payload, uint64_t val)
+{
+    payload->push_back(static_cast<uint32_t>(val & 0xffffffff));
+    payload->push_back(static_cast<uint32_t>(val >> 32));
+}
+
+} // namespace implementation
+} // namespace V2_1
+} // namespace composer
+} // namespace graphics
+} // namespace hardware
+} // namespace android
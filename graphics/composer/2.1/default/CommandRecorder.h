@@ -0,0 +1,105 @@
+/*
+ * Copyright 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_GRAPHICS_COMPOSER_V2_1_COMMAND_RECORDER_H
+#define ANDROID_HARDWARE_GRAPHICS_COMPOSER_V2_1_COMMAND_RECORDER_H
+
+#include <stdio.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <android/hardware/graphics/composer/2.1/IComposer.h>
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace implementation {
+
+// Records the command streams passed to executeCommands, together with the
+// calls that create and destroy the objects they refer to, so that they can
+// be replayed offline.
+//
+// A recording is a sequence of uint32_t's in host byte order: kMagic and
+// kVersion followed by records of the form
+//
+//   type, length, payload[length]
+//
+// where 64-bit values in a payload are stored low word first.  Handles are
+// recorded by shape only, as their numFds and numInts (kNullHandle for a
+// null handle); their contents are not recorded.
+class CommandRecorder {
+public:
+    static constexpr uint32_t kMagic = 0x52435748; // "HWCR"
+    static constexpr uint32_t kVersion = 1;
+    static constexpr uint32_t kNullHandle = 0xffffffff;
+
+    enum class RecordType : uint32_t {
+        // display, connected
+        HOTPLUG = 1,
+        // display, outputBufferSlotCount
+        CREATE_VIRTUAL_DISPLAY = 2,
+        // display
+        DESTROY_VIRTUAL_DISPLAY = 3,
+        // display, layer, bufferSlotCount
+        CREATE_LAYER = 4,
+        // display, layer
+        DESTROY_LAYER = 5,
+        // display, clientTargetSlotCount
+        SET_CLIENT_TARGET_SLOT_COUNT = 6,
+        // handleCount, (numFds, numInts)[handleCount], commands
+        EXECUTE_COMMANDS = 7,
+    };
+
+    // Returns nullptr when path cannot be opened for writing.
+    static std::unique_ptr<CommandRecorder> create(const char* path);
+    ~CommandRecorder();
+
+    void recordHotplug(Display display,
+            IComposerCallback::Connection connected);
+    void recordCreateVirtualDisplay(Display display,
+            uint32_t outputBufferSlotCount);
+    void recordDestroyVirtualDisplay(Display display);
+    void recordCreateLayer(Display display, Layer layer,
+            uint32_t bufferSlotCount);
+    void recordDestroyLayer(Display display, Layer layer);
+    void recordSetClientTargetSlotCount(Display display,
+            uint32_t clientTargetSlotCount);
+    void recordExecuteCommands(const std::vector<uint32_t>& commands,
+            const std::vector<const native_handle_t*>& handles);
+
+private:
+    CommandRecorder(FILE* file);
+
+    void writeRecordLocked(RecordType type,
+            const std::vector<uint32_t>& payload);
+    static void append64(std::vector<uint32_t>* payload, uint64_t val);
+
+    std::mutex mMutex;
+    FILE* mFile;
+};
+
+} // namespace implementation
+} // namespace V2_1
+} // namespace composer
+} // namespace graphics
+} // namespace hardware
+} // namespace android
+
+#endif  // ANDROID_HARDWARE_GRAPHICS_COMPOSER_V2_1_COMMAND_RECORDER_H
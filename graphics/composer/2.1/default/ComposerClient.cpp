@@ -17,6 +17,7 @@
 #define LOG_TAG "HwcPassthrough"
 
 #include <android/hardware/graphics/mapper/2.0/IMapper.h>
+#include <cutils/properties.h>
 #include <log/log.h>
 
 #include "ComposerClient.h"
@@ -135,8 +136,12 @@ void BufferCacheEntry::clear()
     }
 }
 
+constexpr std::array<uint32_t, 7> ComposerClient::kImportLatencyBucketsUs;
+
 ComposerClient::ComposerClient(ComposerBase& hal)
-    : mHal(hal), mWriter(kWriterInitialSize)
+    : mHal(hal), mWriter(kWriterInitialSize),
+      mDisplayData(std::make_shared<DisplayDataMap>()),
+      mDisplayDataGeneration(0)
 {
 }
 
@@ -159,12 +164,16 @@ ComposerClient::~ComposerClient()
 
     mHal.enableCallback(false);
 
+    // drop the reader's copy of the display data so that all cached
+    // buffers are freed before the handle importer is cleaned up
+    mReader = nullptr;
+
     // no need to grab the mutex as any in-flight hwbinder call would have
     // kept the client alive
-    for (const auto& dpy : mDisplayData) {
+    for (const auto& dpy : *mDisplayData) {
         ALOGW("destroying client resources for display %" PRIu64, dpy.first);
 
-        for (const auto& ly : dpy.second.Layers) {
+        for (const auto& ly : dpy.second.LayerIndices) {
             mHal.destroyLayer(dpy.first, ly.first);
         }
 
@@ -198,7 +207,7 @@ ComposerClient::~ComposerClient()
         }
     }
 
-    mDisplayData.clear();
+    mDisplayData = nullptr;
 
     sHandleImporter.cleanup();
 
@@ -210,9 +219,15 @@ ComposerClient::~ComposerClient()
 void ComposerClient::initialize()
 {
     mReader = createCommandReader();
+    mReader->setInPlaceRead(true);
     if (!sHandleImporter.initialize()) {
         LOG_ALWAYS_FATAL("failed to initialize handle importer");
     }
+
+    char recordPath[PROPERTY_VALUE_MAX];
+    if (property_get("debug.hwc.record", recordPath, nullptr) > 0) {
+        mRecorder = CommandRecorder::create(recordPath);
+    }
 }
 
 void ComposerClient::onHotplug(Display display,
@@ -221,11 +236,17 @@ void ComposerClient::onHotplug(Display display,
     {
         std::lock_guard<std::mutex> lock(mDisplayDataMutex);
 
+        auto displayData = copyDisplayDataLocked();
         if (connected == IComposerCallback::Connection::CONNECTED) {
-            mDisplayData.emplace(display, DisplayData(false));
+            displayData->emplace(display, DisplayData(false));
         } else if (connected == IComposerCallback::Connection::DISCONNECTED) {
-            mDisplayData.erase(display);
+            displayData->erase(display);
         }
+        publishDisplayDataLocked(std::move(displayData));
+    }
+
+    if (mRecorder) {
+        mRecorder->recordHotplug(display, connected);
     }
 
     auto ret = mCallback->onHotplug(display, connected);
@@ -247,6 +268,149 @@ void ComposerClient::onVsync(Display display, int64_t timestamp)
             ret.description().c_str());
 }
 
+void ComposerClient::dumpDebugInfo(std::string* outDump)
+{
+    uint32_t generation;
+    auto displayData = getDisplayData(&generation);
+
+    outDump->append("Elided layer state calls:\n");
+    for (const auto& dpy : *displayData) {
+        const auto& stats = *dpy.second.Stats;
+        uint64_t frames = stats.Frames;
+        uint64_t elided = stats.ElidedCalls;
+        uint32_t lastFrame = stats.LastFrameElidedCalls;
+        uint64_t average = (frames) ? elided / frames : 0;
+
+        outDump->append("  display " + std::to_string(dpy.first) +
+                ": frames " + std::to_string(frames) +
+                ", elided " + std::to_string(elided) +
+                ", last frame " + std::to_string(lastFrame) +
+                ", per frame " + std::to_string(average) + "\n");
+    }
+
+    outDump->append("Buffer import latency: total " +
+            std::to_string(mImportStats.TotalImports.load()) +
+            ", batched " +
+            std::to_string(mImportStats.BatchedImports.load()) + "\n");
+    for (size_t i = 0; i < mImportStats.Buckets.size(); i++) {
+        std::string bucket = (i < kImportLatencyBucketsUs.size()) ?
+            "  <" + std::to_string(kImportLatencyBucketsUs[i]) + "us: " :
+            "  >=" + std::to_string(kImportLatencyBucketsUs.back()) + "us: ";
+        outDump->append(bucket +
+                std::to_string(mImportStats.Buckets[i].load()) + "\n");
+    }
+}
+
+void ComposerClient::recordImportLatency(
+        std::chrono::steady_clock::duration latency, bool batched)
+{
+    auto us = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                latency).count());
+
+    size_t bucket = 0;
+    while (bucket < kImportLatencyBucketsUs.size() &&
+            us >= kImportLatencyBucketsUs[bucket]) {
+        bucket++;
+    }
+
+    mImportStats.Buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    mImportStats.TotalImports.fetch_add(1, std::memory_order_relaxed);
+    if (batched) {
+        mImportStats.BatchedImports.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+ComposerClient::BufferSlots ComposerClient::resizeBufferSlots(
+        const BufferSlots& slots, uint32_t count)
+{
+    BufferSlots newSlots(count);
+    for (uint32_t i = 0; i < count; i++) {
+        newSlots[i] = (i < slots.size()) ?
+            slots[i] : std::make_shared<BufferCacheEntry>();
+    }
+
+    return newSlots;
+}
+
+std::shared_ptr<ComposerClient::DisplayDataMap>
+ComposerClient::copyDisplayDataLocked() const
+{
+    return std::make_shared<DisplayDataMap>(*mDisplayData);
+}
+
+void ComposerClient::publishDisplayDataLocked(
+        std::shared_ptr<DisplayDataMap> displayData)
+{
+    mDisplayData = std::move(displayData);
+    mDisplayDataGeneration.fetch_add(1, std::memory_order_release);
+}
+
+std::shared_ptr<const ComposerClient::DisplayDataMap>
+ComposerClient::getDisplayData(uint32_t* outGeneration)
+{
+    std::lock_guard<std::mutex> lock(mDisplayDataMutex);
+
+    *outGeneration = mDisplayDataGeneration.load(std::memory_order_relaxed);
+    return mDisplayData;
+}
+
+ComposerClient::LayerBuffers* ComposerClient::DisplayData::findLayer(
+        Layer layer) const
+{
+    auto ly = std::lower_bound(LayerIndices.cbegin(), LayerIndices.cend(),
+            layer, [](const auto& entry, Layer id) {
+                return entry.first < id;
+            });
+    if (ly == LayerIndices.cend() || ly->first != layer) {
+        return nullptr;
+    }
+
+    return LayerSlots[ly->second].get();
+}
+
+void ComposerClient::DisplayData::addLayer(Layer layer,
+        uint32_t bufferSlotCount)
+{
+    auto ly = std::lower_bound(LayerIndices.begin(), LayerIndices.end(),
+            layer, [](const auto& entry, Layer id) {
+                return entry.first < id;
+            });
+    if (ly != LayerIndices.end() && ly->first == layer) {
+        return;
+    }
+
+    uint32_t index;
+    if (FreeLayerSlots.empty()) {
+        index = LayerSlots.size();
+        LayerSlots.emplace_back();
+    } else {
+        index = FreeLayerSlots.back();
+        FreeLayerSlots.pop_back();
+    }
+
+    auto buffers = std::make_shared<LayerBuffers>();
+    buffers->Buffers.resize(bufferSlotCount);
+    LayerSlots[index] = std::move(buffers);
+
+    LayerIndices.emplace(ly, layer, index);
+}
+
+void ComposerClient::DisplayData::removeLayer(Layer layer)
+{
+    auto ly = std::lower_bound(LayerIndices.begin(), LayerIndices.end(),
+            layer, [](const auto& entry, Layer id) {
+                return entry.first < id;
+            });
+    if (ly == LayerIndices.end() || ly->first != layer) {
+        return;
+    }
+
+    LayerSlots[ly->second] = nullptr;
+    FreeLayerSlots.push_back(ly->second);
+    LayerIndices.erase(ly);
+}
+
 Return<void> ComposerClient::registerCallback(
         const sp<IComposerCallback>& callback)
 {
@@ -272,8 +436,16 @@ Return<void> ComposerClient::createVirtualDisplay(uint32_t width,
     if (err == Error::NONE) {
         std::lock_guard<std::mutex> lock(mDisplayDataMutex);
 
-        auto dpy = mDisplayData.emplace(display, DisplayData(true)).first;
-        dpy->second.OutputBuffers.resize(outputBufferSlotCount);
+        auto displayData = copyDisplayDataLocked();
+        auto dpy = displayData->emplace(display, DisplayData(true)).first;
+        dpy->second.OutputBuffers = resizeBufferSlots(
+                dpy->second.OutputBuffers, outputBufferSlotCount);
+        publishDisplayDataLocked(std::move(displayData));
+
+        if (mRecorder) {
+            mRecorder->recordCreateVirtualDisplay(display,
+                    outputBufferSlotCount);
+        }
     }
 
     hidl_cb(err, display, formatHint);
@@ -286,7 +458,13 @@ Return<Error> ComposerClient::destroyVirtualDisplay(Display display)
     if (err == Error::NONE) {
         std::lock_guard<std::mutex> lock(mDisplayDataMutex);
 
-        mDisplayData.erase(display);
+        auto displayData = copyDisplayDataLocked();
+        displayData->erase(display);
+        publishDisplayDataLocked(std::move(displayData));
+
+        if (mRecorder) {
+            mRecorder->recordDestroyVirtualDisplay(display);
+        }
     }
 
     return err;
@@ -300,9 +478,16 @@ Return<void> ComposerClient::createLayer(Display display,
     if (err == Error::NONE) {
         std::lock_guard<std::mutex> lock(mDisplayDataMutex);
 
-        auto dpy = mDisplayData.find(display);
-        auto ly = dpy->second.Layers.emplace(layer, LayerBuffers()).first;
-        ly->second.Buffers.resize(bufferSlotCount);
+        auto displayData = copyDisplayDataLocked();
+        auto dpy = displayData->find(display);
+        if (dpy != displayData->end()) {
+            dpy->second.addLayer(layer, bufferSlotCount);
+            publishDisplayDataLocked(std::move(displayData));
+        }
+
+        if (mRecorder) {
+            mRecorder->recordCreateLayer(display, layer, bufferSlotCount);
+        }
     }
 
     hidl_cb(err, layer);
@@ -315,8 +500,16 @@ Return<Error> ComposerClient::destroyLayer(Display display, Layer layer)
     if (err == Error::NONE) {
         std::lock_guard<std::mutex> lock(mDisplayDataMutex);
 
-        auto dpy = mDisplayData.find(display);
-        dpy->second.Layers.erase(layer);
+        auto displayData = copyDisplayDataLocked();
+        auto dpy = displayData->find(display);
+        if (dpy != displayData->end()) {
+            dpy->second.removeLayer(layer);
+            publishDisplayDataLocked(std::move(displayData));
+        }
+
+        if (mRecorder) {
+            mRecorder->recordDestroyLayer(display, layer);
+        }
     }
 
     return err;
@@ -421,12 +614,20 @@ Return<Error> ComposerClient::setClientTargetSlotCount(Display display,
 {
     std::lock_guard<std::mutex> lock(mDisplayDataMutex);
 
-    auto dpy = mDisplayData.find(display);
-    if (dpy == mDisplayData.end()) {
+    auto displayData = copyDisplayDataLocked();
+    auto dpy = displayData->find(display);
+    if (dpy == displayData->end()) {
         return Error::BAD_DISPLAY;
     }
 
-    dpy->second.ClientTargets.resize(clientTargetSlotCount);
+    dpy->second.ClientTargets = resizeBufferSlots(dpy->second.ClientTargets,
+            clientTargetSlotCount);
+    publishDisplayDataLocked(std::move(displayData));
+
+    if (mRecorder) {
+        mRecorder->recordSetClientTargetSlotCount(display,
+                clientTargetSlotCount);
+    }
 
     return Error::NONE;
 }
@@ -494,15 +695,22 @@ Return<void> ComposerClient::executeCommands(uint32_t inLength,
         return Void();
     }
 
+    if (mRecorder) {
+        mReader->record(mRecorder.get());
+    }
+
     Error err = mReader->parse();
     if (err == Error::NONE &&
             !mWriter.writeQueue(&outChanged, &outLength, &outHandles)) {
         err = Error::NO_RESOURCES;
     }
 
+    // release the input queue before replying so that the client can
+    // write the next batch of commands as soon as we return
+    mReader->reset();
+
     hidl_cb(err, outChanged, outLength, outHandles);
 
-    mReader->reset();
     mWriter.reset();
 
     return Void();
@@ -516,7 +724,9 @@ ComposerClient::createCommandReader()
 }
 
 ComposerClient::CommandReader::CommandReader(ComposerClient& client)
-    : mClient(client), mHal(client.mHal), mWriter(client.mWriter)
+    : mClient(client), mHal(client.mHal), mWriter(client.mWriter),
+      mDisplayDataGeneration(0), mDisplayDataEntry(nullptr),
+      mLayerBuffers(nullptr)
 {
 }
 
@@ -524,11 +734,29 @@ ComposerClient::CommandReader::~CommandReader()
 {
 }
 
+void ComposerClient::CommandReader::record(CommandRecorder* recorder)
+{
+    std::vector<uint32_t> commands(getDataSize());
+    for (uint32_t i = 0; i < commands.size(); i++) {
+        commands[i] = peek(i);
+    }
+
+    std::vector<const native_handle_t*> handles(getHandleCount());
+    for (size_t i = 0; i < handles.size(); i++) {
+        handles[i] = getHandle(static_cast<int32_t>(i));
+    }
+
+    recorder->recordExecuteCommands(commands, handles);
+}
+
 Error ComposerClient::CommandReader::parse()
 {
     IComposerClient::Command command;
     uint16_t length = 0;
 
+    refreshDisplayData();
+    importBuffers();
+
     while (!isEmpty()) {
         if (!beginCommand(&command, &length)) {
             break;
@@ -544,6 +772,8 @@ Error ComposerClient::CommandReader::parse()
         }
     }
 
+    freeImportedBuffers();
+
     return (isEmpty()) ? Error::NONE : Error::BAD_PARAMETER;
 }
 
@@ -610,6 +840,9 @@ bool ComposerClient::CommandReader::parseSelectDisplay(uint16_t length)
     mDisplay = read64();
     mWriter.selectDisplay(mDisplay);
 
+    mDisplayDataEntry = nullptr;
+    mLayerBuffers = nullptr;
+
     return true;
 }
 
@@ -621,6 +854,8 @@ bool ComposerClient::CommandReader::parseSelectLayer(uint16_t length)
 
     mLayer = read64();
 
+    mLayerBuffers = nullptr;
+
     return true;
 }
 
@@ -753,6 +988,7 @@ bool ComposerClient::CommandReader::parsePresentOrValidateDisplay(uint16_t lengt
     std::vector<int> fences;
     auto err = mHal.presentDisplay(mDisplay, &presentFence, &layers, &fences);
     if (err == Error::NONE) {
+        endLayerStateFrame();
         mWriter.setPresentOrValidateResult(1);
         mWriter.setPresentFence(presentFence);
         mWriter.setReleaseFences(layers, fences);
@@ -807,6 +1043,7 @@ bool ComposerClient::CommandReader::parsePresentDisplay(uint16_t length)
     std::vector<int> fences;
     auto err = mHal.presentDisplay(mDisplay, &presentFence, &layers, &fences);
     if (err == Error::NONE) {
+        endLayerStateFrame();
         mWriter.setPresentFence(presentFence);
         mWriter.setReleaseFences(layers, fences);
     } else {
@@ -886,8 +1123,15 @@ bool ComposerClient::CommandReader::parseSetLayerBlendMode(uint16_t length)
         return false;
     }
 
-    auto err = mHal.setLayerBlendMode(mDisplay, mLayer, readSigned());
+    auto mode = readSigned();
+    if (!updateLayerState(LayerState::BLEND_MODE,
+                &LayerState::BlendMode, mode)) {
+        return true;
+    }
+
+    auto err = mHal.setLayerBlendMode(mDisplay, mLayer, mode);
     if (err != Error::NONE) {
+        invalidateLayerState(LayerState::BLEND_MODE);
         mWriter.setError(getCommandLoc(), err);
     }
 
@@ -900,8 +1144,15 @@ bool ComposerClient::CommandReader::parseSetLayerColor(uint16_t length)
         return false;
     }
 
-    auto err = mHal.setLayerColor(mDisplay, mLayer, readColor());
+    auto color = readColor();
+    if (!updateLayerState(LayerState::COLOR,
+                &LayerState::Color, color)) {
+        return true;
+    }
+
+    auto err = mHal.setLayerColor(mDisplay, mLayer, color);
     if (err != Error::NONE) {
+        invalidateLayerState(LayerState::COLOR);
         mWriter.setError(getCommandLoc(), err);
     }
 
@@ -929,8 +1180,15 @@ bool ComposerClient::CommandReader::parseSetLayerDataspace(uint16_t length)
         return false;
     }
 
-    auto err = mHal.setLayerDataspace(mDisplay, mLayer, readSigned());
+    auto dataspace = readSigned();
+    if (!updateLayerState(LayerState::DATASPACE,
+                &LayerState::Dataspace, dataspace)) {
+        return true;
+    }
+
+    auto err = mHal.setLayerDataspace(mDisplay, mLayer, dataspace);
     if (err != Error::NONE) {
+        invalidateLayerState(LayerState::DATASPACE);
         mWriter.setError(getCommandLoc(), err);
     }
 
@@ -943,8 +1201,15 @@ bool ComposerClient::CommandReader::parseSetLayerDisplayFrame(uint16_t length)
         return false;
     }
 
-    auto err = mHal.setLayerDisplayFrame(mDisplay, mLayer, readRect());
+    auto frame = readRect();
+    if (!updateLayerState(LayerState::DISPLAY_FRAME,
+                &LayerState::DisplayFrame, frame)) {
+        return true;
+    }
+
+    auto err = mHal.setLayerDisplayFrame(mDisplay, mLayer, frame);
     if (err != Error::NONE) {
+        invalidateLayerState(LayerState::DISPLAY_FRAME);
         mWriter.setError(getCommandLoc(), err);
     }
 
@@ -957,8 +1222,15 @@ bool ComposerClient::CommandReader::parseSetLayerPlaneAlpha(uint16_t length)
         return false;
     }
 
-    auto err = mHal.setLayerPlaneAlpha(mDisplay, mLayer, readFloat());
+    auto alpha = readFloat();
+    if (!updateLayerState(LayerState::PLANE_ALPHA,
+                &LayerState::PlaneAlpha, alpha)) {
+        return true;
+    }
+
+    auto err = mHal.setLayerPlaneAlpha(mDisplay, mLayer, alpha);
     if (err != Error::NONE) {
+        invalidateLayerState(LayerState::PLANE_ALPHA);
         mWriter.setError(getCommandLoc(), err);
     }
 
@@ -994,8 +1266,15 @@ bool ComposerClient::CommandReader::parseSetLayerSourceCrop(uint16_t length)
         return false;
     }
 
-    auto err = mHal.setLayerSourceCrop(mDisplay, mLayer, readFRect());
+    auto crop = readFRect();
+    if (!updateLayerState(LayerState::SOURCE_CROP,
+                &LayerState::SourceCrop, crop)) {
+        return true;
+    }
+
+    auto err = mHal.setLayerSourceCrop(mDisplay, mLayer, crop);
     if (err != Error::NONE) {
+        invalidateLayerState(LayerState::SOURCE_CROP);
         mWriter.setError(getCommandLoc(), err);
     }
 
@@ -1008,8 +1287,15 @@ bool ComposerClient::CommandReader::parseSetLayerTransform(uint16_t length)
         return false;
     }
 
-    auto err = mHal.setLayerTransform(mDisplay, mLayer, readSigned());
+    auto transform = readSigned();
+    if (!updateLayerState(LayerState::TRANSFORM,
+                &LayerState::Transform, transform)) {
+        return true;
+    }
+
+    auto err = mHal.setLayerTransform(mDisplay, mLayer, transform);
     if (err != Error::NONE) {
+        invalidateLayerState(LayerState::TRANSFORM);
         mWriter.setError(getCommandLoc(), err);
     }
 
@@ -1038,8 +1324,15 @@ bool ComposerClient::CommandReader::parseSetLayerZOrder(uint16_t length)
         return false;
     }
 
-    auto err = mHal.setLayerZOrder(mDisplay, mLayer, read());
+    auto z = read();
+    if (!updateLayerState(LayerState::Z_ORDER,
+                &LayerState::ZOrder, z)) {
+        return true;
+    }
+
+    auto err = mHal.setLayerZOrder(mDisplay, mLayer, z);
     if (err != Error::NONE) {
+        invalidateLayerState(LayerState::Z_ORDER);
         mWriter.setError(getCommandLoc(), err);
     }
 
@@ -1078,45 +1371,149 @@ hwc_frect_t ComposerClient::CommandReader::readFRect()
     };
 }
 
-Error ComposerClient::CommandReader::lookupBufferCacheEntryLocked(
+template<typename T>
+bool ComposerClient::CommandReader::updateLayerState(LayerState::Field field,
+        T LayerState::*member, const T& value)
+{
+    auto ly = getLayerBuffers();
+    if (!ly) {
+        return true;
+    }
+
+    // compare bitwise, as none of the values has padding: a value with the
+    // same bits as the cached one, NaN included, is elided, while any change
+    // in the bits, such as 0.0 to -0.0, is passed on to the HAL
+    auto& state = ly->State;
+    if ((state.ValidFields & field) &&
+            memcmp(&(state.*member), &value, sizeof(T)) == 0) {
+        mDisplayDataEntry->Stats->CurrentFrameElidedCalls++;
+        return false;
+    }
+
+    state.*member = value;
+    state.ValidFields |= field;
+
+    return true;
+}
+
+void ComposerClient::CommandReader::invalidateLayerState(
+        LayerState::Field field)
+{
+    auto ly = getLayerBuffers();
+    if (ly) {
+        ly->State.ValidFields &= ~field;
+    }
+}
+
+void ComposerClient::CommandReader::endLayerStateFrame()
+{
+    auto dpy = getDisplayData();
+    if (!dpy) {
+        return;
+    }
+
+    auto& stats = *dpy->Stats;
+    stats.Frames.fetch_add(1, std::memory_order_relaxed);
+    stats.ElidedCalls.fetch_add(stats.CurrentFrameElidedCalls,
+            std::memory_order_relaxed);
+    stats.LastFrameElidedCalls.store(stats.CurrentFrameElidedCalls,
+            std::memory_order_relaxed);
+    stats.CurrentFrameElidedCalls = 0;
+}
+
+void ComposerClient::CommandReader::refreshDisplayData()
+{
+    if (mDisplayData && mDisplayDataGeneration ==
+            mClient.mDisplayDataGeneration.load(std::memory_order_acquire)) {
+        return;
+    }
+
+    mDisplayData = mClient.getDisplayData(&mDisplayDataGeneration);
+    mDisplayDataEntry = nullptr;
+    mLayerBuffers = nullptr;
+}
+
+const ComposerClient::DisplayData*
+ComposerClient::CommandReader::getDisplayData()
+{
+    if (mDisplayDataEntry) {
+        return mDisplayDataEntry;
+    }
+
+    // the display might have been published after the last refresh
+    for (int attempt = 0; attempt < 2; attempt++) {
+        auto dpy = mDisplayData->find(mDisplay);
+        if (dpy != mDisplayData->end()) {
+            mDisplayDataEntry = &dpy->second;
+            break;
+        }
+        refreshDisplayData();
+    }
+
+    return mDisplayDataEntry;
+}
+
+ComposerClient::LayerBuffers* ComposerClient::CommandReader::getLayerBuffers()
+{
+    if (mLayerBuffers) {
+        return mLayerBuffers;
+    }
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        auto dpy = getDisplayData();
+        if (!dpy) {
+            break;
+        }
+
+        mLayerBuffers = dpy->findLayer(mLayer);
+        if (mLayerBuffers) {
+            break;
+        }
+        refreshDisplayData();
+    }
+
+    return mLayerBuffers;
+}
+
+Error ComposerClient::CommandReader::lookupBufferCacheEntry(
         BufferCache cache, uint32_t slot, BufferCacheEntry** outEntry)
 {
-    auto dpy = mClient.mDisplayData.find(mDisplay);
-    if (dpy == mClient.mDisplayData.end()) {
+    auto dpy = getDisplayData();
+    if (!dpy) {
         return Error::BAD_DISPLAY;
     }
 
     BufferCacheEntry* entry = nullptr;
     switch (cache) {
     case BufferCache::CLIENT_TARGETS:
-        if (slot < dpy->second.ClientTargets.size()) {
-            entry = &dpy->second.ClientTargets[slot];
+        if (slot < dpy->ClientTargets.size()) {
+            entry = dpy->ClientTargets[slot].get();
         }
         break;
     case BufferCache::OUTPUT_BUFFERS:
-        if (slot < dpy->second.OutputBuffers.size()) {
-            entry = &dpy->second.OutputBuffers[slot];
+        if (slot < dpy->OutputBuffers.size()) {
+            entry = dpy->OutputBuffers[slot].get();
         }
         break;
     case BufferCache::LAYER_BUFFERS:
         {
-            auto ly = dpy->second.Layers.find(mLayer);
-            if (ly == dpy->second.Layers.end()) {
+            auto ly = getLayerBuffers();
+            if (!ly) {
                 return Error::BAD_LAYER;
             }
-            if (slot < ly->second.Buffers.size()) {
-                entry = &ly->second.Buffers[slot];
+            if (slot < ly->Buffers.size()) {
+                entry = &ly->Buffers[slot];
             }
         }
         break;
     case BufferCache::LAYER_SIDEBAND_STREAMS:
         {
-            auto ly = dpy->second.Layers.find(mLayer);
-            if (ly == dpy->second.Layers.end()) {
+            auto ly = getLayerBuffers();
+            if (!ly) {
                 return Error::BAD_LAYER;
             }
             if (slot == 0) {
-                entry = &ly->second.SidebandStream;
+                entry = &ly->SidebandStream;
             }
         }
         break;
@@ -1139,10 +1536,8 @@ Error ComposerClient::CommandReader::lookupBuffer(BufferCache cache,
         buffer_handle_t* outHandle)
 {
     if (useCache) {
-        std::lock_guard<std::mutex> lock(mClient.mDisplayDataMutex);
-
         BufferCacheEntry* entry;
-        Error error = lookupBufferCacheEntryLocked(cache, slot, &entry);
+        Error error = lookupBufferCacheEntry(cache, slot, &entry);
         if (error != Error::NONE) {
             return error;
         }
@@ -1150,7 +1545,15 @@ Error ComposerClient::CommandReader::lookupBuffer(BufferCache cache,
         // input handle is ignored
         *outHandle = entry->getHandle();
     } else {
-        if (!sHandleImporter.importBuffer(handle)) {
+        auto imported = std::find_if(mImportedBuffers.begin(),
+                mImportedBuffers.end(), [handle](const auto& buffer) {
+                    return buffer.Handle == handle;
+                });
+        if (imported != mImportedBuffers.end()) {
+            // ownership of the imported handle moves to the caller
+            handle = imported->ImportedHandle;
+            mImportedBuffers.erase(imported);
+        } else if (!importBuffer(handle, false)) {
             return Error::NO_RESOURCES;
         }
 
@@ -1160,6 +1563,80 @@ Error ComposerClient::CommandReader::lookupBuffer(BufferCache cache,
     return Error::NONE;
 }
 
+void ComposerClient::CommandReader::importBuffers()
+{
+    constexpr uint32_t opcode_mask =
+        static_cast<uint32_t>(IComposerClient::Command::OPCODE_MASK);
+    constexpr uint32_t length_mask =
+        static_cast<uint32_t>(IComposerClient::Command::LENGTH_MASK);
+
+    uint32_t size = getDataSize();
+    uint32_t offset = 0;
+    while (offset < size) {
+        uint32_t val = peek(offset++);
+        auto command = static_cast<IComposerClient::Command>(
+                val & opcode_mask);
+        uint32_t length = val & length_mask;
+        if (offset + length > size) {
+            // let parse() report the error
+            break;
+        }
+
+        // offset of the buffer handle index within the command
+        uint32_t handleOffset = length;
+        switch (command) {
+        case IComposerClient::Command::SET_CLIENT_TARGET:
+        case IComposerClient::Command::SET_OUTPUT_BUFFER:
+        case IComposerClient::Command::SET_LAYER_BUFFER:
+            handleOffset = 1;
+            break;
+        case IComposerClient::Command::SET_LAYER_SIDEBAND_STREAM:
+            handleOffset = 0;
+            break;
+        default:
+            break;
+        }
+
+        if (handleOffset < length) {
+            int32_t index = static_cast<int32_t>(peek(offset + handleOffset));
+            buffer_handle_t handle = getHandle(index);
+            if (handle && (handle->numFds || handle->numInts)) {
+                buffer_handle_t importedHandle = handle;
+                if (importBuffer(importedHandle, true)) {
+                    mImportedBuffers.push_back({handle, importedHandle});
+                }
+            }
+        }
+
+        offset += length;
+    }
+}
+
+void ComposerClient::CommandReader::freeImportedBuffers()
+{
+    // buffers of commands that were never executed
+    for (const auto& buffer : mImportedBuffers) {
+        sHandleImporter.freeBuffer(buffer.ImportedHandle);
+    }
+    mImportedBuffers.clear();
+}
+
+bool ComposerClient::CommandReader::importBuffer(buffer_handle_t& handle,
+        bool batched)
+{
+    // empty handles are translated without a mapper call
+    if (!handle || (!handle->numFds && !handle->numInts)) {
+        return sHandleImporter.importBuffer(handle);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bool imported = sHandleImporter.importBuffer(handle);
+    mClient.recordImportLatency(std::chrono::steady_clock::now() - start,
+            batched);
+
+    return imported;
+}
+
 Error ComposerClient::CommandReader::updateBuffer(BufferCache cache,
         uint32_t slot, bool useCache, buffer_handle_t handle)
 {
@@ -1168,10 +1645,8 @@ Error ComposerClient::CommandReader::updateBuffer(BufferCache cache,
         return Error::NONE;
     }
 
-    std::lock_guard<std::mutex> lock(mClient.mDisplayDataMutex);
-
     BufferCacheEntry* entry = nullptr;
-    Error error = lookupBufferCacheEntryLocked(cache, slot, &entry);
+    Error error = lookupBufferCacheEntry(cache, slot, &entry);
     if (error != Error::NONE) {
       return error;
     }
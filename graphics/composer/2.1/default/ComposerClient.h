@@ -17,13 +17,20 @@
 #ifndef ANDROID_HARDWARE_GRAPHICS_COMPOSER_V2_1_COMPOSER_CLIENT_H
 #define ANDROID_HARDWARE_GRAPHICS_COMPOSER_V2_1_COMPOSER_CLIENT_H
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include <mutex>
+#include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <hardware/hwcomposer2.h>
 #include "IComposerCommandBuffer.h"
 #include "ComposerBase.h"
+#include "CommandRecorder.h"
 
 namespace android {
 namespace hardware {
@@ -62,6 +69,10 @@ public:
     void onRefresh(Display display);
     void onVsync(Display display, int64_t timestamp);
 
+    // append layer state elision counters and the buffer import latency
+    // histogram to outDump
+    void dumpDebugInfo(std::string* outDump);
+
     // IComposerClient interface
     Return<void> registerCallback(
             const sp<IComposerCallback>& callback) override;
@@ -108,22 +119,105 @@ public:
             executeCommands_cb hidl_cb) override;
 
 protected:
+    // The layer state last sent to the device.  Setters that would not
+    // change it are dropped before reaching hwcomposer2.
+    struct LayerState {
+        enum Field : uint32_t {
+            BLEND_MODE    = 1u << 0,
+            COLOR         = 1u << 1,
+            DATASPACE     = 1u << 2,
+            DISPLAY_FRAME = 1u << 3,
+            PLANE_ALPHA   = 1u << 4,
+            SOURCE_CROP   = 1u << 5,
+            TRANSFORM     = 1u << 6,
+            Z_ORDER       = 1u << 7,
+        };
+
+        // bitmask of Field that hold a value known to the device
+        uint32_t ValidFields = 0;
+
+        int32_t BlendMode;
+        IComposerClient::Color Color;
+        int32_t Dataspace;
+        hwc_rect_t DisplayFrame;
+        float PlaneAlpha;
+        hwc_frect_t SourceCrop;
+        int32_t Transform;
+        uint32_t ZOrder;
+    };
+
+    // Buffer cache slots of a display.  Entries are shared between the
+    // published copies of the slot array so that it can be resized while
+    // the composition thread still uses an older copy.
+    using BufferSlots = std::vector<std::shared_ptr<BufferCacheEntry>>;
+
     struct LayerBuffers {
         std::vector<BufferCacheEntry> Buffers;
         BufferCacheEntry SidebandStream;
+
+        LayerState State;
     };
 
+    // Written by the composition thread, read by dumpDebugInfo.
+    struct LayerStateStats {
+        std::atomic<uint64_t> Frames{0};
+        std::atomic<uint64_t> ElidedCalls{0};
+        std::atomic<uint32_t> LastFrameElidedCalls{0};
+        uint32_t CurrentFrameElidedCalls = 0;
+    };
+
+    // A published DisplayData is never modified.  Adding or removing
+    // slots or layers publishes a modified copy instead (see
+    // publishDisplayDataLocked).  Cache entries and layer state are shared
+    // between copies and are only written by the composition thread.
     struct DisplayData {
         bool IsVirtual;
 
-        std::vector<BufferCacheEntry> ClientTargets;
-        std::vector<BufferCacheEntry> OutputBuffers;
+        BufferSlots ClientTargets;
+        BufferSlots OutputBuffers;
+
+        // Layers live in LayerSlots at dense indices that are recycled
+        // through FreeLayerSlots.  LayerIndices maps layer ids to those
+        // indices and is sorted by layer id.
+        std::vector<std::pair<Layer, uint32_t>> LayerIndices;
+        std::vector<std::shared_ptr<LayerBuffers>> LayerSlots;
+        std::vector<uint32_t> FreeLayerSlots;
 
-        std::unordered_map<Layer, LayerBuffers> Layers;
+        std::shared_ptr<LayerStateStats> Stats;
 
-        DisplayData(bool isVirtual) : IsVirtual(isVirtual) {}
+        DisplayData(bool isVirtual)
+            : IsVirtual(isVirtual),
+              Stats(std::make_shared<LayerStateStats>()) {}
+
+        LayerBuffers* findLayer(Layer layer) const;
+        void addLayer(Layer layer, uint32_t bufferSlotCount);
+        void removeLayer(Layer layer);
+    };
+
+    using DisplayDataMap = std::unordered_map<Display, DisplayData>;
+
+    // Latency histogram of IMapper::importBuffer calls made for this
+    // client.  Bucket i counts imports that took less than
+    // kImportLatencyBucketsUs[i] microseconds; the last bucket counts the
+    // rest.
+    static constexpr std::array<uint32_t, 7> kImportLatencyBucketsUs = {
+        50, 100, 250, 500, 1000, 2000, 5000,
+    };
+    struct ImportStats {
+        std::array<std::atomic<uint64_t>,
+            kImportLatencyBucketsUs.size() + 1> Buckets{};
+        std::atomic<uint64_t> BatchedImports{0};
+        std::atomic<uint64_t> TotalImports{0};
     };
 
+    void recordImportLatency(std::chrono::steady_clock::duration latency,
+            bool batched);
+
+    // Returns a slot array of the given size that shares the surviving
+    // entries with slots.
+    static BufferSlots resizeBufferSlots(const BufferSlots& slots,
+            uint32_t count);
+
     class CommandReader : public CommandReaderBase {
     public:
         CommandReader(ComposerClient& client);
@@ -131,6 +225,9 @@ protected:
 
         Error parse();
 
+        // record the command stream read by the last readQueue
+        void record(CommandRecorder* recorder);
+
     protected:
         virtual bool parseCommand(IComposerClient::Command command,
                 uint16_t length);
@@ -169,7 +266,7 @@ protected:
             LAYER_BUFFERS,
             LAYER_SIDEBAND_STREAMS,
         };
-        Error lookupBufferCacheEntryLocked(BufferCache cache, uint32_t slot,
+        Error lookupBufferCacheEntry(BufferCache cache, uint32_t slot,
                 BufferCacheEntry** outEntry);
         Error lookupBuffer(BufferCache cache, uint32_t slot,
                 bool useCache, buffer_handle_t handle,
@@ -177,6 +274,20 @@ protected:
         Error updateBuffer(BufferCache cache, uint32_t slot,
                 bool useCache, buffer_handle_t handle);
 
+        // Returns true when the layer state field must be sent to the
+        // device, in which case the shadow state is updated to value.
+        template<typename T>
+        bool updateLayerState(LayerState::Field field,
+                T LayerState::*member, const T& value);
+        void invalidateLayerState(LayerState::Field field);
+        void endLayerStateFrame();
+
+        // Imports all buffers referenced by the command stream that are
+        // not looked up from a cache, before any command is executed.
+        void importBuffers();
+        void freeImportedBuffers();
+        bool importBuffer(buffer_handle_t& handle, bool batched);
+
         Error lookupLayerSidebandStream(buffer_handle_t handle,
                 buffer_handle_t* outHandle)
         {
@@ -189,12 +300,34 @@ protected:
                     0, false, handle);
         }
 
+        // Picks up display data published since the last call.  The
+        // mutex is only taken when something was published.
+        void refreshDisplayData();
+        const DisplayData* getDisplayData();
+        LayerBuffers* getLayerBuffers();
+
         ComposerClient& mClient;
         ComposerBase& mHal;
         CommandWriterBase& mWriter;
 
         Display mDisplay;
         Layer mLayer;
+
+        // the copy of the display data used by the composition thread
+        std::shared_ptr<const DisplayDataMap> mDisplayData;
+        uint32_t mDisplayDataGeneration;
+
+        // lookups cached until the next SELECT_DISPLAY / SELECT_LAYER
+        const DisplayData* mDisplayDataEntry;
+        LayerBuffers* mLayerBuffers;
+
+        // buffers imported by importBuffers and not yet consumed by
+        // lookupBuffer
+        struct ImportedBuffer {
+            const native_handle_t* Handle;
+            buffer_handle_t ImportedHandle;
+        };
+        std::vector<ImportedBuffer> mImportedBuffers;
     };
 
     virtual std::unique_ptr<CommandReader> createCommandReader();
@@ -208,10 +341,25 @@ protected:
     std::unique_ptr<CommandReader> mReader;
     CommandWriterBase mWriter;
 
+    // set when the debug.hwc.record property names a file to record to
+    std::unique_ptr<CommandRecorder> mRecorder;
+
     sp<IComposerCallback> mCallback;
 
+    // Copy-on-write accessors for mDisplayData.  The caller must hold
+    // mDisplayDataMutex.
+    std::shared_ptr<DisplayDataMap> copyDisplayDataLocked() const;
+    void publishDisplayDataLocked(std::shared_ptr<DisplayDataMap> displayData);
+
+    std::shared_ptr<const DisplayDataMap> getDisplayData(
+            uint32_t* outGeneration);
+
+    ImportStats mImportStats;
+
     std::mutex mDisplayDataMutex;
-    std::unordered_map<Display, DisplayData> mDisplayData;
+    std::shared_ptr<const DisplayDataMap> mDisplayData;
+    // bumped after every publishDisplayDataLocked
+    std::atomic<uint32_t> mDisplayDataGeneration;
 };
 
 } // namespace implementation
@@ -0,0 +1,323 @@
+/*
+ * Copyright 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Composes frames through ComposerClient while another thread hotplugs a
+// second display and creates and destroys layers, the way SurfaceFlinger's
+// binder threads and the hwcomposer2 callback thread race with its
+// composition thread.  Run it under ASan or TSan to catch a composition
+// thread still using display data that was replaced underneath it.
+
+#define LOG_TAG "HwcStressTest"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "ComposerClient.h"
+#include "IComposerCommandBuffer.h"
+#include "StubHal.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace implementation {
+namespace {
+
+constexpr Display kPrimaryDisplay = 1;
+constexpr Display kExternalDisplay = 2;
+
+constexpr uint32_t kFrameCount = 1000;
+constexpr uint32_t kLayerCount = 8;
+constexpr uint32_t kBufferSlotCount = 3;
+
+// layers composed on the primary and the external display, and layers
+// that only come and go on the primary display
+constexpr Layer kPrimaryLayer = 100;
+constexpr Layer kExternalLayer = 200;
+constexpr Layer kChurnLayer = 1000;
+
+// Counts the layer buffers that reach the device on the primary display.
+class CountingHal : public StubHal {
+public:
+    Error setLayerBuffer(Display display, Layer layer, buffer_handle_t buffer,
+            int32_t acquireFence) override
+    {
+        if (display == kPrimaryDisplay) {
+            mPrimaryLayerBuffers++;
+        }
+
+        return StubHal::setLayerBuffer(display, layer, buffer, acquireFence);
+    }
+
+    uint32_t getPrimaryLayerBuffers() const { return mPrimaryLayerBuffers; }
+
+private:
+    uint32_t mPrimaryLayerBuffers = 0;
+};
+
+// Collects the errors of the returned command stream.
+class ErrorReader : public CommandReaderBase {
+public:
+    bool parse(std::vector<Error>* outErrors)
+    {
+        while (!isEmpty()) {
+            IComposerClient::Command command;
+            uint16_t length;
+            if (!beginCommand(&command, &length)) {
+                return false;
+            }
+
+            if (command == IComposerClient::Command::SET_ERROR) {
+                if (length != CommandWriterBase::kSetErrorLength) {
+                    return false;
+                }
+                read();
+                outErrors->push_back(static_cast<Error>(readSigned()));
+            } else {
+                for (uint16_t i = 0; i < length; i++) {
+                    read();
+                }
+            }
+
+            endCommand();
+        }
+
+        return true;
+    }
+};
+
+class ComposerClientStressTest : public ::testing::Test {
+protected:
+    ComposerClientStressTest()
+        : mClient(new ComposerClient(mHal)),
+          mWriter(1024),
+          mBuffer(native_handle_create(0, 0)) {}
+
+    ~ComposerClientStressTest()
+    {
+        native_handle_delete(mBuffer);
+    }
+
+    void SetUp() override
+    {
+        mClient->initialize();
+        mClient->registerCallback(new StubCallback());
+
+        mClient->onHotplug(kPrimaryDisplay,
+                IComposerCallback::Connection::CONNECTED);
+        ASSERT_EQ(Error::NONE, static_cast<Error>(
+                    mClient->setClientTargetSlotCount(kPrimaryDisplay,
+                        kBufferSlotCount)));
+        for (uint32_t i = 0; i < kLayerCount; i++) {
+            ASSERT_EQ(Error::NONE, createLayer(kPrimaryDisplay,
+                        kPrimaryLayer + i));
+        }
+    }
+
+    Error createLayer(Display display, Layer layer)
+    {
+        Error error = Error::NONE;
+        mHal.setNextLayer(layer);
+        mClient->createLayer(display, kBufferSlotCount,
+                [&](const auto& tmpError, const auto&) {
+                    error = tmpError;
+                });
+
+        return error;
+    }
+
+    // Half of the frames send new buffers, the other half reuse the cached
+    // ones.  Empty handles stand in for buffers; they are imported without
+    // a mapper call.
+    const native_handle_t* getBuffer(uint32_t frame) const
+    {
+        return (frame % (2 * kBufferSlotCount) < kBufferSlotCount) ?
+            mBuffer : nullptr;
+    }
+
+    void writeFrame(Display display, Layer firstLayer, uint32_t frame)
+    {
+        int32_t offset = static_cast<int32_t>(frame % 64);
+
+        mWriter.selectDisplay(display);
+        if (display == kPrimaryDisplay) {
+            mWriter.setClientTarget(0, getBuffer(frame), -1,
+                    Dataspace::UNKNOWN, std::vector<IComposerClient::Rect>());
+        }
+        for (uint32_t i = 0; i < kLayerCount; i++) {
+            mWriter.selectLayer(firstLayer + i);
+            mWriter.setLayerBuffer(frame % kBufferSlotCount,
+                    getBuffer(frame), -1);
+            mWriter.setLayerDisplayFrame({offset, offset,
+                    offset + 64, offset + 64});
+            mWriter.setLayerZOrder(i);
+        }
+        mWriter.validateDisplay();
+        mWriter.presentDisplay();
+    }
+
+    // Sends the commands written to mWriter and appends the errors
+    // returned for them to outErrors.
+    bool execute(std::vector<Error>* outErrors)
+    {
+        bool queueChanged = false;
+        uint32_t commandLength = 0;
+        hidl_vec<hidl_handle> commandHandles;
+        if (!mWriter.writeQueue(&queueChanged, &commandLength,
+                    &commandHandles)) {
+            mWriter.reset();
+            return false;
+        }
+
+        if (queueChanged && static_cast<Error>(
+                    mClient->setInputCommandQueue(
+                        *mWriter.getMQDescriptor())) != Error::NONE) {
+            mWriter.reset();
+            return false;
+        }
+
+        bool parsed = false;
+        mClient->executeCommands(commandLength, commandHandles,
+                [&](const auto& tmpError, const auto& tmpOutQueueChanged,
+                    const auto& tmpOutLength, const auto& tmpOutHandles) {
+                    if (tmpError != Error::NONE) {
+                        return;
+                    }
+
+                    bool queueValid = true;
+                    if (tmpOutQueueChanged) {
+                        mClient->getOutputCommandQueue(
+                                [&](const auto& tmpQueueError,
+                                    const auto& tmpDescriptor) {
+                                    queueValid =
+                                        tmpQueueError == Error::NONE &&
+                                        mReader.setMQDescriptor(tmpDescriptor);
+                                });
+                    }
+
+                    parsed = queueValid &&
+                        mReader.readQueue(tmpOutLength, tmpOutHandles) &&
+                        mReader.parse(outErrors);
+                    mReader.reset();
+                });
+        mWriter.reset();
+
+        return parsed;
+    }
+
+    // Composes kFrameCount frames on both displays.  Nothing may fail on
+    // the primary display.
+    void compose(uint32_t* outExternalErrors)
+    {
+        for (uint32_t frame = 0; frame < kFrameCount; frame++) {
+            std::vector<Error> errors;
+            writeFrame(kPrimaryDisplay, kPrimaryLayer, frame);
+            ASSERT_TRUE(execute(&errors)) << "frame " << frame;
+            ASSERT_TRUE(errors.empty()) << "frame " << frame << ": error "
+                << static_cast<int32_t>(errors.front());
+
+            // the external display and its layers may be gone at any point
+            errors.clear();
+            writeFrame(kExternalDisplay, kExternalLayer, frame);
+            ASSERT_TRUE(execute(&errors)) << "frame " << frame;
+            for (auto error : errors) {
+                ASSERT_TRUE(error == Error::BAD_DISPLAY ||
+                        error == Error::BAD_LAYER) << "frame " << frame
+                    << ": error " << static_cast<int32_t>(error);
+            }
+            *outExternalErrors += errors.size();
+        }
+    }
+
+    // Until stop is set: connects the external display and creates its
+    // layers, replaces a layer and resizes the client target slots of the
+    // primary display, then destroys the external layers and disconnects
+    // the external display again.
+    void churn(const std::atomic<bool>& stop, uint32_t* outCycles)
+    {
+        uint32_t cycle = 0;
+        while (!stop.load(std::memory_order_relaxed)) {
+            mClient->onHotplug(kExternalDisplay,
+                    IComposerCallback::Connection::CONNECTED);
+            for (uint32_t i = 0; i < kLayerCount; i++) {
+                EXPECT_EQ(Error::NONE, createLayer(kExternalDisplay,
+                            kExternalLayer + i));
+            }
+
+            // the new layer reuses the index of the one destroyed last cycle
+            EXPECT_EQ(Error::NONE, createLayer(kPrimaryDisplay,
+                        kChurnLayer + cycle));
+            if (cycle > 0) {
+                EXPECT_EQ(Error::NONE, static_cast<Error>(
+                            mClient->destroyLayer(kPrimaryDisplay,
+                                kChurnLayer + cycle - 1)));
+            }
+            EXPECT_EQ(Error::NONE, static_cast<Error>(
+                        mClient->setClientTargetSlotCount(kPrimaryDisplay,
+                            1 + cycle % kBufferSlotCount)));
+
+            for (uint32_t i = 0; i < kLayerCount; i++) {
+                EXPECT_EQ(Error::NONE, static_cast<Error>(
+                            mClient->destroyLayer(kExternalDisplay,
+                                kExternalLayer + i)));
+            }
+            mClient->onHotplug(kExternalDisplay,
+                    IComposerCallback::Connection::DISCONNECTED);
+
+            cycle++;
+        }
+
+        *outCycles = cycle;
+    }
+
+    CountingHal mHal;
+    sp<ComposerClient> mClient;
+
+    CommandWriterBase mWriter;
+    ErrorReader mReader;
+
+    native_handle_t* mBuffer;
+};
+
+TEST_F(ComposerClientStressTest, HotplugChurnDuringComposition)
+{
+    std::atomic<bool> stop(false);
+    uint32_t cycles = 0;
+    std::thread churnThread([&] { churn(stop, &cycles); });
+
+    uint32_t externalErrors = 0;
+    compose(&externalErrors);
+
+    stop = true;
+    churnThread.join();
+
+    EXPECT_GT(cycles, 0u);
+    EXPECT_EQ(kFrameCount * kLayerCount, mHal.getPrimaryLayerBuffers());
+    RecordProperty("churnCycles", cycles);
+    RecordProperty("externalErrors", externalErrors);
+}
+
+}  // namespace
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
@@ -205,8 +205,14 @@ Return<void> HwcHal::dumpDebugInfo(dumpDebugInfo_cb hidl_cb)
     buf.resize(len + 1);
     buf[len] = '\0';
 
+    std::string dump(buf.data(), len);
+    auto client = getClient();
+    if (client != nullptr) {
+        client->dumpDebugInfo(&dump);
+    }
+
     hidl_string buf_reply;
-    buf_reply.setToExternal(buf.data(), len);
+    buf_reply.setToExternal(dump.c_str(), dump.size());
     hidl_cb(buf_reply);
 
     return Void();
@@ -636,11 +636,21 @@ private:
 // units of uint32_t's.
 class CommandReaderBase {
 public:
-    CommandReaderBase() : mDataMaxSize(0)
+    CommandReaderBase() : mDataMaxSize(0), mInPlaceRead(false),
+        mDataInPlace(nullptr), mPendingRead(0)
     {
         reset();
     }
 
+    // When enabled, readQueue parses commands directly out of the shared
+    // memory of the message queue instead of copying them into a private
+    // buffer first.  The read is committed on reset().  Commands that wrap
+    // around the end of the queue are still copied.
+    void setInPlaceRead(bool enable)
+    {
+        mInPlaceRead = enable;
+    }
+
     bool setMQDescriptor(const MQDescriptorSync<uint32_t>& descriptor)
     {
         mQueue = std::make_unique<CommandQueueType>(descriptor, false);
@@ -659,15 +669,11 @@ public:
             return false;
         }
 
-        auto quantumCount = mQueue->getQuantumCount();
-        if (mDataMaxSize < quantumCount) {
-            mDataMaxSize = quantumCount;
-            mData = std::make_unique<uint32_t[]>(mDataMaxSize);
-        }
-
-        if (commandLength > mDataMaxSize ||
-                !mQueue->read(mData.get(), commandLength)) {
-            ALOGE("failed to read commands from message queue");
+        if (mInPlaceRead) {
+            if (!readQueueInPlace(commandLength)) {
+                return false;
+            }
+        } else if (!readQueueCopy(commandLength)) {
             return false;
         }
 
@@ -684,6 +690,14 @@ public:
 
     void reset()
     {
+        if (mPendingRead) {
+            if (!mQueue->commitRead(mPendingRead)) {
+                ALOGE("failed to commit %" PRIu32 " commands", mPendingRead);
+            }
+            mPendingRead = 0;
+        }
+
+        mDataInPlace = nullptr;
         mDataSize = 0;
         mDataRead = 0;
         mCommandBegin = 0;
@@ -748,22 +762,49 @@ protected:
         return mCommandBegin;
     }
 
+    // Random access to the command stream, for passes over the commands
+    // that must not consume them.
+    uint32_t getDataSize() const
+    {
+        return mDataSize;
+    }
+
+    uint32_t peek(uint32_t offset) const
+    {
+        return mDataInPlace[offset];
+    }
+
+    size_t getHandleCount() const
+    {
+        return mDataHandles.size();
+    }
+
+    // ownership of handle is not transferred
+    const native_handle_t* getHandle(int32_t index) const
+    {
+        if (index < 0 || static_cast<size_t>(index) >= mDataHandles.size()) {
+            return nullptr;
+        }
+
+        return mDataHandles[index].getNativeHandle();
+    }
+
     uint32_t read()
     {
-        return mData[mDataRead++];
+        return mDataInPlace[mDataRead++];
     }
 
     int32_t readSigned()
     {
         int32_t val;
-        memcpy(&val, &mData[mDataRead++], sizeof(val));
+        memcpy(&val, &mDataInPlace[mDataRead++], sizeof(val));
         return val;
     }
 
     float readFloat()
     {
         float val;
-        memcpy(&val, &mData[mDataRead++], sizeof(val));
+        memcpy(&val, &mDataInPlace[mDataRead++], sizeof(val));
         return val;
     }
 
@@ -841,10 +882,69 @@ protected:
     }
 
 private:
+    bool ensureDataSize(uint32_t commandLength)
+    {
+        auto quantumCount = mQueue->getQuantumCount();
+        if (mDataMaxSize < quantumCount) {
+            mDataMaxSize = quantumCount;
+            mData = std::make_unique<uint32_t[]>(mDataMaxSize);
+        }
+
+        return commandLength <= mDataMaxSize;
+    }
+
+    bool readQueueCopy(uint32_t commandLength)
+    {
+        if (!ensureDataSize(commandLength) ||
+                !mQueue->read(mData.get(), commandLength)) {
+            ALOGE("failed to read commands from message queue");
+            return false;
+        }
+
+        mDataInPlace = mData.get();
+
+        return true;
+    }
+
+    bool readQueueInPlace(uint32_t commandLength)
+    {
+        CommandQueueType::MemTransaction tx;
+        if (!mQueue->beginRead(commandLength, &tx)) {
+            ALOGE("failed to read commands from message queue");
+            return false;
+        }
+
+        const auto& first = tx.getFirstRegion();
+        if (first.getLength() >= commandLength) {
+            // the whole stream is contiguous; parse it where it is
+            mDataInPlace = first.getAddress();
+            mPendingRead = commandLength;
+            return true;
+        }
+
+        // the stream wraps around the end of the ring buffer
+        if (!ensureDataSize(commandLength) ||
+                !tx.copyFrom(mData.get(), 0, commandLength) ||
+                !mQueue->commitRead(commandLength)) {
+            ALOGE("failed to read commands from message queue");
+            return false;
+        }
+
+        mDataInPlace = mData.get();
+
+        return true;
+    }
+
     std::unique_ptr<CommandQueueType> mQueue;
     uint32_t mDataMaxSize;
     std::unique_ptr<uint32_t[]> mData;
 
+    bool mInPlaceRead;
+    // points to either mData or the shared memory of mQueue
+    const uint32_t* mDataInPlace;
+    // number of commands parsed in place but not yet committed
+    uint32_t mPendingRead;
+
     uint32_t mDataSize;
     uint32_t mDataRead;
 
@@ -0,0 +1,230 @@
+/*
+ * Copyright 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_GRAPHICS_COMPOSER_V2_1_STUB_HAL_H
+#define ANDROID_HARDWARE_GRAPHICS_COMPOSER_V2_1_STUB_HAL_H
+
+#include <unistd.h>
+
+#include <vector>
+
+#include "ComposerBase.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace implementation {
+
+// A backend that accepts every call without doing any work.  Displays and
+// layers get the ids set with setNextDisplay and setNextLayer.
+class StubHal : public ComposerBase {
+public:
+    void setNextDisplay(Display display) { mNextDisplay = display; }
+    void setNextLayer(Layer layer) { mNextLayer = layer; }
+
+    void removeClient() override {}
+    void enableCallback(bool) override {}
+    uint32_t getMaxVirtualDisplayCount() override { return 1; }
+    Error createVirtualDisplay(uint32_t, uint32_t, PixelFormat*,
+            Display* outDisplay) override
+    {
+        *outDisplay = mNextDisplay;
+        return Error::NONE;
+    }
+    Error destroyVirtualDisplay(Display) override { return Error::NONE; }
+    Error createLayer(Display, Layer* outLayer) override
+    {
+        *outLayer = mNextLayer;
+        return Error::NONE;
+    }
+    Error destroyLayer(Display, Layer) override { return Error::NONE; }
+
+    Error getActiveConfig(Display, Config* outConfig) override
+    {
+        *outConfig = 0;
+        return Error::NONE;
+    }
+    Error getClientTargetSupport(Display, uint32_t, uint32_t,
+            PixelFormat, Dataspace) override
+    {
+        return Error::NONE;
+    }
+    Error getColorModes(Display, hidl_vec<ColorMode>*) override
+    {
+        return Error::NONE;
+    }
+    Error getDisplayAttribute(Display, Config, IComposerClient::Attribute,
+            int32_t* outValue) override
+    {
+        *outValue = 0;
+        return Error::NONE;
+    }
+    Error getDisplayConfigs(Display, hidl_vec<Config>*) override
+    {
+        return Error::NONE;
+    }
+    Error getDisplayName(Display, hidl_string*) override
+    {
+        return Error::NONE;
+    }
+    Error getDisplayType(Display,
+            IComposerClient::DisplayType* outType) override
+    {
+        *outType = IComposerClient::DisplayType::PHYSICAL;
+        return Error::NONE;
+    }
+    Error getDozeSupport(Display, bool* outSupport) override
+    {
+        *outSupport = false;
+        return Error::NONE;
+    }
+    Error getHdrCapabilities(Display, hidl_vec<Hdr>*, float*, float*,
+            float*) override
+    {
+        return Error::NONE;
+    }
+
+    Error setActiveConfig(Display, Config) override { return Error::NONE; }
+    Error setColorMode(Display, ColorMode) override { return Error::NONE; }
+    Error setPowerMode(Display, IComposerClient::PowerMode) override
+    {
+        return Error::NONE;
+    }
+    Error setVsyncEnabled(Display, IComposerClient::Vsync) override
+    {
+        return Error::NONE;
+    }
+
+    Error setColorTransform(Display, const float*, int32_t) override
+    {
+        return Error::NONE;
+    }
+    Error setClientTarget(Display, buffer_handle_t, int32_t acquireFence,
+            int32_t, const std::vector<hwc_rect_t>&) override
+    {
+        closeFence(acquireFence);
+        return Error::NONE;
+    }
+    Error setOutputBuffer(Display, buffer_handle_t,
+            int32_t releaseFence) override
+    {
+        closeFence(releaseFence);
+        return Error::NONE;
+    }
+    Error validateDisplay(Display, std::vector<Layer>*,
+            std::vector<IComposerClient::Composition>*, uint32_t*,
+            std::vector<Layer>*, std::vector<uint32_t>*) override
+    {
+        return Error::NONE;
+    }
+    Error acceptDisplayChanges(Display) override { return Error::NONE; }
+    Error presentDisplay(Display, int32_t* outPresentFence,
+            std::vector<Layer>*, std::vector<int32_t>*) override
+    {
+        *outPresentFence = -1;
+        return Error::NONE;
+    }
+
+    Error setLayerCursorPosition(Display, Layer, int32_t, int32_t) override
+    {
+        return Error::NONE;
+    }
+    Error setLayerBuffer(Display, Layer, buffer_handle_t,
+            int32_t acquireFence) override
+    {
+        closeFence(acquireFence);
+        return Error::NONE;
+    }
+    Error setLayerSurfaceDamage(Display, Layer,
+            const std::vector<hwc_rect_t>&) override
+    {
+        return Error::NONE;
+    }
+    Error setLayerBlendMode(Display, Layer, int32_t) override
+    {
+        return Error::NONE;
+    }
+    Error setLayerColor(Display, Layer, IComposerClient::Color) override
+    {
+        return Error::NONE;
+    }
+    Error setLayerCompositionType(Display, Layer, int32_t) override
+    {
+        return Error::NONE;
+    }
+    Error setLayerDataspace(Display, Layer, int32_t) override
+    {
+        return Error::NONE;
+    }
+    Error setLayerDisplayFrame(Display, Layer, const hwc_rect_t&) override
+    {
+        return Error::NONE;
+    }
+    Error setLayerPlaneAlpha(Display, Layer, float) override
+    {
+        return Error::NONE;
+    }
+    Error setLayerSidebandStream(Display, Layer, buffer_handle_t) override
+    {
+        return Error::NONE;
+    }
+    Error setLayerSourceCrop(Display, Layer, const hwc_frect_t&) override
+    {
+        return Error::NONE;
+    }
+    Error setLayerTransform(Display, Layer, int32_t) override
+    {
+        return Error::NONE;
+    }
+    Error setLayerVisibleRegion(Display, Layer,
+            const std::vector<hwc_rect_t>&) override
+    {
+        return Error::NONE;
+    }
+    Error setLayerZOrder(Display, Layer, uint32_t) override
+    {
+        return Error::NONE;
+    }
+
+private:
+    static void closeFence(int32_t fence)
+    {
+        if (fence >= 0) {
+            close(fence);
+        }
+    }
+
+    Display mNextDisplay = 0;
+    Layer mNextLayer = 0;
+};
+
+class StubCallback : public IComposerCallback {
+public:
+    Return<void> onHotplug(Display, Connection) override { return Void(); }
+    Return<void> onRefresh(Display) override { return Void(); }
+    Return<void> onVsync(Display, int64_t) override { return Void(); }
+};
+
+}  // namespace implementation
+}  // namespace V2_1
+}  // namespace composer
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
+
+#endif  // ANDROID_HARDWARE_GRAPHICS_COMPOSER_V2_1_STUB_HAL_H
@@ -0,0 +1,420 @@
+/*
+ * Copyright 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Replays a recording made with the debug.hwc.record property through
+// ComposerClient against a backend that accepts every call, and reports
+// the time spent per executeCommands, per command type, and the number of
+// heap allocations per frame.
+//
+// usage: android.hardware.graphics.composer@2.1-replay <recording> [loops]
+
+#define LOG_TAG "HwcReplay"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <vector>
+
+#include <log/log.h>
+
+#include "CommandRecorder.h"
+#include "ComposerClient.h"
+#include "StubHal.h"
+
+namespace {
+
+std::atomic<bool> sCountAllocations(false);
+std::atomic<uint64_t> sAllocations(0);
+
+} // anonymous namespace
+
+void* operator new(size_t size)
+{
+    if (sCountAllocations.load(std::memory_order_relaxed)) {
+        sAllocations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        abort();
+    }
+
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete[](void* p) noexcept
+{
+    operator delete(p);
+}
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace composer {
+namespace V2_1 {
+namespace implementation {
+namespace {
+
+using RecordType = CommandRecorder::RecordType;
+
+struct CommandStats {
+    uint64_t Count = 0;
+    std::chrono::nanoseconds Time{0};
+};
+
+// indexed by opcode >> OPCODE_SHIFT
+using CommandStatsTable = std::array<CommandStats, 0x1000>;
+
+// A ComposerClient whose command reader times every command it parses.
+class ReplayClient : public ComposerClient {
+public:
+    ReplayClient(ComposerBase& hal, CommandStatsTable& stats)
+        : ComposerClient(hal), mStats(stats) {}
+
+protected:
+    class TimingCommandReader : public CommandReader {
+    public:
+        TimingCommandReader(ComposerClient& client, CommandStatsTable& stats)
+            : CommandReader(client), mStats(stats) {}
+
+    protected:
+        bool parseCommand(IComposerClient::Command command,
+                uint16_t length) override
+        {
+            auto start = std::chrono::steady_clock::now();
+            bool parsed = CommandReader::parseCommand(command, length);
+            auto& stats = mStats[(static_cast<uint32_t>(command) >>
+                    static_cast<uint32_t>(
+                        IComposerClient::Command::OPCODE_SHIFT)) &
+                    (mStats.size() - 1)];
+            stats.Count++;
+            stats.Time += std::chrono::steady_clock::now() - start;
+
+            return parsed;
+        }
+
+    private:
+        CommandStatsTable& mStats;
+    };
+
+    std::unique_ptr<CommandReader> createCommandReader() override
+    {
+        return std::unique_ptr<CommandReader>(
+                new TimingCommandReader(*this, mStats));
+    }
+
+private:
+    CommandStatsTable& mStats;
+};
+
+struct FrameStats {
+    uint64_t Frames = 0;
+    uint64_t FailedFrames = 0;
+    uint64_t Allocations = 0;
+    std::chrono::nanoseconds Total{0};
+    std::chrono::nanoseconds Min = std::chrono::nanoseconds::max();
+    std::chrono::nanoseconds Max{0};
+};
+
+uint64_t read64(const uint32_t* payload)
+{
+    return (static_cast<uint64_t>(payload[1]) << 32) | payload[0];
+}
+
+bool loadRecording(const char* path, std::vector<uint32_t>* outData)
+{
+    FILE* file = fopen(path, "re");
+    if (!file) {
+        fprintf(stderr, "failed to open %s\n", path);
+        return false;
+    }
+
+    uint32_t buf[4096];
+    size_t count;
+    while ((count = fread(buf, sizeof(uint32_t), 4096, file)) > 0) {
+        outData->insert(outData->end(), buf, buf + count);
+    }
+    fclose(file);
+
+    if (outData->size() < 2 || (*outData)[0] != CommandRecorder::kMagic ||
+            (*outData)[1] != CommandRecorder::kVersion) {
+        fprintf(stderr, "%s is not a composer recording\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+class Replayer {
+public:
+    Replayer() : mClient(new ReplayClient(mHal, mCommandStats))
+    {
+        mCommandStats.fill(CommandStats());
+        mClient->initialize();
+        mClient->registerCallback(new StubCallback());
+    }
+
+    ~Replayer()
+    {
+        for (auto handle : mHandles) {
+            native_handle_delete(handle);
+        }
+    }
+
+    bool replay(const std::vector<uint32_t>& data)
+    {
+        size_t offset = 2;
+        while (offset + 2 <= data.size()) {
+            auto type = static_cast<RecordType>(data[offset]);
+            uint32_t length = data[offset + 1];
+            offset += 2;
+            if (offset + length > data.size()) {
+                fprintf(stderr, "truncated record at word %zu\n", offset);
+                return false;
+            }
+
+            if (!replayRecord(type, &data[offset], length)) {
+                fprintf(stderr, "invalid record %u at word %zu\n",
+                        static_cast<uint32_t>(type), offset);
+                return false;
+            }
+            offset += length;
+        }
+
+        return true;
+    }
+
+    void report() const
+    {
+        if (!mFrameStats.Frames) {
+            printf("no frames replayed\n");
+            return;
+        }
+
+        printf("frames: %" PRIu64 " (%" PRIu64 " failed)\n",
+                mFrameStats.Frames, mFrameStats.FailedFrames);
+        printf("executeCommands: avg %" PRId64 " ns, min %" PRId64
+                " ns, max %" PRId64 " ns\n",
+                static_cast<int64_t>(mFrameStats.Total.count() /
+                    mFrameStats.Frames),
+                static_cast<int64_t>(mFrameStats.Min.count()),
+                static_cast<int64_t>(mFrameStats.Max.count()));
+        printf("allocations per frame: %.2f\n",
+                static_cast<double>(mFrameStats.Allocations) /
+                mFrameStats.Frames);
+
+        printf("%-10s %12s %14s %10s\n", "opcode", "count", "total ns",
+                "avg ns");
+        for (size_t i = 0; i < mCommandStats.size(); i++) {
+            const auto& stats = mCommandStats[i];
+            if (!stats.Count) {
+                continue;
+            }
+
+            printf("0x%08zx %12" PRIu64 " %14" PRId64 " %10" PRId64 "\n",
+                    i << static_cast<uint32_t>(
+                        IComposerClient::Command::OPCODE_SHIFT),
+                    stats.Count,
+                    static_cast<int64_t>(stats.Time.count()),
+                    static_cast<int64_t>(stats.Time.count() / stats.Count));
+        }
+    }
+
+private:
+    bool replayRecord(RecordType type, const uint32_t* payload,
+            uint32_t length)
+    {
+        switch (type) {
+        case RecordType::HOTPLUG:
+            if (length != 3) {
+                return false;
+            }
+            mClient->onHotplug(read64(payload),
+                    static_cast<IComposerCallback::Connection>(payload[2]));
+            return true;
+        case RecordType::CREATE_VIRTUAL_DISPLAY:
+            if (length != 3) {
+                return false;
+            }
+            mHal.setNextDisplay(read64(payload));
+            mClient->createVirtualDisplay(0, 0, PixelFormat::RGBA_8888,
+                    payload[2], [](const auto&, const auto&, const auto&) {});
+            return true;
+        case RecordType::DESTROY_VIRTUAL_DISPLAY:
+            if (length != 2) {
+                return false;
+            }
+            mClient->destroyVirtualDisplay(read64(payload));
+            return true;
+        case RecordType::CREATE_LAYER:
+            if (length != 5) {
+                return false;
+            }
+            mHal.setNextLayer(read64(payload + 2));
+            mClient->createLayer(read64(payload), payload[4],
+                    [](const auto&, const auto&) {});
+            return true;
+        case RecordType::DESTROY_LAYER:
+            if (length != 4) {
+                return false;
+            }
+            mClient->destroyLayer(read64(payload), read64(payload + 2));
+            return true;
+        case RecordType::SET_CLIENT_TARGET_SLOT_COUNT:
+            if (length != 3) {
+                return false;
+            }
+            mClient->setClientTargetSlotCount(read64(payload), payload[2]);
+            return true;
+        case RecordType::EXECUTE_COMMANDS:
+            return replayCommands(payload, length);
+        default:
+            return false;
+        }
+    }
+
+    bool replayCommands(const uint32_t* payload, uint32_t length)
+    {
+        if (length < 1) {
+            return false;
+        }
+        uint32_t handleCount = payload[0];
+        if (handleCount > (length - 1) / 2) {
+            return false;
+        }
+        const uint32_t* commands = payload + 1 + handleCount * 2;
+        uint32_t commandLength = length - 1 - handleCount * 2;
+
+        // Handle contents are not recorded.  Empty handles stand in for
+        // buffers and fences; they are imported without a mapper call.
+        hidl_vec<hidl_handle> handles;
+        handles.resize(handleCount);
+        for (uint32_t i = 0; i < handleCount; i++) {
+            if (payload[1 + i * 2] != CommandRecorder::kNullHandle) {
+                handles[i] = getEmptyHandle(i);
+            }
+        }
+
+        if (!mQueue || mQueue->getQuantumCount() < commandLength) {
+            mQueue = std::make_unique<CommandQueueType>(
+                    std::max<size_t>(commandLength, 1));
+            if (!mQueue->isValid()) {
+                return false;
+            }
+            mClient->setInputCommandQueue(*mQueue->getDesc());
+        }
+        if (!mQueue->write(commands, commandLength)) {
+            return false;
+        }
+
+        Error error = Error::NONE;
+        sAllocations = 0;
+        sCountAllocations = true;
+        auto start = std::chrono::steady_clock::now();
+        mClient->executeCommands(commandLength, handles,
+                [&](const auto& tmpError, const auto&, const auto&,
+                    const auto&) {
+                    error = tmpError;
+                });
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        sCountAllocations = false;
+
+        mFrameStats.Frames++;
+        if (error != Error::NONE) {
+            mFrameStats.FailedFrames++;
+        }
+        mFrameStats.Allocations += sAllocations;
+        mFrameStats.Total += elapsed;
+        mFrameStats.Min = std::min<std::chrono::nanoseconds>(
+                mFrameStats.Min, elapsed);
+        mFrameStats.Max = std::max<std::chrono::nanoseconds>(
+                mFrameStats.Max, elapsed);
+
+        return true;
+    }
+
+    native_handle_t* getEmptyHandle(uint32_t index)
+    {
+        while (mHandles.size() <= index) {
+            mHandles.push_back(native_handle_create(0, 0));
+        }
+
+        return mHandles[index];
+    }
+
+    StubHal mHal;
+    CommandStatsTable mCommandStats;
+    sp<ReplayClient> mClient;
+
+    std::unique_ptr<CommandQueueType> mQueue;
+    std::vector<native_handle_t*> mHandles;
+
+    FrameStats mFrameStats;
+};
+
+} // anonymous namespace
+} // namespace implementation
+} // namespace V2_1
+} // namespace composer
+} // namespace graphics
+} // namespace hardware
+} // namespace android
+
+int main(int argc, char** argv)
+{
+    using android::hardware::graphics::composer::V2_1::implementation::
+        Replayer;
+    using android::hardware::graphics::composer::V2_1::implementation::
+        loadRecording;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <recording> [loops]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<uint32_t> data;
+    if (!loadRecording(argv[1], &data)) {
+        return 1;
+    }
+
+    int loops = (argc > 2) ? atoi(argv[2]) : 1;
+
+    Replayer replayer;
+    for (int i = 0; i < loops; i++) {
+        if (!replayer.replay(data)) {
+            return 1;
+        }
+    }
+    replayer.report();
+
+    return 0;
+}
@@ -56,7 +56,9 @@ static Result ResultFromStatus(status_t err) {
 Sensors::Sensors()
     : mInitCheck(NO_INIT),
       mSensorModule(nullptr),
-      mSensorDevice(nullptr) {
+      mSensorDevice(nullptr),
+      mPollBuffer(new sensors_event_t[kPollMaxBufferSize]),
+      mPollEvents(new Event[kPollMaxBufferSize]) {
     status_t err = OK;
     if (UseMultiHal()) {
         mSensorModule = ::get_multi_hal_module_info();
@@ -162,7 +164,6 @@ Return<void> Sensors::poll(int32_t maxCount, poll_cb _hidl_cb) {
     hidl_vec<Event> out;
     hidl_vec<SensorInfo> dynamicSensorsAdded;
 
-    std::unique_ptr<sensors_event_t[]> data;
     int err = android::NO_ERROR;
 
     { // scope of reentry lock
@@ -187,46 +188,45 @@ Return<void> Sensors::poll(int32_t maxCount, poll_cb _hidl_cb) {
             err = android::BAD_VALUE;
         } else {
             int bufferSize = maxCount <= kPollMaxBufferSize ? maxCount : kPollMaxBufferSize;
-            data.reset(new sensors_event_t[bufferSize]);
             err = mSensorDevice->poll(
                     reinterpret_cast<sensors_poll_device_t *>(mSensorDevice),
-                    data.get(), bufferSize);
+                    mPollBuffer.get(), bufferSize);
         }
-    }
 
-    if (err < 0) {
-        _hidl_cb(ResultFromStatus(err), out, dynamicSensorsAdded);
-        return Void();
-    }
+        if (err >= 0) {
+            const size_t count = (size_t)err;
+            const sensors_event_t *data = mPollBuffer.get();
 
-    const size_t count = (size_t)err;
+            for (size_t i = 0; i < count; ++i) {
+                if (data[i].type != SENSOR_TYPE_DYNAMIC_SENSOR_META) {
+                    continue;
+                }
 
-    for (size_t i = 0; i < count; ++i) {
-        if (data[i].type != SENSOR_TYPE_DYNAMIC_SENSOR_META) {
-            continue;
-        }
-
-        const dynamic_sensor_meta_event_t *dyn = &data[i].dynamic_sensor_meta;
+                const dynamic_sensor_meta_event_t *dyn = &data[i].dynamic_sensor_meta;
 
-        if (!dyn->connected) {
-            continue;
-        }
+                if (!dyn->connected) {
+                    continue;
+                }
 
-        CHECK(dyn->sensor != nullptr);
-        CHECK_EQ(dyn->sensor->handle, dyn->handle);
+                CHECK(dyn->sensor != nullptr);
+                CHECK_EQ(dyn->sensor->handle, dyn->handle);
 
-        SensorInfo info;
-        convertFromSensor(*dyn->sensor, &info);
+                SensorInfo info;
+                convertFromSensor(*dyn->sensor, &info);
 
-        size_t numDynamicSensors = dynamicSensorsAdded.size();
-        dynamicSensorsAdded.resize(numDynamicSensors + 1);
-        dynamicSensorsAdded[numDynamicSensors] = info;
-    }
+                size_t numDynamicSensors = dynamicSensorsAdded.size();
+                dynamicSensorsAdded.resize(numDynamicSensors + 1);
+                dynamicSensorsAdded[numDynamicSensors] = info;
+            }
 
-    out.resize(count);
-    convertFromSensorEvents(err, data.get(), &out);
+            convertFromSensorEvents(count, data, mPollEvents.get());
+            out.setToExternal(mPollEvents.get(), count);
+        }
 
-    _hidl_cb(Result::OK, out, dynamicSensorsAdded);
+        // The events are not copied again, the lock keeps another poll() from
+        // overwriting mPollEvents until _hidl_cb has serialized them.
+        _hidl_cb(err < 0 ? ResultFromStatus(err) : Result::OK, out, dynamicSensorsAdded);
+    }
 
     return Void();
 }
@@ -328,19 +328,6 @@ Return<void> Sensors::configDirectReport(
     return Void();
 }
 
-// static
-void Sensors::convertFromSensorEvents(
-        size_t count,
-        const sensors_event_t *srcArray,
-        hidl_vec<Event> *dstVec) {
-    for (size_t i = 0; i < count; ++i) {
-        const sensors_event_t &src = srcArray[i];
-        Event *dst = &(*dstVec)[i];
-
-        convertFromSensorEvent(src, dst);
-    }
-}
-
 ISensors *HIDL_FETCH_ISensors(const char * /* hal */) {
     Sensors *sensors = new Sensors;
     if (sensors->initCheck() != OK) {
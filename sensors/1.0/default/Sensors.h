@@ -20,6 +20,7 @@
 
 #include <android/hardware/sensors/1.0/ISensors.h>
 #include <hardware/sensors.h>
+#include <memory>
 #include <mutex>
 
 namespace android {
@@ -67,12 +68,12 @@ private:
     sensors_module_t *mSensorModule;
     sensors_poll_device_1_t *mSensorDevice;
     std::mutex mPollLock;
+    // Only used by poll() with mPollLock held, sized to kPollMaxBufferSize.
+    std::unique_ptr<sensors_event_t[]> mPollBuffer;
+    std::unique_ptr<Event[]> mPollEvents;
 
     int getHalDeviceVersion() const;
 
-    static void convertFromSensorEvents(
-            size_t count, const sensors_event_t *src, hidl_vec<Event> *dst);
-
     DISALLOW_COPY_AND_ASSIGN(Sensors);
 };
 
@@ -207,6 +207,99 @@ void convertFromSensorEvent(const sensors_event_t &src, Event *dst) {
   }
 }
 
+namespace {
+
+// Payload layouts of the high rate sensors, which are converted with bulk
+// copies. Everything else goes through convertFromSensorEvent().
+enum class EventLayout {
+    GENERIC,
+    VEC3,
+    VEC4,
+    UNCAL,
+};
+
+EventLayout getEventLayout(int32_t type) {
+    switch ((SensorType)type) {
+        case SensorType::ACCELEROMETER:
+        case SensorType::MAGNETIC_FIELD:
+        case SensorType::ORIENTATION:
+        case SensorType::GYROSCOPE:
+        case SensorType::GRAVITY:
+        case SensorType::LINEAR_ACCELERATION:
+            return EventLayout::VEC3;
+
+        case SensorType::ROTATION_VECTOR:
+        case SensorType::GAME_ROTATION_VECTOR:
+        case SensorType::GEOMAGNETIC_ROTATION_VECTOR:
+            return EventLayout::VEC4;
+
+        case SensorType::MAGNETIC_FIELD_UNCALIBRATED:
+        case SensorType::GYROSCOPE_UNCALIBRATED:
+        case SensorType::ACCELEROMETER_UNCALIBRATED:
+            return EventLayout::UNCAL;
+
+        default:
+            return EventLayout::GENERIC;
+    }
+}
+
+inline void convertEventHeader(const sensors_event_t &src, Event *dst) {
+    dst->timestamp = src.timestamp;
+    dst->sensorHandle = src.sensor;
+    dst->sensorType = (SensorType)src.type;
+    // Same as the aggregate initialization in convertFromSensorEvent, the
+    // destination may hold an older event of another type.
+    memset(&dst->u, 0, sizeof(dst->u));
+}
+
+}  // namespace
+
+void convertFromSensorEvents(size_t count, const sensors_event_t *src, Event *dst) {
+    static_assert(sizeof(Vec4) == 4 * sizeof(float), "unexpected Vec4 layout");
+    static_assert(sizeof(Uncal) == sizeof(uncalibrated_event_t), "unexpected Uncal layout");
+
+    size_t i = 0;
+    while (i < count) {
+        // Events come out of the HAL FIFO in batches, so most neighbours share
+        // the type and the layout is looked up once per run.
+        const int32_t type = src[i].type;
+        size_t end = i + 1;
+        while (end < count && src[end].type == type) {
+            ++end;
+        }
+
+        switch (getEventLayout(type)) {
+            case EventLayout::VEC3:
+                for (; i < end; ++i) {
+                    convertEventHeader(src[i], &dst[i]);
+                    memcpy(&dst[i].u.vec3, src[i].acceleration.v, 3 * sizeof(float));
+                    dst[i].u.vec3.status = (SensorStatus)src[i].acceleration.status;
+                }
+                break;
+
+            case EventLayout::VEC4:
+                for (; i < end; ++i) {
+                    convertEventHeader(src[i], &dst[i]);
+                    memcpy(&dst[i].u.vec4, src[i].data, sizeof(Vec4));
+                }
+                break;
+
+            case EventLayout::UNCAL:
+                for (; i < end; ++i) {
+                    convertEventHeader(src[i], &dst[i]);
+                    memcpy(&dst[i].u.uncal, &src[i].uncalibrated_gyro, sizeof(Uncal));
+                }
+                break;
+
+            default:
+                for (; i < end; ++i) {
+                    convertFromSensorEvent(src[i], &dst[i]);
+                }
+                break;
+        }
+    }
+}
+
 void convertToSensorEvent(const Event &src, sensors_event_t *dst) {
   *dst = {
       .version = sizeof(sensors_event_t),
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <sensors/convert.h>
+
+#include <vector>
+
+using ::android::hardware::hidl_vec;
+using ::android::hardware::sensors::V1_0::Event;
+using ::android::hardware::sensors::V1_0::implementation::convertFromSensorEvent;
+using ::android::hardware::sensors::V1_0::implementation::convertFromSensorEvents;
+
+namespace {
+
+constexpr size_t kPollMaxBufferSize = 128;
+
+/*
+ * A poll() worth of events from a FIFO draining accelerometer, gyroscope and
+ * magnetometer at 400Hz, with the uncalibrated and fused sensors and a light
+ * sensor in between.
+ */
+std::vector<sensors_event_t> makeMixedStream() {
+    static const struct {
+        int32_t type;
+        size_t count;
+    } kRuns[] = {
+        { SENSOR_TYPE_ACCELEROMETER, 32 },
+        { SENSOR_TYPE_GYROSCOPE, 32 },
+        { SENSOR_TYPE_MAGNETIC_FIELD, 16 },
+        { SENSOR_TYPE_GYROSCOPE_UNCALIBRATED, 16 },
+        { SENSOR_TYPE_MAGNETIC_FIELD_UNCALIBRATED, 8 },
+        { SENSOR_TYPE_GAME_ROTATION_VECTOR, 16 },
+        { SENSOR_TYPE_LIGHT, 4 },
+        { SENSOR_TYPE_STEP_COUNTER, 4 },
+    };
+
+    std::vector<sensors_event_t> events;
+    for (const auto& run : kRuns) {
+        for (size_t i = 0; i < run.count; ++i) {
+            sensors_event_t event = {};
+            event.version = sizeof(sensors_event_t);
+            event.sensor = run.type;
+            event.type = run.type;
+            event.timestamp = 2500000 * (int64_t)events.size();
+            for (size_t j = 0; j < 16; ++j) {
+                event.data[j] = 0.5f * (float)(i + j);
+            }
+            events.push_back(event);
+        }
+    }
+    return events;
+}
+
+// What poll() used to do: allocate the result on every call and convert event by event.
+void BM_convertFromSensorEvent(benchmark::State& state) {
+    const std::vector<sensors_event_t> src = makeMixedStream();
+    while (state.KeepRunning()) {
+        hidl_vec<Event> out;
+        out.resize(src.size());
+        for (size_t i = 0; i < src.size(); ++i) {
+            convertFromSensorEvent(src[i], &out[i]);
+        }
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * src.size());
+}
+BENCHMARK(BM_convertFromSensorEvent);
+
+// What poll() does now: convert into a persistent buffer with bulk copies.
+void BM_convertFromSensorEvents(benchmark::State& state) {
+    const std::vector<sensors_event_t> src = makeMixedStream();
+    std::unique_ptr<Event[]> out(new Event[kPollMaxBufferSize]);
+    while (state.KeepRunning()) {
+        convertFromSensorEvents(src.size(), src.data(), out.get());
+        benchmark::DoNotOptimize(out.get());
+    }
+    state.SetItemsProcessed(state.iterations() * src.size());
+}
+BENCHMARK(BM_convertFromSensorEvents);
+
+}  // namespace
+
+BENCHMARK_MAIN();
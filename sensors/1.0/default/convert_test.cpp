@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <sensors/convert.h>
+
+#include <string.h>
+
+#include <vector>
+
+using ::android::hardware::sensors::V1_0::Event;
+using ::android::hardware::sensors::V1_0::SensorType;
+using ::android::hardware::sensors::V1_0::implementation::convertFromSensorEvent;
+using ::android::hardware::sensors::V1_0::implementation::convertFromSensorEvents;
+
+namespace {
+
+/*
+ * Events of every type, in runs of one to four events of the same type as a
+ * HAL FIFO hands them out, so that both the bulk copies and the per event
+ * conversion see runs starting and ending next to other types.
+ */
+std::vector<sensors_event_t> makeAllTypesStream(size_t rotate) {
+    static const int32_t kTypes[] = {
+        SENSOR_TYPE_META_DATA,
+        SENSOR_TYPE_ACCELEROMETER,
+        SENSOR_TYPE_MAGNETIC_FIELD,
+        SENSOR_TYPE_ORIENTATION,
+        SENSOR_TYPE_GYROSCOPE,
+        SENSOR_TYPE_LIGHT,
+        SENSOR_TYPE_PRESSURE,
+        SENSOR_TYPE_TEMPERATURE,
+        SENSOR_TYPE_PROXIMITY,
+        SENSOR_TYPE_GRAVITY,
+        SENSOR_TYPE_LINEAR_ACCELERATION,
+        SENSOR_TYPE_ROTATION_VECTOR,
+        SENSOR_TYPE_RELATIVE_HUMIDITY,
+        SENSOR_TYPE_AMBIENT_TEMPERATURE,
+        SENSOR_TYPE_MAGNETIC_FIELD_UNCALIBRATED,
+        SENSOR_TYPE_GAME_ROTATION_VECTOR,
+        SENSOR_TYPE_GYROSCOPE_UNCALIBRATED,
+        SENSOR_TYPE_SIGNIFICANT_MOTION,
+        SENSOR_TYPE_STEP_DETECTOR,
+        SENSOR_TYPE_STEP_COUNTER,
+        SENSOR_TYPE_GEOMAGNETIC_ROTATION_VECTOR,
+        SENSOR_TYPE_HEART_RATE,
+        SENSOR_TYPE_POSE_6DOF,
+        SENSOR_TYPE_DYNAMIC_SENSOR_META,
+        SENSOR_TYPE_ADDITIONAL_INFO,
+        SENSOR_TYPE_ACCELEROMETER_UNCALIBRATED,
+        SENSOR_TYPE_DEVICE_PRIVATE_BASE + 1,
+    };
+    constexpr size_t kNumTypes = sizeof(kTypes) / sizeof(kTypes[0]);
+
+    std::vector<sensors_event_t> events;
+    for (size_t t = 0; t < kNumTypes; ++t) {
+        const int32_t type = kTypes[(t + rotate) % kNumTypes];
+        for (size_t i = 0; i <= (t + rotate) % 4; ++i) {
+            sensors_event_t event = {};
+            event.version = sizeof(sensors_event_t);
+            event.sensor = 100 + (int32_t)events.size();
+            event.type = type;
+            event.timestamp = 2500000 * (int64_t)events.size();
+            for (size_t j = 0; j < 16; ++j) {
+                event.data[j] = 0.25f * (float)(events.size() + j);
+            }
+            if (type == SENSOR_TYPE_DYNAMIC_SENSOR_META) {
+                event.dynamic_sensor_meta.sensor = nullptr;
+            }
+            events.push_back(event);
+        }
+    }
+    return events;
+}
+
+void expectSameEvent(const Event &expected, const Event &actual, size_t index) {
+    SCOPED_TRACE(testing::Message() << "event " << index);
+    EXPECT_EQ(expected.timestamp, actual.timestamp);
+    EXPECT_EQ(expected.sensorHandle, actual.sensorHandle);
+    ASSERT_EQ(expected.sensorType, actual.sensorType);
+
+    switch (expected.sensorType) {
+        case SensorType::ACCELEROMETER:
+        case SensorType::MAGNETIC_FIELD:
+        case SensorType::ORIENTATION:
+        case SensorType::GYROSCOPE:
+        case SensorType::GRAVITY:
+        case SensorType::LINEAR_ACCELERATION:
+            EXPECT_EQ(expected.u.vec3.x, actual.u.vec3.x);
+            EXPECT_EQ(expected.u.vec3.y, actual.u.vec3.y);
+            EXPECT_EQ(expected.u.vec3.z, actual.u.vec3.z);
+            EXPECT_EQ(expected.u.vec3.status, actual.u.vec3.status);
+            break;
+
+        case SensorType::ROTATION_VECTOR:
+        case SensorType::GAME_ROTATION_VECTOR:
+        case SensorType::GEOMAGNETIC_ROTATION_VECTOR:
+            EXPECT_EQ(expected.u.vec4.x, actual.u.vec4.x);
+            EXPECT_EQ(expected.u.vec4.y, actual.u.vec4.y);
+            EXPECT_EQ(expected.u.vec4.z, actual.u.vec4.z);
+            EXPECT_EQ(expected.u.vec4.w, actual.u.vec4.w);
+            break;
+
+        case SensorType::MAGNETIC_FIELD_UNCALIBRATED:
+        case SensorType::GYROSCOPE_UNCALIBRATED:
+        case SensorType::ACCELEROMETER_UNCALIBRATED:
+            EXPECT_EQ(expected.u.uncal.x, actual.u.uncal.x);
+            EXPECT_EQ(expected.u.uncal.y, actual.u.uncal.y);
+            EXPECT_EQ(expected.u.uncal.z, actual.u.uncal.z);
+            EXPECT_EQ(expected.u.uncal.x_bias, actual.u.uncal.x_bias);
+            EXPECT_EQ(expected.u.uncal.y_bias, actual.u.uncal.y_bias);
+            EXPECT_EQ(expected.u.uncal.z_bias, actual.u.uncal.z_bias);
+            break;
+
+        default:
+            // Both go through convertFromSensorEvent().
+            EXPECT_EQ(0, memcmp(&expected.u, &actual.u, sizeof(expected.u)));
+            break;
+    }
+}
+
+}  // namespace
+
+TEST(ConvertTest, BatchedSameAsPerEvent) {
+    for (size_t rotate = 0; rotate < 4; ++rotate) {
+        SCOPED_TRACE(testing::Message() << "rotation " << rotate);
+        const std::vector<sensors_event_t> src = makeAllTypesStream(rotate);
+
+        // Same garbage in both, so that payload bytes left alone compare equal.
+        std::vector<Event> perEvent(src.size());
+        std::vector<Event> batched(src.size());
+        memset(perEvent.data(), 0xa5, perEvent.size() * sizeof(Event));
+        memset(batched.data(), 0xa5, batched.size() * sizeof(Event));
+
+        for (size_t i = 0; i < src.size(); ++i) {
+            convertFromSensorEvent(src[i], &perEvent[i]);
+        }
+        convertFromSensorEvents(src.size(), src.data(), batched.data());
+
+        for (size_t i = 0; i < src.size(); ++i) {
+            expectSameEvent(perEvent[i], batched[i], i);
+        }
+    }
+}
+
+// poll() converts into the same buffer every time, which still holds the
+// events of other types from the previous poll.
+TEST(ConvertTest, BatchedIntoReusedBuffer) {
+    std::vector<Event> batched(makeAllTypesStream(0).size() + 8);
+    for (size_t rotate = 0; rotate < 8; ++rotate) {
+        SCOPED_TRACE(testing::Message() << "rotation " << rotate);
+        const std::vector<sensors_event_t> src = makeAllTypesStream(rotate);
+        ASSERT_LE(src.size(), batched.size());
+
+        convertFromSensorEvents(src.size(), src.data(), batched.data());
+
+        for (size_t i = 0; i < src.size(); ++i) {
+            Event expected;
+            convertFromSensorEvent(src[i], &expected);
+            expectSameEvent(expected, batched[i], i);
+        }
+    }
+}
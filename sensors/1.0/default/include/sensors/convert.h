@@ -31,6 +31,8 @@ void convertFromSensor(const sensor_t &src, SensorInfo *dst);
 void convertToSensor(const SensorInfo &src, sensor_t *dst);
 
 void convertFromSensorEvent(const sensors_event_t &src, Event *dst);
+// Same as convertFromSensorEvent() over an array of count events.
+void convertFromSensorEvents(size_t count, const sensors_event_t *src, Event *dst);
 void convertToSensorEvent(const Event &src, sensors_event_t *dst);
 
 bool convertFromSharedMemInfo(const SharedMemInfo& memIn, sensors_direct_mem_t *memOut);
@@ -24,6 +24,7 @@ endif
 LOCAL_SRC_FILES := \
     hidl_struct_util.cpp \
     hidl_sync_util.cpp \
+    ring_buffer_stager.cpp \
     service.cpp \
     wifi.cpp \
     wifi_ap_iface.cpp \
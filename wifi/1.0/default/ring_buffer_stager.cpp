@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <android-base/logging.h>
+
+#include "ring_buffer_stager.h"
+
+namespace android {
+namespace hardware {
+namespace wifi {
+namespace V1_0 {
+namespace implementation {
+namespace ring_buffer {
+
+struct RingBufferStager::State {
+  struct Ring {
+    // Filled by |stage|.
+    std::vector<uint8_t> pending;
+    std::chrono::steady_clock::time_point pending_since;
+    // Only touched by the delivery thread, swapped with |pending| to
+    // deliver without holding the lock or allocating.
+    std::vector<uint8_t> delivering;
+    legacy_hal::wifi_ring_buffer_status status;
+    std::chrono::steady_clock::time_point first_data_time;
+    RingStats stats;
+  };
+
+  State(size_t max_batch_size,
+        size_t max_staged_size,
+        std::chrono::milliseconds max_batch_latency,
+        const on_ring_buffer_batch_callback& on_batch_callback)
+      : max_batch_size(max_batch_size),
+        max_staged_size(max_staged_size),
+        max_batch_latency(max_batch_latency),
+        on_batch_callback(on_batch_callback) {}
+
+  const size_t max_batch_size;
+  const size_t max_staged_size;
+  const std::chrono::milliseconds max_batch_latency;
+  const on_ring_buffer_batch_callback on_batch_callback;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  // Rings are never removed, so references stay valid while unlocked.
+  std::map<std::string, Ring> rings;
+  bool flush_requested = false;
+  bool stopped = false;
+};
+
+RingBufferStager::RingBufferStager(
+    size_t max_batch_size,
+    size_t max_staged_size,
+    std::chrono::milliseconds max_batch_latency,
+    const on_ring_buffer_batch_callback& on_batch_callback)
+    : state_(std::make_shared<State>(max_batch_size,
+                                     max_staged_size,
+                                     max_batch_latency,
+                                     on_batch_callback)) {
+  std::thread(&RingBufferStager::deliveryLoop, state_).detach();
+}
+
+RingBufferStager::~RingBufferStager() {
+  {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    state_->stopped = true;
+  }
+  state_->cv.notify_one();
+}
+
+void RingBufferStager::stage(
+    const std::string& ring_name,
+    const uint8_t* data,
+    size_t size,
+    const legacy_hal::wifi_ring_buffer_status& status) {
+  bool notify = false;
+  {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    const auto now = std::chrono::steady_clock::now();
+    auto ring_iter = state_->rings.find(ring_name);
+    if (ring_iter == state_->rings.end()) {
+      ring_iter = state_->rings.emplace(ring_name, State::Ring{}).first;
+      ring_iter->second.pending.reserve(state_->max_batch_size);
+      ring_iter->second.delivering.reserve(state_->max_batch_size);
+      ring_iter->second.first_data_time = now;
+    }
+    State::Ring& ring = ring_iter->second;
+    ring.status = status;
+    ring.stats.received_bytes += size;
+    if (ring.pending.size() + size > state_->max_staged_size) {
+      ring.stats.dropped_bytes += size;
+      ring.stats.dropped_chunks++;
+      return;
+    }
+    // The delivery thread needs to learn about a new deadline or a full
+    // batch, other chunks don't wake it up.
+    if (ring.pending.empty()) {
+      ring.pending_since = now;
+      notify = true;
+    }
+    ring.pending.insert(ring.pending.end(), data, data + size);
+    if (ring.pending.size() >= state_->max_batch_size &&
+        ring.pending.size() - size < state_->max_batch_size) {
+      notify = true;
+    }
+  }
+  if (notify) {
+    state_->cv.notify_one();
+  }
+}
+
+void RingBufferStager::flush() {
+  {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    state_->flush_requested = true;
+  }
+  state_->cv.notify_one();
+}
+
+std::map<std::string, RingBufferStager::RingStats>
+RingBufferStager::getStats() {
+  std::map<std::string, RingStats> stats;
+  std::lock_guard<std::mutex> lock(state_->mutex);
+  const auto now = std::chrono::steady_clock::now();
+  for (const auto& ring_entry : state_->rings) {
+    RingStats ring_stats = ring_entry.second.stats;
+    ring_stats.active_time = now - ring_entry.second.first_data_time;
+    stats.emplace(ring_entry.first, ring_stats);
+  }
+  return stats;
+}
+
+void RingBufferStager::deliveryLoop(const std::shared_ptr<State>& state) {
+  std::unique_lock<std::mutex> lock(state->mutex);
+  while (!state->stopped) {
+    const auto now = std::chrono::steady_clock::now();
+    auto next_deadline = std::chrono::steady_clock::time_point::max();
+    const std::string* ring_name = nullptr;
+    State::Ring* ring = nullptr;
+    for (auto& ring_entry : state->rings) {
+      State::Ring& candidate = ring_entry.second;
+      if (candidate.pending.empty()) continue;
+      const auto deadline = candidate.pending_since + state->max_batch_latency;
+      if (state->flush_requested ||
+          candidate.pending.size() >= state->max_batch_size ||
+          deadline <= now) {
+        ring_name = &ring_entry.first;
+        ring = &candidate;
+        break;
+      }
+      next_deadline = std::min(next_deadline, deadline);
+    }
+    if (!ring) {
+      state->flush_requested = false;
+      if (next_deadline == std::chrono::steady_clock::time_point::max()) {
+        state->cv.wait(lock);
+      } else {
+        state->cv.wait_until(lock, next_deadline);
+      }
+      continue;
+    }
+
+    ring->pending.swap(ring->delivering);
+    const legacy_hal::wifi_ring_buffer_status status = ring->status;
+    ring->stats.delivered_bytes += ring->delivering.size();
+    ring->stats.delivered_batches++;
+    lock.unlock();
+    state->on_batch_callback(*ring_name, ring->delivering, status);
+    ring->delivering.clear();
+    lock.lock();
+  }
+}
+
+}  // namespace ring_buffer
+}  // namespace implementation
+}  // namespace V1_0
+}  // namespace wifi
+}  // namespace hardware
+}  // namespace android
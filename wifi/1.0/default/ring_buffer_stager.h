@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RING_BUFFER_STAGER_H_
+#define RING_BUFFER_STAGER_H_
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <android-base/macros.h>
+
+#include "wifi_legacy_hal.h"
+
+namespace android {
+namespace hardware {
+namespace wifi {
+namespace V1_0 {
+namespace implementation {
+namespace ring_buffer {
+// Callback for a batch of ring buffer data. The data is only valid for the
+// duration of the callback.
+using on_ring_buffer_batch_callback =
+    std::function<void(const std::string&,
+                       const std::vector<uint8_t>&,
+                       const legacy_hal::wifi_ring_buffer_status&)>;
+
+/**
+ * Class that stages the debug ring buffer data handed over by the legacy HAL
+ * one chunk at a time, and delivers it in batches on a thread of its own.
+ * Staging a chunk only copies it into the pending buffer of its ring, it
+ * neither blocks on nor takes the global HIDL lock.
+ *
+ * The pending data of a ring is delivered once it reaches |max_batch_size|,
+ * or |max_batch_latency| after its first chunk was staged. While a batch is
+ * being delivered the next one keeps growing, chunks that would make it
+ * exceed |max_staged_size| are dropped.
+ */
+class RingBufferStager {
+ public:
+  struct RingStats {
+    uint64_t received_bytes;
+    uint64_t delivered_bytes;
+    uint64_t delivered_batches;
+    uint64_t dropped_bytes;
+    uint64_t dropped_chunks;
+    // Time since the first chunk of the ring was staged.
+    std::chrono::steady_clock::duration active_time;
+  };
+
+  RingBufferStager(size_t max_batch_size,
+                   size_t max_staged_size,
+                   std::chrono::milliseconds max_batch_latency,
+                   const on_ring_buffer_batch_callback& on_batch_callback);
+  // Pending data is discarded. This does not wait for the delivery thread,
+  // which exits once it is done with the batch it is delivering.
+  ~RingBufferStager();
+
+  // Invoked on the legacy HAL event loop thread. Callee does not retain
+  // |data|.
+  void stage(const std::string& ring_name,
+             const uint8_t* data,
+             size_t size,
+             const legacy_hal::wifi_ring_buffer_status& status);
+  // Delivers the pending data of all rings without waiting for the batches
+  // to fill up.
+  void flush();
+  std::map<std::string, RingStats> getStats();
+
+ private:
+  struct State;
+  static void deliveryLoop(const std::shared_ptr<State>& state);
+
+  // Shared with the delivery thread, which may outlive this object.
+  std::shared_ptr<State> state_;
+
+  DISALLOW_COPY_AND_ASSIGN(RingBufferStager);
+};
+
+}  // namespace ring_buffer
+}  // namespace implementation
+}  // namespace V1_0
+}  // namespace wifi
+}  // namespace hardware
+}  // namespace android
+
+#endif  // RING_BUFFER_STAGER_H_
@@ -14,10 +14,14 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <chrono>
+
 #include <android-base/logging.h>
 
 #include "hidl_return_util.h"
 #include "hidl_struct_util.h"
+#include "hidl_sync_util.h"
 #include "wifi_chip.h"
 #include "wifi_feature_flags.h"
 #include "wifi_status_util.h"
@@ -33,6 +37,12 @@ using android::hardware::wifi::V1_0::IfaceType;
 constexpr ChipModeId kStaChipModeId = 0;
 constexpr ChipModeId kApChipModeId = 1;
 constexpr ChipModeId kInvalidModeId = UINT32_MAX;
+// Debug ring buffer data is delivered to the clients once a ring has this
+// much pending, or at the latest after |kMaxRingBufferBatchLatency|.
+constexpr size_t kMaxRingBufferBatchSize = 32 * 1024;
+constexpr std::chrono::milliseconds kMaxRingBufferBatchLatency{200};
+// Data beyond this is dropped while the clients are not keeping up.
+constexpr size_t kMaxRingBufferStagedSize = 256 * 1024;
 
 template <typename Iface>
 void invalidateAndClear(sp<Iface>& iface) {
@@ -64,6 +74,7 @@ WifiChip::WifiChip(
 void WifiChip::invalidate() {
   invalidateAndRemoveAllIfaces();
   legacy_hal_.reset();
+  ring_buffer_stager_.reset();
   event_cb_handler_.invalidate();
   is_valid_ = false;
 }
@@ -728,6 +739,25 @@ WifiChip::getDebugRingBuffersStatusInternal() {
           legacy_ring_buffer_status_vec, &hidl_ring_buffer_status_vec)) {
     return {createWifiStatus(WifiStatusCode::ERROR_UNKNOWN), {}};
   }
+  // |WifiDebugRingBufferStatus| has no room for the delivery counters, so
+  // log them along with the status.
+  if (ring_buffer_stager_) {
+    for (const auto& ring_stats : ring_buffer_stager_->getStats()) {
+      const auto& stats = ring_stats.second;
+      const int64_t active_ms =
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              stats.active_time)
+              .count();
+      const uint64_t bytes_per_sec =
+          stats.delivered_bytes * 1000 / std::max<int64_t>(1, active_ms);
+      LOG(INFO) << "Ring buffer " << ring_stats.first << ": "
+                << stats.received_bytes << " bytes received, "
+                << stats.delivered_bytes << " bytes delivered in "
+                << stats.delivered_batches << " batches (" << bytes_per_sec
+                << " bytes/sec), " << stats.dropped_bytes
+                << " bytes dropped in " << stats.dropped_chunks << " chunks";
+    }
+  }
   return {createWifiStatus(WifiStatusCode::SUCCESS),
           hidl_ring_buffer_status_vec};
 }
@@ -766,6 +796,10 @@ WifiStatus WifiChip::forceDumpToDebugRingBufferInternal(
 WifiStatus WifiChip::stopLoggingToDebugRingBufferInternal() {
   legacy_hal::wifi_error legacy_status =
       legacy_hal_.lock()->deregisterRingBufferCallbackHandler();
+  // Don't hold back what was logged before stopping.
+  if (ring_buffer_stager_) {
+    ring_buffer_stager_->flush();
+  }
   return createWifiStatusFromLegacyError(legacy_status);
 }
 
@@ -849,14 +883,21 @@ WifiStatus WifiChip::registerDebugRingBufferCallback() {
   }
 
   android::wp<WifiChip> weak_ptr_this(this);
-  const auto& on_ring_buffer_data_callback = [weak_ptr_this](
+  const auto& on_ring_buffer_batch_callback = [weak_ptr_this](
       const std::string& /* name */,
       const std::vector<uint8_t>& data,
       const legacy_hal::wifi_ring_buffer_status& status) {
-    const auto shared_ptr_this = weak_ptr_this.promote();
-    if (!shared_ptr_this.get() || !shared_ptr_this->isValid()) {
-      LOG(ERROR) << "Callback invoked on an invalid object";
-      return;
+    // Batches are delivered on the stager thread. Only take the global lock
+    // to look up the callbacks, not for the duration of the HIDL calls.
+    std::set<sp<IWifiChipEventCallback>> callbacks;
+    {
+      const auto lock = hidl_sync_util::acquireGlobalLock();
+      const auto shared_ptr_this = weak_ptr_this.promote();
+      if (!shared_ptr_this.get() || !shared_ptr_this->isValid()) {
+        LOG(ERROR) << "Callback invoked on an invalid object";
+        return;
+      }
+      callbacks = shared_ptr_this->getEventCallbacks();
     }
     WifiDebugRingBufferStatus hidl_status;
     if (!hidl_struct_util::convertLegacyDebugRingBufferStatusToHidl(
@@ -864,20 +905,41 @@ WifiStatus WifiChip::registerDebugRingBufferCallback() {
       LOG(ERROR) << "Error converting ring buffer status";
       return;
     }
-    for (const auto& callback : shared_ptr_this->getEventCallbacks()) {
-      if (!callback->onDebugRingBufferDataAvailable(hidl_status, data).isOk()) {
+    hidl_vec<uint8_t> hidl_data;
+    hidl_data.setToExternal(const_cast<uint8_t*>(data.data()), data.size());
+    for (const auto& callback : callbacks) {
+      if (!callback->onDebugRingBufferDataAvailable(hidl_status, hidl_data)
+               .isOk()) {
         LOG(ERROR) << "Failed to invoke onDebugRingBufferDataAvailable"
                    << " callback on: " << toString(callback);
-
       }
     }
   };
+  const auto ring_buffer_stager =
+      std::make_shared<ring_buffer::RingBufferStager>(
+          kMaxRingBufferBatchSize,
+          kMaxRingBufferStagedSize,
+          kMaxRingBufferBatchLatency,
+          on_ring_buffer_batch_callback);
+  std::weak_ptr<ring_buffer::RingBufferStager> weak_ptr_stager(
+      ring_buffer_stager);
+  const auto& on_ring_buffer_data_callback = [weak_ptr_stager](
+      const std::string& name,
+      const uint8_t* data,
+      size_t size,
+      const legacy_hal::wifi_ring_buffer_status& status) {
+    const auto shared_ptr_stager = weak_ptr_stager.lock();
+    if (shared_ptr_stager) {
+      shared_ptr_stager->stage(name, data, size, status);
+    }
+  };
   legacy_hal::wifi_error legacy_status =
       legacy_hal_.lock()->registerRingBufferCallbackHandler(
           on_ring_buffer_data_callback);
 
   if (legacy_status == legacy_hal::WIFI_SUCCESS) {
     debug_ring_buffer_cb_registered_ = true;
+    ring_buffer_stager_ = ring_buffer_stager;
   }
   return createWifiStatusFromLegacyError(legacy_status);
 }
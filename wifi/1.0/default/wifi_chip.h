@@ -23,6 +23,7 @@
 #include <android/hardware/wifi/1.0/IWifiChip.h>
 
 #include "hidl_callback_util.h"
+#include "ring_buffer_stager.h"
 #include "wifi_ap_iface.h"
 #include "wifi_legacy_hal.h"
 #include "wifi_mode_controller.h"
@@ -194,6 +195,9 @@ class WifiChip : public IWifiChip {
   // registration mechanism. Use this to check if we have already
   // registered a callback.
   bool debug_ring_buffer_cb_registered_;
+  // Batches the ring buffer data outside of the global lock. Shared with
+  // the legacy HAL callback, which runs on the event loop thread.
+  std::shared_ptr<ring_buffer::RingBufferStager> ring_buffer_stager_;
   hidl_callback_util::HidlCallbackHandler<IWifiChipEventCallback>
       event_cb_handler_;
 
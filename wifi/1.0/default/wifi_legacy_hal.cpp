@@ -15,6 +15,7 @@
  */
 
 #include <array>
+#include <mutex>
 
 #include <android-base/logging.h>
 #include <cutils/properties.h>
@@ -128,13 +129,17 @@ void onAsyncRssiThresholdBreached(wifi_request_id id,
 }
 
 // Callback to be invoked for ring buffer data indication.
+// With verbose logging the firmware sends a lot of these, so they are
+// guarded by a lock of their own instead of the global lock, which would
+// block the HIDL thread for each chunk. See THREADING.README.
+std::mutex on_ring_buffer_data_lock;
 std::function<void(char*, char*, int, wifi_ring_buffer_status*)>
     on_ring_buffer_data_internal_callback;
 void onAsyncRingBufferData(char* ring_name,
                            char* buffer,
                            int buffer_size,
                            wifi_ring_buffer_status* status) {
-  const auto lock = hidl_sync_util::acquireGlobalLock();
+  std::lock_guard<std::mutex> lock(on_ring_buffer_data_lock);
   if (on_ring_buffer_data_internal_callback) {
     on_ring_buffer_data_internal_callback(
         ring_name, buffer, buffer_size, status);
@@ -838,34 +843,41 @@ std::pair<wifi_error, WakeReasonStats> WifiLegacyHal::getWakeReasonStats() {
 
 wifi_error WifiLegacyHal::registerRingBufferCallbackHandler(
     const on_ring_buffer_data_callback& on_user_data_callback) {
-  if (on_ring_buffer_data_internal_callback) {
-    return WIFI_ERROR_NOT_AVAILABLE;
-  }
-  on_ring_buffer_data_internal_callback = [on_user_data_callback](
-      char* ring_name,
-      char* buffer,
-      int buffer_size,
-      wifi_ring_buffer_status* status) {
-    if (status && buffer) {
-      std::vector<uint8_t> buffer_vector(
-          reinterpret_cast<uint8_t*>(buffer),
-          reinterpret_cast<uint8_t*>(buffer) + buffer_size);
-      on_user_data_callback(ring_name, buffer_vector, *status);
+  {
+    std::lock_guard<std::mutex> lock(on_ring_buffer_data_lock);
+    if (on_ring_buffer_data_internal_callback) {
+      return WIFI_ERROR_NOT_AVAILABLE;
     }
-  };
+    on_ring_buffer_data_internal_callback = [on_user_data_callback](
+        char* ring_name,
+        char* buffer,
+        int buffer_size,
+        wifi_ring_buffer_status* status) {
+      if (status && buffer && buffer_size > 0) {
+        on_user_data_callback(ring_name,
+                              reinterpret_cast<const uint8_t*>(buffer),
+                              buffer_size,
+                              *status);
+      }
+    };
+  }
   wifi_error status = global_func_table_.wifi_set_log_handler(
       0, wlan_interface_handle_, {onAsyncRingBufferData});
   if (status != WIFI_SUCCESS) {
+    std::lock_guard<std::mutex> lock(on_ring_buffer_data_lock);
     on_ring_buffer_data_internal_callback = nullptr;
   }
   return status;
 }
 
 wifi_error WifiLegacyHal::deregisterRingBufferCallbackHandler() {
-  if (!on_ring_buffer_data_internal_callback) {
-    return WIFI_ERROR_NOT_AVAILABLE;
+  {
+    std::lock_guard<std::mutex> lock(on_ring_buffer_data_lock);
+    if (!on_ring_buffer_data_internal_callback) {
+      return WIFI_ERROR_NOT_AVAILABLE;
+    }
+    on_ring_buffer_data_internal_callback = nullptr;
   }
-  on_ring_buffer_data_internal_callback = nullptr;
   return global_func_table_.wifi_reset_log_handler(0, wlan_interface_handle_);
 }
 
@@ -1289,7 +1301,10 @@ void WifiLegacyHal::invalidate() {
   on_gscan_full_result_internal_callback = nullptr;
   on_link_layer_stats_result_internal_callback = nullptr;
   on_rssi_threshold_breached_internal_callback = nullptr;
-  on_ring_buffer_data_internal_callback = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(on_ring_buffer_data_lock);
+    on_ring_buffer_data_internal_callback = nullptr;
+  }
   on_error_alert_internal_callback = nullptr;
   on_rtt_results_internal_callback = nullptr;
   on_nan_notify_response_user_callback = nullptr;
@@ -121,9 +121,13 @@ using on_rtt_results_callback = std::function<void(
     wifi_request_id, const std::vector<const wifi_rtt_result*>&)>;
 
 // Callback for ring buffer data.
+// Invoked on the legacy HAL event loop thread without the global lock held.
+// The data is passed by pointer to avoid a copy. Callee must not retain the
+// pointer.
 using on_ring_buffer_data_callback =
     std::function<void(const std::string&,
-                       const std::vector<uint8_t>&,
+                       const uint8_t*,
+                       size_t,
                        const wifi_ring_buffer_status&)>;
 
 // Callback for alerts.